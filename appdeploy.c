@@ -7,12 +7,64 @@
 //
 
 #include "mobiledevice.h"
+#ifdef __APPLE__
+#include <CommonCrypto/CommonDigest.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <zlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 
-#define ASSERT_OR_EXIT(_cnd_, ...) do { if(!(_cnd_)) { fprintf(stderr, __VA_ARGS__); unregister_device_notification(1); } } while (0)
+#define ASSERT_OR_EXIT(_cnd_, ...) do { if(!(_cnd_)) { fprintf(command_stderr(), __VA_ARGS__); unregister_device_notification(1); } } while (0)
+
+// For commands, which return their exit status so fan-out and appdeploy serve can
+// carry on with other devices. Only where nothing is left open.
+#define ASSERT_OR_RETURN(_cnd_, ...) do { if(!(_cnd_)) { fprintf(command_stderr(), __VA_ARGS__); return 1; } } while (0)
+
+// Size of each piece moved between the device and the local disk
+#define TRANSFER_CHUNK_SIZE (1024 * 1024)
+#define TRANSFER_SLOT_COUNT 2
+
+// Bytes before the checkpoint read back from the device before an upload resumes
+#define RESUME_CHECK_SIZE (1024 * 1024)
+
+// Fan-out limits, see run_fanout()
+#define MAX_FANOUT_DEVICES 64
+#define DEFAULT_SETTLE_SECONDS 2.0
+
+// Daemon limits, see serve_commands()
+#define MAX_KNOWN_DEVICES 64
+#define MAX_REQUEST_SIZE (64 * 1024)
+#define REQUEST_READ_SECONDS 10
+
+// House arrest connection pool limits, see acquire_file_connection()
+#define MAX_POOLED_CONNECTIONS 64
+#define MAX_POOLED_CONNECTIONS_PER_DEVICE 4
+#define POOL_IDLE_SECONDS 120.0
+#define POOL_HEALTH_CHECK_SECONDS 5.0
+
+// Apps one install command can take, see install_apps()
+#define MAX_INSTALL_APPS 16
+
+// Paths found while walking a sandbox are packed into blocks of this size
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Patterns list_files takes for each of -include and -exclude, see walk_sandbox()
+#define MAX_FILTER_PATTERNS 16
 
 // Object Structures
 enum MobileDeviceCommandType
@@ -24,28 +76,334 @@ enum MobileDeviceCommandType
     ListFiles,
     RemoveFile,
     DownloadFile,
-    UploadFile
+    UploadFile,
+    ReadRange,
+    Syslog,
+    Batch,
+    PullDirectory,
+    PushDirectory,
+    SyncDirectory,
+    Snapshot,
+    DiffSnapshot,
+    Bench
+};
+
+// What list_files keeps, a max_size of 0 means no limit and ages are in seconds
+struct file_filter
+{
+    char *include[MAX_FILTER_PATTERNS];
+    int include_count;
+    char *exclude[MAX_FILTER_PATTERNS];
+    int exclude_count;
+    int regex;
+    int max_depth;
+    uint64_t min_size;
+    uint64_t max_size;
+    double newer_than;
+    double older_than;
 };
 
 struct
 {
     struct am_device_notification *notification;
     enum MobileDeviceCommandType type;
+    char *name;
     char *target;
     char *app_path;
+    char *app_paths[MAX_INSTALL_APPS];
+    int app_count;
     char *bundle_id;
     char *file_path;
     char *destination_path;
     int print_paths;
+    int jobs;
+    int compare_hashes;
+    int delete_extras;
+    int delta_install;
+    int if_changed;
+    int resume;
+    uint64_t range_offset;
+    uint64_t range_length;
+    uint64_t range_last;
+    int follow;
+    char *syslog_processes[MAX_FILTER_PATTERNS];
+    int syslog_process_count;
+    char *syslog_match;
+    int syslog_level;
+    int cache;
+    char *app_type;
+    int sha256;
+    int json;
+    int progress;
+    int iterations;
+    struct file_filter filter;
+    char *batch_path;
+    char *snapshot_path;
+    char *after_snapshot_path;
+    char *socket_path;
     uint16_t src_port;
     uint16_t dst_port;
 } command;
 
+// One device driven by a fan-out worker thread
+struct device_worker
+{
+    struct am_device *device;
+    char *udid;
+    pthread_t thread;
+    double start;
+    double seconds;
+    int status;
+};
+
+struct
+{
+    int enabled;
+    int all_devices;
+    char *targets[MAX_FANOUT_DEVICES];
+    int target_count;
+    double settle_seconds;
+    struct device_worker workers[MAX_FANOUT_DEVICES];
+    int worker_count;
+} fanout;
+
+// Set on fan-out worker threads so failures only stop the current device
+static __thread struct device_worker *current_worker;
+
+// Devices kept attached by appdeploy serve
+struct known_device
+{
+    struct am_device *device;
+    char *udid;
+    int paired;
+};
+
+// lock guards the devices, which attach and detach on the run loop while requests
+// run on their own threads. request_lock lets one command run at a time, since command
+// and the working directory belong to the whole process, and the streams are that
+// request's client's.
+struct
+{
+    pthread_mutex_t lock;
+    pthread_mutex_t request_lock;
+    int serving;
+    int listen_fd;
+    char *path;
+    struct known_device devices[MAX_KNOWN_DEVICES];
+    int device_count;
+    FILE *input;
+    FILE *output;
+    FILE *errors;
+} server = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+// Streams commands print to and read a batch from: the client's while appdeploy serve
+// runs its request, the process's own otherwise
+FILE *command_stdin()
+{
+    return (server.input != NULL) ? server.input : stdin;
+}
+
+FILE *command_stdout()
+{
+    return (server.output != NULL) ? server.output : stdout;
+}
+
+FILE *command_stderr()
+{
+    return (server.errors != NULL) ? server.errors : stderr;
+}
+
+// A live house arrest AFC connection for one (device, bundle id) pair
+struct pooled_connection
+{
+    char *udid;
+    char *bundle_id;
+    struct afc_connection *connection;
+    struct device_worker *owner;
+    unsigned long ticket;
+    double last_used;
+    int in_use;
+};
+
+struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    struct pooled_connection entries[MAX_POOLED_CONNECTIONS];
+    int count;
+    unsigned long next_ticket;
+} connection_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// Every MobileDevice and AFC call goes through backend, so the same code can drive
+// a real device or the simulated one (-sim) that lives in local directories
+struct device_backend
+{
+    mach_error_t (*notification_subscribe)(am_device_notification_callback callback, unsigned int unused0, unsigned int unused1, unsigned int cookie, struct am_device_notification **subscription);
+    mach_error_t (*notification_unsubscribe)(struct am_device_notification *subscription);
+    CFStringRef (*copy_device_identifier)(struct am_device *device);
+    void (*retain)(struct am_device *device);
+    void (*release)(struct am_device *device);
+    mach_error_t (*connect)(struct am_device *device);
+    mach_error_t (*is_paired)(struct am_device *device);
+    mach_error_t (*validate_pairing)(struct am_device *device);
+    mach_error_t (*start_session)(struct am_device *device);
+    mach_error_t (*stop_session)(struct am_device *device);
+    mach_error_t (*disconnect)(struct am_device *device);
+    mach_error_t (*start_service)(struct am_device *device, CFStringRef service_name, int *socket_fd);
+    mach_error_t (*start_house_arrest_service)(struct am_device *device, CFStringRef identifier, void *unknown, service_conn_t *handle, unsigned int *what);
+    int (*secure_transfer_path)(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int callback_arg);
+    int (*secure_install_application)(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int callback_arg);
+    int (*secure_uninstall_application)(int unknown0, struct am_device *device, CFStringRef bundle_id, int unknown1, void *callback, int callback_arg);
+    int (*lookup_applications)(struct am_device *device, CFDictionaryRef options, CFDictionaryRef *apps);
+    afc_error_t (*connection_open)(int socket_fd, unsigned int io_timeout, struct afc_connection **connection);
+    afc_error_t (*connection_close)(struct afc_connection *connection);
+    afc_error_t (*device_info_open)(struct afc_connection *connection, struct afc_dictionary **info);
+    afc_error_t (*directory_open)(struct afc_connection *connection, char *path, struct afc_directory **directory);
+    afc_error_t (*directory_read)(struct afc_connection *connection, struct afc_directory *directory, char **entry);
+    afc_error_t (*directory_close)(struct afc_connection *connection, struct afc_directory *directory);
+    afc_error_t (*directory_create)(struct afc_connection *connection, char *path);
+    afc_error_t (*remove_path)(struct afc_connection *connection, char *path);
+    afc_error_t (*rename_path)(struct afc_connection *connection, char *old_path, char *new_path);
+    afc_error_t (*file_info_open)(struct afc_connection *connection, char *path, struct afc_dictionary **info);
+    afc_error_t (*key_value_read)(struct afc_dictionary *dictionary, char **key, char **value);
+    afc_error_t (*key_value_close)(struct afc_dictionary *dictionary);
+    afc_error_t (*file_ref_open)(struct afc_connection *connection, char *path, unsigned long long mode, afc_file_ref *file_ref);
+    afc_error_t (*file_ref_read)(struct afc_connection *connection, afc_file_ref file_ref, void *buffer, unsigned int *length);
+    afc_error_t (*file_ref_write)(struct afc_connection *connection, afc_file_ref file_ref, void *buffer, unsigned int length);
+    afc_error_t (*file_ref_seek)(struct afc_connection *connection, afc_file_ref file_ref, unsigned long long offset, int origin, int unused);
+    afc_error_t (*file_ref_tell)(struct afc_connection *connection, afc_file_ref file_ref, unsigned long long *offset);
+    afc_error_t (*file_ref_set_file_size)(struct afc_connection *connection, afc_file_ref file_ref, unsigned long long size);
+    afc_error_t (*file_ref_close)(struct afc_connection *connection, afc_file_ref file_ref);
+};
+
+#ifdef __APPLE__
+
+struct device_backend mobile_device_backend =
+{
+    AMDeviceNotificationSubscribe,
+    AMDeviceNotificationUnsubscribe,
+    AMDeviceCopyDeviceIdentifier,
+    AMDeviceRetain,
+    AMDeviceRelease,
+    AMDeviceConnect,
+    AMDeviceIsPaired,
+    AMDeviceValidatePairing,
+    AMDeviceStartSession,
+    AMDeviceStopSession,
+    AMDeviceDisconnect,
+    AMDeviceStartService,
+    AMDeviceStartHouseArrestService,
+    AMDeviceSecureTransferPath,
+    AMDeviceSecureInstallApplication,
+    AMDeviceSecureUninstallApplication,
+    AMDeviceLookupApplications,
+    AFCConnectionOpen,
+    AFCConnectionClose,
+    AFCDeviceInfoOpen,
+    AFCDirectoryOpen,
+    AFCDirectoryRead,
+    AFCDirectoryClose,
+    AFCDirectoryCreate,
+    AFCRemovePath,
+    AFCRenamePath,
+    AFCFileInfoOpen,
+    AFCKeyValueRead,
+    AFCKeyValueClose,
+    AFCFileRefOpen,
+    AFCFileRefRead,
+    AFCFileRefWrite,
+    AFCFileRefSeek,
+    AFCFileRefTell,
+    AFCFileRefSetFileSize,
+    AFCFileRefClose
+};
+
+struct device_backend *backend = &mobile_device_backend;
+
+#else
+
+// MobileDevice only exists on the Mac, elsewhere every device is a simulated one
+struct device_backend *backend = NULL;
+
+#endif
+
+// State of the simulated devices behind -sim
+// lock guards seed, so each device fails the same calls whatever runs beside it
+struct simulated_device
+{
+    struct am_device device;
+    char *udid;
+    char *root;
+    pthread_mutex_t lock;
+    unsigned int seed;
+};
+
+struct simulated_connection
+{
+    struct simulated_device *device;
+    char *root;
+};
+
+#define SIMULATED_KEY_COUNT 6
+
+struct simulated_dictionary
+{
+    int next;
+    int count;
+    char keys[SIMULATED_KEY_COUNT][16];
+    char values[SIMULATED_KEY_COUNT][32];
+};
+
+struct
+{
+    pthread_mutex_t lock;
+    char *root;
+    double latency;
+    double bandwidth;
+    double failure_rate;
+    double link_busy_until;
+    struct simulated_device *devices[MAX_KNOWN_DEVICES];
+    int device_count;
+    struct simulated_connection **services;
+    size_t service_capacity;
+} simulator = { PTHREAD_MUTEX_INITIALIZER };
+
+// Chrome trace events written with -trace
+struct
+{
+    pthread_mutex_t lock;
+    char *path;
+    FILE *file;
+    double start;
+    int event_count;
+    int thread_count;
+    double discovery_start;
+    struct device_backend *backend;
+} trace = { PTHREAD_MUTEX_INITIALIZER };
+
+// Trace ids are handed out the first time a thread records a span
+static __thread int trace_thread_id;
+static __thread double command_trace_start;
+
+char *create_cstr_from_cfstring(CFStringRef cfstring);
+void close_connection_pool(const char *udid);
+void invalidate_app_inventory(struct am_device *device);
+int is_ipa_path(const char *path);
+CFDictionaryRef copy_ipa_app_info(const char *ipa_path);
+char *unpack_ipa(const char *ipa_path);
+struct transfer_checkpoint *open_checkpoint(struct am_device *device, const char *kind, const char *source, const char *destination, uint64_t source_size, uint64_t source_mtime, const char *local_path);
+uint64_t checkpoint_offset(struct transfer_checkpoint *checkpoint);
+int advance_checkpoint(struct transfer_checkpoint *checkpoint, const char *data, size_t length);
+void save_checkpoint(struct transfer_checkpoint *checkpoint);
+void restart_checkpoint(struct transfer_checkpoint *checkpoint);
+void close_checkpoint(struct transfer_checkpoint *checkpoint, int completed);
+void print_resume(struct transfer_checkpoint *checkpoint, const char *source);
+
 void print_usage()
 {
     printf("\nUsage: appdeploy <command> [<options>]\n");
     printf("    -p <path_to_app>\n");
-    printf("        - Local Path to .app file. ex /Users/me/Documents/CumberTest.app \n\n");
+    printf("        - Local Path to .app file, or an .ipa holding one. ex /Users/me/Documents/CumberTest.app \n\n");
     printf("    -b <bundle_id>\n");
     printf("        - Bundle Identification of application. ex com.apple.Music \n\n");
     printf("    -f <file_path>\n");
@@ -53,7 +411,17 @@ void print_usage()
     printf("    -dest <destination_path>\n");
     printf("        - The local path to store the downloaded file. ex /Users/me/File.png \n\n");
     printf("    -t <target_device>\n");
-    printf("        - The device to target with the selected action. Will install to the first device found if not specified\n\n");
+    printf("        - The device to target with the selected action. Will install to the first device found if not specified\n");
+    printf("        - Use all, or a comma separated list of UDIDs, to run the command on several devices at once\n\n");
+    printf("    -settle <seconds>\n");
+    printf("        - How long to wait for devices to attach when -t names more than one device. Defaults to 2\n\n");
+    printf("    -socket <socket_path>\n");
+    printf("        - Send the command to a running appdeploy serve listening on socket_path\n\n");
+    printf("    -sim <directory> [-latency <ms>] [-bandwidth <MB/s>] [-failure_rate <rate>]\n");
+    printf("        - Run the command against the simulated devices in directory instead of real ones\n");
+    printf("        - Optionally delay every call, cap transfer speed, or fail a fraction (0 to 1) of calls\n\n");
+    printf("    -trace <trace_file>\n");
+    printf("        - Record how long each phase of the command takes to trace_file, in Chrome trace event format\n\n");
     printf("    -v (verbose)\n");
     printf("        - Enables the verbose output where available.\n\n");
     printf("Commands:\n");
@@ -61,195 +429,702 @@ void print_usage()
     printf("        - Display UDID of connected device (will only show the first device discovered) \n\n");
     printf("    get_bundle_id <path_to_app>\n");
     printf("        - Display bundle identifier of app \n\n");
-    printf("    install -p <path_to_app> [-t <target_device>]\n");
-    printf("        - Install app to device\n\n");
+    printf("    hash_app -p <path_to_app> [-sha256] [-v] [-j <jobs>]\n");
+    printf("        - Display a fingerprint of the app's contents, computed on this machine\n");
+    printf("        - Use -sha256 for SHA-256 digests and -v to list the digest of every file\n");
+    printf("        - Files are hashed on -j threads at once, one per core by default\n");
+    printf("        - An .ipa is hashed as the app it holds, unpacked once into ~/.appdeploy/unpacked\n\n");
+    printf("    install -p <path_to_app> [-p <path_to_app> ...] [-delta] [-if_changed [-hash]] [-progress [-json]] [-j <jobs>] [-t <target_device>]\n");
+    printf("        - Install app to device. With several -p the next app is copied while the previous one installs\n");
+    printf("        - An .ipa is unpacked on the way to the device, without extracting it locally\n");
+    printf("        - Use -delta to only send the files that changed since the last install to the device\n");
+    printf("        - Use -if_changed to skip apps whose installed version matches, -hash to also compare contents\n");
+    printf("        - Use -progress to report the phase, percent complete and copy speed, as JSON lines with -json\n\n");
     printf("    uninstall -b <bundle_id> [-t <target_device>]\n");
     printf("        - Uninstall app by bundle id\n\n");
     printf("    remove_file -b <bundle_id> -f <file_path> [-t <target_device>]\n");
     printf("        - Deletes the specified file at the given path\n\n");
-    printf("    download_file -b <bundle_id> -f <file_path> -dest <destination_path> [-t <target_device>]\n");
-    printf("        - Deletes the specified file at the given path\n\n");
-    printf("    upload_file -b <bundle_id> -f <file_path> -dest <destination_path> [-t <target_device>]\n");
-    printf("        - Upload the specified file at the given path\n\n");
-    printf("    list_files -b <bundle_id> [-v] [-t <target_device>]\n");
+    printf("    download_file -b <bundle_id> -f <file_path> -dest <destination_path> [-resume] [-v] [-t <target_device>]\n");
+    printf("        - Downloads the specified file at the given path\n");
+    printf("        - Use -resume to continue an interrupted download from its last checkpoint\n");
+    printf("        - Use the optional -v paramater to print the transfer size and throughput\n\n");
+    printf("    upload_file -b <bundle_id> -f <file_path> -dest <destination_path> [-resume] [-v] [-t <target_device>]\n");
+    printf("        - Upload the specified file at the given path\n");
+    printf("        - Use -resume to continue an interrupted upload from its last checkpoint\n");
+    printf("        - Use the optional -v paramater to print the transfer size and throughput\n\n");
+    printf("    read_range -b <bundle_id> -f <file_path> [-offset <bytes>] [-length <bytes>] [-last <bytes>] [-follow] [-dest <destination_path>] [-t <target_device>]\n");
+    printf("        - Writes part of the file at the given path to stdout, or to destination_path\n");
+    printf("        - Use -offset and -length for a range (64K, 10M), or -last for the end of the file\n");
+    printf("        - Use -follow to keep writing whatever is appended to the file, like tail -f\n\n");
+    printf("    syslog [-process <name>] [-level <level>] [-match <regex>] [-dest <destination_path>] [-v] [-t <target_device>]\n");
+    printf("        - Streams the device log to stdout, or appends it to destination_path, until the device goes away\n");
+    printf("        - Use -process (more than once for several), -level (debug to fault) and -match to show only some lines\n\n");
+    printf("    list_files -b <bundle_id> [-f <file_path>] [-include <pattern>] [-exclude <pattern>] [-regex] [-max_depth <depth>]\n");
+    printf("               [-min_size <bytes>] [-max_size <bytes>] [-newer <age>] [-older <age>] [-v] [-j <jobs>] [-t <target_device>]\n");
     printf("        - Lists all of the files in the sandbox for the specified app.\n");
-    printf("        - Use the optional -v paramater to get also list all directories\n\n");
-    printf("    list_apps [-v] [-t <target_device>]\n");
+    printf("        - Use the optional -v paramater to get also list all directories\n");
+    printf("        - Use -f to list a directory other than /Documents\n");
+    printf("        - Use -include and -exclude globs (regular expressions with -regex) to choose files, excluded directories are not read\n");
+    printf("        - Use -max_depth, -min_size, -max_size, -newer and -older to limit depth, size (64K, 10M) and age (30m, 12h, 7d)\n");
+    printf("        - Directories are read over up to -j connections at once, 4 by default, opened only as the tree fans out\n\n");
+    printf("    list_apps [-v] [-type <user|system|any>] [-cache] [-t <target_device>]\n");
     printf("        - Lists all installed apps on device\n");
-    printf("        - Use the optional -v paramater to include all application installation paths\n\n");
+    printf("        - Use the optional -v paramater to include all application installation paths\n");
+    printf("        - Use -type to list only user or system apps, and -cache to answer from the list saved by the last -cache run\n\n");
+    printf("    pull_dir -b <bundle_id> -f <file_path> -dest <destination_path> [-j <jobs>] [-t <target_device>]\n");
+    printf("        - Copies the directory at file_path on the device, and everything in it, to destination_path\n\n");
+    printf("    push_dir -b <bundle_id> -f <file_path> -dest <destination_path> [-j <jobs>] [-t <target_device>]\n");
+    printf("        - Copies the local directory at file_path, and everything in it, to destination_path on the device\n\n");
+    printf("    sync -b <bundle_id> -f <file_path> -dest <destination_path> [-hash] [-delete] [-j <jobs>] [-t <target_device>]\n");
+    printf("        - Uploads only the files in the local directory file_path that are new or changed on the device\n");
+    printf("        - Use -hash to compare file contents as well, and -delete to remove device files missing locally\n\n");
+    printf("    batch <batch_file|-> -b <bundle_id> [-j <jobs>] [-t <target_device>]\n");
+    printf("        - Runs the upload, download, remove, list, mkdir and rename operations listed in batch_file (or stdin)\n");
+    printf("        - Up to -j operations on unrelated paths run at once, 4 by default\n\n");
+    printf("    snapshot -b <bundle_id> -dest <snapshot_file> [-f <file_path>] [-include <pattern>] [-exclude <pattern>] [-j <jobs>] [-t <target_device>]\n");
+    printf("        - Saves the path, size, mtime and type of everything under file_path, /Documents by default, to snapshot_file\n");
+    printf("        - Takes the same filters as list_files\n\n");
+    printf("    diff <snapshot_file> [<snapshot_file>] [-b <bundle_id>] [-f <file_path>] [-v] [-t <target_device>]\n");
+    printf("        - Lists what was added (A), removed (D) or modified (M) between two snapshots\n");
+    printf("        - With one snapshot compares it with the device, under the snapshot's directory unless -f is given\n");
+    printf("        - The device is walked with the filters the snapshot was taken with\n\n");
+    printf("    bench -b <bundle_id> [-iterations <count>] [-json] [-j <jobs>] [-t <target_device>]\n");
+    printf("        - Measures handshakes, transfer speed across chunk and file sizes, small files and list_files\n");
+    printf("        - Every measurement runs -iterations times, 5 by default. Use -json for machine readable output\n\n");
+    printf("    serve [-socket <socket_path>]\n");
+    printf("        - Stay running and accept commands sent with -socket. Defaults to /tmp/appdeploy-<uid>.sock\n\n");
 }
 
-// Unregister notifications
-void unregister_device_notification(int status)
+double current_time()
 {
-    AMDeviceNotificationUnsubscribe(command.notification);
-    exit(status);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    
+    return now.tv_sec + now.tv_usec / 1000000.0;
 }
 
-// Helpers
-char *create_cstr_from_cfstring(CFStringRef cfstring)
+// Tracing
+//
+// With -trace every MobileDevice and AFC call that reaches the device is recorded
+// as a span in the Chrome trace event format, which chrome://tracing and Perfetto
+// open directly. This is done by wrapping backend, so the calls cost nothing extra
+// when tracing is off. Discovery, the whole command, and each file moved by
+// download_path() and upload_path() get spans of their own; those call sites only
+// check trace.file when tracing is off.
+
+void write_trace_string(const char *string)
 {
-    CFIndex str_length = CFStringGetLength(cfstring);
-    
-    if (str_length < 0)
-    {
-        return NULL;
-    }
-    
-    CFIndex buf_length = CFStringGetMaximumSizeForEncoding(str_length, kCFStringEncodingUTF8) + 1;
-    
-    if (buf_length < 1)
-    {
-        return NULL;
-    }
-    
-    char *cstr = (char *)malloc(buf_length);
-    
-    if (cstr == NULL)
-    {
-        return NULL;
-    }
+    fputc('"', trace.file);
     
-    if (CFStringGetCString(cfstring, cstr, buf_length, kCFStringEncodingUTF8))
+    for (; *string != '\0'; string++)
     {
-        return cstr;
+        unsigned char c = (unsigned char)*string;
+        
+        if (c == '"' || c == '\\')
+        {
+            fprintf(trace.file, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(trace.file, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, trace.file);
+        }
     }
     
-    return NULL;
-}
-
-CFURLRef get_absolute_file_url(const char *file_path)
-{
-    CFStringRef path = CFStringCreateWithCString(NULL, file_path, kCFStringEncodingUTF8);
-    CFURLRef relative_url = CFURLCreateWithFileSystemPath(NULL, path, kCFURLPOSIXPathStyle, false);
-    CFURLRef url = CFURLCopyAbsoluteURL(relative_url);
-    
-    CFRelease(path);
-    CFRelease(relative_url);
-    return url;
+    fputc('"', trace.file);
 }
 
-void connect_to_device(struct am_device *device)
+// Start time for trace_span(), or 0 when tracing is off
+double trace_begin()
 {
-    AMDeviceConnect(device);
-    ASSERT_OR_EXIT(AMDeviceIsPaired(device), "Error attempting to connect to device: AMDeviceIsPaired failed\n");
-    ASSERT_OR_EXIT(!AMDeviceValidatePairing(device), "Error attempting to connect to device: AMDeviceValidatePairing failed\n");
-    ASSERT_OR_EXIT(!AMDeviceStartSession(device), "Error attempting to connect to device: AMDeviceStartSession failed\n");
+    return (trace.file != NULL) ? current_time() : 0;
 }
 
-static void print_installed_app(const void *key, const void *value, void *context)
+// Records a span from start until now. path is added to the span's args when set.
+void trace_span(const char *name, const char *category, const char *path, double start)
 {
-    if ((key == NULL) || (value == NULL))
+    if (trace.file == NULL)
     {
         return;
     }
     
-    char *bundle_id = create_cstr_from_cfstring((CFStringRef)key);
+    double end = current_time();
     
-    if (bundle_id == NULL)
+    pthread_mutex_lock(&trace.lock);
+    
+    // finish_trace() may have closed the file since the check above
+    if (trace.file == NULL)
     {
+        pthread_mutex_unlock(&trace.lock);
         return;
     }
     
-    if (command.print_paths)
+    if (trace_thread_id == 0)
     {
-        char *path = NULL;
-        CFStringRef path_value;
-        path_value = CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("Path"));
+        trace_thread_id = ++trace.thread_count;
         
-        if (path_value != NULL)
+        // Name fan-out threads after their device so each gets a labelled track
+        fprintf(trace.file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": ", (trace.event_count++ > 0) ? "," : "", (int)getpid(), trace_thread_id);
+        
+        if (current_worker != NULL && current_worker->udid != NULL)
         {
-            path = create_cstr_from_cfstring(path_value);
+            write_trace_string(current_worker->udid);
         }
-        
-        printf("%s\n\tPath: %s\n", bundle_id, (path == NULL) ? "" : path);
-        
-        if (path != NULL)
+        else
         {
-            free(path);
+            fprintf(trace.file, "\"thread %d\"", trace_thread_id);
         }
+        
+        fprintf(trace.file, "}}");
     }
-    else
+    
+    fprintf(trace.file, "%s\n{\"name\": ", (trace.event_count++ > 0) ? "," : "");
+    write_trace_string(name);
+    fprintf(trace.file, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.1f, \"dur\": %.1f, \"pid\": %d, \"tid\": %d", category, (start - trace.start) * 1000000, (end - start) * 1000000, (int)getpid(), trace_thread_id);
+    
+    if (path != NULL)
     {
-        printf("%s\n", bundle_id);
+        fprintf(trace.file, ", \"args\": {\"path\": ");
+        write_trace_string(path);
+        fprintf(trace.file, "}");
     }
     
+    fprintf(trace.file, "}");
+    pthread_mutex_unlock(&trace.lock);
+}
+
+static mach_error_t traced_connect(struct am_device *device)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->connect(device);
+    trace_span("AMDeviceConnect", "device", NULL, start);
+    return err;
+}
+
+static mach_error_t traced_is_paired(struct am_device *device)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->is_paired(device);
+    trace_span("AMDeviceIsPaired", "device", NULL, start);
+    return err;
+}
+
+static mach_error_t traced_validate_pairing(struct am_device *device)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->validate_pairing(device);
+    trace_span("AMDeviceValidatePairing", "device", NULL, start);
+    return err;
+}
+
+static mach_error_t traced_start_session(struct am_device *device)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->start_session(device);
+    trace_span("AMDeviceStartSession", "device", NULL, start);
+    return err;
+}
+
+static mach_error_t traced_stop_session(struct am_device *device)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->stop_session(device);
+    trace_span("AMDeviceStopSession", "device", NULL, start);
+    return err;
+}
+
+static mach_error_t traced_disconnect(struct am_device *device)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->disconnect(device);
+    trace_span("AMDeviceDisconnect", "device", NULL, start);
+    return err;
+}
+
+static mach_error_t traced_start_service(struct am_device *device, CFStringRef service_name, int *socket_fd)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->start_service(device, service_name, socket_fd);
+    trace_span("AMDeviceStartService", "device", NULL, start);
+    return err;
+}
+
+static mach_error_t traced_start_house_arrest_service(struct am_device *device, CFStringRef identifier, void *unknown, service_conn_t *handle, unsigned int *what)
+{
+    double start = trace_begin();
+    mach_error_t err = trace.backend->start_house_arrest_service(device, identifier, unknown, handle, what);
+    char *bundle_id = (identifier != NULL) ? create_cstr_from_cfstring(identifier) : NULL;
+    
+    trace_span("AMDeviceStartHouseArrestService", "device", bundle_id, start);
     free(bundle_id);
+    return err;
 }
 
-// Get UDID
-void get_udid(struct am_device *device)
+static int traced_secure_transfer_path(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int callback_arg)
+{
+    char path[PATH_MAX];
+    double start = trace_begin();
+    int err = trace.backend->secure_transfer_path(unknown0, device, url, options, callback, callback_arg);
+    trace_span("AMDeviceSecureTransferPath", "install", CFURLGetFileSystemRepresentation(url, true, (UInt8 *)path, PATH_MAX) ? path : NULL, start);
+    return err;
+}
+
+static int traced_secure_install_application(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int callback_arg)
+{
+    char path[PATH_MAX];
+    double start = trace_begin();
+    int err = trace.backend->secure_install_application(unknown0, device, url, options, callback, callback_arg);
+    trace_span("AMDeviceSecureInstallApplication", "install", CFURLGetFileSystemRepresentation(url, true, (UInt8 *)path, PATH_MAX) ? path : NULL, start);
+    return err;
+}
+
+static int traced_secure_uninstall_application(int unknown0, struct am_device *device, CFStringRef bundle_id, int unknown1, void *callback, int callback_arg)
 {
-    char *udid = create_cstr_from_cfstring(AMDeviceCopyDeviceIdentifier(device));
+    double start = trace_begin();
+    int err = trace.backend->secure_uninstall_application(unknown0, device, bundle_id, unknown1, callback, callback_arg);
+    char *bundle_id_cstr = (bundle_id != NULL) ? create_cstr_from_cfstring(bundle_id) : NULL;
     
-    if (udid == NULL)
+    trace_span("AMDeviceSecureUninstallApplication", "install", bundle_id_cstr, start);
+    free(bundle_id_cstr);
+    return err;
+}
+
+static int traced_lookup_applications(struct am_device *device, CFDictionaryRef options, CFDictionaryRef *apps)
+{
+    double start = trace_begin();
+    int err = trace.backend->lookup_applications(device, options, apps);
+    trace_span("AMDeviceLookupApplications", "device", NULL, start);
+    return err;
+}
+
+static afc_error_t traced_connection_open(int socket_fd, unsigned int io_timeout, struct afc_connection **connection)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->connection_open(socket_fd, io_timeout, connection);
+    trace_span("AFCConnectionOpen", "afc", NULL, start);
+    return err;
+}
+
+static afc_error_t traced_connection_close(struct afc_connection *connection)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->connection_close(connection);
+    trace_span("AFCConnectionClose", "afc", NULL, start);
+    return err;
+}
+
+static afc_error_t traced_device_info_open(struct afc_connection *connection, struct afc_dictionary **info)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->device_info_open(connection, info);
+    trace_span("AFCDeviceInfoOpen", "afc", NULL, start);
+    return err;
+}
+
+static afc_error_t traced_directory_open(struct afc_connection *connection, char *path, struct afc_directory **directory)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->directory_open(connection, path, directory);
+    trace_span("AFCDirectoryOpen", "afc", path, start);
+    return err;
+}
+
+static afc_error_t traced_directory_create(struct afc_connection *connection, char *path)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->directory_create(connection, path);
+    trace_span("AFCDirectoryCreate", "afc", path, start);
+    return err;
+}
+
+static afc_error_t traced_remove_path(struct afc_connection *connection, char *path)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->remove_path(connection, path);
+    trace_span("AFCRemovePath", "afc", path, start);
+    return err;
+}
+
+static afc_error_t traced_rename_path(struct afc_connection *connection, char *old_path, char *new_path)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->rename_path(connection, old_path, new_path);
+    trace_span("AFCRenamePath", "afc", old_path, start);
+    return err;
+}
+
+static afc_error_t traced_file_info_open(struct afc_connection *connection, char *path, struct afc_dictionary **info)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->file_info_open(connection, path, info);
+    trace_span("AFCFileInfoOpen", "afc", path, start);
+    return err;
+}
+
+static afc_error_t traced_file_ref_open(struct afc_connection *connection, char *path, unsigned long long mode, afc_file_ref *file_ref)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->file_ref_open(connection, path, mode, file_ref);
+    trace_span("AFCFileRefOpen", "afc", path, start);
+    return err;
+}
+
+static afc_error_t traced_file_ref_read(struct afc_connection *connection, afc_file_ref file_ref, void *buffer, unsigned int *length)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->file_ref_read(connection, file_ref, buffer, length);
+    trace_span("AFCFileRefRead", "afc", NULL, start);
+    return err;
+}
+
+static afc_error_t traced_file_ref_write(struct afc_connection *connection, afc_file_ref file_ref, void *buffer, unsigned int length)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->file_ref_write(connection, file_ref, buffer, length);
+    trace_span("AFCFileRefWrite", "afc", NULL, start);
+    return err;
+}
+
+static afc_error_t traced_file_ref_close(struct afc_connection *connection, afc_file_ref file_ref)
+{
+    double start = trace_begin();
+    afc_error_t err = trace.backend->file_ref_close(connection, file_ref);
+    trace_span("AFCFileRefClose", "afc", NULL, start);
+    return err;
+}
+
+struct device_backend traced_backend;
+
+void finish_trace()
+{
+    pthread_mutex_lock(&trace.lock);
+    
+    if (trace.file != NULL)
     {
-        unregister_device_notification(1);
+        fprintf(trace.file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+        fclose(trace.file);
+        trace.file = NULL;
     }
     
-    // print UDID to console
-    printf("%s\n", udid);
-    
-    free(udid);
+    pthread_mutex_unlock(&trace.lock);
 }
 
-// Get Bundle ID
-CFStringRef read_plist_for_app_path(const char *app_path)
+// Opens trace.path and puts traced_backend in front of the current backend.
+// The file is completed by finish_trace() when the process exits.
+void start_trace()
 {
-    CFURLRef app_url = get_absolute_file_url(app_path);
+    trace.file = fopen(trace.path, "w");
     
-    if (app_url == NULL)
+    if (trace.file == NULL)
     {
-        return NULL;
+        fprintf(stderr, "Unable to write trace to %s\n", trace.path);
+        exit(1);
     }
     
-    CFURLRef url = CFURLCreateCopyAppendingPathComponent(NULL, app_url, CFSTR("Info.plist"), false);
-    CFRelease(app_url);
+    trace.start = current_time();
+    fprintf(trace.file, "{\"traceEvents\": [");
+    atexit(finish_trace);
     
-    if (url == NULL)
+    // hash_app needs no device, and off the Mac there is none without -sim
+    if (backend == NULL)
     {
-        return NULL;
+        return;
     }
     
-    CFReadStreamRef stream = CFReadStreamCreateWithFile(NULL, url);
-    CFRelease(url);
+    traced_backend = *backend;
+    traced_backend.connect = traced_connect;
+    traced_backend.is_paired = traced_is_paired;
+    traced_backend.validate_pairing = traced_validate_pairing;
+    traced_backend.start_session = traced_start_session;
+    traced_backend.stop_session = traced_stop_session;
+    traced_backend.disconnect = traced_disconnect;
+    traced_backend.start_service = traced_start_service;
+    traced_backend.start_house_arrest_service = traced_start_house_arrest_service;
+    traced_backend.secure_transfer_path = traced_secure_transfer_path;
+    traced_backend.secure_install_application = traced_secure_install_application;
+    traced_backend.secure_uninstall_application = traced_secure_uninstall_application;
+    traced_backend.lookup_applications = traced_lookup_applications;
+    traced_backend.connection_open = traced_connection_open;
+    traced_backend.connection_close = traced_connection_close;
+    traced_backend.device_info_open = traced_device_info_open;
+    traced_backend.directory_open = traced_directory_open;
+    traced_backend.directory_create = traced_directory_create;
+    traced_backend.remove_path = traced_remove_path;
+    traced_backend.rename_path = traced_rename_path;
+    traced_backend.file_info_open = traced_file_info_open;
+    traced_backend.file_ref_open = traced_file_ref_open;
+    traced_backend.file_ref_read = traced_file_ref_read;
+    traced_backend.file_ref_write = traced_file_ref_write;
+    traced_backend.file_ref_close = traced_file_ref_close;
     
-    if (stream == NULL)
+    trace.backend = backend;
+    backend = &traced_backend;
+}
+
+// Unregister notifications
+void unregister_device_notification(int status)
+{
+    if (command_trace_start > 0)
     {
-        return NULL;
+        trace_span(command.name, "command", NULL, command_trace_start);
+        command_trace_start = 0;
     }
     
-    CFPropertyListRef plist = NULL;
+    close_connection_pool(NULL);
     
-    if (CFReadStreamOpen(stream) == TRUE)
+    if (backend != NULL)
     {
-        plist = CFPropertyListCreateWithStream(NULL, stream, 0, kCFPropertyListImmutable, NULL, NULL);
+        backend->notification_unsubscribe(command.notification);
     }
     
-    CFReadStreamClose(stream);
-    CFRelease(stream);
+    exit(status);
+}
+
+// Helpers
+char *create_cstr_from_cfstring(CFStringRef cfstring)
+{
+    CFIndex str_length = CFStringGetLength(cfstring);
     
-    if (plist == NULL)
+    if (str_length < 0)
     {
         return NULL;
     }
     
-    const void *value = CFDictionaryGetValue(plist, CFSTR("CFBundleIdentifier"));
-    CFStringRef bundle_id = NULL;
+    CFIndex buf_length = CFStringGetMaximumSizeForEncoding(str_length, kCFStringEncodingUTF8) + 1;
     
-    if (value != NULL)
+    if (buf_length < 1)
     {
-        bundle_id = CFRetain(value);
+        return NULL;
     }
     
-    CFRelease(plist);
+    char *cstr = (char *)malloc(buf_length);
+    
+    if (cstr == NULL)
+    {
+        return NULL;
+    }
+    
+    if (CFStringGetCString(cfstring, cstr, buf_length, kCFStringEncodingUTF8))
+    {
+        return cstr;
+    }
+    
+    return NULL;
+}
+
+char *copy_device_udid(struct am_device *device)
+{
+    CFStringRef identifier = backend->copy_device_identifier(device);
+    
+    if (identifier == NULL)
+    {
+        return NULL;
+    }
+    
+    char *udid = create_cstr_from_cfstring(identifier);
+    CFRelease(identifier);
+    
+    return udid;
+}
+
+CFURLRef get_absolute_file_url(const char *file_path)
+{
+    CFStringRef path = CFStringCreateWithCString(NULL, file_path, kCFStringEncodingUTF8);
+    CFURLRef relative_url = CFURLCreateWithFileSystemPath(NULL, path, kCFURLPOSIXPathStyle, false);
+    CFURLRef url = CFURLCopyAbsoluteURL(relative_url);
+    
+    CFRelease(path);
+    CFRelease(relative_url);
+    return url;
+}
+
+// Called with server.lock held
+struct known_device *find_known_device(struct am_device *device)
+{
+    int i;
+    
+    for (i = 0; i < server.device_count; i++)
+    {
+        if (server.devices[i].device == device)
+        {
+            return &server.devices[i];
+        }
+    }
+    
+    return NULL;
+}
+
+int known_device_paired(struct am_device *device)
+{
+    pthread_mutex_lock(&server.lock);
+    
+    struct known_device *known = find_known_device(device);
+    int paired = (known != NULL && known->paired);
+    
+    pthread_mutex_unlock(&server.lock);
+    return paired;
+}
+
+void set_known_device_paired(struct am_device *device, int paired)
+{
+    pthread_mutex_lock(&server.lock);
+    
+    struct known_device *known = find_known_device(device);
+    
+    if (known != NULL)
+    {
+        known->paired = paired;
+    }
+    
+    pthread_mutex_unlock(&server.lock);
+}
+
+// Connects to device and starts a session, returns 0 or prints why it could not. A
+// session that was started is ended with close_device_session().
+int connect_to_device(struct am_device *device)
+{
+    const char *failure = NULL;
+    
+    backend->connect(device);
+    
+    // appdeploy serve only validates pairing the first time it talks to a device
+    if (known_device_paired(device))
+    {
+        if (backend->start_session(device) == 0)
+        {
+            return 0;
+        }
+        
+        set_known_device_paired(device, 0);
+    }
+    
+    if (!backend->is_paired(device))
+    {
+        failure = "AMDeviceIsPaired";
+    }
+    else if (backend->validate_pairing(device))
+    {
+        failure = "AMDeviceValidatePairing";
+    }
+    else if (backend->start_session(device))
+    {
+        failure = "AMDeviceStartSession";
+    }
+    
+    if (failure != NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to connect to device: %s failed\n", failure);
+        backend->disconnect(device);
+        return -1;
+    }
+    
+    set_known_device_paired(device, 1);
+    return 0;
+}
+
+void close_device_session(struct am_device *device)
+{
+    backend->stop_session(device);
+    backend->disconnect(device);
+}
+
+// Get UDID
+int get_udid(struct am_device *device)
+{
+    char *udid = create_cstr_from_cfstring(backend->copy_device_identifier(device));
+    
+    if (udid == NULL)
+    {
+        return 1;
+    }
+    
+    // print UDID to console
+    fprintf(command_stdout(), "%s\n", udid);
+    
+    free(udid);
+    return 0;
+}
+
+// Get Bundle ID
+
+// Reads the Info.plist of the bundle at app_path, or of the app inside an .ipa
+CFDictionaryRef copy_app_info(const char *app_path)
+{
+    if (is_ipa_path(app_path))
+    {
+        return copy_ipa_app_info(app_path);
+    }
+    
+    CFURLRef app_url = get_absolute_file_url(app_path);
+    
+    if (app_url == NULL)
+    {
+        return NULL;
+    }
+    
+    CFURLRef url = CFURLCreateCopyAppendingPathComponent(NULL, app_url, CFSTR("Info.plist"), false);
+    CFRelease(app_url);
+    
+    if (url == NULL)
+    {
+        return NULL;
+    }
+    
+    CFReadStreamRef stream = CFReadStreamCreateWithFile(NULL, url);
+    CFRelease(url);
+    
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+    
+    CFPropertyListRef plist = NULL;
+    
+    if (CFReadStreamOpen(stream) == TRUE)
+    {
+        plist = CFPropertyListCreateWithStream(NULL, stream, 0, kCFPropertyListImmutable, NULL, NULL);
+    }
+    
+    CFReadStreamClose(stream);
+    CFRelease(stream);
+    
+    if (plist != NULL && CFGetTypeID(plist) != CFDictionaryGetTypeID())
+    {
+        CFRelease(plist);
+        return NULL;
+    }
+    
+    return plist;
+}
+
+CFStringRef read_plist_for_app_path(const char *app_path)
+{
+    CFDictionaryRef plist = copy_app_info(app_path);
+    
+    if (plist == NULL)
+    {
+        return NULL;
+    }
+    
+    const void *value = CFDictionaryGetValue(plist, CFSTR("CFBundleIdentifier"));
+    CFStringRef bundle_id = NULL;
+    
+    if (value != NULL)
+    {
+        bundle_id = CFRetain(value);
+    }
+    
+    CFRelease(plist);
     
     return bundle_id;
 }
 
 void get_bundle_id(const char *app_path)
 {
-    CFStringRef bundle_id = read_plist_for_app_path(app_path);
+    CFStringRef bundle_id = (app_path != NULL) ? read_plist_for_app_path(app_path) : NULL;
     
     if (bundle_id == NULL)
     {
@@ -269,404 +1144,10760 @@ void get_bundle_id(const char *app_path)
     exit(0);
 }
 
-// Install App
-void install_app(struct am_device *device)
+
+// Uninstall App
+int uninstall_app(struct am_device *device)
 {
-    connect_to_device(device);
+    invalidate_app_inventory(device);
     
-    CFURLRef local_app_url = get_absolute_file_url(command.app_path);
-    CFStringRef keys[] = { CFSTR("PackageType") }, values[] = { CFSTR("Developer") };
-    CFDictionaryRef options = CFDictionaryCreate(NULL, (const void **)&keys, (const void **)&values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (connect_to_device(device) != 0)
+    {
+        return 1;
+    }
     
-    // copy .app to device
-    ASSERT_OR_EXIT(!AMDeviceSecureTransferPath(0, device, local_app_url, options, NULL, 0), "Error attempting to install app: AMDeviceSecureTransferPath failed\n");
+    CFStringRef bundle_id = CFStringCreateWithCString(NULL, command.bundle_id, kCFStringEncodingUTF8);
     
-    // install package on device
-    ASSERT_OR_EXIT(!AMDeviceSecureInstallApplication(0, device, local_app_url, options, NULL, 0), "Error attempting to install app: AMDeviceSecureInstallApplication failed\n");
+    // uninstall package from device
+    int err = backend->secure_uninstall_application(0, device, bundle_id, 0, NULL, 0);
     
-    CFRelease(options);
-    CFRelease(local_app_url);
+    CFRelease(bundle_id);
+    close_device_session(device);
+    
+    if (err != 0)
+    {
+        fprintf(command_stderr(), "Error attempting to uninstall app: AMDeviceSecureUninstallApplication failed\n");
+        return 1;
+    }
+    
+    fprintf(command_stdout(), "%s successfully uninstalled.\n", command.bundle_id);
+    return 0;
+}
+
+// List Files
+
+// Starts house arrest for command.bundle_id, returns 0 or prints why it could not
+int open_file_service(struct am_device *device, service_conn_t *service)
+{
+    if (connect_to_device(device) != 0)
+    {
+        return -1;
+    }
+    
+    CFStringRef cf_bundle_id = CFStringCreateWithCString(NULL, command.bundle_id, kCFStringEncodingASCII);
+    int status = 0;
+    
+    if (backend->start_house_arrest_service(device, cf_bundle_id, 0, service, 0) != 0)
+    {
+        fprintf(command_stdout(), "Unable to find bundle with id: %s\n", command.bundle_id);
+        status = -1;
+    }
+    
+    CFRelease(cf_bundle_id);
+    
+    if (backend->stop_session(device) != 0)
+    {
+        fprintf(command_stderr(), "Error attempting to list files: AMDeviceStopSession failed\n");
+        status = -1;
+    }
+    
+    if (backend->disconnect(device) != 0)
+    {
+        fprintf(command_stderr(), "Error attempting to list files: AMDeviceDisconnect failed\n");
+        status = -1;
+    }
+    
+    return status;
+}
+
+// Connection Pool
+
+int file_connection_is_alive(struct afc_connection *connection)
+{
+    struct afc_dictionary *info;
+    
+    if (backend->device_info_open(connection, &info) != 0)
+    {
+        return 0;
+    }
+    
+    backend->key_value_close(info);
+    return 1;
+}
+
+// Removes entry i from the pool; the caller holds the lock
+static void drop_pooled_connection(int i)
+{
+    struct pooled_connection *entry = &connection_pool.entries[i];
+    
+    if (entry->connection != NULL)
+    {
+        backend->connection_close(entry->connection);
+    }
+    
+    free(entry->udid);
+    free(entry->bundle_id);
+    
+    *entry = connection_pool.entries[--connection_pool.count];
+    pthread_cond_broadcast(&connection_pool.released);
+}
+
+// Closes idle connections that have not been used for POOL_IDLE_SECONDS; the caller holds the lock
+static void evict_idle_connections(double now)
+{
+    int i = 0;
+    
+    while (i < connection_pool.count)
+    {
+        struct pooled_connection *entry = &connection_pool.entries[i];
+        
+        if (!entry->in_use && now - entry->last_used > POOL_IDLE_SECONDS)
+        {
+            drop_pooled_connection(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+// Hands out a house arrest connection to command.bundle_id on the given device.
+// Idle connections for the same (device, bundle id) are reused, after a health
+// check when they have been idle for a while. The check is a device round trip, so
+// it runs on the reserved entry after the pool lock is released. At most
+// MAX_POOLED_CONNECTIONS_PER_DEVICE connections exist per device; when all of them
+// are busy the caller waits for one to be released. Returns NULL, after saying why,
+// when no connection could be opened.
+struct afc_connection *acquire_file_connection(struct am_device *device)
+{
+    char *udid = copy_device_udid(device);
+    
+    if (udid == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to open file service: AMDeviceCopyDeviceIdentifier failed\n");
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&connection_pool.lock);
+    
+    struct pooled_connection *reserved = NULL;
+    int check = 0;
+    
+    while (reserved == NULL)
+    {
+        double now = current_time();
+        int i, device_count = 0, oldest_idle = -1;
+        
+        evict_idle_connections(now);
+        
+        for (i = 0; i < connection_pool.count && reserved == NULL; i++)
+        {
+            struct pooled_connection *entry = &connection_pool.entries[i];
+            
+            if (strcmp(entry->udid, udid) != 0)
+            {
+                continue;
+            }
+            
+            device_count++;
+            
+            if (entry->in_use)
+            {
+                continue;
+            }
+            
+            if (strcmp(entry->bundle_id, command.bundle_id) == 0)
+            {
+                check = (now - entry->last_used > POOL_HEALTH_CHECK_SECONDS);
+                reserved = entry;
+            }
+            else if (oldest_idle < 0 || entry->last_used < connection_pool.entries[oldest_idle].last_used)
+            {
+                oldest_idle = i;
+            }
+        }
+        
+        if (reserved != NULL)
+        {
+            break;
+        }
+        
+        // make room for a new connection by closing one to a different container
+        if (device_count >= MAX_POOLED_CONNECTIONS_PER_DEVICE && oldest_idle >= 0)
+        {
+            drop_pooled_connection(oldest_idle);
+            device_count--;
+        }
+        
+        if (device_count < MAX_POOLED_CONNECTIONS_PER_DEVICE && connection_pool.count < MAX_POOLED_CONNECTIONS)
+        {
+            reserved = &connection_pool.entries[connection_pool.count++];
+            memset(reserved, 0, sizeof(*reserved));
+            reserved->udid = strdup(udid);
+            reserved->bundle_id = strdup(command.bundle_id);
+            reserved->ticket = ++connection_pool.next_ticket;
+            break;
+        }
+        
+        pthread_cond_wait(&connection_pool.released, &connection_pool.lock);
+    }
+    
+    reserved->in_use = 1;
+    reserved->owner = current_worker;
+    struct afc_connection *connection = reserved->connection;
+    unsigned long ticket = reserved->ticket;
+    
+    pthread_mutex_unlock(&connection_pool.lock);
+    free(udid);
+    
+    if (connection != NULL && (!check || file_connection_is_alive(connection)))
+    {
+        return connection;
+    }
+    
+    int i;
+    
+    // a connection that failed its check is replaced in place, the entry stays reserved
+    if (connection != NULL)
+    {
+        pthread_mutex_lock(&connection_pool.lock);
+        
+        for (i = 0; i < connection_pool.count; i++)
+        {
+            if (connection_pool.entries[i].ticket == ticket)
+            {
+                connection_pool.entries[i].connection = NULL;
+                break;
+            }
+        }
+        
+        pthread_mutex_unlock(&connection_pool.lock);
+        backend->connection_close(connection);
+        connection = NULL;
+    }
+    
+    // the handshake runs outside the lock, the reserved entry keeps its place in the pool
+    service_conn_t service_connection;
+    afc_error_t err = -1;
+    
+    if (open_file_service(device, &service_connection) == 0)
+    {
+        err = backend->connection_open(service_connection, 0, &connection);
+        
+        if (err != 0)
+        {
+            fprintf(command_stderr(), "Error attempting to open file service: AFCConnectionOpen failed\n");
+        }
+    }
+    
+    pthread_mutex_lock(&connection_pool.lock);
+    
+    for (i = 0; i < connection_pool.count; i++)
+    {
+        struct pooled_connection *entry = &connection_pool.entries[i];
+        
+        if (entry->ticket == ticket)
+        {
+            if (err == 0)
+            {
+                entry->connection = connection;
+            }
+            else
+            {
+                drop_pooled_connection(i);
+            }
+            
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&connection_pool.lock);
+    
+    return (err == 0) ? connection : NULL;
+}
+
+// Returns a connection to the pool. Connections that saw an error are closed instead.
+void release_file_connection(struct afc_connection *connection, int reusable)
+{
+    int i;
+    
+    pthread_mutex_lock(&connection_pool.lock);
+    
+    for (i = 0; i < connection_pool.count; i++)
+    {
+        struct pooled_connection *entry = &connection_pool.entries[i];
+        
+        if (entry->connection == connection)
+        {
+            if (reusable)
+            {
+                entry->in_use = 0;
+                entry->owner = NULL;
+                entry->last_used = current_time();
+                pthread_cond_broadcast(&connection_pool.released);
+            }
+            else
+            {
+                drop_pooled_connection(i);
+            }
+            
+            break;
+        }
+    }
+    
+    evict_idle_connections(current_time());
+    pthread_mutex_unlock(&connection_pool.lock);
+}
+
+// Closes everything a worker still holds when it finishes, after a failure its state is unknown
+void release_worker_connections(struct device_worker *worker)
+{
+    int i = 0;
+    
+    pthread_mutex_lock(&connection_pool.lock);
+    
+    while (i < connection_pool.count)
+    {
+        if (connection_pool.entries[i].in_use && connection_pool.entries[i].owner == worker)
+        {
+            drop_pooled_connection(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    
+    pthread_mutex_unlock(&connection_pool.lock);
+}
+
+static void on_connection_pool_timer(CFRunLoopTimerRef timer, void *info)
+{
+    pthread_mutex_lock(&connection_pool.lock);
+    evict_idle_connections(current_time());
+    pthread_mutex_unlock(&connection_pool.lock);
+}
+
+// Closes the idle connections to one device, or to every device when udid is NULL
+void close_connection_pool(const char *udid)
+{
+    int i = 0;
+    
+    pthread_mutex_lock(&connection_pool.lock);
+    
+    while (i < connection_pool.count)
+    {
+        struct pooled_connection *entry = &connection_pool.entries[i];
+        
+        if (!entry->in_use && (udid == NULL || strcmp(entry->udid, udid) == 0))
+        {
+            drop_pooled_connection(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    
+    pthread_mutex_unlock(&connection_pool.lock);
+}
+
+// Number of connections used by commands that work on several paths at once (-j)
+int parallel_job_count()
+{
+    int jobs = (command.jobs > 0) ? command.jobs : MAX_POOLED_CONNECTIONS_PER_DEVICE;
+    
+    return (jobs > MAX_POOLED_CONNECTIONS_PER_DEVICE) ? MAX_POOLED_CONNECTIONS_PER_DEVICE : jobs;
+}
+
+// Path Arena
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct path_arena
+{
+    struct arena_block *head;
+};
+
+char *arena_alloc(struct path_arena *arena, size_t length)
+{
+    struct arena_block *block = arena->head;
+    
+    if (block == NULL || block->size - block->used < length)
+    {
+        size_t size = (length > ARENA_BLOCK_SIZE) ? length : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + size);
+        
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        
+        block->next = arena->head;
+        block->used = 0;
+        block->size = size;
+        arena->head = block;
+    }
+    
+    char *memory = block->data + block->used;
+    block->used += length;
+    
+    return memory;
+}
+
+char *arena_join_path(struct path_arena *arena, const char *directory, const char *name)
+{
+    size_t directory_length = strlen(directory);
+    size_t name_length = strlen(name);
+    int needs_separator = (directory_length == 0 || directory[directory_length - 1] != '/');
+    char *path = arena_alloc(arena, directory_length + needs_separator + name_length + 1);
+    
+    if (path != NULL)
+    {
+        memcpy(path, directory, directory_length);
+        
+        if (needs_separator)
+        {
+            path[directory_length] = '/';
+        }
+        
+        memcpy(path + directory_length + needs_separator, name, name_length + 1);
+    }
+    
+    return path;
+}
+
+// Moves every block of source into destination
+void arena_merge(struct path_arena *destination, struct path_arena *source)
+{
+    while (source->head != NULL)
+    {
+        struct arena_block *block = source->head;
+        source->head = block->next;
+        block->next = destination->head;
+        destination->head = block;
+    }
+}
+
+void free_arena(struct path_arena *arena)
+{
+    while (arena->head != NULL)
+    {
+        struct arena_block *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+// Sandbox Walk
+//
+// walk_sandbox() lists a sandbox tree from a shared work queue.
+// Every queued path is opened with AFCDirectoryOpen by whichever worker takes it:
+// success means it is a directory whose children are queued in turn, failure means
+// it is a file. That is one round trip per entry, spread across one worker per
+// connection. With with_info set the probe is AFCFileInfoOpen instead, which costs a
+// second round trip for directories but records the size and mtime of every file.
+// Paths live in per-worker arenas that are handed to the walk when the workers finish.
+// walk_device_sandbox() starts with a single connection and only adds workers, each
+// opening its own pooled connection, once more than one directory is waiting, so a
+// small listing costs one handshake. A walk that runs out of memory stops and is
+// marked failed rather than returning a partial tree.
+//
+// A walk_filter is checked as children are queued, so an excluded directory is never
+// opened at all, and directories at max_depth are probed but not read. The include
+// patterns and the size and age limits only decide which files are kept, since any
+// directory may still hold a match. A walk with_info leaves out symbolic links, which
+// AFC reports as S_IFLNK, rather than copying or recording them as regular files.
+
+struct sandbox_entry
+{
+    char *path;
+    int is_directory;
+    uint64_t size;
+    uint64_t mtime;
+};
+
+// Fields of interest from AFCFileInfoOpen, st_mtime and st_birthtime are in nanoseconds
+struct remote_file_info
+{
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t birthtime;
+    int is_directory;
+    int is_link;
+};
+
+afc_error_t read_remote_file_info(struct afc_connection *connection, char *path, struct remote_file_info *info)
+{
+    struct afc_dictionary *file_dictionary;
+    afc_error_t err = backend->file_info_open(connection, path, &file_dictionary);
+    
+    memset(info, 0, sizeof(*info));
+    
+    if (err != 0)
+    {
+        return err;
+    }
+    
+    char *key, *value;
+    
+    while (backend->key_value_read(file_dictionary, &key, &value) == 0 && key != NULL && value != NULL)
+    {
+        if (strcmp(key, "st_size") == 0)
+        {
+            info->size = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "st_mtime") == 0)
+        {
+            info->mtime = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "st_birthtime") == 0)
+        {
+            info->birthtime = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(key, "st_ifmt") == 0)
+        {
+            info->is_directory = (strcmp(value, "S_IFDIR") == 0);
+            info->is_link = (strcmp(value, "S_IFLNK") == 0);
+        }
+    }
+    
+    backend->key_value_close(file_dictionary);
+    return 0;
+}
+
+// Compiled form of a file_filter, mtime cutoffs are in nanoseconds like st_mtime
+struct walk_filter
+{
+    const struct file_filter *options;
+    regex_t include_regex[MAX_FILTER_PATTERNS];
+    regex_t exclude_regex[MAX_FILTER_PATTERNS];
+    uint64_t newer_than;
+    uint64_t older_than;
+    int needs_info;
+};
+
+// Returns the pattern that failed to compile, or NULL once filter is ready
+const char *compile_walk_filter(struct walk_filter *filter, const struct file_filter *options)
+{
+    int i, j;
+    
+    memset(filter, 0, sizeof(*filter));
+    filter->options = options;
+    filter->needs_info = (options->min_size > 0 || options->max_size > 0 || options->newer_than > 0 || options->older_than > 0);
+    
+    if (options->newer_than > 0)
+    {
+        filter->newer_than = (uint64_t)((current_time() - options->newer_than) * 1000000000.0);
+    }
+    
+    if (options->older_than > 0)
+    {
+        filter->older_than = (uint64_t)((current_time() - options->older_than) * 1000000000.0);
+    }
+    
+    if (!options->regex)
+    {
+        return NULL;
+    }
+    
+    for (i = 0; i < options->include_count; i++)
+    {
+        if (regcomp(&filter->include_regex[i], options->include[i], REG_EXTENDED | REG_NOSUB) != 0)
+        {
+            for (j = 0; j < i; j++)
+            {
+                regfree(&filter->include_regex[j]);
+            }
+            
+            return options->include[i];
+        }
+    }
+    
+    for (i = 0; i < options->exclude_count; i++)
+    {
+        if (regcomp(&filter->exclude_regex[i], options->exclude[i], REG_EXTENDED | REG_NOSUB) != 0)
+        {
+            for (j = 0; j < options->include_count; j++)
+            {
+                regfree(&filter->include_regex[j]);
+            }
+            
+            for (j = 0; j < i; j++)
+            {
+                regfree(&filter->exclude_regex[j]);
+            }
+            
+            return options->exclude[i];
+        }
+    }
+    
+    return NULL;
+}
+
+void free_walk_filter(struct walk_filter *filter)
+{
+    int i;
+    
+    if (filter->options->regex)
+    {
+        for (i = 0; i < filter->options->include_count; i++)
+        {
+            regfree(&filter->include_regex[i]);
+        }
+        
+        for (i = 0; i < filter->options->exclude_count; i++)
+        {
+            regfree(&filter->exclude_regex[i]);
+        }
+    }
+}
+
+// Regexes search the path relative to the walk root. Globs without a slash match
+// the name at any depth, those with one match the whole relative path.
+static int match_filter_pattern(const struct walk_filter *filter, const char *pattern, regex_t *regex, const char *relative)
+{
+    if (filter->options->regex)
+    {
+        return regexec(regex, relative, 0, NULL, 0) == 0;
+    }
+    
+    const char *name = strrchr(relative, '/');
+    
+    if (strchr(pattern, '/') == NULL && name != NULL)
+    {
+        return fnmatch(pattern, name + 1, 0) == 0;
+    }
+    
+    return fnmatch(pattern, relative, 0) == 0;
+}
+
+// Whether a child is worth probing, an excluded directory is skipped with everything in it
+int walk_filter_visits(struct walk_filter *filter, const char *relative)
+{
+    int i;
+    
+    if (filter == NULL)
+    {
+        return 1;
+    }
+    
+    for (i = 0; i < filter->options->exclude_count; i++)
+    {
+        if (match_filter_pattern(filter, filter->options->exclude[i], &filter->exclude_regex[i], relative))
+        {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+// Whether a directory's children are read, the root is at depth 0
+int walk_filter_expands(struct walk_filter *filter, const char *relative)
+{
+    if (filter == NULL || filter->options->max_depth <= 0)
+    {
+        return 1;
+    }
+    
+    int depth = (*relative == '\0') ? 0 : 1;
+    
+    for (; *relative != '\0'; relative++)
+    {
+        depth += (*relative == '/');
+    }
+    
+    return depth < filter->options->max_depth;
+}
+
+// Whether a probed entry goes into the walk. Directories and the root always do.
+int walk_filter_keeps(struct walk_filter *filter, const char *relative, int is_directory, struct remote_file_info *info)
+{
+    const struct file_filter *options;
+    int i;
+    
+    if (filter == NULL || is_directory || *relative == '\0')
+    {
+        return 1;
+    }
+    
+    options = filter->options;
+    
+    if (options->include_count > 0)
+    {
+        for (i = 0; i < options->include_count; i++)
+        {
+            if (match_filter_pattern(filter, options->include[i], &filter->include_regex[i], relative))
+            {
+                break;
+            }
+        }
+        
+        if (i == options->include_count)
+        {
+            return 0;
+        }
+    }
+    
+    if ((options->min_size > 0 && info->size < options->min_size) || (options->max_size > 0 && info->size > options->max_size))
+    {
+        return 0;
+    }
+    
+    return (filter->newer_than == 0 || info->mtime >= filter->newer_than) && (filter->older_than == 0 || info->mtime <= filter->older_than);
+}
+
+struct sandbox_walk
+{
+    struct sandbox_entry *entries;
+    size_t count;
+    size_t capacity;
+    char **pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    int busy;
+    int with_info;
+    int with_links;
+    int failed;
+    struct walk_filter *filter;
+    size_t root_length;
+    struct path_arena arena;
+    struct am_device *device;
+    struct walk_worker *workers;
+    int worker_count;
+    int worker_limit;
+    int starting;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+struct walk_worker
+{
+    struct sandbox_walk *walk;
+    struct afc_connection *connection;
+    struct path_arena arena;
+    char **children;
+    size_t child_capacity;
+    pthread_t thread;
+};
+
+// Orders paths so every directory is directly followed by its contents
+int compare_tree_paths(const char *a, const char *b)
+{
+    while (*a != '\0' && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    
+    unsigned char a_char = (*a == '/') ? 1 : (unsigned char)*a;
+    unsigned char b_char = (*b == '/') ? 1 : (unsigned char)*b;
+    
+    return (int)a_char - (int)b_char;
+}
+
+static int compare_sandbox_entries(const void *a, const void *b)
+{
+    return compare_tree_paths(((const struct sandbox_entry *)a)->path, ((const struct sandbox_entry *)b)->path);
+}
+
+// Appends to a growable array of fixed size items, returns 0 when out of memory
+int grow_array(void **items, size_t *capacity, size_t needed, size_t item_size)
+{
+    if (needed <= *capacity)
+    {
+        return 1;
+    }
+    
+    size_t new_capacity = (*capacity == 0) ? 256 : *capacity;
+    
+    while (new_capacity < needed)
+    {
+        new_capacity *= 2;
+    }
+    
+    void *grown = realloc(*items, new_capacity * item_size);
+    
+    if (grown == NULL)
+    {
+        return 0;
+    }
+    
+    *items = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+// The part of path below the walk root, empty for the root itself
+static const char *walk_relative_path(struct sandbox_walk *walk, const char *path)
+{
+    const char *relative = path + walk->root_length;
+    
+    return (*relative == '/') ? relative + 1 : relative;
+}
+
+static void add_walk_worker(struct sandbox_walk *walk);
+
+static void *run_walk_worker(void *context)
+{
+    struct walk_worker *worker = context;
+    struct sandbox_walk *walk = worker->walk;
+    
+    pthread_mutex_lock(&walk->lock);
+    
+    while (true)
+    {
+        // a failed walk stops handing out paths, the workers still busy wind down
+        if (walk->failed)
+        {
+            walk->pending_count = 0;
+        }
+        
+
+        while (walk->pending_count == 0 && walk->busy > 0)
+        {
+            pthread_cond_wait(&walk->changed, &walk->lock);
+        }
+        
+        if (walk->pending_count == 0)
+        {
+            break;
+        }
+        
+        char *path = walk->pending[--walk->pending_count];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+        
+        size_t child_count = 0;
+        struct afc_directory *directory;
+        struct remote_file_info info;
+        const char *relative = walk_relative_path(walk, path);
+        int is_directory, found = 1, complete = 1;
+        
+        if (walk->with_info)
+        {
+            found = (read_remote_file_info(worker->connection, path, &info) == 0);
+            is_directory = found && info.is_directory && backend->directory_open(worker->connection, path, &directory) == 0;
+        }
+        else
+        {
+            memset(&info, 0, sizeof(info));
+            is_directory = (backend->directory_open(worker->connection, path, &directory) == 0);
+        }
+        
+        if (is_directory && walk_filter_expands(walk->filter, relative))
+        {
+            char *name;
+            
+            while (backend->directory_read(worker->connection, directory, &name) == 0 && name != NULL)
+            {
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                {
+                    continue;
+                }
+                
+                char *child = arena_join_path(&worker->arena, path, name);
+                
+                if (child == NULL || !grow_array((void **)&worker->children, &worker->child_capacity, child_count + 1, sizeof(char *)))
+                {
+                    complete = 0;
+                    break;
+                }
+                
+                if (walk_filter_visits(walk->filter, walk_relative_path(walk, child)))
+                {
+                    worker->children[child_count++] = child;
+                }
+            }
+        }
+        
+        if (is_directory)
+        {
+            backend->directory_close(worker->connection, directory);
+        }
+        
+        int keep = found && !info.is_link && walk_filter_keeps(walk->filter, relative, is_directory, &info);
+        
+        pthread_mutex_lock(&walk->lock);
+        
+        if (!complete)
+        {
+            walk->failed = 1;
+        }
+        else if (keep && !grow_array((void **)&walk->entries, &walk->capacity, walk->count + 1, sizeof(struct sandbox_entry)))
+        {
+            walk->failed = 1;
+        }
+        else if (keep)
+        {
+            walk->entries[walk->count].path = path;
+            walk->entries[walk->count].is_directory = is_directory;
+            walk->entries[walk->count].size = info.size;
+            walk->entries[walk->count].mtime = info.mtime;
+            walk->count++;
+        }
+        
+        if (!grow_array((void **)&walk->pending, &walk->pending_capacity, walk->pending_count + child_count, sizeof(char *)))
+        {
+            walk->failed = 1;
+        }
+        else if (!walk->failed)
+        {
+            memcpy(walk->pending + walk->pending_count, worker->children, child_count * sizeof(char *));
+            walk->pending_count += child_count;
+        }
+        
+        if (!walk->failed)
+        {
+            add_walk_worker(walk);
+        }
+        
+        walk->busy--;
+        pthread_cond_broadcast(&walk->changed);
+    }
+    
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+// Opens a connection for a worker added by add_walk_worker() and walks with it. A
+// worker that cannot connect leaves the queue to the others.
+static void *run_added_walk_worker(void *context)
+{
+    struct walk_worker *worker = context;
+    struct sandbox_walk *walk = worker->walk;
+    
+    worker->connection = acquire_file_connection(walk->device);
+    
+    pthread_mutex_lock(&walk->lock);
+    walk->starting--;
+    pthread_mutex_unlock(&walk->lock);
+    
+    if (worker->connection != NULL)
+    {
+        run_walk_worker(worker);
+        release_file_connection(worker->connection, 1);
+    }
+    
+    return NULL;
+}
+
+// Starts another worker when more directories are waiting than the workers still
+// connecting will take; the caller holds the lock
+static void add_walk_worker(struct sandbox_walk *walk)
+{
+    if (walk->device == NULL || walk->worker_count >= walk->worker_limit || walk->pending_count <= (size_t)walk->starting + 1)
+    {
+        return;
+    }
+    
+    struct walk_worker *worker = &walk->workers[walk->worker_count];
+    
+    memset(worker, 0, sizeof(*worker));
+    worker->walk = walk;
+    
+    if (pthread_create(&worker->thread, NULL, run_added_walk_worker, worker) != 0)
+    {
+        // carry on with the workers already running
+        walk->worker_limit = walk->worker_count;
+        return;
+    }
+    
+    walk->worker_count++;
+    walk->starting++;
+}
+
+void free_sandbox_walk(struct sandbox_walk *walk)
+{
+    free(walk->entries);
+    free_arena(&walk->arena);
+    memset(walk, 0, sizeof(*walk));
+}
+
+// Queues root on an empty walk, or marks the walk failed when out of memory
+static void start_sandbox_walk(const char *root, int with_info, struct walk_filter *filter, struct sandbox_walk *walk)
+{
+    memset(walk, 0, sizeof(*walk));
+    walk->with_info = with_info;
+    walk->filter = filter;
+    walk->root_length = strlen(root);
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->changed, NULL);
+    
+    char *root_path = arena_alloc(&walk->arena, strlen(root) + 1);
+    
+    if (root_path == NULL || !grow_array((void **)&walk->pending, &walk->pending_capacity, 1, sizeof(char *)))
+    {
+        walk->failed = 1;
+        return;
+    }
+    
+    strcpy(root_path, root);
+    walk->pending[walk->pending_count++] = root_path;
+}
+
+// Takes over the arenas of the workers that ran and sorts the entries
+static void finish_sandbox_walk(struct walk_worker *workers, int worker_count, struct sandbox_walk *walk)
+{
+    int i;
+    
+    for (i = 0; i < worker_count; i++)
+    {
+        arena_merge(&walk->arena, &workers[i].arena);
+        free(workers[i].children);
+    }
+    
+    free(walk->pending);
+    walk->pending = NULL;
+    walk->pending_count = 0;
+    walk->workers = NULL;
+    walk->device = NULL;
+    pthread_cond_destroy(&walk->changed);
+    pthread_mutex_destroy(&walk->lock);
+    
+    qsort(walk->entries, walk->count, sizeof(struct sandbox_entry), compare_sandbox_entries);
+}
+
+// Walks everything under root that filter lets through, or everything when it is NULL,
+// using one worker per connection. The entries are sorted with compare_tree_paths so
+// the result does not depend on timing. walk->failed is set when the walk ran out of
+// memory and the entries are incomplete.
+void walk_sandbox(struct afc_connection **connections, int connection_count, const char *root, int with_info, struct walk_filter *filter, struct sandbox_walk *walk)
+{
+    struct walk_worker workers[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int i;
+    
+    start_sandbox_walk(root, with_info, filter, walk);
+    
+    if (connection_count > MAX_POOLED_CONNECTIONS_PER_DEVICE)
+    {
+        connection_count = MAX_POOLED_CONNECTIONS_PER_DEVICE;
+    }
+    
+    for (i = 0; i < connection_count; i++)
+    {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].walk = walk;
+        workers[i].connection = connections[i];
+    }
+    
+    // the first connection walks on the calling thread, the walk still finishes when
+    // fewer threads than connections could be started
+    int started = 1;
+    
+    while (started < connection_count && pthread_create(&workers[started].thread, NULL, run_walk_worker, &workers[started]) == 0)
+    {
+        started++;
+    }
+    
+    run_walk_worker(&workers[0]);
+    
+    for (i = 1; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    finish_sandbox_walk(workers, connection_count, walk);
+}
+
+// Walks root on device like walk_sandbox(), starting with one pooled connection and
+// adding workers up to -j while the queue is deeper than one, see add_walk_worker().
+// Returns 0, with an empty walk, when not even the first connection could be opened.
+int walk_device_sandbox(struct am_device *device, const char *root, int with_info, struct walk_filter *filter, struct sandbox_walk *walk)
+{
+    struct walk_worker workers[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int i;
+    
+    start_sandbox_walk(root, with_info, filter, walk);
+    
+    memset(&workers[0], 0, sizeof(workers[0]));
+    workers[0].walk = walk;
+    workers[0].connection = acquire_file_connection(device);
+    
+    if (workers[0].connection == NULL)
+    {
+        finish_sandbox_walk(workers, 1, walk);
+        free_sandbox_walk(walk);
+        return 0;
+    }
+    
+    walk->device = device;
+    walk->workers = workers;
+    walk->worker_count = 1;
+    walk->worker_limit = parallel_job_count();
+    
+    if (walk->worker_limit > MAX_POOLED_CONNECTIONS_PER_DEVICE)
+    {
+        walk->worker_limit = MAX_POOLED_CONNECTIONS_PER_DEVICE;
+    }
+    
+    run_walk_worker(&workers[0]);
+    release_file_connection(workers[0].connection, 1);
+    
+    // no worker is busy any more, so none can be added while these finish
+    for (i = 1; i < walk->worker_count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    finish_sandbox_walk(workers, walk->worker_count, walk);
+    return 1;
+}
+
+// Prints files, and directories as well with -v
+void print_sandbox_walk(struct sandbox_walk *walk)
+{
+    size_t i;
+    
+    for (i = 0; i < walk->count; i++)
+    {
+        if (!walk->entries[i].is_directory || command.print_paths)
+        {
+            fprintf(command_stdout(), "%s\n", walk->entries[i].path);
+        }
+    }
+}
+
+// Lists /Documents, or the directory given with -f, through the -include, -exclude,
+// -max_depth, size and age filters
+int list_files(struct am_device *device)
+{
+    char *root = (command.file_path != NULL) ? command.file_path : "/Documents";
+    struct walk_filter filter;
+    const char *bad_pattern = compile_walk_filter(&filter, &command.filter);
+    
+    ASSERT_OR_RETURN(bad_pattern == NULL, "Error: %s is not a valid regular expression\n", bad_pattern);
+    
+    struct sandbox_walk walk;
+    int connected = walk_device_sandbox(device, root, filter.needs_info, &filter, &walk);
+    int failed = walk.failed;
+    
+    free_walk_filter(&filter);
+    
+    if (connected && !failed)
+    {
+        print_sandbox_walk(&walk);
+    }
+    
+    free_sandbox_walk(&walk);
+    
+    ASSERT_OR_RETURN(!failed, "Error attempting to list files: out of memory walking %s\n", root);
+    return !connected;
+}
+
+//Remove File
+
+int delete_file(struct am_device *device)
+{
+    struct afc_connection* fileConnection = acquire_file_connection(device);
+    
+    if (fileConnection == NULL)
+    {
+        return 1;
+    }
+    
+    char *fileDir = command.file_path;
+    int err = backend->remove_path(fileConnection, fileDir);
+    
+    release_file_connection(fileConnection, 1);
+    
+    ASSERT_OR_RETURN(err == 0, "Error attempting to remove file: AFCRemovePath failed\n");
+    fprintf(command_stdout(), "%s successfully removed.\n", command.file_path);
+    return 0;
+}
+
+// Chunked Transfers
+
+struct transfer_stats
+{
+    uint64_t bytes;
+    double seconds;
+    const char *failure;
+};
+
+// Fills buffer with up to capacity bytes; a length of 0 marks the end of the input
+typedef int (*chunk_fill_callback)(void *context, char *buffer, size_t capacity, size_t *length);
+typedef int (*chunk_drain_callback)(void *context, char *buffer, size_t length);
+
+struct chunk_slot
+{
+    char *buffer;
+    size_t length;
+    int full;
+};
+
+struct chunk_pipeline
+{
+    struct chunk_slot slots[TRANSFER_SLOT_COUNT];
+    size_t chunk_size;
+    chunk_fill_callback fill;
+    void *fill_context;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int finished;
+    int cancelled;
+    int error;
+};
+
+void print_transfer_rate(struct transfer_stats *stats)
+{
+    double megabytes = stats->bytes / (1024.0 * 1024.0);
+    double rate = (stats->seconds > 0) ? megabytes / stats->seconds : 0;
+    
+    fprintf(command_stdout(), "%llu bytes in %.2f s (%.2f MB/s)\n", (unsigned long long)stats->bytes, stats->seconds, rate);
+}
+
+// Producer side of the pipeline, fills the slots in order on its own thread
+static void *run_chunk_producer(void *context)
+{
+    struct chunk_pipeline *pipeline = context;
+    int index = 0;
+    
+    while (true)
+    {
+        struct chunk_slot *slot = &pipeline->slots[index];
+        
+        pthread_mutex_lock(&pipeline->lock);
+        
+        while (slot->full && !pipeline->cancelled)
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        
+        int cancelled = pipeline->cancelled;
+        pthread_mutex_unlock(&pipeline->lock);
+        
+        if (cancelled)
+        {
+            break;
+        }
+        
+        size_t length = 0;
+        int error = pipeline->fill(pipeline->fill_context, slot->buffer, pipeline->chunk_size, &length);
+        
+        pthread_mutex_lock(&pipeline->lock);
+        
+        if (error || length == 0)
+        {
+            // a drain error recorded by the consumer wins over the end of the input
+            if (error != 0 && pipeline->error == 0)
+            {
+                pipeline->error = error;
+            }
+            
+            pipeline->finished = 1;
+        }
+        else
+        {
+            slot->length = length;
+            slot->full = 1;
+        }
+        
+        int finished = pipeline->finished;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+        
+        if (finished)
+        {
+            break;
+        }
+        
+        index = (index + 1) % TRANSFER_SLOT_COUNT;
+    }
+    
+    return NULL;
+}
+
+// Moves data from fill to drain in chunk_size pieces. The fill callback runs on a
+// second thread so the next chunk is being read while the current one is written.
+// Memory use is TRANSFER_SLOT_COUNT * chunk_size regardless of the input size.
+int run_chunk_pipeline(chunk_fill_callback fill, void *fill_context, chunk_drain_callback drain, void *drain_context, size_t chunk_size, uint64_t *transferred)
+{
+    struct chunk_pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.chunk_size = chunk_size;
+    pipeline.fill = fill;
+    pipeline.fill_context = fill_context;
+    
+    int i;
+    
+    for (i = 0; i < TRANSFER_SLOT_COUNT; i++)
+    {
+        pipeline.slots[i].buffer = malloc(chunk_size);
+        
+        if (pipeline.slots[i].buffer == NULL)
+        {
+            while (i-- > 0)
+            {
+                free(pipeline.slots[i].buffer);
+            }
+            
+            return ENOMEM;
+        }
+    }
+    
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    
+    pthread_t producer;
+    int error = pthread_create(&producer, NULL, run_chunk_producer, &pipeline);
+    int index = 0;
+    
+    while (!error)
+    {
+        struct chunk_slot *slot = &pipeline.slots[index];
+        
+        pthread_mutex_lock(&pipeline.lock);
+        
+        while (!slot->full && !pipeline.finished)
+        {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        
+        int has_data = slot->full;
+        pthread_mutex_unlock(&pipeline.lock);
+        
+        if (!has_data)
+        {
+            break;
+        }
+        
+        int drain_error = drain(drain_context, slot->buffer, slot->length);
+        
+        if (!drain_error && transferred != NULL)
+        {
+            *transferred += slot->length;
+        }
+        
+        pthread_mutex_lock(&pipeline.lock);
+        slot->full = 0;
+        
+        if (drain_error)
+        {
+            pipeline.cancelled = 1;
+            pipeline.error = (pipeline.error != 0) ? pipeline.error : drain_error;
+        }
+        
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+        
+        if (drain_error)
+        {
+            break;
+        }
+        
+        index = (index + 1) % TRANSFER_SLOT_COUNT;
+    }
+    
+    if (!error)
+    {
+        pthread_join(producer, NULL);
+        error = pipeline.error;
+    }
+    
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+    
+    for (i = 0; i < TRANSFER_SLOT_COUNT; i++)
+    {
+        free(pipeline.slots[i].buffer);
+    }
+    
+    return error;
+}
+
+struct afc_file_stream
+{
+    struct afc_connection *connection;
+    afc_file_ref file_ref;
+};
+
+static int fill_from_afc_file(void *context, char *buffer, size_t capacity, size_t *length)
+{
+    struct afc_file_stream *stream = context;
+    unsigned int read_length = (unsigned int)capacity;
+    afc_error_t err = backend->file_ref_read(stream->connection, stream->file_ref, buffer, &read_length);
+    
+    *length = (err == 0) ? read_length : 0;
+    return err;
+}
+
+static int drain_to_local_file(void *context, char *buffer, size_t length)
+{
+    FILE *file = context;
+    
+    if (fwrite(buffer, 1, length, file) != length)
+    {
+        return (errno != 0) ? errno : EIO;
+    }
+    
+    return 0;
+}
+
+// Local side of a download. error keeps what the local write failed with, so it is not
+// reported as a failed read from the device.
+struct checkpointed_file
+{
+    FILE *file;
+    struct transfer_checkpoint *checkpoint;
+    int error;
+};
+
+static int drain_to_checkpointed_file(void *context, char *buffer, size_t length)
+{
+    struct checkpointed_file *output = context;
+    int err = drain_to_local_file(output->file, buffer, length);
+    
+    // a checkpoint may only cover bytes that have left the stdio buffer
+    if (err == 0 && output->checkpoint != NULL && advance_checkpoint(output->checkpoint, buffer, length))
+    {
+        err = (fflush(output->file) == 0) ? 0 : EIO;
+        
+        if (err == 0)
+        {
+            save_checkpoint(output->checkpoint);
+        }
+    }
+    
+    output->error = err;
+    return err;
+}
+
+// Reads st_size for the given path, 0 if the device does not report it
+afc_error_t read_remote_file_size(struct afc_connection *connection, char *path, uint64_t *size)
+{
+    struct remote_file_info info;
+    afc_error_t err = read_remote_file_info(connection, path, &info);
+    
+    *size = info.size;
+    return err;
+}
+
+// Streams a file off the device without holding more than two chunks in memory. With a
+// checkpoint the download continues after the bytes it already covers.
+int download_path(struct afc_connection *connection, char *remote_path, const char *local_path, struct transfer_checkpoint *checkpoint, size_t chunk_size, struct transfer_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    double start = current_time();
+    
+    uint64_t expected_size;
+    
+    if (read_remote_file_size(connection, remote_path, &expected_size) != 0)
+    {
+        stats->failure = "AFCFileInfoOpen";
+        return 1;
+    }
+    
+    struct afc_file_stream stream = { connection, 0 };
+    uint64_t offset = (checkpoint != NULL) ? checkpoint_offset(checkpoint) : 0;
+    
+    if (backend->file_ref_open(connection, remote_path, 2, &stream.file_ref) != 0)
+    {
+        stats->failure = "AFCFileRefOpen";
+        return 1;
+    }
+    
+    if (offset > 0 && backend->file_ref_seek(connection, stream.file_ref, offset, SEEK_SET, 0) != 0)
+    {
+        backend->file_ref_close(connection, stream.file_ref);
+        stats->failure = "AFCFileRefSeek";
+        return 1;
+    }
+    
+    // a resumed download drops whatever came after the checkpoint
+    FILE *local_file = fopen(local_path, (offset > 0) ? "r+b" : "wb");
+    
+    if (local_file == NULL || (offset > 0 && (ftruncate(fileno(local_file), (off_t)offset) != 0 || fseeko(local_file, (off_t)offset, SEEK_SET) != 0)))
+    {
+        if (local_file != NULL)
+        {
+            fclose(local_file);
+        }
+        
+        backend->file_ref_close(connection, stream.file_ref);
+        stats->failure = "fopen";
+        return 1;
+    }
+    
+    struct checkpointed_file output = { local_file, checkpoint, 0 };
+    int err = run_chunk_pipeline(fill_from_afc_file, &stream, drain_to_checkpointed_file, &output, chunk_size, &stats->bytes);
+    
+    if (err)
+    {
+        stats->failure = (output.error != 0) ? "fwrite" : "AFCFileRefRead";
+    }
+    else if (offset + stats->bytes != expected_size)
+    {
+        stats->failure = "AFCFileRefRead (short read)";
+        err = 1;
+    }
+    
+    if (fclose(local_file) != 0 && !err)
+    {
+        stats->failure = "fclose";
+        err = 1;
+    }
+    
+    if (backend->file_ref_close(connection, stream.file_ref) != 0 && !err)
+    {
+        stats->failure = "AFCFileRefClose";
+        err = 1;
+    }
+    
+    stats->seconds = current_time() - start;
+    trace_span("Download", "transfer", remote_path, start);
+    return err;
+}
+
+// With several devices each copy is kept apart as <destination_path>.<udid>, built in
+// buffer so that there is nothing to free
+char *local_destination_path(char *buffer, size_t size)
+{
+    if (current_worker != NULL && fanout.enabled)
+    {
+        snprintf(buffer, size, "%s.%s", command.destination_path, current_worker->udid);
+        return buffer;
+    }
+    
+    return command.destination_path;
+}
+
+//Downlaod File
+
+int download_file(struct am_device *device)
+{
+    struct afc_connection* fileConnection = acquire_file_connection(device);
+    
+    if (fileConnection == NULL)
+    {
+        return 1;
+    }
+    
+    char destination_buffer[PATH_MAX];
+    char *destination_path = local_destination_path(destination_buffer, sizeof(destination_buffer));
+    struct transfer_stats stats;
+    struct remote_file_info info;
+    
+    if (read_remote_file_info(fileConnection, command.file_path, &info) != 0)
+    {
+        fprintf(command_stderr(), "Error attempting to download file: AFCFileInfoOpen failed\n");
+        release_file_connection(fileConnection, 1);
+        return 1;
+    }
+    
+    // the partial download itself is what proves the checkpoint still holds
+    struct transfer_checkpoint *checkpoint = open_checkpoint(device, "download", command.file_path, destination_path, info.size, info.mtime, destination_path);
+    
+    if (checkpoint == NULL)
+    {
+        release_file_connection(fileConnection, 1);
+        return 1;
+    }
+    
+    print_resume(checkpoint, command.file_path);
+    
+    int err = download_path(fileConnection, command.file_path, destination_path, checkpoint, TRANSFER_CHUNK_SIZE, &stats);
+    
+    close_checkpoint(checkpoint, err == 0);
+    release_file_connection(fileConnection, 1);
+    ASSERT_OR_RETURN(err == 0, "Error attempting to download file: %s failed\n", stats.failure);
+    
+    fprintf(command_stdout(), "%s successfully downloaded to %s.\n", command.file_path, destination_path);
+    
+    if (command.print_paths)
+    {
+        print_transfer_rate(&stats);
+    }
+    
+    return 0;
+}
+
+static int fill_from_local_fd(void *context, char *buffer, size_t capacity, size_t *length)
+{
+    int fd = *(int *)context;
+    ssize_t read_length;
+    
+    do
+    {
+        read_length = read(fd, buffer, capacity);
+    } while (read_length < 0 && errno == EINTR);
+    
+    *length = (read_length > 0) ? (size_t)read_length : 0;
+    return (read_length < 0) ? errno : 0;
+}
+
+static int drain_to_afc_file(void *context, char *buffer, size_t length)
+{
+    struct afc_file_stream *stream = context;
+    
+    return backend->file_ref_write(stream->connection, stream->file_ref, buffer, (unsigned int)length);
+}
+
+// Maps one chunk of the source file and asks the kernel to start paging it in
+static char *map_upload_window(int fd, uint64_t offset, size_t length)
+{
+    void *window = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, (off_t)offset);
+    
+    if (window == MAP_FAILED)
+    {
+        return NULL;
+    }
+    
+    madvise(window, length, MADV_SEQUENTIAL);
+    madvise(window, length, MADV_WILLNEED);
+    return window;
+}
+
+// Writes regular files straight out of one-chunk mmap windows, from offset on. The
+// window after the current one is mapped and prefetched before the current
+// AFCFileRefWrite, so disk reads overlap the device write and at most two chunks are
+// resident at a time.
+static int upload_mapped_file(struct afc_file_stream *stream, int fd, uint64_t offset, uint64_t file_size, struct transfer_checkpoint *checkpoint, size_t chunk_size, struct transfer_stats *stats)
+{
+    size_t length = (file_size - offset < chunk_size) ? (size_t)(file_size - offset) : chunk_size;
+    char *current = map_upload_window(fd, offset, length);
+    
+    if (current == NULL)
+    {
+        stats->failure = "mmap";
+        return 1;
+    }
+    
+    while (current != NULL)
+    {
+        uint64_t next_offset = offset + length;
+        size_t next_length = 0;
+        char *next = NULL;
+        
+        if (next_offset < file_size)
+        {
+            next_length = (file_size - next_offset < chunk_size) ? (size_t)(file_size - next_offset) : chunk_size;
+            next = map_upload_window(fd, next_offset, next_length);
+            
+            if (next == NULL)
+            {
+                munmap(current, length);
+                stats->failure = "mmap";
+                return 1;
+            }
+        }
+        
+        afc_error_t err = backend->file_ref_write(stream->connection, stream->file_ref, current, (unsigned int)length);
+        
+        if (err == 0 && checkpoint != NULL && advance_checkpoint(checkpoint, current, length))
+        {
+            save_checkpoint(checkpoint);
+        }
+        
+        munmap(current, length);
+        
+        if (err != 0)
+        {
+            if (next != NULL)
+            {
+                munmap(next, next_length);
+            }
+            
+            stats->failure = "AFCFileRefWrite";
+            return 1;
+        }
+        
+        stats->bytes += length;
+        offset = next_offset;
+        length = next_length;
+        current = next;
+    }
+    
+    return 0;
+}
+
+// Streams a local file onto the device in chunk_size pieces. With a checkpoint
+// a regular file is written from the first byte the checkpoint does not cover.
+int upload_path(struct afc_connection *connection, const char *local_path, char *remote_path, struct transfer_checkpoint *checkpoint, size_t chunk_size, struct transfer_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    double start = current_time();
+    
+    int fd = open(local_path, O_RDONLY);
+    
+    if (fd < 0)
+    {
+        stats->failure = "open";
+        return 1;
+    }
+    
+    struct stat file_info;
+    
+    if (fstat(fd, &file_info) != 0)
+    {
+        close(fd);
+        stats->failure = "fstat";
+        return 1;
+    }
+    
+    struct afc_file_stream stream = { connection, 0 };
+    uint64_t offset = (checkpoint != NULL && S_ISREG(file_info.st_mode)) ? checkpoint_offset(checkpoint) : 0;
+    
+    // a resumed upload opens the file without truncating it, then cuts it back to the checkpoint
+    if (backend->file_ref_open(connection, remote_path, (offset > 0) ? 2 : 3, &stream.file_ref) != 0)
+    {
+        close(fd);
+        stats->failure = "AFCFileRefOpen";
+        return 1;
+    }
+    
+    if (offset > 0 && (backend->file_ref_set_file_size(connection, stream.file_ref, offset) != 0 ||
+                       backend->file_ref_seek(connection, stream.file_ref, offset, SEEK_SET, 0) != 0))
+    {
+        close(fd);
+        backend->file_ref_close(connection, stream.file_ref);
+        stats->failure = "AFCFileRefSeek";
+        return 1;
+    }
+    
+    int err = 0;
+    uint64_t file_size = (uint64_t)file_info.st_size;
+    
+    if (S_ISREG(file_info.st_mode) && file_size > offset)
+    {
+        err = upload_mapped_file(&stream, fd, offset, file_size, checkpoint, chunk_size, stats);
+    }
+    else if (!S_ISREG(file_info.st_mode))
+    {
+        // pipes and devices cannot be mapped, read them through the chunk pipeline instead
+        err = run_chunk_pipeline(fill_from_local_fd, &fd, drain_to_afc_file, &stream, chunk_size, &stats->bytes);
+        
+        if (err)
+        {
+            stats->failure = "AFCFileRefWrite";
+        }
+    }
+    
+    close(fd);
+    
+    if (backend->file_ref_close(connection, stream.file_ref) != 0 && !err)
+    {
+        stats->failure = "AFCFileRefClose";
+        err = 1;
+    }
+    
+    stats->seconds = current_time() - start;
+    trace_span("Upload", "transfer", remote_path, start);
+    return err;
+}
+
+//Upload File
+
+// Reads back the RESUME_CHECK_SIZE bytes the device holds just before offset and
+// compares them with the same bytes of the local file, returns 1 when they match.
+// The checkpoint only proves the local prefix is unchanged, this catches a partial
+// file on the device that was since replaced or rewritten.
+static int remote_prefix_matches(struct afc_connection *connection, char *remote_path, const char *local_path, uint64_t offset)
+{
+    uint64_t start = (offset > RESUME_CHECK_SIZE) ? offset - RESUME_CHECK_SIZE : 0;
+    size_t length = (size_t)(offset - start), remote_length = 0;
+    char *local = malloc(length), *remote = malloc(length);
+    int fd = open(local_path, O_RDONLY);
+    afc_file_ref file_ref;
+    int matches = 0;
+    
+    if (local != NULL && remote != NULL && fd >= 0 && pread(fd, local, length, (off_t)start) == (ssize_t)length &&
+        backend->file_ref_open(connection, remote_path, 1, &file_ref) == 0)
+    {
+        if (backend->file_ref_seek(connection, file_ref, start, SEEK_SET, 0) == 0)
+        {
+            unsigned int read_length = 1;
+            
+            while (remote_length < length && read_length > 0)
+            {
+                read_length = (unsigned int)(length - remote_length);
+                
+                if (backend->file_ref_read(connection, file_ref, remote + remote_length, &read_length) != 0)
+                {
+                    break;
+                }
+                
+                remote_length += read_length;
+            }
+        }
+        
+        backend->file_ref_close(connection, file_ref);
+        matches = (remote_length == length && memcmp(local, remote, length) == 0);
+    }
+    
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    
+    free(local);
+    free(remote);
+    return matches;
+}
+
+int upload_file(struct am_device *device)
+{
+    struct afc_connection* fileConnection = acquire_file_connection(device);
+    
+    if (fileConnection == NULL)
+    {
+        return 1;
+    }
+    
+    struct transfer_stats stats;
+    struct transfer_checkpoint *checkpoint = NULL;
+    struct stat file_info;
+    uint64_t remote_size;
+    
+    // only regular files can be resumed, the start of the source proves the checkpoint holds
+    if (stat(command.file_path, &file_info) == 0 && S_ISREG(file_info.st_mode))
+    {
+        checkpoint = open_checkpoint(device, "upload", command.file_path, command.destination_path, (uint64_t)file_info.st_size, (uint64_t)file_info.st_mtime * 1000000000ULL, command.file_path);
+        
+        if (checkpoint == NULL)
+        {
+            release_file_connection(fileConnection, 1);
+            return 1;
+        }
+        
+        // upload windows are mapped from page boundaries, and the device must still hold the prefix
+        if (checkpoint_offset(checkpoint) > 0 && (checkpoint_offset(checkpoint) % (uint64_t)sysconf(_SC_PAGESIZE) != 0 ||
+            read_remote_file_size(fileConnection, command.destination_path, &remote_size) != 0 || remote_size < checkpoint_offset(checkpoint) ||
+            !remote_prefix_matches(fileConnection, command.destination_path, command.file_path, checkpoint_offset(checkpoint))))
+        {
+            restart_checkpoint(checkpoint);
+        }
+        
+        print_resume(checkpoint, command.file_path);
+    }
+    
+    int err = upload_path(fileConnection, command.file_path, command.destination_path, checkpoint, TRANSFER_CHUNK_SIZE, &stats);
+    
+    if (checkpoint != NULL)
+    {
+        close_checkpoint(checkpoint, err == 0);
+    }
+    
+    release_file_connection(fileConnection, 1);
+    ASSERT_OR_RETURN(err == 0, "Error attempting to upload file: %s failed\n", stats.failure);
+    
+    fprintf(command_stdout(), "%s successfully upload to %s.\n", command.file_path, command.destination_path);
+    
+    if (command.print_paths)
+    {
+        print_transfer_rate(&stats);
+    }
+    
+    return 0;
+}
+
+// Read Range
+//
+// read_range writes part of a sandbox file to stdout, or to -dest: -length bytes from
+// -offset, everything from -offset on, or the last -last bytes. The file is opened and
+// AFCFileRefSeek moves straight to the start, so nothing before it crosses the wire.
+// With -follow it then keeps the file open on the same connection like tail -f,
+// polling st_size and reading only what was appended. Appends are small, so they are
+// read on the calling thread into one FOLLOW_BUFFER_SIZE buffer kept for the whole
+// follow rather than through run_chunk_pipeline(). Polls start FOLLOW_MIN_INTERVAL
+// apart after new data and back off to FOLLOW_MAX_INTERVAL while the file is idle. A
+// file that gets shorter, gets a new st_birthtime, or ends before st_size when read
+// through the open file was truncated or replaced. The path is then opened again and
+// followed from its start.
+
+#define FOLLOW_MIN_INTERVAL 0.01
+#define FOLLOW_MAX_INTERVAL 0.25
+#define FOLLOW_BUFFER_SIZE (256 * 1024)
+
+struct afc_range_stream
+{
+    struct afc_file_stream stream;
+    uint64_t remaining;
+};
+
+static int fill_from_afc_range(void *context, char *buffer, size_t capacity, size_t *length)
+{
+    struct afc_range_stream *range = context;
+    int err = fill_from_afc_file(&range->stream, buffer, (range->remaining < capacity) ? (size_t)range->remaining : capacity, length);
+    
+    range->remaining -= *length;
+    return err;
+}
+
+// Copies up to length bytes from the current position of stream to output, adding the
+// bytes written to copied. Stops early, without an error, if the file ends first.
+static int copy_remote_range(struct afc_file_stream *stream, uint64_t length, FILE *output, uint64_t *copied)
+{
+    struct afc_range_stream range = { *stream, length };
+    int err = (length > 0) ? run_chunk_pipeline(fill_from_afc_range, &range, drain_to_local_file, output, TRANSFER_CHUNK_SIZE, copied) : 0;
+    
+    return (err == 0 && fflush(output) != 0) ? EIO : err;
+}
+
+// Opens the followed path again after it was truncated or replaced, returns 0 or
+// the call that failed
+static const char *reopen_followed_file(struct afc_file_stream *stream)
+{
+    fprintf(command_stderr(), "%s: file truncated or replaced\n", command.file_path);
+    backend->file_ref_close(stream->connection, stream->file_ref);
+    
+    if (backend->file_ref_open(stream->connection, command.file_path, 2, &stream->file_ref) != 0)
+    {
+        stream->file_ref = 0;
+        return "AFCFileRefOpen";
+    }
+    
+    return NULL;
+}
+
+// Writes what is appended to the file after position until the device or the output
+// goes away. Returns the call that failed, NULL when the output went away.
+static const char *follow_remote_file(struct afc_file_stream *stream, uint64_t position, FILE *output)
+{
+    double interval = FOLLOW_MIN_INTERVAL;
+    struct remote_file_info info;
+    uint64_t birthtime = 0;
+    char *buffer = malloc(FOLLOW_BUFFER_SIZE);
+    const char *failure = (buffer == NULL) ? "malloc" : NULL;
+    
+    while (failure == NULL && !ferror(output))
+    {
+        if (read_remote_file_info(stream->connection, command.file_path, &info) != 0)
+        {
+            failure = "AFCFileInfoOpen";
+            break;
+        }
+        
+        if (info.size < position || (birthtime != 0 && info.birthtime != birthtime))
+        {
+            failure = reopen_followed_file(stream);
+            position = 0;
+            continue;
+        }
+        
+        birthtime = info.birthtime;
+        
+        if (info.size == position)
+        {
+            usleep((useconds_t)(interval * 1000000));
+            interval = (interval * 2 < FOLLOW_MAX_INTERVAL) ? interval * 2 : FOLLOW_MAX_INTERVAL;
+            continue;
+        }
+        
+        unsigned int length = 1;
+        
+        while (position < info.size && length > 0 && !ferror(output))
+        {
+            length = (info.size - position < FOLLOW_BUFFER_SIZE) ? (unsigned int)(info.size - position) : FOLLOW_BUFFER_SIZE;
+            
+            if (backend->file_ref_read(stream->connection, stream->file_ref, buffer, &length) != 0)
+            {
+                failure = "AFCFileRefRead";
+                break;
+            }
+            
+            fwrite(buffer, 1, length, output);
+            position += length;
+        }
+        
+        // the open file ended short of what the path reports, so the path names a new file
+        if (failure == NULL && position < info.size && !ferror(output))
+        {
+            failure = reopen_followed_file(stream);
+            position = 0;
+        }
+        
+        fflush(output);
+        interval = FOLLOW_MIN_INTERVAL;
+    }
+    
+    free(buffer);
+    return failure;
+}
+
+int read_range(struct am_device *device)
+{
+    ASSERT_OR_RETURN(command.file_path != NULL, "Error attempting to read range: no -f <file_path>\n");
+    
+    struct afc_connection *connection = acquire_file_connection(device);
+    struct afc_file_stream stream = { connection, 0 };
+    uint64_t size, copied = 0;
+    
+    if (connection == NULL)
+    {
+        return 1;
+    }
+    
+    if (read_remote_file_size(connection, command.file_path, &size) != 0)
+    {
+        fprintf(command_stderr(), "Error attempting to read range: AFCFileInfoOpen failed\n");
+        release_file_connection(connection, 1);
+        return 1;
+    }
+    
+    uint64_t offset = command.range_offset;
+    
+    if (command.range_last > 0)
+    {
+        offset = (size > command.range_last) ? size - command.range_last : 0;
+    }
+    
+    offset = (offset < size) ? offset : size;
+    
+    uint64_t length = size - offset;
+    
+    if (command.range_length > 0 && command.range_length < length)
+    {
+        length = command.range_length;
+    }
+    
+    char destination_buffer[PATH_MAX];
+    char *destination_path = (command.destination_path != NULL) ? local_destination_path(destination_buffer, sizeof(destination_buffer)) : NULL;
+    FILE *output = (destination_path != NULL) ? fopen(destination_path, "wb") : command_stdout();
+    const char *failure = NULL, *follow_failure = NULL;
+    
+    if (output == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to read range: unable to write %s\n", destination_path);
+        release_file_connection(connection, 1);
+        return 1;
+    }
+    
+    if (backend->file_ref_open(connection, command.file_path, 2, &stream.file_ref) != 0)
+    {
+        failure = "AFCFileRefOpen";
+    }
+    else if (offset > 0 && backend->file_ref_seek(connection, stream.file_ref, offset, SEEK_SET, 0) != 0)
+    {
+        failure = "AFCFileRefSeek";
+    }
+    else if (copy_remote_range(&stream, length, output, &copied) != 0)
+    {
+        failure = "AFCFileRefRead";
+    }
+    else if (command.follow)
+    {
+        follow_failure = follow_remote_file(&stream, offset + copied, output);
+    }
+    
+    if (stream.file_ref != 0)
+    {
+        backend->file_ref_close(connection, stream.file_ref);
+    }
+    
+    release_file_connection(connection, 1);
+    
+    int write_failed = (destination_path != NULL && fclose(output) != 0);
+    
+    ASSERT_OR_RETURN(failure == NULL, "Error attempting to read range: %s failed\n", failure);
+    ASSERT_OR_RETURN(follow_failure == NULL, "Error attempting to follow file: %s failed\n", follow_failure);
+    ASSERT_OR_RETURN(!write_failed, "Error attempting to read range: unable to write %s\n", destination_path);
+    return 0;
+}
+
+// Mirror Directories
+//
+// pull_dir and push_dir copy a whole tree over -j pooled connections. The files are
+// sorted by size and handed out from both ends of the list: the first worker always
+// takes the smallest remaining file and the others the largest, so a few big files
+// cannot hold up the many small ones and the big ones still start early.
+
+struct transfer_job
+{
+    char *source;
+    char *destination;
+    uint64_t size;
+    int status;
+    const char *failure;
+    void *context;
+};
+
+struct transfer_queue
+{
+    struct transfer_job *jobs;
+    size_t count;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    int upload;
+    uint64_t bytes;
+    size_t failed;
+    pthread_mutex_t lock;
+};
+
+struct transfer_worker
+{
+    struct transfer_queue *queue;
+    struct afc_connection *connection;
+    int takes_smallest;
+    pthread_t thread;
+};
+
+static int compare_transfer_jobs(const void *a, const void *b)
+{
+    uint64_t a_size = ((const struct transfer_job *)a)->size;
+    uint64_t b_size = ((const struct transfer_job *)b)->size;
+    
+    return (a_size < b_size) ? 1 : (a_size > b_size) ? -1 : 0;
+}
+
+// Returns the new job, valid until the next one is added
+struct transfer_job *add_transfer_job(struct transfer_queue *queue, char *source, char *destination, uint64_t size)
+{
+    if (!grow_array((void **)&queue->jobs, &queue->capacity, queue->count + 1, sizeof(struct transfer_job)))
+    {
+        return NULL;
+    }
+    
+    struct transfer_job *job = &queue->jobs[queue->count++];
+    memset(job, 0, sizeof(*job));
+    job->source = source;
+    job->destination = destination;
+    job->size = size;
+    
+    return job;
+}
+
+static void *run_transfer_worker(void *context)
+{
+    struct transfer_worker *worker = context;
+    struct transfer_queue *queue = worker->queue;
+    
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+        
+        if (queue->head == queue->tail)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        
+        struct transfer_job *job = worker->takes_smallest ? &queue->jobs[--queue->tail] : &queue->jobs[queue->head++];
+        pthread_mutex_unlock(&queue->lock);
+        
+        struct transfer_stats stats;
+        
+        if (queue->upload)
+        {
+            job->status = upload_path(worker->connection, job->source, job->destination, NULL, TRANSFER_CHUNK_SIZE, &stats);
+        }
+        else
+        {
+            job->status = download_path(worker->connection, job->source, job->destination, NULL, TRANSFER_CHUNK_SIZE, &stats);
+        }
+        
+        job->failure = stats.failure;
+        
+        pthread_mutex_lock(&queue->lock);
+        queue->bytes += stats.bytes;
+        queue->failed += (job->status != 0);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    
+    return NULL;
+}
+
+// Runs every job in the queue, one worker per connection
+void run_transfer_queue(struct afc_connection **connections, int connection_count, struct transfer_queue *queue)
+{
+    struct transfer_worker workers[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int i;
+    
+    qsort(queue->jobs, queue->count, sizeof(struct transfer_job), compare_transfer_jobs);
+    queue->head = 0;
+    queue->tail = queue->count;
+    pthread_mutex_init(&queue->lock, NULL);
+    
+    for (i = 0; i < connection_count; i++)
+    {
+        workers[i].queue = queue;
+        workers[i].connection = connections[i];
+        workers[i].takes_smallest = (i == 0 && connection_count > 1);
+    }
+    
+    int started = 1;
+    
+    while (started < connection_count && pthread_create(&workers[started].thread, NULL, run_transfer_worker, &workers[started]) == 0)
+    {
+        started++;
+    }
+    
+    run_transfer_worker(&workers[0]);
+    
+    while (started > 1)
+    {
+        pthread_join(workers[--started].thread, NULL);
+    }
+    
+    pthread_mutex_destroy(&queue->lock);
+}
+
+void print_transfer_failures(struct transfer_queue *queue)
+{
+    size_t i;
+    
+    for (i = 0; i < queue->count; i++)
+    {
+        if (queue->jobs[i].status != 0)
+        {
+            fprintf(command_stderr(), "Error attempting to copy %s: %s failed\n", queue->jobs[i].source, queue->jobs[i].failure);
+        }
+    }
+}
+
+void print_transfer_queue_summary(struct transfer_queue *queue, size_t directory_count, double seconds)
+{
+    print_transfer_failures(queue);
+    
+    struct transfer_stats stats = { queue->bytes, seconds, NULL };
+    
+    fprintf(command_stdout(), "%lu files, %lu directories, %lu failed, ", (unsigned long)(queue->count - queue->failed), (unsigned long)directory_count, (unsigned long)queue->failed);
+    print_transfer_rate(&stats);
+}
+
+static void walk_local_path(char *path, int follow, struct sandbox_walk *walk)
+{
+    struct stat info;
+    int is_link;
+    
+    if ((follow ? stat(path, &info) : lstat(path, &info)) != 0)
+    {
+        return;
+    }
+    
+    is_link = S_ISLNK(info.st_mode);
+    
+    if (!(S_ISDIR(info.st_mode) || S_ISREG(info.st_mode) || (is_link && walk->with_links)))
+    {
+        return;
+    }
+    
+    if (!grow_array((void **)&walk->entries, &walk->capacity, walk->count + 1, sizeof(struct sandbox_entry)))
+    {
+        walk->failed = 1;
+        return;
+    }
+    
+    struct sandbox_entry *entry = &walk->entries[walk->count++];
+    entry->path = path;
+    entry->is_directory = S_ISDIR(info.st_mode);
+    entry->size = (entry->is_directory || is_link) ? 0 : (uint64_t)info.st_size;
+    entry->mtime = (uint64_t)info.st_mtime * 1000000000ULL;
+    
+    if (!entry->is_directory)
+    {
+        return;
+    }
+    
+    DIR *directory = opendir(path);
+    struct dirent *child;
+    
+    if (directory == NULL)
+    {
+        return;
+    }
+    
+    while (!walk->failed && (child = readdir(directory)) != NULL)
+    {
+        if (strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0)
+        {
+            continue;
+        }
+        
+        char *child_path = arena_join_path(&walk->arena, path, child->d_name);
+        
+        if (child_path == NULL)
+        {
+            walk->failed = 1;
+            break;
+        }
+        
+        walk_local_path(child_path, 0, walk);
+    }
+    
+    closedir(directory);
+}
+
+// Adds every directory and regular file under root to the walk, root included,
+// in the same tree order walk_sandbox() produces. Symbolic links below root are
+// never followed, so a link cycle cannot recurse and a link out of the tree is not
+// copied as its target. They are left out unless with_links is set, then listed as
+// files of size 0 so the tree can be removed. Running out of memory sets walk->failed.
+void walk_local_tree(const char *root, struct sandbox_walk *walk)
+{
+    char *path = arena_alloc(&walk->arena, strlen(root) + 1);
+    
+    if (path == NULL)
+    {
+        walk->failed = 1;
+        return;
+    }
+    
+    strcpy(path, root);
+    walk_local_path(path, !walk->with_links, walk);
+    qsort(walk->entries, walk->count, sizeof(struct sandbox_entry), compare_sandbox_entries);
+}
+
+// Maps a path under from_root onto the same relative path under to_root
+char *rebase_path(struct path_arena *arena, const char *path, const char *from_root, const char *to_root)
+{
+    const char *relative = path + strlen(from_root);
+    
+    while (*relative == '/')
+    {
+        relative++;
+    }
+    
+    return (*relative == '\0') ? arena_join_path(arena, to_root, "") : arena_join_path(arena, to_root, relative);
+}
+
+// Returns path relative to root, without a leading slash
+const char *relative_path(const char *path, const char *root)
+{
+    const char *relative = path + strlen(root);
+    
+    while (*relative == '/')
+    {
+        relative++;
+    }
+    
+    return relative;
+}
+
+// Drops trailing slashes so paths under the root can be compared by suffix
+char *trim_root(char *root)
+{
+    size_t length = strlen(root);
+    
+    while (length > 1 && root[length - 1] == '/')
+    {
+        root[--length] = '\0';
+    }
+    
+    return root;
+}
+
+void release_file_connections(struct afc_connection **connections, int count)
+{
+    int i;
+    
+    for (i = 0; i < count; i++)
+    {
+        release_file_connection(connections[i], 1);
+    }
+}
+
+// Returns 0 with count connections, or -1 with none held
+int acquire_file_connections(struct am_device *device, struct afc_connection **connections, int count)
+{
+    int i;
+    
+    for (i = 0; i < count; i++)
+    {
+        connections[i] = acquire_file_connection(device);
+        
+        if (connections[i] == NULL)
+        {
+            release_file_connections(connections, i);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int pull_directory(struct am_device *device)
+{
+    struct afc_connection *connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int connection_count = parallel_job_count();
+    double start = current_time();
+    
+    if (acquire_file_connections(device, connections, connection_count) != 0)
+    {
+        return 1;
+    }
+    
+    struct sandbox_walk walk;
+    walk_sandbox(connections, connection_count, command.file_path, 1, NULL, &walk);
+    
+    if (walk.failed || walk.count == 0 || !walk.entries[0].is_directory)
+    {
+        int out_of_memory = walk.failed;
+        
+        release_file_connections(connections, connection_count);
+        free_sandbox_walk(&walk);
+        ASSERT_OR_RETURN(!out_of_memory, "Error attempting to pull directory: out of memory walking %s\n", command.file_path);
+        ASSERT_OR_RETURN(0, "Error attempting to pull directory: %s is not a directory\n", command.file_path);
+    }
+    
+    char destination_buffer[PATH_MAX];
+    char *destination_root = local_destination_path(destination_buffer, sizeof(destination_buffer));
+    struct transfer_queue queue;
+    size_t i, directory_count = 0;
+    const char *failed_directory = NULL;
+    
+    memset(&queue, 0, sizeof(queue));
+    
+    // entries are in tree order, so every parent directory is created before its contents
+    for (i = 0; i < walk.count && failed_directory == NULL; i++)
+    {
+        struct sandbox_entry *entry = &walk.entries[i];
+        char *local_path = rebase_path(&walk.arena, entry->path, command.file_path, destination_root);
+        
+        if (entry->is_directory)
+        {
+            if (mkdir(local_path, 0755) != 0 && errno != EEXIST)
+            {
+                failed_directory = local_path;
+            }
+            
+            directory_count++;
+        }
+        else
+        {
+            add_transfer_job(&queue, entry->path, local_path, entry->size);
+        }
+    }
+    
+    if (failed_directory == NULL)
+    {
+        run_transfer_queue(connections, connection_count, &queue);
+        print_transfer_queue_summary(&queue, directory_count, current_time() - start);
+    }
+    else
+    {
+        fprintf(command_stderr(), "Error attempting to pull directory: unable to create %s\n", failed_directory);
+    }
+    
+    release_file_connections(connections, connection_count);
+    
+    int failed = (failed_directory != NULL || queue.failed > 0);
+    
+    free(queue.jobs);
+    free_sandbox_walk(&walk);
+    
+    return failed;
+}
+
+int push_directory(struct am_device *device)
+{
+    struct afc_connection *connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int connection_count = parallel_job_count();
+    double start = current_time();
+    
+    struct sandbox_walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk_local_tree(command.file_path, &walk);
+    
+    if (walk.failed || walk.count == 0 || !walk.entries[0].is_directory)
+    {
+        int out_of_memory = walk.failed;
+        
+        free_sandbox_walk(&walk);
+        ASSERT_OR_RETURN(!out_of_memory, "Error attempting to push directory: out of memory walking %s\n", command.file_path);
+        ASSERT_OR_RETURN(0, "Error attempting to push directory: %s is not a directory\n", command.file_path);
+    }
+    
+    if (acquire_file_connections(device, connections, connection_count) != 0)
+    {
+        free_sandbox_walk(&walk);
+        return 1;
+    }
+    
+    struct transfer_queue queue;
+    size_t i, directory_count = 0;
+    
+    memset(&queue, 0, sizeof(queue));
+    queue.upload = 1;
+    
+    for (i = 0; i < walk.count; i++)
+    {
+        struct sandbox_entry *entry = &walk.entries[i];
+        char *remote_path = rebase_path(&walk.arena, entry->path, command.file_path, command.destination_path);
+        
+        if (entry->is_directory)
+        {
+            // an existing directory is not an error, a real failure shows up when its files are written
+            backend->directory_create(connections[0], remote_path);
+            directory_count++;
+        }
+        else
+        {
+            add_transfer_job(&queue, entry->path, remote_path, entry->size);
+        }
+    }
+    
+    run_transfer_queue(connections, connection_count, &queue);
+    release_file_connections(connections, connection_count);
+    
+    print_transfer_queue_summary(&queue, directory_count, current_time() - start);
+    
+    int failed = (queue.failed > 0);
+    
+    free(queue.jobs);
+    free_sandbox_walk(&walk);
+    
+    return failed;
+}
+
+// Content Hashing
+//
+// The fast content hash runs 16 independent 32-bit lanes over 64 byte stripes, with
+// the xxHash32 round in every lane. The inner loop is plain array arithmetic, so the
+// compiler turns it into SSE, AVX2 or NEON code. Words are read little endian, which
+// on the usual hosts is a plain load, so a digest is the same on every machine. At the
+// end the lanes are folded into 64 bits together with the length.
+//
+// SHA-256 is available where a cryptographic digest is wanted. It comes from
+// CommonCrypto on the Mac; elsewhere, where appdeploy is built for hash_app and the
+// simulator, the FIPS 180-4 implementation below stands in for it.
+
+#define CONTENT_HASH_NAME "lanes16x32"
+#define CONTENT_HASH_LANES 16
+#define CONTENT_HASH_STRIPE (CONTENT_HASH_LANES * 4)
+#define SHA256_DIGEST_SIZE 32
+#define CONTENT_DIGEST_MAX SHA256_DIGEST_SIZE
+
+#ifdef __APPLE__
+
+typedef CC_SHA256_CTX sha256_context;
+
+#define sha256_init(context) CC_SHA256_Init(context)
+#define sha256_update(context, data, length) CC_SHA256_Update(context, data, (CC_LONG)(length))
+#define sha256_final(context, digest) CC_SHA256_Final(digest, context)
+
+#else
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t block_length;
+} sha256_context;
+
+static const uint32_t sha256_constants[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTATE(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const unsigned char *block)
+{
+    uint32_t schedule[64], a, b, c, d, e, f, g, h;
+    int i;
+    
+    for (i = 0; i < 16; i++)
+    {
+        schedule[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) | ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+    
+    for (i = 16; i < 64; i++)
+    {
+        uint32_t s0 = SHA256_ROTATE(schedule[i - 15], 7) ^ SHA256_ROTATE(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTATE(schedule[i - 2], 17) ^ SHA256_ROTATE(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+        schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+    }
+    
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (SHA256_ROTATE(e, 6) ^ SHA256_ROTATE(e, 11) ^ SHA256_ROTATE(e, 25)) + ((e & f) ^ (~e & g)) + sha256_constants[i] + schedule[i];
+        uint32_t t2 = (SHA256_ROTATE(a, 2) ^ SHA256_ROTATE(a, 13) ^ SHA256_ROTATE(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_init(sha256_context *context)
+{
+    static const uint32_t initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    
+    memset(context, 0, sizeof(*context));
+    memcpy(context->state, initial, sizeof(initial));
+}
+
+static void sha256_update(sha256_context *context, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    
+    context->length += length;
+    
+    while (length > 0)
+    {
+        if (context->block_length == 0 && length >= 64)
+        {
+            sha256_block(context->state, bytes);
+            bytes += 64;
+            length -= 64;
+            continue;
+        }
+        
+        size_t taken = 64 - context->block_length;
+        taken = (length < taken) ? length : taken;
+        
+        memcpy(context->block + context->block_length, bytes, taken);
+        context->block_length += taken;
+        bytes += taken;
+        length -= taken;
+        
+        if (context->block_length == 64)
+        {
+            sha256_block(context->state, context->block);
+            context->block_length = 0;
+        }
+    }
+}
+
+static void sha256_final(sha256_context *context, unsigned char *digest)
+{
+    uint64_t bits = context->length * 8;
+    int i;
+    
+    context->block[context->block_length++] = 0x80;
+    
+    if (context->block_length > 56)
+    {
+        memset(context->block + context->block_length, 0, 64 - context->block_length);
+        sha256_block(context->state, context->block);
+        context->block_length = 0;
+    }
+    
+    memset(context->block + context->block_length, 0, 56 - context->block_length);
+    
+    for (i = 0; i < 8; i++)
+    {
+        context->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    
+    sha256_block(context->state, context->block);
+    
+    for (i = 0; i < 32; i++)
+    {
+        digest[i] = (unsigned char)(context->state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+#endif
+
+enum ContentHashType
+{
+    FastContentHash,
+    SHA256ContentHash
+};
+
+struct content_hash
+{
+    enum ContentHashType type;
+    uint32_t lanes[CONTENT_HASH_LANES];
+    unsigned char tail[CONTENT_HASH_STRIPE];
+    size_t tail_length;
+    uint64_t length;
+    sha256_context sha256;
+};
+
+static const uint32_t lane_prime_1 = 0x9E3779B1U;
+static const uint32_t lane_prime_2 = 0x85EBCA77U;
+
+size_t content_digest_length(enum ContentHashType type)
+{
+    return (type == SHA256ContentHash) ? SHA256_DIGEST_SIZE : sizeof(uint64_t);
+}
+
+void content_hash_init(struct content_hash *hash, enum ContentHashType type)
+{
+    int i;
+    
+    memset(hash, 0, sizeof(*hash));
+    hash->type = type;
+    
+    if (type == SHA256ContentHash)
+    {
+        sha256_init(&hash->sha256);
+        return;
+    }
+    
+    for (i = 0; i < CONTENT_HASH_LANES; i++)
+    {
+        hash->lanes[i] = lane_prime_1 * (uint32_t)(i + 1);
+    }
+}
+
+static uint16_t read_le16(const unsigned char *bytes)
+{
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static uint32_t read_le32(const unsigned char *bytes)
+{
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t read_le64(const unsigned char *bytes)
+{
+    return (uint64_t)read_le32(bytes) | ((uint64_t)read_le32(bytes + 4) << 32);
+}
+
+static void hash_stripes(uint32_t *state, const unsigned char *data, size_t stripe_count)
+{
+    uint32_t lanes[CONTENT_HASH_LANES], words[CONTENT_HASH_LANES];
+    size_t stripe;
+    int i;
+    
+    memcpy(lanes, state, sizeof(lanes));
+    
+    for (stripe = 0; stripe < stripe_count; stripe++, data += CONTENT_HASH_STRIPE)
+    {
+        for (i = 0; i < CONTENT_HASH_LANES; i++)
+        {
+            words[i] = read_le32(data + 4 * i);
+        }
+        
+        for (i = 0; i < CONTENT_HASH_LANES; i++)
+        {
+            uint32_t lane = lanes[i] + words[i] * lane_prime_2;
+            lanes[i] = ((lane << 13) | (lane >> 19)) * lane_prime_1;
+        }
+    }
+    
+    memcpy(state, lanes, sizeof(lanes));
+}
+
+void content_hash_update(struct content_hash *hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+    
+    if (hash->type == SHA256ContentHash)
+    {
+        sha256_update(&hash->sha256, data, length);
+        return;
+    }
+    
+    hash->length += length;
+    
+    if (hash->tail_length > 0)
+    {
+        size_t needed = CONTENT_HASH_STRIPE - hash->tail_length;
+        size_t taken = (length < needed) ? length : needed;
+        
+        memcpy(hash->tail + hash->tail_length, bytes, taken);
+        hash->tail_length += taken;
+        bytes += taken;
+        length -= taken;
+        
+        if (hash->tail_length < CONTENT_HASH_STRIPE)
+        {
+            return;
+        }
+        
+        hash_stripes(hash->lanes, hash->tail, 1);
+        hash->tail_length = 0;
+    }
+    
+    hash_stripes(hash->lanes, bytes, length / CONTENT_HASH_STRIPE);
+    
+    hash->tail_length = length % CONTENT_HASH_STRIPE;
+    memcpy(hash->tail, bytes + length - hash->tail_length, hash->tail_length);
+}
+
+// Writes the digest, big endian for the fast hash, and returns its length
+size_t content_hash_final(struct content_hash *hash, unsigned char *digest)
+{
+    if (hash->type == SHA256ContentHash)
+    {
+        sha256_final(&hash->sha256, digest);
+        return SHA256_DIGEST_SIZE;
+    }
+    
+    if (hash->tail_length > 0)
+    {
+        memset(hash->tail + hash->tail_length, 0, CONTENT_HASH_STRIPE - hash->tail_length);
+        hash_stripes(hash->lanes, hash->tail, 1);
+    }
+    
+    uint64_t value = hash->length * 0x9E3779B97F4A7C15ULL;
+    int i;
+    
+    for (i = 0; i < CONTENT_HASH_LANES; i++)
+    {
+        value ^= hash->lanes[i];
+        value = ((value << 27) | (value >> 37)) * 0x9E3779B185EBCA87ULL + 0x85EBCA77C2B2AE63ULL;
+    }
+    
+    value ^= value >> 33;
+    value *= 0xC2B2AE3D27D4EB4FULL;
+    value ^= value >> 29;
+    value *= 0x165667B19E3779F9ULL;
+    value ^= value >> 32;
+    
+    for (i = 0; i < 8; i++)
+    {
+        digest[i] = (unsigned char)(value >> (56 - 8 * i));
+    }
+    
+    return sizeof(uint64_t);
+}
+
+// Hashes a local file in TRANSFER_CHUNK_SIZE pieces, returns the digest length or 0
+size_t hash_file(const char *path, enum ContentHashType type, unsigned char *digest)
+{
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0)
+    {
+        return 0;
+    }
+    
+    unsigned char *buffer = malloc(TRANSFER_CHUNK_SIZE);
+    struct content_hash hash;
+    ssize_t length = 0;
+    
+    content_hash_init(&hash, type);
+    
+    while (buffer != NULL && (length = read(fd, buffer, TRANSFER_CHUNK_SIZE)) > 0)
+    {
+        content_hash_update(&hash, buffer, length);
+    }
+    
+    close(fd);
+    
+    if (buffer == NULL || length < 0)
+    {
+        free(buffer);
+        return 0;
+    }
+    
+    free(buffer);
+    return content_hash_final(&hash, digest);
+}
+
+// Fast content hash of a local file as a number, for the manifests
+int hash_local_file(const char *path, uint64_t *hash)
+{
+    unsigned char digest[CONTENT_DIGEST_MAX];
+    int i;
+    
+    if (hash_file(path, FastContentHash, digest) == 0)
+    {
+        return 0;
+    }
+    
+    for (*hash = 0, i = 0; i < 8; i++)
+    {
+        *hash = (*hash << 8) | digest[i];
+    }
+    
+    return 1;
+}
+
+void print_digest(FILE *file, const unsigned char *digest, size_t length)
+{
+    size_t i;
+    
+    for (i = 0; i < length; i++)
+    {
+        fprintf(file, "%02x", digest[i]);
+    }
+}
+
+// Creates path and any missing parent directories
+int make_directories(const char *path, mode_t mode)
+{
+    char *copy = strdup(path);
+    char *position = copy;
+    int ok = 1;
+    
+    while (ok && (position = strchr(position + 1, '/')) != NULL)
+    {
+        *position = '\0';
+        ok = (mkdir(copy, mode) == 0 || errno == EEXIST);
+        *position = '/';
+    }
+    
+    ok = ok && (mkdir(copy, mode) == 0 || errno == EEXIST);
+    free(copy);
+    
+    return ok;
+}
+
+// Bundle Hashing
+//
+// hash_app_bundle() fingerprints a bundle on the host. Files are hashed on up to one
+// thread per core, largest first so one big binary does not finish last on its own.
+// The root is the hash of one record per entry in tree order: the relative path, a
+// NUL, 'd' for a directory or 'f' and the file's digest. The same bundle therefore
+// has the same root wherever it is hashed, and any added, removed, renamed or
+// changed file changes it.
+
+#define MAX_HASH_THREADS 64
+
+struct app_hash_entry
+{
+    const char *path;
+    int is_directory;
+    uint64_t size;
+    unsigned char digest[CONTENT_DIGEST_MAX];
+};
+
+struct app_hash
+{
+    enum ContentHashType type;
+    size_t digest_length;
+    struct app_hash_entry *entries;
+    size_t count;
+    unsigned char root[CONTENT_DIGEST_MAX];
+    uint64_t bytes;
+    struct sandbox_walk walk;
+};
+
+struct app_hash_run
+{
+    struct app_hash *result;
+    struct app_hash_entry **order;
+    size_t order_count;
+    size_t next;
+    const char *failure;
+    pthread_mutex_t lock;
+};
+
+static int compare_hash_sizes(const void *a, const void *b)
+{
+    uint64_t left = (*(struct app_hash_entry * const *)a)->size;
+    uint64_t right = (*(struct app_hash_entry * const *)b)->size;
+    
+    return (left < right) - (left > right);
+}
+
+static void *run_hash_worker(void *context)
+{
+    struct app_hash_run *run = context;
+    
+    while (1)
+    {
+        pthread_mutex_lock(&run->lock);
+        struct app_hash_entry *entry = (run->next < run->order_count && run->failure == NULL) ? run->order[run->next++] : NULL;
+        pthread_mutex_unlock(&run->lock);
+        
+        if (entry == NULL)
+        {
+            return NULL;
+        }
+        
+        // the entry path is relative, the walk keeps the full one right after the root
+        const char *full_path = run->result->walk.entries[entry - run->result->entries + 1].path;
+        
+        if (hash_file(full_path, run->result->type, entry->digest) == 0)
+        {
+            pthread_mutex_lock(&run->lock);
+            run->failure = full_path;
+            pthread_mutex_unlock(&run->lock);
+        }
+    }
+}
+
+int hash_thread_count(size_t file_count)
+{
+    long jobs = (command.jobs > 0) ? command.jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    
+    if (jobs > MAX_HASH_THREADS)
+    {
+        jobs = MAX_HASH_THREADS;
+    }
+    
+    if ((size_t)jobs > file_count)
+    {
+        jobs = (long)file_count;
+    }
+    
+    return (jobs < 1) ? 1 : (int)jobs;
+}
+
+void free_app_hash(struct app_hash *result)
+{
+    free(result->entries);
+    free_sandbox_walk(&result->walk);
+    memset(result, 0, sizeof(*result));
+}
+
+// Hashes every file under path and fills in result. Returns 0, with a message on
+// stderr and nothing left to free, when path is not a directory or a file cannot be
+// read.
+int hash_app_bundle(const char *path, enum ContentHashType type, struct app_hash *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->type = type;
+    result->digest_length = content_digest_length(type);
+    
+    walk_local_tree(path, &result->walk);
+    
+    if (result->walk.failed)
+    {
+        fprintf(command_stderr(), "Error attempting to hash app: out of memory walking %s\n", path);
+        free_app_hash(result);
+        return 0;
+    }
+    
+    if (result->walk.count == 0 || !result->walk.entries[0].is_directory)
+    {
+        fprintf(command_stderr(), "Error attempting to hash app: %s is not a directory\n", path);
+        free_app_hash(result);
+        return 0;
+    }
+    
+    const char *root_path = result->walk.entries[0].path;
+    struct app_hash_run run;
+    size_t i;
+    
+    memset(&run, 0, sizeof(run));
+    run.result = result;
+    result->count = result->walk.count - 1;
+    result->entries = calloc(result->count + 1, sizeof(struct app_hash_entry));
+    run.order = malloc((result->count + 1) * sizeof(struct app_hash_entry *));
+    
+    if (result->entries == NULL || run.order == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to hash app: out of memory\n");
+        free(run.order);
+        free_app_hash(result);
+        return 0;
+    }
+    
+    for (i = 0; i < result->count; i++)
+    {
+        struct sandbox_entry *walked = &result->walk.entries[i + 1];
+        struct app_hash_entry *entry = &result->entries[i];
+        
+        entry->path = relative_path(walked->path, root_path);
+        entry->is_directory = walked->is_directory;
+        entry->size = walked->size;
+        result->bytes += walked->size;
+        
+        if (!entry->is_directory)
+        {
+            run.order[run.order_count++] = entry;
+        }
+    }
+    
+    qsort(run.order, run.order_count, sizeof(struct app_hash_entry *), compare_hash_sizes);
+    pthread_mutex_init(&run.lock, NULL);
+    
+    pthread_t threads[MAX_HASH_THREADS];
+    int thread_count = hash_thread_count(run.order_count);
+    int started = 0;
+    
+    while (started < thread_count - 1 && pthread_create(&threads[started], NULL, run_hash_worker, &run) == 0)
+    {
+        started++;
+    }
+    
+    run_hash_worker(&run);
+    
+    while (started > 0)
+    {
+        pthread_join(threads[--started], NULL);
+    }
+    
+    pthread_mutex_destroy(&run.lock);
+    free(run.order);
+    
+    if (run.failure != NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to hash app: unable to read %s\n", run.failure);
+        free_app_hash(result);
+        return 0;
+    }
+    
+    struct content_hash root;
+    content_hash_init(&root, type);
+    
+    for (i = 0; i < result->count; i++)
+    {
+        struct app_hash_entry *entry = &result->entries[i];
+        
+        content_hash_update(&root, entry->path, strlen(entry->path) + 1);
+        content_hash_update(&root, entry->is_directory ? "d" : "f", 1);
+        
+        if (!entry->is_directory)
+        {
+            content_hash_update(&root, entry->digest, result->digest_length);
+        }
+    }
+    
+    content_hash_final(&root, result->root);
+    return 1;
+}
+
+// Prints the root of the bundle at app_path, with -v after one line per file
+void hash_app(char *app_path)
+{
+    ASSERT_OR_EXIT(app_path != NULL, "Error attempting to hash app: no -p <path_to_app>\n");
+    
+    struct app_hash result;
+    double start = current_time();
+    size_t i, file_count = 0;
+    
+    // an .ipa is hashed as the bundle it unpacks to, so it matches the same .app
+    char *bundle_path = is_ipa_path(app_path) ? unpack_ipa(app_path) : trim_root(app_path);
+    
+    if (bundle_path == NULL || !hash_app_bundle(bundle_path, command.sha256 ? SHA256ContentHash : FastContentHash, &result))
+    {
+        exit(1);
+    }
+    
+    for (i = 0; i < result.count; i++)
+    {
+        struct app_hash_entry *entry = &result.entries[i];
+        
+        if (entry->is_directory)
+        {
+            continue;
+        }
+        
+        file_count++;
+        
+        if (command.print_paths)
+        {
+            print_digest(stdout, entry->digest, result.digest_length);
+            printf(" %llu %s\n", (unsigned long long)entry->size, entry->path);
+        }
+    }
+    
+    struct transfer_stats stats = { result.bytes, current_time() - start, NULL };
+    
+    if (command.print_paths)
+    {
+        printf("%lu files, ", (unsigned long)file_count);
+        print_transfer_rate(&stats);
+    }
+    
+    print_digest(stdout, result.root, result.digest_length);
+    printf("  %s\n", app_path);
+    
+    free_app_hash(&result);
+    exit(0);
+}
+
+// Sync
+//
+// sync pushes a local directory to the device and only uploads files that are new or
+// changed. What was last written to each device and bundle id is kept in a manifest
+// under ~/.appdeploy/manifests: the size and mtime the device reported after the
+// upload, and the size, mtime and optionally content hash of the local file. As long
+// as the device still reports the recorded size and mtime the manifest describes
+// what is on the device, so a file is unchanged when the local side matches it
+// (by hash with -hash). When the device disagrees, or there is no record, the file
+// is rescanned: it is uploaded if the sizes differ or the local copy is newer.
+
+#define MANIFEST_VERSION 1
+
+struct manifest_entry
+{
+    char *path;
+    uint64_t hash;
+    uint64_t local_size;
+    uint64_t local_mtime;
+    uint64_t remote_size;
+    uint64_t remote_mtime;
+    int has_hash;
+};
+
+struct sync_manifest
+{
+    struct manifest_entry *entries;
+    size_t count;
+    size_t capacity;
+    struct path_arena arena;
+};
+
+static int compare_manifest_entries(const void *a, const void *b)
+{
+    return compare_tree_paths(((const struct manifest_entry *)a)->path, ((const struct manifest_entry *)b)->path);
+}
+
+// ~/.appdeploy/<kind>/<udid>/<name><extension>, creating the directories on the way
+char *state_file_path(const char *kind, const char *udid, const char *name, const char *extension)
+{
+    const char *home = getenv("HOME");
+    char *directory = malloc(strlen((home != NULL) ? home : "/tmp") + strlen(kind) + strlen(udid) + 16);
+    
+    sprintf(directory, "%s/.appdeploy/%s/%s", (home != NULL) ? home : "/tmp", kind, udid);
+    
+    if (!make_directories(directory, 0755))
+    {
+        free(directory);
+        return NULL;
+    }
+    
+    char *path = malloc(strlen(directory) + strlen(name) + strlen(extension) + 2);
+    sprintf(path, "%s/%s%s", directory, name, extension);
+    free(directory);
+    
+    return path;
+}
+
+char *manifest_path(const char *udid, const char *name)
+{
+    return state_file_path("manifests", udid, name, ".manifest");
+}
+
+struct manifest_entry *add_manifest_entry(struct sync_manifest *manifest, const char *path)
+{
+    if (!grow_array((void **)&manifest->entries, &manifest->capacity, manifest->count + 1, sizeof(struct manifest_entry)))
+    {
+        return NULL;
+    }
+    
+    char *copy = arena_alloc(&manifest->arena, strlen(path) + 1);
+    
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    
+    struct manifest_entry *entry = &manifest->entries[manifest->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->path = strcpy(copy, path);
+    
+    return entry;
+}
+
+struct manifest_entry *find_manifest_entry(struct sync_manifest *manifest, const char *path)
+{
+    struct manifest_entry key;
+    key.path = (char *)path;
+    
+    return bsearch(&key, manifest->entries, manifest->count, sizeof(struct manifest_entry), compare_manifest_entries);
+}
+
+// Loads the manifest written for root. A missing file, another root or another
+// format leaves the manifest empty, which makes every file fall back to a rescan.
+void load_manifest(const char *path, const char *root, struct sync_manifest *manifest)
+{
+    memset(manifest, 0, sizeof(*manifest));
+    
+    FILE *file = fopen(path, "r");
+    
+    if (file == NULL)
+    {
+        return;
+    }
+    
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    char header[64];
+    
+    snprintf(header, sizeof(header), "appdeploy-manifest %d %s", MANIFEST_VERSION, CONTENT_HASH_NAME);
+    
+    int valid = (getline(&line, &line_capacity, file) > 0 && strncmp(line, header, strlen(header)) == 0 && line[strlen(header)] == '\n');
+    valid = valid && (length = getline(&line, &line_capacity, file)) > 5 && strncmp(line, "root ", 5) == 0;
+    
+    if (valid)
+    {
+        line[length - 1] = '\0';
+        valid = (strcmp(line + 5, root) == 0);
+    }
+    
+    while (valid && (length = getline(&line, &line_capacity, file)) > 0)
+    {
+        char hash[17];
+        unsigned long long local_size, local_mtime, remote_size, remote_mtime;
+        int offset = 0;
+        
+        if (line[length - 1] == '\n')
+        {
+            line[length - 1] = '\0';
+        }
+        
+        if (sscanf(line, "%16s %llu %llu %llu %llu %n", hash, &local_size, &local_mtime, &remote_size, &remote_mtime, &offset) != 5 || offset == 0)
+        {
+            continue;
+        }
+        
+        struct manifest_entry *entry = add_manifest_entry(manifest, line + offset);
+        
+        if (entry != NULL)
+        {
+            entry->has_hash = (strcmp(hash, "-") != 0);
+            entry->hash = entry->has_hash ? strtoull(hash, NULL, 16) : 0;
+            entry->local_size = local_size;
+            entry->local_mtime = local_mtime;
+            entry->remote_size = remote_size;
+            entry->remote_mtime = remote_mtime;
+        }
+    }
+    
+    free(line);
+    fclose(file);
+    qsort(manifest->entries, manifest->count, sizeof(struct manifest_entry), compare_manifest_entries);
+}
+
+int save_manifest(const char *path, const char *root, struct sync_manifest *manifest)
+{
+    char *temporary_path = malloc(strlen(path) + 5);
+    sprintf(temporary_path, "%s.tmp", path);
+    
+    FILE *file = fopen(temporary_path, "w");
+    size_t i;
+    
+    if (file == NULL)
+    {
+        free(temporary_path);
+        return 0;
+    }
+    
+    fprintf(file, "appdeploy-manifest %d %s\nroot %s\n", MANIFEST_VERSION, CONTENT_HASH_NAME, root);
+    
+    for (i = 0; i < manifest->count; i++)
+    {
+        struct manifest_entry *entry = &manifest->entries[i];
+        
+        if (entry->has_hash)
+        {
+            fprintf(file, "%016llx", (unsigned long long)entry->hash);
+        }
+        else
+        {
+            fprintf(file, "-");
+        }
+        
+        fprintf(file, " %llu %llu %llu %llu %s\n", (unsigned long long)entry->local_size, (unsigned long long)entry->local_mtime, (unsigned long long)entry->remote_size, (unsigned long long)entry->remote_mtime, entry->path);
+    }
+    
+    // written to the side and renamed so an interrupted sync never leaves half a manifest
+    int ok = (fclose(file) == 0 && rename(temporary_path, path) == 0);
+    
+    free(temporary_path);
+    return ok;
+}
+
+void free_manifest(struct sync_manifest *manifest)
+{
+    free(manifest->entries);
+    free_arena(&manifest->arena);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+struct sandbox_entry *find_walk_entry(struct sandbox_walk *walk, const char *root, const char *relative)
+{
+    size_t low = 0, high = walk->count;
+    
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        int order = compare_tree_paths(relative_path(walk->entries[middle].path, root), relative);
+        
+        if (order == 0)
+        {
+            return &walk->entries[middle];
+        }
+        
+        if (order < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    
+    return NULL;
+}
+
+// Decides whether the local file differs from what is on the device. Fills in
+// hash when one was computed, and counts a rescan when the manifest cannot be used.
+int sync_file_changed(struct sandbox_entry *local, struct sandbox_entry *remote, struct manifest_entry *record, int compare_hashes, uint64_t *hash, int *has_hash, size_t *rescanned)
+{
+    *has_hash = 0;
+    
+    if (remote == NULL || remote->is_directory)
+    {
+        return 1;
+    }
+    
+    int record_matches_device = (record != NULL && record->remote_size == remote->size && record->remote_mtime == remote->mtime);
+    
+    if (!record_matches_device)
+    {
+        (*rescanned)++;
+        
+        if (compare_hashes)
+        {
+            *has_hash = hash_local_file(local->path, hash);
+        }
+        
+        return local->size != remote->size || local->mtime > remote->mtime;
+    }
+    
+    if (!compare_hashes)
+    {
+        return local->size != record->local_size || local->mtime != record->local_mtime;
+    }
+    
+    // the recorded hash is reused while the local file keeps its size and mtime
+    if (record->has_hash && local->size == record->local_size && local->mtime == record->local_mtime)
+    {
+        *hash = record->hash;
+        *has_hash = 1;
+        return 0;
+    }
+    
+    *has_hash = hash_local_file(local->path, hash);
+    
+    if (!record->has_hash)
+    {
+        return local->size != record->local_size || local->mtime != record->local_mtime;
+    }
+    
+    return !*has_hash || *hash != record->hash;
+}
+
+// Returns 1 when the device still holds exactly what the manifest recorded for every file
+int manifest_matches_device(struct sync_manifest *manifest, struct sandbox_walk *remote, const char *remote_root)
+{
+    size_t i;
+    
+    if (manifest->count == 0 || remote->count == 0 || !remote->entries[0].is_directory)
+    {
+        return 0;
+    }
+    
+    for (i = 0; i < manifest->count; i++)
+    {
+        struct manifest_entry *record = &manifest->entries[i];
+        struct sandbox_entry *entry = find_walk_entry(remote, remote_root, record->path);
+        
+        if (entry == NULL || entry->is_directory || entry->size != record->remote_size || entry->mtime != record->remote_mtime)
+        {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+enum SyncFlags
+{
+    SyncCompareHashes = 1 << 0,
+    SyncDeleteExtras = 1 << 1,
+    SyncRequireManifest = 1 << 2
+};
+
+struct sync_result
+{
+    size_t uploaded;
+    size_t failed;
+    size_t unchanged;
+    size_t deleted;
+    size_t directories;
+    size_t rescanned;
+    uint64_t bytes;
+};
+
+// Brings remote_root in line with the local directory local_root and rewrites the
+// manifest. With SyncRequireManifest nothing is touched unless the manifest still
+// describes every file on the device, and 0 is returned when it does not. Returns -1
+// when either tree could not be walked.
+int sync_tree(struct afc_connection **connections, int connection_count, char *local_root, char *remote_root, const char *manifest_file, int flags, struct sync_result *result)
+{
+    memset(result, 0, sizeof(*result));
+    
+    struct sandbox_walk local;
+    memset(&local, 0, sizeof(local));
+    walk_local_tree(local_root, &local);
+    
+    if (local.failed)
+    {
+        fprintf(command_stderr(), "Error attempting to sync: out of memory walking %s\n", local_root);
+        free_sandbox_walk(&local);
+        return -1;
+    }
+    
+    if (local.count == 0 || !local.entries[0].is_directory)
+    {
+        fprintf(command_stderr(), "Error attempting to sync: %s is not a directory\n", local_root);
+        free_sandbox_walk(&local);
+        return -1;
+    }
+    
+    struct sync_manifest previous, next;
+    load_manifest(manifest_file, remote_root, &previous);
+    memset(&next, 0, sizeof(next));
+    
+    struct sandbox_walk remote;
+    walk_sandbox(connections, connection_count, remote_root, 1, NULL, &remote);
+    
+    int status = remote.failed ? -1 : 1;
+    
+    if (remote.failed)
+    {
+        fprintf(command_stderr(), "Error attempting to sync: out of memory walking %s\n", remote_root);
+    }
+    else if ((flags & SyncRequireManifest) && !manifest_matches_device(&previous, &remote, remote_root))
+    {
+        status = 0;
+    }
+    
+    if (status != 1)
+    {
+        free_manifest(&previous);
+        free_sandbox_walk(&local);
+        free_sandbox_walk(&remote);
+        return status;
+    }
+    
+    struct transfer_queue queue;
+    size_t i;
+    
+    memset(&queue, 0, sizeof(queue));
+    queue.upload = 1;
+    
+    for (i = 0; i < local.count; i++)
+    {
+        struct sandbox_entry *entry = &local.entries[i];
+        const char *relative = relative_path(entry->path, local_root);
+        struct sandbox_entry *remote_entry = find_walk_entry(&remote, remote_root, relative);
+        
+        if (entry->is_directory)
+        {
+            if (remote_entry == NULL)
+            {
+                backend->directory_create(connections[0], rebase_path(&local.arena, entry->path, local_root, remote_root));
+                result->directories++;
+            }
+            
+            continue;
+        }
+        
+        uint64_t hash = 0;
+        int has_hash;
+        struct manifest_entry *record = find_manifest_entry(&previous, relative);
+        int changed = sync_file_changed(entry, remote_entry, record, (flags & SyncCompareHashes) != 0, &hash, &has_hash, &result->rescanned);
+        struct manifest_entry *updated = add_manifest_entry(&next, relative);
+        
+        if (updated == NULL)
+        {
+            continue;
+        }
+        
+        updated->hash = hash;
+        updated->has_hash = has_hash;
+        updated->local_size = entry->size;
+        updated->local_mtime = entry->mtime;
+        
+        if (changed)
+        {
+            struct transfer_job *job = add_transfer_job(&queue, entry->path, rebase_path(&local.arena, entry->path, local_root, remote_root), entry->size);
+            
+            if (job != NULL)
+            {
+                job->context = (void *)(uintptr_t)(next.count - 1);
+            }
+        }
+        else
+        {
+            updated->remote_size = remote_entry->size;
+            updated->remote_mtime = remote_entry->mtime;
+            result->unchanged++;
+        }
+    }
+    
+    run_transfer_queue(connections, connection_count, &queue);
+    
+    // record what the device reports for every file that was written
+    for (i = 0; i < queue.count; i++)
+    {
+        struct transfer_job *job = &queue.jobs[i];
+        struct manifest_entry *updated = &next.entries[(uintptr_t)job->context];
+        struct remote_file_info info;
+        
+        if (job->status == 0 && read_remote_file_info(connections[0], job->destination, &info) == 0)
+        {
+            updated->remote_size = info.size;
+            updated->remote_mtime = info.mtime;
+        }
+        else
+        {
+            // no usable record, the next sync rescans this file
+            updated->remote_size = UINT64_MAX;
+        }
+    }
+    
+    if (flags & SyncDeleteExtras)
+    {
+        // reverse tree order removes the contents of a directory before the directory
+        for (i = remote.count; i-- > 1;)
+        {
+            struct sandbox_entry *entry = &remote.entries[i];
+            
+            if (find_walk_entry(&local, local_root, relative_path(entry->path, remote_root)) == NULL && backend->remove_path(connections[0], entry->path) == 0)
+            {
+                result->deleted++;
+            }
+        }
+    }
+    
+    qsort(next.entries, next.count, sizeof(struct manifest_entry), compare_manifest_entries);
+    
+    if (!save_manifest(manifest_file, remote_root, &next))
+    {
+        fprintf(command_stderr(), "Warning: unable to write %s\n", manifest_file);
+    }
+    
+    print_transfer_failures(&queue);
+    
+    result->uploaded = queue.count - queue.failed;
+    result->failed = queue.failed;
+    result->bytes = queue.bytes;
+    
+    free(queue.jobs);
+    free_manifest(&previous);
+    free_manifest(&next);
+    free_sandbox_walk(&local);
+    free_sandbox_walk(&remote);
+    
+    return 1;
+}
+
+int sync_directory(struct am_device *device)
+{
+    struct afc_connection *connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int connection_count = parallel_job_count();
+    double start = current_time();
+    char *local_root = trim_root(command.file_path);
+    char *remote_root = trim_root(command.destination_path);
+    
+    char *udid = copy_device_udid(device);
+    char *manifest_file = (udid != NULL) ? manifest_path(udid, command.bundle_id) : NULL;
+    free(udid);
+    
+    ASSERT_OR_RETURN(manifest_file != NULL, "Error attempting to sync: unable to create the manifest directory\n");
+    
+    int flags = (command.compare_hashes ? SyncCompareHashes : 0) | (command.delete_extras ? SyncDeleteExtras : 0);
+    struct sync_result result;
+    
+    if (acquire_file_connections(device, connections, connection_count) != 0)
+    {
+        free(manifest_file);
+        return 1;
+    }
+    
+    int synced = sync_tree(connections, connection_count, local_root, remote_root, manifest_file, flags, &result);
+    release_file_connections(connections, connection_count);
+    
+    if (synced < 0)
+    {
+        free(manifest_file);
+        return 1;
+    }
+    
+    struct transfer_stats stats = { result.bytes, current_time() - start, NULL };
+    
+    fprintf(command_stdout(), "%lu uploaded, %lu failed, %lu unchanged, %lu deleted, %lu directories created, %lu rescanned, ", (unsigned long)result.uploaded, (unsigned long)result.failed, (unsigned long)result.unchanged, (unsigned long)result.deleted, (unsigned long)result.directories, (unsigned long)result.rescanned);
+    print_transfer_rate(&stats);
+    
+    free(manifest_file);
+    
+    return (result.failed > 0);
+}
+
+// Resumable Transfers
+//
+// download_file and upload_file keep a checkpoint under ~/.appdeploy/checkpoints/<udid>
+// while they run: the size and mtime of the source, how many bytes are known to be at
+// the destination, and the fast content hash of those bytes. It is rewritten every
+// CHECKPOINT_INTERVAL bytes and when the transfer fails, and removed once the transfer
+// succeeds. With -resume a transfer continues from the checkpoint as long as the
+// source still has the same size and mtime and the local side of the prefix, the
+// partial download or the start of the file being uploaded, still hashes the same.
+// An upload also reads back the last RESUME_CHECK_SIZE bytes of the prefix from the
+// device and compares them with the source. Anything else starts over from the first
+// byte.
+
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_INTERVAL (64 * 1024 * 1024)
+
+struct transfer_checkpoint
+{
+    char *path;
+    uint64_t source_size;
+    uint64_t source_mtime;
+    uint64_t offset;
+    uint64_t saved_offset;
+    struct content_hash hash;
+};
+
+// Fast hash of the bytes the checkpoint covers so far
+static uint64_t checkpoint_digest(struct transfer_checkpoint *checkpoint)
+{
+    struct content_hash hash = checkpoint->hash;
+    unsigned char digest[CONTENT_DIGEST_MAX];
+    uint64_t value = 0;
+    size_t i, length = content_hash_final(&hash, digest);
+    
+    for (i = 0; i < length; i++)
+    {
+        value = (value << 8) | digest[i];
+    }
+    
+    return value;
+}
+
+// Hashes the first length bytes of the file at path, returns 0 when it is shorter
+static int hash_local_prefix(const char *path, uint64_t length, struct content_hash *hash)
+{
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0)
+    {
+        return 0;
+    }
+    
+    unsigned char *buffer = malloc(TRANSFER_CHUNK_SIZE);
+    ssize_t read_length = 0;
+    
+    while (buffer != NULL && length > 0 && (read_length = read(fd, buffer, (length < TRANSFER_CHUNK_SIZE) ? (size_t)length : TRANSFER_CHUNK_SIZE)) > 0)
+    {
+        content_hash_update(hash, buffer, read_length);
+        length -= read_length;
+    }
+    
+    close(fd);
+    free(buffer);
+    
+    return length == 0;
+}
+
+// Reads the offset and digest saved for the same source, returns 0 when there are none
+static int load_checkpoint(struct transfer_checkpoint *checkpoint, uint64_t *offset, uint64_t *digest)
+{
+    FILE *file = fopen(checkpoint->path, "r");
+    
+    if (file == NULL)
+    {
+        return 0;
+    }
+    
+    char header[64], line[64];
+    unsigned long long source_size, source_mtime, saved_offset, saved_digest;
+    
+    snprintf(header, sizeof(header), "appdeploy-checkpoint %d %s\n", CHECKPOINT_VERSION, CONTENT_HASH_NAME);
+    
+    int valid = (fgets(line, sizeof(line), file) != NULL && strcmp(line, header) == 0);
+    valid = valid && fscanf(file, "%llu %llu %llu %llx", &source_size, &source_mtime, &saved_offset, &saved_digest) == 4;
+    valid = valid && source_size == checkpoint->source_size && source_mtime == checkpoint->source_mtime && saved_offset <= source_size;
+    
+    fclose(file);
+    
+    if (valid)
+    {
+        *offset = saved_offset;
+        *digest = saved_digest;
+    }
+    
+    return valid;
+}
+
+void save_checkpoint(struct transfer_checkpoint *checkpoint)
+{
+    if (checkpoint->path == NULL)
+    {
+        return;
+    }
+    
+    FILE *file = fopen(checkpoint->path, "w");
+    int failed = (file == NULL);
+    
+    if (file != NULL)
+    {
+        fprintf(file, "appdeploy-checkpoint %d %s\n", CHECKPOINT_VERSION, CONTENT_HASH_NAME);
+        fprintf(file, "%llu %llu %llu %016llx\n", (unsigned long long)checkpoint->source_size, (unsigned long long)checkpoint->source_mtime,
+                (unsigned long long)checkpoint->offset, (unsigned long long)checkpoint_digest(checkpoint));
+        failed = (fclose(file) != 0);
+    }
+    
+    if (failed)
+    {
+        fprintf(command_stderr(), "Warning: unable to write %s\n", checkpoint->path);
+    }
+    
+    checkpoint->saved_offset = checkpoint->offset;
+}
+
+// Checkpoint for copying source to destination. With -resume it starts at the saved
+// offset when the first bytes of the local file at local_path still match it. Returns
+// NULL, after saying so, when out of memory.
+struct transfer_checkpoint *open_checkpoint(struct am_device *device, const char *kind, const char *source, const char *destination, uint64_t source_size, uint64_t source_mtime, const char *local_path)
+{
+    struct transfer_checkpoint *checkpoint = calloc(1, sizeof(struct transfer_checkpoint));
+    struct content_hash key;
+    unsigned char digest[CONTENT_DIGEST_MAX];
+    char name[CONTENT_DIGEST_MAX * 2 + 1];
+    size_t length, i;
+    
+    if (checkpoint == NULL)
+    {
+        fprintf(command_stderr(), "Error: out of memory\n");
+        return NULL;
+    }
+    
+    // one checkpoint per direction, source and destination
+    content_hash_init(&key, FastContentHash);
+    content_hash_update(&key, kind, strlen(kind) + 1);
+    content_hash_update(&key, source, strlen(source) + 1);
+    content_hash_update(&key, destination, strlen(destination) + 1);
+    length = content_hash_final(&key, digest);
+    
+    for (i = 0; i < length; i++)
+    {
+        sprintf(name + i * 2, "%02x", digest[i]);
+    }
+    
+    char *udid = copy_device_udid(device);
+    checkpoint->path = (udid != NULL) ? state_file_path("checkpoints", udid, name, ".checkpoint") : NULL;
+    free(udid);
+    
+    checkpoint->source_size = source_size;
+    checkpoint->source_mtime = source_mtime;
+    content_hash_init(&checkpoint->hash, FastContentHash);
+    
+    uint64_t offset, saved_digest;
+    
+    if (command.resume && checkpoint->path != NULL && load_checkpoint(checkpoint, &offset, &saved_digest))
+    {
+        if (hash_local_prefix(local_path, offset, &checkpoint->hash) && checkpoint_digest(checkpoint) == saved_digest)
+        {
+            checkpoint->offset = offset;
+            checkpoint->saved_offset = offset;
+        }
+        else
+        {
+            content_hash_init(&checkpoint->hash, FastContentHash);
+        }
+    }
+    
+    return checkpoint;
+}
+
+uint64_t checkpoint_offset(struct transfer_checkpoint *checkpoint)
+{
+    return checkpoint->offset;
+}
+
+// Adds bytes that reached the destination, returns 1 when the checkpoint should be saved
+int advance_checkpoint(struct transfer_checkpoint *checkpoint, const char *data, size_t length)
+{
+    content_hash_update(&checkpoint->hash, data, length);
+    checkpoint->offset += length;
+    
+    return checkpoint->offset - checkpoint->saved_offset >= CHECKPOINT_INTERVAL;
+}
+
+void restart_checkpoint(struct transfer_checkpoint *checkpoint)
+{
+    checkpoint->offset = 0;
+    checkpoint->saved_offset = 0;
+    content_hash_init(&checkpoint->hash, FastContentHash);
+}
+
+void print_resume(struct transfer_checkpoint *checkpoint, const char *source)
+{
+    if (!command.resume)
+    {
+        return;
+    }
+    
+    if (checkpoint->offset > 0)
+    {
+        fprintf(command_stdout(), "Resuming %s at %llu of %llu bytes.\n", source, (unsigned long long)checkpoint->offset, (unsigned long long)checkpoint->source_size);
+    }
+    else
+    {
+        fprintf(command_stdout(), "No checkpoint to resume %s from, starting over.\n", source);
+    }
+}
+
+// Removes the checkpoint once the transfer completed, or saves how far a failed one got
+void close_checkpoint(struct transfer_checkpoint *checkpoint, int completed)
+{
+    if (checkpoint->path != NULL && completed)
+    {
+        remove(checkpoint->path);
+    }
+    else if (checkpoint->offset > checkpoint->saved_offset)
+    {
+        save_checkpoint(checkpoint);
+    }
+    
+    free(checkpoint->path);
+    free(checkpoint);
+}
+
+// Snapshots
+//
+// snapshot records the sandbox tree under a root as a compact binary index, and diff
+// compares one snapshot with another or with the live device. The walk uses
+// AFCFileInfoOpen probes so every entry carries its size and mtime. A snapshot is
+// the SNAPSHOT_MAGIC header, then varints for the format version, the length of the
+// root, the root itself, the filters the walk used (see write_file_filter) and the
+// entry count. Each entry follows in compare_tree_paths
+// order, relative to the root: the bytes shared with the previous path, the length of
+// the rest, the rest, then 1 for a directory or 0 for a file, the size and the mtime.
+// Paths in a tree share long prefixes, so 100k entries take a couple of megabytes.
+// Since both sides are in the same order, diff merges them one entry at a time and
+// only ever holds the current path of a snapshot in memory. Two sides walked with
+// different filters would show everything one of them left out as added or removed,
+// so diff refuses them.
+
+#define SNAPSHOT_MAGIC "ADSNAP"
+#define SNAPSHOT_VERSION 2
+
+// Longest path a snapshot may hold, anything longer means the file is damaged
+#define MAX_SNAPSHOT_PATH (64 * 1024)
+
+void write_varint(FILE *file, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        fputc((int)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    
+    fputc((int)value, file);
+}
+
+int read_varint(FILE *file, uint64_t *value)
+{
+    int shift, c;
+    
+    *value = 0;
+    
+    for (shift = 0; shift < 64; shift += 7)
+    {
+        if ((c = fgetc(file)) == EOF)
+        {
+            return 0;
+        }
+        
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        
+        if ((c & 0x80) == 0)
+        {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+void write_snapshot_string(FILE *file, const char *string)
+{
+    write_varint(file, strlen(string));
+    fwrite(string, 1, strlen(string), file);
+}
+
+// Reads a string written by write_snapshot_string into a new allocation
+char *read_snapshot_string(FILE *file)
+{
+    uint64_t length;
+    
+    if (!read_varint(file, &length) || length >= MAX_SNAPSHOT_PATH)
+    {
+        return NULL;
+    }
+    
+    char *string = calloc(1, length + 1);
+    
+    if (string != NULL && fread(string, 1, length, file) != length)
+    {
+        free(string);
+        return NULL;
+    }
+    
+    return string;
+}
+
+// Records the patterns, the regex flag, the depth, the size limits and the ages in
+// milliseconds, all as given on the command line
+void write_file_filter(FILE *file, const struct file_filter *filter)
+{
+    int i;
+    
+    write_varint(file, filter->include_count);
+    
+    for (i = 0; i < filter->include_count; i++)
+    {
+        write_snapshot_string(file, filter->include[i]);
+    }
+    
+    write_varint(file, filter->exclude_count);
+    
+    for (i = 0; i < filter->exclude_count; i++)
+    {
+        write_snapshot_string(file, filter->exclude[i]);
+    }
+    
+    write_varint(file, filter->regex);
+    write_varint(file, (uint64_t)(uint32_t)filter->max_depth);
+    write_varint(file, filter->min_size);
+    write_varint(file, filter->max_size);
+    write_varint(file, (uint64_t)(filter->newer_than * 1000.0 + 0.5));
+    write_varint(file, (uint64_t)(filter->older_than * 1000.0 + 0.5));
+}
+
+void free_file_filter(struct file_filter *filter)
+{
+    int i;
+    
+    for (i = 0; i < filter->include_count; i++)
+    {
+        free(filter->include[i]);
+    }
+    
+    for (i = 0; i < filter->exclude_count; i++)
+    {
+        free(filter->exclude[i]);
+    }
+    
+    memset(filter, 0, sizeof(*filter));
+}
+
+// Reads what write_file_filter wrote, the patterns are allocated and freed with
+// free_file_filter. Returns 0 when the filter is damaged.
+int read_file_filter(FILE *file, struct file_filter *filter)
+{
+    uint64_t count, regex, max_depth, newer_than, older_than;
+    
+    memset(filter, 0, sizeof(*filter));
+    
+    if (!read_varint(file, &count) || count > MAX_FILTER_PATTERNS)
+    {
+        return 0;
+    }
+    
+    for (; filter->include_count < (int)count; filter->include_count++)
+    {
+        if ((filter->include[filter->include_count] = read_snapshot_string(file)) == NULL)
+        {
+            free_file_filter(filter);
+            return 0;
+        }
+    }
+    
+    if (!read_varint(file, &count) || count > MAX_FILTER_PATTERNS)
+    {
+        free_file_filter(filter);
+        return 0;
+    }
+    
+    for (; filter->exclude_count < (int)count; filter->exclude_count++)
+    {
+        if ((filter->exclude[filter->exclude_count] = read_snapshot_string(file)) == NULL)
+        {
+            free_file_filter(filter);
+            return 0;
+        }
+    }
+    
+    if (!read_varint(file, &regex) || !read_varint(file, &max_depth) || !read_varint(file, &filter->min_size) ||
+        !read_varint(file, &filter->max_size) || !read_varint(file, &newer_than) || !read_varint(file, &older_than))
+    {
+        free_file_filter(filter);
+        return 0;
+    }
+    
+    filter->regex = (regex != 0);
+    filter->max_depth = (int)(uint32_t)max_depth;
+    filter->newer_than = (double)newer_than / 1000.0;
+    filter->older_than = (double)older_than / 1000.0;
+    
+    return 1;
+}
+
+int file_filter_is_empty(const struct file_filter *filter)
+{
+    return filter->include_count == 0 && filter->exclude_count == 0 && filter->max_depth == 0 &&
+           filter->min_size == 0 && filter->max_size == 0 && filter->newer_than == 0 && filter->older_than == 0;
+}
+
+// Compares two filters the way write_file_filter records them
+int same_file_filter(const struct file_filter *a, const struct file_filter *b)
+{
+    int i;
+    
+    if (a->include_count != b->include_count || a->exclude_count != b->exclude_count || a->regex != b->regex ||
+        a->max_depth != b->max_depth || a->min_size != b->min_size || a->max_size != b->max_size ||
+        (uint64_t)(a->newer_than * 1000.0 + 0.5) != (uint64_t)(b->newer_than * 1000.0 + 0.5) ||
+        (uint64_t)(a->older_than * 1000.0 + 0.5) != (uint64_t)(b->older_than * 1000.0 + 0.5))
+    {
+        return 0;
+    }
+    
+    for (i = 0; i < a->include_count; i++)
+    {
+        if (strcmp(a->include[i], b->include[i]) != 0)
+        {
+            return 0;
+        }
+    }
+    
+    for (i = 0; i < a->exclude_count; i++)
+    {
+        if (strcmp(a->exclude[i], b->exclude[i]) != 0)
+        {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+// Writes every entry of walk below root, and the filters it was walked with, returns
+// 0 when the file cannot be written
+int write_snapshot(const char *path, const char *root, const struct file_filter *filter, struct sandbox_walk *walk)
+{
+    FILE *file = fopen(path, "wb");
+    const char *previous = "";
+    size_t i, root_length = strlen(root), count = 0;
+    
+    if (file == NULL)
+    {
+        return 0;
+    }
+    
+    for (i = 0; i < walk->count; i++)
+    {
+        count += (strlen(walk->entries[i].path) > root_length);
+    }
+    
+    fwrite(SNAPSHOT_MAGIC, 1, strlen(SNAPSHOT_MAGIC), file);
+    write_varint(file, SNAPSHOT_VERSION);
+    write_varint(file, root_length);
+    fwrite(root, 1, root_length, file);
+    write_file_filter(file, filter);
+    write_varint(file, count);
+    
+    for (i = 0; i < walk->count; i++)
+    {
+        struct sandbox_entry *entry = &walk->entries[i];
+        const char *relative = entry->path + root_length;
+        size_t shared = 0;
+        
+        if (*relative == '\0')
+        {
+            continue;
+        }
+        
+        relative += (*relative == '/');
+        
+        while (previous[shared] != '\0' && previous[shared] == relative[shared])
+        {
+            shared++;
+        }
+        
+        write_varint(file, shared);
+        write_varint(file, strlen(relative + shared));
+        fwrite(relative + shared, 1, strlen(relative + shared), file);
+        write_varint(file, entry->is_directory);
+        write_varint(file, entry->size);
+        write_varint(file, entry->mtime);
+        previous = relative;
+    }
+    
+    int failed = ferror(file);
+    
+    if (fclose(file) != 0 || failed)
+    {
+        unlink(path);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Streams the entries of a snapshot, entry.path is only valid until the next one
+struct snapshot_reader
+{
+    FILE *file;
+    char *root;
+    struct file_filter filter;
+    uint64_t remaining;
+    struct sandbox_entry entry;
+    size_t path_length;
+    size_t path_capacity;
+    int damaged;
+};
+
+// Opens path and reads its header, returns 0 when it is not a snapshot
+int open_snapshot(struct snapshot_reader *reader, const char *path)
+{
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    uint64_t version, root_length;
+    
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    
+    if (reader->file == NULL)
+    {
+        return 0;
+    }
+    
+    if (fread(magic, 1, sizeof(magic), reader->file) != sizeof(magic) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+        !read_varint(reader->file, &version) || version != SNAPSHOT_VERSION ||
+        !read_varint(reader->file, &root_length) || root_length >= MAX_SNAPSHOT_PATH)
+    {
+        fclose(reader->file);
+        return 0;
+    }
+    
+    reader->root = calloc(1, root_length + 1);
+    
+    if (reader->root == NULL || fread(reader->root, 1, root_length, reader->file) != root_length)
+    {
+        fclose(reader->file);
+        free(reader->root);
+        return 0;
+    }
+    
+    if (!read_file_filter(reader->file, &reader->filter))
+    {
+        fclose(reader->file);
+        free(reader->root);
+        return 0;
+    }
+    
+    if (!read_varint(reader->file, &reader->remaining))
+    {
+        fclose(reader->file);
+        free(reader->root);
+        free_file_filter(&reader->filter);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Moves to the next entry, returns 0 at the end or when the rest of the file is damaged
+int next_snapshot_entry(struct snapshot_reader *reader)
+{
+    uint64_t shared, length, is_directory;
+    
+    if (reader->remaining == 0 || reader->damaged)
+    {
+        return 0;
+    }
+    
+    reader->damaged = 1;
+    
+    if (!read_varint(reader->file, &shared) || !read_varint(reader->file, &length) ||
+        shared > reader->path_length || shared + length >= MAX_SNAPSHOT_PATH ||
+        !grow_array((void **)&reader->entry.path, &reader->path_capacity, shared + length + 1, 1) ||
+        fread(reader->entry.path + shared, 1, length, reader->file) != length ||
+        !read_varint(reader->file, &is_directory) || !read_varint(reader->file, &reader->entry.size) || !read_varint(reader->file, &reader->entry.mtime))
+    {
+        return 0;
+    }
+    
+    reader->path_length = shared + length;
+    reader->entry.path[reader->path_length] = '\0';
+    reader->entry.is_directory = (is_directory != 0);
+    reader->remaining--;
+    reader->damaged = 0;
+    
+    return 1;
+}
+
+void close_snapshot(struct snapshot_reader *reader)
+{
+    fclose(reader->file);
+    free(reader->root);
+    free_file_filter(&reader->filter);
+    free(reader->entry.path);
+}
+
+// One side of a diff, either a snapshot or a walk of the device
+struct snapshot_source
+{
+    struct snapshot_reader *reader;
+    struct sandbox_walk *walk;
+    size_t root_length;
+    size_t next;
+    struct sandbox_entry entry;
+};
+
+// Moves to the next entry, with walk paths made relative to the root like a snapshot's
+int next_source_entry(struct snapshot_source *source)
+{
+    if (source->reader != NULL)
+    {
+        if (!next_snapshot_entry(source->reader))
+        {
+            return 0;
+        }
+        
+        source->entry = source->reader->entry;
+        return 1;
+    }
+    
+    while (source->next < source->walk->count)
+    {
+        source->entry = source->walk->entries[source->next++];
+        source->entry.path += source->root_length;
+        
+        if (*source->entry.path != '\0')
+        {
+            source->entry.path += (*source->entry.path == '/');
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int source_damaged(struct snapshot_source *source)
+{
+    return source->reader != NULL && source->reader->damaged;
+}
+
+void print_snapshot_change(char change, const char *root, struct sandbox_entry *entry)
+{
+    size_t root_length = strlen(root);
+    const char *separator = (root_length > 0 && root[root_length - 1] == '/') ? "" : "/";
+    
+    if (current_worker != NULL && fanout.enabled)
+    {
+        fprintf(command_stdout(), "%s ", current_worker->udid);
+    }
+    
+    fprintf(command_stdout(), "%c %s%s%s\n", change, root, separator, entry->path);
+}
+
+// Prints A, D or M and the device path for every entry added, removed or modified
+// between before and after. Directories only count as modified when they turn into
+// files or back, since their mtime moves with every change inside them.
+void diff_snapshot_sources(struct snapshot_source *before, struct snapshot_source *after, const char *root)
+{
+    unsigned long added = 0, removed = 0, modified = 0;
+    int has_before = next_source_entry(before);
+    int has_after = next_source_entry(after);
+    
+    // a damaged snapshot stops the diff rather than showing the rest as added or removed
+    while ((has_before || has_after) && !source_damaged(before) && !source_damaged(after))
+    {
+        int order = !has_before ? 1 : (!has_after ? -1 : compare_tree_paths(before->entry.path, after->entry.path));
+        
+        if (order < 0)
+        {
+            print_snapshot_change('D', root, &before->entry);
+            removed++;
+            has_before = next_source_entry(before);
+        }
+        else if (order > 0)
+        {
+            print_snapshot_change('A', root, &after->entry);
+            added++;
+            has_after = next_source_entry(after);
+        }
+        else
+        {
+            if (before->entry.is_directory != after->entry.is_directory ||
+                (!after->entry.is_directory && (before->entry.size != after->entry.size || before->entry.mtime != after->entry.mtime)))
+            {
+                print_snapshot_change('M', root, &after->entry);
+                modified++;
+            }
+            
+            has_before = next_source_entry(before);
+            has_after = next_source_entry(after);
+        }
+    }
+    
+    if (command.print_paths)
+    {
+        fprintf(command_stdout(), "%lu added, %lu removed, %lu modified\n", added, removed, modified);
+    }
+}
+
+// Walks the directory given with -f, or /Documents, through the list_files filters
+// Walks root with the filters in options, returns 0 with walk filled in or prints why
+// it could not
+int walk_snapshot_root(struct am_device *device, const char *root, const struct file_filter *options, struct sandbox_walk *walk)
+{
+    struct walk_filter filter;
+    const char *bad_pattern = compile_walk_filter(&filter, options);
+    
+    ASSERT_OR_RETURN(bad_pattern == NULL, "Error: %s is not a valid regular expression\n", bad_pattern);
+    
+    int connected = walk_device_sandbox(device, root, 1, &filter, walk);
+    free_walk_filter(&filter);
+    
+    if (!connected)
+    {
+        return 1;
+    }
+    
+    if (walk->failed)
+    {
+        free_sandbox_walk(walk);
+        fprintf(command_stderr(), "Error attempting to snapshot: out of memory walking %s\n", root);
+        return 1;
+    }
+    
+    return 0;
+}
+
+int take_snapshot(struct am_device *device)
+{
+    ASSERT_OR_RETURN(command.destination_path != NULL, "Error attempting to snapshot: no -dest <snapshot_file>\n");
+    
+    char *root = (command.file_path != NULL) ? command.file_path : "/Documents";
+    char destination_buffer[PATH_MAX];
+    char *destination_path = local_destination_path(destination_buffer, sizeof(destination_buffer));
+    struct sandbox_walk walk;
+    
+    if (walk_snapshot_root(device, root, &command.filter, &walk) != 0)
+    {
+        return 1;
+    }
+    
+    int failed = 1;
+    
+    if (walk.count == 0 || !walk.entries[0].is_directory)
+    {
+        fprintf(command_stderr(), "Error attempting to snapshot: %s is not a directory\n", root);
+    }
+    else if (!write_snapshot(destination_path, root, &command.filter, &walk))
+    {
+        fprintf(command_stderr(), "Error attempting to snapshot: could not write %s\n", destination_path);
+    }
+    else
+    {
+        fprintf(command_stdout(), "%lu entries under %s saved to %s.\n", (unsigned long)(walk.count - 1), root, destination_path);
+        failed = 0;
+    }
+    
+    free_sandbox_walk(&walk);
+    return failed;
+}
+
+// diff with two snapshot files, no device involved. Both must have been taken with
+// the same filters.
+int diff_snapshot_files(const char *before_path, const char *after_path)
+{
+    struct snapshot_reader before_reader, after_reader;
+    struct snapshot_source before, after;
+    
+    ASSERT_OR_RETURN(open_snapshot(&before_reader, before_path), "Error attempting to diff: %s is not a snapshot\n", before_path);
+    
+    if (!open_snapshot(&after_reader, after_path))
+    {
+        close_snapshot(&before_reader);
+        ASSERT_OR_RETURN(0, "Error attempting to diff: %s is not a snapshot\n", after_path);
+    }
+    
+    int same_filter = same_file_filter(&before_reader.filter, &after_reader.filter);
+    
+    if (same_filter)
+    {
+        memset(&before, 0, sizeof(before));
+        memset(&after, 0, sizeof(after));
+        before.reader = &before_reader;
+        after.reader = &after_reader;
+        
+        diff_snapshot_sources(&before, &after, after_reader.root);
+    }
+    
+    int before_damaged = before_reader.damaged, after_damaged = after_reader.damaged;
+    
+    close_snapshot(&before_reader);
+    close_snapshot(&after_reader);
+    
+    ASSERT_OR_RETURN(same_filter, "Error attempting to diff: %s and %s were taken with different filters\n", before_path, after_path);
+    ASSERT_OR_RETURN(!before_damaged, "Error attempting to diff: %s is damaged\n", before_path);
+    ASSERT_OR_RETURN(!after_damaged, "Error attempting to diff: %s is damaged\n", after_path);
+    return 0;
+}
+
+// diff with one snapshot file compares it with the device, under the snapshot's root
+// unless -f names another. The device is walked with the snapshot's filters; filters
+// given to diff must be the same ones.
+int diff_snapshot(struct am_device *device)
+{
+    if (command.after_snapshot_path != NULL)
+    {
+        return diff_snapshot_files(command.snapshot_path, command.after_snapshot_path);
+    }
+    
+    struct snapshot_reader reader;
+    struct snapshot_source before, after;
+    struct sandbox_walk walk;
+    
+    ASSERT_OR_RETURN(open_snapshot(&reader, command.snapshot_path), "Error attempting to diff: %s is not a snapshot\n", command.snapshot_path);
+    
+    char *root = (command.file_path != NULL) ? command.file_path : reader.root;
+    
+    if (!file_filter_is_empty(&command.filter) && !same_file_filter(&command.filter, &reader.filter))
+    {
+        fprintf(command_stderr(), "Error attempting to diff: %s was taken with different filters\n", command.snapshot_path);
+        close_snapshot(&reader);
+        return 1;
+    }
+    
+    if (walk_snapshot_root(device, root, &reader.filter, &walk) != 0)
+    {
+        close_snapshot(&reader);
+        return 1;
+    }
+    
+    memset(&before, 0, sizeof(before));
+    memset(&after, 0, sizeof(after));
+    before.reader = &reader;
+    after.walk = &walk;
+    after.root_length = strlen(root);
+    
+    diff_snapshot_sources(&before, &after, root);
+    
+    int damaged = reader.damaged;
+    
+    close_snapshot(&reader);
+    free_sandbox_walk(&walk);
+    
+    ASSERT_OR_RETURN(!damaged, "Error attempting to diff: %s is damaged\n", command.snapshot_path);
+    return 0;
+}
+
+// List Apps
+//
+// list_apps asks AMDeviceLookupApplications for only the attributes it prints, and
+// with -type user or -type system only for that kind of app, instead of the whole
+// Info.plist of every app on the device. With -cache the inventory is kept in
+// ~/.appdeploy/apps/<udid>/inventory and answered from there, without talking to the
+// device, until an install or uninstall through appdeploy removes it. The cache
+// holds every app so it can answer any -type.
+
+#define APP_INVENTORY_VERSION 1
+
+struct installed_app
+{
+    char *bundle_id;
+    char *type;
+    char *path;
+};
+
+struct app_inventory
+{
+    struct installed_app *apps;
+    size_t count;
+    size_t capacity;
+    struct path_arena arena;
+};
+
+// Lookup options asking for the given attributes of one ApplicationType (User,
+// System or Any)
+CFDictionaryRef create_lookup_options(CFStringRef type, const CFStringRef *attributes, CFIndex attribute_count)
+{
+    CFArrayRef attribute_array = CFArrayCreate(NULL, (const void **)attributes, attribute_count, &kCFTypeArrayCallBacks);
+    CFStringRef keys[] = { CFSTR("ApplicationType"), CFSTR("ReturnAttributes") };
+    CFTypeRef values[] = { type, attribute_array };
+    CFDictionaryRef options = CFDictionaryCreate(NULL, (const void **)keys, (const void **)values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    
+    CFRelease(attribute_array);
+    
+    return options;
+}
+
+char *copy_app_attribute(CFDictionaryRef attributes, CFStringRef key)
+{
+    CFTypeRef value = CFDictionaryGetValue(attributes, key);
+    
+    if (value == NULL || CFGetTypeID(value) != CFStringGetTypeID())
+    {
+        return NULL;
+    }
+    
+    return create_cstr_from_cfstring(value);
+}
+
+char *arena_copy(struct path_arena *arena, const char *string)
+{
+    char *copy = arena_alloc(arena, strlen(string) + 1);
+    
+    return (copy != NULL) ? strcpy(copy, string) : NULL;
+}
+
+int add_installed_app(struct app_inventory *inventory, const char *bundle_id, const char *type, const char *path)
+{
+    if (!grow_array((void **)&inventory->apps, &inventory->capacity, inventory->count + 1, sizeof(struct installed_app)))
+    {
+        return 0;
+    }
+    
+    struct installed_app *app = &inventory->apps[inventory->count];
+    
+    app->bundle_id = arena_copy(&inventory->arena, bundle_id);
+    app->type = arena_copy(&inventory->arena, type);
+    app->path = arena_copy(&inventory->arena, path);
+    
+    if (app->bundle_id == NULL || app->type == NULL || app->path == NULL)
+    {
+        return 0;
+    }
+    
+    inventory->count++;
+    return 1;
+}
+
+static void collect_installed_app(const void *key, const void *value, void *context)
+{
+    if (key == NULL || value == NULL)
+    {
+        return;
+    }
+    
+    char *bundle_id = create_cstr_from_cfstring((CFStringRef)key);
+    char *type = copy_app_attribute(value, CFSTR("ApplicationType"));
+    char *path = copy_app_attribute(value, CFSTR("Path"));
+    
+    if (bundle_id != NULL)
+    {
+        add_installed_app(context, bundle_id, (type != NULL) ? type : "", (path != NULL) ? path : "");
+    }
+    
+    free(bundle_id);
+    free(type);
+    free(path);
+}
+
+static int compare_installed_apps(const void *a, const void *b)
+{
+    return strcmp(((const struct installed_app *)a)->bundle_id, ((const struct installed_app *)b)->bundle_id);
+}
+
+// Asks the device for its apps of the given ApplicationType
+// Returns 0 with inventory filled in, or prints why it could not
+int lookup_app_inventory(struct am_device *device, CFStringRef type, struct app_inventory *inventory)
+{
+    if (connect_to_device(device) != 0)
+    {
+        return 1;
+    }
+    
+    CFStringRef attributes[] = { CFSTR("CFBundleIdentifier"), CFSTR("ApplicationType"), CFSTR("Path") };
+    CFDictionaryRef options = create_lookup_options(type, attributes, 3);
+    CFDictionaryRef apps;
+    int err = backend->lookup_applications(device, options, &apps);
+    
+    close_device_session(device);
+    CFRelease(options);
+    
+    ASSERT_OR_RETURN(!err, "Error attempting to list installed apps: AMDeviceLookupApplications failed\n");
+    
+    CFDictionaryApplyFunction(apps, collect_installed_app, inventory);
+    CFRelease(apps);
+    
+    qsort(inventory->apps, inventory->count, sizeof(struct installed_app), compare_installed_apps);
+    return 0;
+}
+
+char *app_inventory_path(struct am_device *device)
+{
+    char *udid = copy_device_udid(device);
+    char *path = (udid != NULL) ? state_file_path("apps", udid, "inventory", "") : NULL;
+    
+    free(udid);
+    
+    return path;
+}
+
+// The cache is "<bundle_id>\t<type>\t<path>" lines after a header line
+int load_app_inventory(const char *path, struct app_inventory *inventory)
+{
+    FILE *file = fopen(path, "r");
+    char line[PATH_MAX * 2];
+    char header[64];
+    
+    if (file == NULL)
+    {
+        return 0;
+    }
+    
+    snprintf(header, sizeof(header), "appdeploy-apps %d\n", APP_INVENTORY_VERSION);
+    
+    int ok = (fgets(line, sizeof(line), file) != NULL && strcmp(line, header) == 0);
+    
+    while (ok && fgets(line, sizeof(line), file) != NULL)
+    {
+        char *type = strchr(line, '\t');
+        char *app_path = (type != NULL) ? strchr(type + 1, '\t') : NULL;
+        
+        if (app_path == NULL)
+        {
+            ok = 0;
+            break;
+        }
+        
+        *type++ = '\0';
+        *app_path++ = '\0';
+        app_path[strcspn(app_path, "\n")] = '\0';
+        ok = add_installed_app(inventory, line, type, app_path);
+    }
+    
+    fclose(file);
+    
+    return ok;
+}
+
+void save_app_inventory(const char *path, struct app_inventory *inventory)
+{
+    char *temporary_path = malloc(strlen(path) + 5);
+    FILE *file;
+    size_t i;
+    
+    sprintf(temporary_path, "%s.tmp", path);
+    file = fopen(temporary_path, "w");
+    
+    if (file != NULL)
+    {
+        fprintf(file, "appdeploy-apps %d\n", APP_INVENTORY_VERSION);
+        
+        for (i = 0; i < inventory->count; i++)
+        {
+            fprintf(file, "%s\t%s\t%s\n", inventory->apps[i].bundle_id, inventory->apps[i].type, inventory->apps[i].path);
+        }
+        
+        if (fclose(file) == 0)
+        {
+            rename(temporary_path, path);
+        }
+    }
+    
+    unlink(temporary_path);
+    free(temporary_path);
+}
+
+void invalidate_app_inventory(struct am_device *device)
+{
+    char *path = app_inventory_path(device);
+    
+    if (path != NULL)
+    {
+        unlink(path);
+    }
+    
+    free(path);
+}
+
+void free_app_inventory(struct app_inventory *inventory)
+{
+    free(inventory->apps);
+    free_arena(&inventory->arena);
+}
+
+int list_apps(struct am_device *device)
+{
+    struct app_inventory inventory;
+    CFStringRef type = CFSTR("Any");
+    const char *type_name = "Any";
+    size_t i;
+    
+    if (command.app_type != NULL && strcasecmp(command.app_type, "user") == 0)
+    {
+        type = CFSTR("User");
+        type_name = "User";
+    }
+    else if (command.app_type != NULL && strcasecmp(command.app_type, "system") == 0)
+    {
+        type = CFSTR("System");
+        type_name = "System";
+    }
+    else
+    {
+        ASSERT_OR_RETURN(command.app_type == NULL || strcasecmp(command.app_type, "any") == 0, "Error attempting to list installed apps: -type must be user, system or any\n");
+    }
+    
+    memset(&inventory, 0, sizeof(inventory));
+    
+    char *cache_path = command.cache ? app_inventory_path(device) : NULL;
+    
+    if (cache_path == NULL || !load_app_inventory(cache_path, &inventory))
+    {
+        free_app_inventory(&inventory);
+        memset(&inventory, 0, sizeof(inventory));
+        
+        // the cache has to answer every -type later on
+        if (lookup_app_inventory(device, (cache_path != NULL) ? CFSTR("Any") : type, &inventory) != 0)
+        {
+            free(cache_path);
+            free_app_inventory(&inventory);
+            return 1;
+        }
+        
+        if (cache_path != NULL)
+        {
+            save_app_inventory(cache_path, &inventory);
+        }
+    }
+    
+    for (i = 0; i < inventory.count; i++)
+    {
+        struct installed_app *app = &inventory.apps[i];
+        
+        if (strcmp(type_name, "Any") != 0 && strcmp(app->type, type_name) != 0)
+        {
+            continue;
+        }
+        
+        if (command.print_paths)
+        {
+            fprintf(command_stdout(), "%s\n\tPath: %s\n", app->bundle_id, app->path);
+        }
+        else
+        {
+            fprintf(command_stdout(), "%s\n", app->bundle_id);
+        }
+    }
+    
+    free(cache_path);
+    free_app_inventory(&inventory);
+    return 0;
+}
+
+// IPA Archives
+//
+// An .ipa is a zip archive holding the bundle under Payload/<App>.app. The archive
+// is mapped and its central directory read once; entries are then inflated with
+// zlib straight from the mapping, a chunk at a time, so no part of the bundle is
+// ever extracted to the local disk. Zip64 sizes and offsets are understood, and
+// every entry's CRC-32 is checked as the last of it is inflated.
+
+#define ZIP_END_SIGNATURE 0x06054b50
+#define ZIP64_END_SIGNATURE 0x06064b50
+#define ZIP64_LOCATOR_SIGNATURE 0x07064b50
+#define ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define ZIP_LOCAL_SIGNATURE 0x04034b50
+
+struct ipa_entry
+{
+    const char *name;
+    size_t name_length;
+    uint64_t offset;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint32_t crc;
+    uint16_t method;
+    uint16_t flags;
+    uint32_t mode;
+    int is_directory;
+    int is_link;
+};
+
+struct ipa_archive
+{
+    int fd;
+    const unsigned char *data;
+    uint64_t length;
+    struct ipa_entry *entries;
+    size_t count;
+    size_t capacity;
+    char *app_name;
+    size_t app_prefix_length;
+};
+
+int is_ipa_path(const char *path)
+{
+    size_t length = (path != NULL) ? strlen(path) : 0;
+    
+    return length > 4 && strcasecmp(path + length - 4, ".ipa") == 0;
+}
+
+// Replaces the 32-bit fields that are all ones with the values in the zip64 extra field
+static void read_zip64_extra(const unsigned char *extra, size_t length, struct ipa_entry *entry)
+{
+    while (length >= 4)
+    {
+        uint16_t id = read_le16(extra);
+        uint16_t size = read_le16(extra + 2);
+        const unsigned char *value = extra + 4, *end = extra + 4 + size;
+        
+        if (4 + (size_t)size > length)
+        {
+            return;
+        }
+        
+        if (id == 0x0001)
+        {
+            if (entry->size == 0xffffffff && value + 8 <= end)
+            {
+                entry->size = read_le64(value);
+                value += 8;
+            }
+            
+            if (entry->compressed_size == 0xffffffff && value + 8 <= end)
+            {
+                entry->compressed_size = read_le64(value);
+                value += 8;
+            }
+            
+            if (entry->offset == 0xffffffff && value + 8 <= end)
+            {
+                entry->offset = read_le64(value);
+            }
+            
+            return;
+        }
+        
+        extra += 4 + size;
+        length -= 4 + size;
+    }
+}
+
+// Finds the central directory, returns 0 when data does not end like a zip archive
+static int find_zip_directory(const unsigned char *data, uint64_t length, uint64_t *offset, uint64_t *size, uint64_t *count)
+{
+    uint64_t end;
+    
+    if (length < 22)
+    {
+        return 0;
+    }
+    
+    // the end record is followed by a comment of at most 64 KB
+    for (end = length - 22; read_le32(data + end) != ZIP_END_SIGNATURE; end--)
+    {
+        if (end == 0 || length - end > 22 + 0xffff)
+        {
+            return 0;
+        }
+    }
+    
+    *count = read_le16(data + end + 10);
+    *size = read_le32(data + end + 12);
+    *offset = read_le32(data + end + 16);
+    
+    if (end >= 20 && read_le32(data + end - 20) == ZIP64_LOCATOR_SIGNATURE)
+    {
+        uint64_t zip64_end = read_le64(data + end - 20 + 8);
+        
+        if (length < 56 || zip64_end > length - 56 || read_le32(data + zip64_end) != ZIP64_END_SIGNATURE)
+        {
+            return 0;
+        }
+        
+        *count = read_le64(data + zip64_end + 32);
+        *size = read_le64(data + zip64_end + 40);
+        *offset = read_le64(data + zip64_end + 48);
+    }
+    
+    return *offset <= length && *size <= length - *offset;
+}
+
+// The Payload/<App>.app/ directory an entry lives in, 0 for anything outside one
+static size_t ipa_app_prefix_length(const struct ipa_entry *entry)
+{
+    const char *start = entry->name + strlen("Payload/");
+    const char *end = entry->name + entry->name_length;
+    const char *slash;
+    
+    if (entry->name_length <= strlen("Payload/") || strncmp(entry->name, "Payload/", strlen("Payload/")) != 0)
+    {
+        return 0;
+    }
+    
+    slash = memchr(start, '/', end - start);
+    
+    if (slash == NULL || slash - start <= 4 || strncasecmp(slash - 4, ".app", 4) != 0)
+    {
+        return 0;
+    }
+    
+    return slash + 1 - entry->name;
+}
+
+void close_ipa(struct ipa_archive *archive)
+{
+    munmap((void *)archive->data, archive->length);
+    close(archive->fd);
+    free(archive->entries);
+    free(archive->app_name);
+    memset(archive, 0, sizeof(*archive));
+}
+
+// Maps the archive at path and reads its central directory. Returns 0 when it is not
+// a zip archive with an app under Payload.
+int open_ipa(const char *path, struct ipa_archive *archive)
+{
+    struct stat info;
+    uint64_t offset = 0, size = 0, count = 0, i;
+    
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = open(path, O_RDONLY);
+    
+    if (archive->fd < 0)
+    {
+        return 0;
+    }
+    
+    if (fstat(archive->fd, &info) != 0 || info.st_size == 0)
+    {
+        close(archive->fd);
+        return 0;
+    }
+    
+    archive->length = (uint64_t)info.st_size;
+    archive->data = mmap(NULL, archive->length, PROT_READ, MAP_PRIVATE, archive->fd, 0);
+    
+    if (archive->data == MAP_FAILED)
+    {
+        close(archive->fd);
+        return 0;
+    }
+    
+    const unsigned char *record = archive->data, *end = archive->data;
+    
+    if (find_zip_directory(archive->data, archive->length, &offset, &size, &count))
+    {
+        record = archive->data + offset;
+        end = record + size;
+    }
+    
+    for (i = 0; i < count && record + 46 <= end && read_le32(record) == ZIP_CENTRAL_SIGNATURE; i++)
+    {
+        size_t name_length = read_le16(record + 28), extra_length = read_le16(record + 30), comment_length = read_le16(record + 32);
+        
+        if (record + 46 + name_length + extra_length + comment_length > end ||
+            !grow_array((void **)&archive->entries, &archive->capacity, archive->count + 1, sizeof(struct ipa_entry)))
+        {
+            break;
+        }
+        
+        struct ipa_entry *entry = &archive->entries[archive->count++];
+        uint32_t mode = read_le32(record + 38) >> 16;
+        
+        entry->name = (const char *)record + 46;
+        entry->name_length = name_length;
+        entry->flags = read_le16(record + 8);
+        entry->method = read_le16(record + 10);
+        entry->crc = read_le32(record + 16);
+        entry->compressed_size = read_le32(record + 20);
+        entry->size = read_le32(record + 24);
+        entry->offset = read_le32(record + 42);
+        entry->is_directory = (name_length > 0 && entry->name[name_length - 1] == '/');
+        entry->mode = mode;
+        entry->is_link = ((mode & S_IFMT) == S_IFLNK);
+        read_zip64_extra(record + 46 + name_length, extra_length, entry);
+        
+        if (archive->app_name == NULL && ipa_app_prefix_length(entry) > 0)
+        {
+            archive->app_prefix_length = ipa_app_prefix_length(entry);
+            archive->app_name = strndup(entry->name + strlen("Payload/"), archive->app_prefix_length - strlen("Payload/") - 1);
+        }
+        
+        record += 46 + name_length + extra_length + comment_length;
+    }
+    
+    if (i < count || archive->app_name == NULL)
+    {
+        close_ipa(archive);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Path of entry inside the app bundle, NULL for entries outside it. "../" anywhere in
+// the path also gives NULL, so an archive cannot reach outside the staging directory.
+char *copy_ipa_bundle_path(struct ipa_archive *archive, const struct ipa_entry *entry)
+{
+    if (entry->name_length < archive->app_prefix_length ||
+        strncmp(entry->name, "Payload/", strlen("Payload/")) != 0 ||
+        strncmp(entry->name + strlen("Payload/"), archive->app_name, archive->app_prefix_length - strlen("Payload/") - 1) != 0 ||
+        entry->name[archive->app_prefix_length - 1] != '/')
+    {
+        return NULL;
+    }
+    
+    char *path = strndup(entry->name + archive->app_prefix_length, entry->name_length - archive->app_prefix_length);
+    size_t length = strlen(path);
+    
+    if (length != entry->name_length - archive->app_prefix_length || strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0 ||
+        strstr(path, "/../") != NULL || (length >= 3 && strcmp(path + length - 3, "/..") == 0))
+    {
+        free(path);
+        return NULL;
+    }
+    
+    return path;
+}
+
+// Bytes the app bundle in the archive unpacks to
+uint64_t ipa_bundle_size(struct ipa_archive *archive)
+{
+    uint64_t total = 0;
+    size_t i;
+    
+    for (i = 0; i < archive->count; i++)
+    {
+        char *path = copy_ipa_bundle_path(archive, &archive->entries[i]);
+        
+        total += (path != NULL) ? archive->entries[i].size : 0;
+        free(path);
+    }
+    
+    return total;
+}
+
+// Inflates one entry a buffer at a time, see fill_from_ipa_entry()
+struct ipa_reader
+{
+    const struct ipa_entry *entry;
+    z_stream stream;
+    const unsigned char *data;
+    uint64_t remaining;
+    uint64_t produced;
+    uLong crc;
+};
+
+// Returns 0 for an entry that is encrypted, compressed some other way than deflate or
+// stored, or does not fit in the archive
+int open_ipa_reader(struct ipa_archive *archive, const struct ipa_entry *entry, struct ipa_reader *reader)
+{
+    const unsigned char *header = archive->data + entry->offset;
+    
+    memset(reader, 0, sizeof(*reader));
+    reader->entry = entry;
+    reader->crc = crc32(0, Z_NULL, 0);
+    
+    if ((entry->flags & 1) != 0 || (entry->method != Z_DEFLATED && entry->method != 0) ||
+        archive->length < 30 || entry->offset > archive->length - 30 || read_le32(header) != ZIP_LOCAL_SIGNATURE)
+    {
+        return 0;
+    }
+    
+    uint64_t start = entry->offset + 30 + read_le16(header + 26) + read_le16(header + 28);
+    
+    if (start > archive->length || entry->compressed_size > archive->length - start)
+    {
+        return 0;
+    }
+    
+    reader->data = archive->data + start;
+    reader->remaining = entry->compressed_size;
+    
+    // negative window bits read raw deflate data, without a zlib header
+    return entry->method == 0 || inflateInit2(&reader->stream, -MAX_WBITS) == Z_OK;
+}
+
+void close_ipa_reader(struct ipa_reader *reader)
+{
+    if (reader->entry->method == Z_DEFLATED)
+    {
+        inflateEnd(&reader->stream);
+    }
+}
+
+// chunk_fill_callback that inflates the entry, EIO when it is damaged
+int fill_from_ipa_entry(void *context, char *buffer, size_t capacity, size_t *length)
+{
+    struct ipa_reader *reader = context;
+    uint64_t wanted = reader->entry->size - reader->produced;
+    
+    *length = (wanted < capacity) ? (size_t)wanted : capacity;
+    
+    if (reader->entry->method == 0)
+    {
+        if (*length > reader->remaining)
+        {
+            return EIO;
+        }
+        
+        memcpy(buffer, reader->data, *length);
+        reader->data += *length;
+        reader->remaining -= *length;
+    }
+    else if (*length > 0)
+    {
+        reader->stream.next_out = (Bytef *)buffer;
+        reader->stream.avail_out = (uInt)*length;
+        
+        while (reader->stream.avail_out > 0)
+        {
+            // avail_in is 32 bits wide, so a big entry is fed in pieces
+            if (reader->stream.avail_in == 0)
+            {
+                uInt piece = (reader->remaining > 0x40000000) ? 0x40000000 : (uInt)reader->remaining;
+                
+                reader->stream.next_in = (Bytef *)reader->data;
+                reader->stream.avail_in = piece;
+                reader->data += piece;
+                reader->remaining -= piece;
+            }
+            
+            int status = inflate(&reader->stream, Z_NO_FLUSH);
+            
+            if (status == Z_STREAM_END && reader->stream.avail_out > 0)
+            {
+                return EIO;
+            }
+            
+            if (status != Z_OK && status != Z_STREAM_END)
+            {
+                return EIO;
+            }
+        }
+    }
+    
+    reader->crc = crc32(reader->crc, (const Bytef *)buffer, (uInt)*length);
+    reader->produced += *length;
+    
+    if (reader->produced == reader->entry->size && reader->crc != reader->entry->crc)
+    {
+        return EIO;
+    }
+    
+    return 0;
+}
+
+// Inflates a whole entry into memory, for small files such as Info.plist
+char *read_ipa_entry(struct ipa_archive *archive, const struct ipa_entry *entry)
+{
+    struct ipa_reader reader;
+    size_t length;
+    
+    if (!open_ipa_reader(archive, entry, &reader))
+    {
+        return NULL;
+    }
+    
+    char *contents = malloc(entry->size + 1);
+    int err = (contents == NULL) ? ENOMEM : fill_from_ipa_entry(&reader, contents, entry->size, &length);
+    
+    close_ipa_reader(&reader);
+    
+    if (err != 0 || reader.produced != entry->size)
+    {
+        free(contents);
+        return NULL;
+    }
+    
+    contents[entry->size] = '\0';
+    return contents;
+}
+
+// Reads Payload/<App>.app/Info.plist out of the archive at ipa_path
+CFDictionaryRef copy_ipa_app_info(const char *ipa_path)
+{
+    struct ipa_archive archive;
+    CFPropertyListRef plist = NULL;
+    size_t i;
+    
+    if (!open_ipa(ipa_path, &archive))
+    {
+        return NULL;
+    }
+    
+    for (i = 0; i < archive.count && plist == NULL; i++)
+    {
+        struct ipa_entry *entry = &archive.entries[i];
+        char *path = copy_ipa_bundle_path(&archive, entry);
+        char *contents = (path != NULL && strcmp(path, "Info.plist") == 0) ? read_ipa_entry(&archive, entry) : NULL;
+        
+        if (contents != NULL)
+        {
+            CFDataRef data = CFDataCreate(NULL, (const UInt8 *)contents, (CFIndex)entry->size);
+            
+            plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+            CFRelease(data);
+        }
+        
+        free(contents);
+        free(path);
+    }
+    
+    close_ipa(&archive);
+    
+    if (plist != NULL && CFGetTypeID(plist) != CFDictionaryGetTypeID())
+    {
+        CFRelease(plist);
+        return NULL;
+    }
+    
+    return plist;
+}
+
+// IPA Cache
+//
+// Hashing a bundle and install -delta need the files of an .ipa on disk, so
+// unpack_ipa() inflates the archive into ~/.appdeploy/unpacked/<hash>/<App>.app,
+// keyed by the fast content hash of the whole archive, and every later run on the
+// same archive finds it there. Hashing a large archive costs as much as reading it,
+// so unpacked/index/<lookup>.key remembers the hash for a lookup key made from the
+// path, size and mtime of the file and the names, sizes and CRC-32s of its central
+// directory, and the archive is only hashed when that key is new.
+//
+// Entries are inflated on up to one thread per core, largest first like
+// hash_app_bundle(). The tree is built in a temporary directory next to its final
+// place, without holding ipa_cache.lock, and renamed in under it, so a cached tree is
+// always complete. Fan-out workers deploying the same archive wait for the one
+// unpacking it rather than unpacking it twice. Every use touches unpacked/<hash>, and
+// once the cache outgrows IPA_CACHE_MAX_SIZE the least recently used archives are
+// removed, except those used in the last IPA_CACHE_KEEP_SECONDS.
+
+#define IPA_CACHE_MAX_SIZE (4ULL * 1024 * 1024 * 1024)
+#define IPA_CACHE_KEEP_SECONDS (10 * 60)
+#define IPA_CACHE_KEY_LENGTH (CONTENT_DIGEST_MAX * 2 + 1)
+
+struct ipa_unpack
+{
+    struct ipa_archive *archive;
+    const char *root;
+    const struct ipa_entry **order;
+    size_t order_count;
+    size_t next;
+    const struct ipa_entry *failure;
+    pthread_mutex_t lock;
+};
+
+// One archive under unpacked/, for evict_unpacked_ipas()
+struct cached_ipa
+{
+    char *path;
+    time_t used;
+    uint64_t size;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t unpacked;
+    char unpacking[MAX_FANOUT_DEVICES][IPA_CACHE_KEY_LENGTH];
+    int unpacking_count;
+} ipa_cache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// Removes root and everything under it
+void remove_local_tree(const char *root)
+{
+    struct sandbox_walk walk;
+    size_t i;
+    
+    memset(&walk, 0, sizeof(walk));
+    walk.with_links = 1;
+    walk_local_tree(root, &walk);
+    
+    // reverse tree order empties every directory before removing it
+    for (i = walk.count; i-- > 0;)
+    {
+        remove(walk.entries[i].path);
+    }
+    
+    free_sandbox_walk(&walk);
+}
+
+static int compare_ipa_sizes(const void *a, const void *b)
+{
+    uint64_t left = (*(const struct ipa_entry * const *)a)->size;
+    uint64_t right = (*(const struct ipa_entry * const *)b)->size;
+    
+    return (left < right) - (left > right);
+}
+
+// Inflates entry into a new file at path, returns 0 when the entry is damaged or the
+// file cannot be written
+static int unpack_ipa_entry(struct ipa_archive *archive, const struct ipa_entry *entry, const char *path, char *buffer, size_t capacity)
+{
+    struct ipa_reader reader;
+    size_t length = 0;
+    int err = 0;
+    
+    if (!open_ipa_reader(archive, entry, &reader))
+    {
+        return 0;
+    }
+    
+    FILE *file = fopen(path, "wb");
+    int failed = (file == NULL);
+    
+    while (!failed && err == 0 && reader.produced < entry->size)
+    {
+        err = fill_from_ipa_entry(&reader, buffer, capacity, &length);
+        
+        if (err == 0 && fwrite(buffer, 1, length, file) != length)
+        {
+            err = EIO;
+        }
+    }
+    
+    if (file != NULL && fclose(file) != 0)
+    {
+        failed = 1;
+    }
+    
+    close_ipa_reader(&reader);
+    
+    // keep the executable bits, the rest of the mode is left to the umask
+    if (!failed && err == 0 && (entry->mode & 0111) != 0)
+    {
+        chmod(path, 0755);
+    }
+    
+    return !failed && err == 0;
+}
+
+static void *run_unpack_worker(void *context)
+{
+    struct ipa_unpack *unpack = context;
+    size_t capacity = TRANSFER_CHUNK_SIZE;
+    char *buffer = malloc(capacity);
+    
+    while (1)
+    {
+        pthread_mutex_lock(&unpack->lock);
+        const struct ipa_entry *entry = (unpack->next < unpack->order_count && unpack->failure == NULL) ? unpack->order[unpack->next++] : NULL;
+        pthread_mutex_unlock(&unpack->lock);
+        
+        if (entry == NULL)
+        {
+            break;
+        }
+        
+        char *relative = copy_ipa_bundle_path(unpack->archive, entry);
+        char *path = (relative != NULL) ? malloc(strlen(unpack->root) + strlen(relative) + 2) : NULL;
+        
+        if (path != NULL)
+        {
+            sprintf(path, "%s/%s", unpack->root, relative);
+        }
+        
+        if (buffer == NULL || path == NULL || !unpack_ipa_entry(unpack->archive, entry, path, buffer, capacity))
+        {
+            pthread_mutex_lock(&unpack->lock);
+            unpack->failure = entry;
+            pthread_mutex_unlock(&unpack->lock);
+        }
+        
+        free(path);
+        free(relative);
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+// Unpacks the bundle of archive into the directory root. Returns 0, with a message on
+// stderr, when an entry cannot be unpacked.
+static int unpack_ipa_tree(struct ipa_archive *archive, const char *root)
+{
+    struct ipa_unpack unpack;
+    const struct ipa_entry *failure = NULL;
+    char *made = NULL;
+    size_t i;
+    
+    memset(&unpack, 0, sizeof(unpack));
+    unpack.archive = archive;
+    unpack.root = root;
+    unpack.order = malloc((archive->count + 1) * sizeof(struct ipa_entry *));
+    
+    if (unpack.order == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to unpack app: out of memory\n");
+        return 0;
+    }
+    
+    // directories first, so the workers only ever create files
+    for (i = 0; i < archive->count && failure == NULL; i++)
+    {
+        const struct ipa_entry *entry = &archive->entries[i];
+        char *path = copy_ipa_bundle_path(archive, entry);
+        char *slash = (path != NULL) ? strrchr(path, '/') : NULL;
+        
+        if (path != NULL && entry->is_link)
+        {
+            failure = entry;
+        }
+        else if (path != NULL && !entry->is_directory)
+        {
+            unpack.order[unpack.order_count++] = entry;
+        }
+        
+        if (failure == NULL && slash != NULL && slash != path)
+        {
+            *slash = '\0';
+            
+            if (made == NULL || strcmp(made, path) != 0)
+            {
+                char *local_path = malloc(strlen(root) + strlen(path) + 2);
+                
+                if (local_path != NULL)
+                {
+                    sprintf(local_path, "%s/%s", root, path);
+                }
+                
+                if (local_path == NULL || !make_directories(local_path, 0755))
+                {
+                    failure = entry;
+                }
+                
+                free(local_path);
+                free(made);
+                made = path;
+                path = NULL;
+            }
+        }
+        
+        free(path);
+    }
+    
+    free(made);
+    
+    if (failure == NULL)
+    {
+        qsort(unpack.order, unpack.order_count, sizeof(struct ipa_entry *), compare_ipa_sizes);
+        pthread_mutex_init(&unpack.lock, NULL);
+        
+        pthread_t threads[MAX_HASH_THREADS];
+        int thread_count = hash_thread_count(unpack.order_count);
+        int started = 0;
+        
+        while (started < thread_count - 1 && pthread_create(&threads[started], NULL, run_unpack_worker, &unpack) == 0)
+        {
+            started++;
+        }
+        
+        run_unpack_worker(&unpack);
+        
+        while (started > 0)
+        {
+            pthread_join(threads[--started], NULL);
+        }
+        
+        pthread_mutex_destroy(&unpack.lock);
+        failure = unpack.failure;
+    }
+    
+    free(unpack.order);
+    
+    if (failure != NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to unpack app: unable to unpack %.*s\n", (int)failure->name_length, failure->name);
+        return 0;
+    }
+    
+    return 1;
+}
+
+static void format_cache_key(struct content_hash *hash, char *key)
+{
+    unsigned char digest[CONTENT_DIGEST_MAX];
+    size_t i, length = content_hash_final(hash, digest);
+    
+    for (i = 0; i < length; i++)
+    {
+        sprintf(key + i * 2, "%02x", digest[i]);
+    }
+}
+
+// Lookup key of the .ipa at ipa_path, from its file and its central directory only
+static void format_ipa_lookup_key(struct ipa_archive *archive, const char *ipa_path, char *key)
+{
+    struct content_hash hash;
+    struct stat info;
+    char resolved[PATH_MAX];
+    const char *path = (realpath(ipa_path, resolved) != NULL) ? resolved : ipa_path;
+    uint64_t values[2] = { 0, 0 };
+    size_t i;
+    
+    if (fstat(archive->fd, &info) == 0)
+    {
+        values[0] = (uint64_t)info.st_size;
+        values[1] = (uint64_t)info.st_mtime;
+    }
+    
+    content_hash_init(&hash, FastContentHash);
+    content_hash_update(&hash, path, strlen(path) + 1);
+    content_hash_update(&hash, values, sizeof(values));
+    
+    for (i = 0; i < archive->count; i++)
+    {
+        const struct ipa_entry *entry = &archive->entries[i];
+        
+        content_hash_update(&hash, entry->name, entry->name_length);
+        content_hash_update(&hash, &entry->crc, sizeof(entry->crc));
+        content_hash_update(&hash, &entry->size, sizeof(entry->size));
+    }
+    
+    format_cache_key(&hash, key);
+}
+
+// Reads the content key an index file points to, returns 0 when it holds none
+static int read_ipa_index(const char *index_path, char *key)
+{
+    FILE *file = fopen(index_path, "r");
+    size_t expected = content_digest_length(FastContentHash) * 2;
+    int valid = 0;
+    
+    if (file != NULL)
+    {
+        valid = (fgets(key, IPA_CACHE_KEY_LENGTH, file) != NULL && strlen(key) == expected && strspn(key, "0123456789abcdef") == expected);
+        fclose(file);
+    }
+    
+    return valid;
+}
+
+static void write_ipa_index(const char *index_path, const char *key)
+{
+    FILE *file = fopen(index_path, "w");
+    
+    if (file == NULL || fputs(key, file) == EOF || fclose(file) != 0)
+    {
+        fprintf(command_stderr(), "Warning: unable to write %s\n", index_path);
+        unlink(index_path);
+    }
+}
+
+static int compare_cached_ipas(const void *a, const void *b)
+{
+    time_t left = ((const struct cached_ipa *)a)->used;
+    time_t right = ((const struct cached_ipa *)b)->used;
+    
+    return (left > right) - (left < right);
+}
+
+// Removes the least recently used archives under cache_root, other than the one in
+// directory keep, while the cache holds more than IPA_CACHE_MAX_SIZE, then the index
+// files whose archive is gone
+static void evict_unpacked_ipas(const char *cache_root, const char *keep)
+{
+    struct cached_ipa *entries = NULL;
+    size_t count = 0, capacity = 0, i, j;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+    DIR *directory = opendir(cache_root);
+    struct dirent *child;
+    struct stat info;
+    
+    while (directory != NULL && (child = readdir(directory)) != NULL)
+    {
+        if (child->d_name[0] == '.' || strcmp(child->d_name, "index") == 0)
+        {
+            continue;
+        }
+        
+        char *path = malloc(strlen(cache_root) + strlen(child->d_name) + 2);
+        
+        if (path != NULL)
+        {
+            sprintf(path, "%s/%s", cache_root, child->d_name);
+        }
+        
+        if (path == NULL || lstat(path, &info) != 0 || !S_ISDIR(info.st_mode) || !grow_array((void **)&entries, &capacity, count + 1, sizeof(struct cached_ipa)))
+        {
+            free(path);
+            continue;
+        }
+        
+        struct sandbox_walk walk;
+        
+        memset(&walk, 0, sizeof(walk));
+        walk.with_links = 1;
+        walk_local_tree(path, &walk);
+        
+        entries[count].path = path;
+        entries[count].used = info.st_mtime;
+        entries[count].size = 0;
+        
+        for (j = 0; j < walk.count; j++)
+        {
+            entries[count].size += walk.entries[j].size;
+        }
+        
+        total += entries[count++].size;
+        free_sandbox_walk(&walk);
+    }
+    
+    if (directory != NULL)
+    {
+        closedir(directory);
+    }
+    
+    qsort(entries, count, sizeof(struct cached_ipa), compare_cached_ipas);
+    
+    for (i = 0; i < count && total > IPA_CACHE_MAX_SIZE; i++)
+    {
+        if (now - entries[i].used >= IPA_CACHE_KEEP_SECONDS && strcmp(entries[i].path, keep) != 0)
+        {
+            remove_local_tree(entries[i].path);
+            total -= entries[i].size;
+        }
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        free(entries[i].path);
+    }
+    
+    free(entries);
+    
+    char *index_root = malloc(strlen(cache_root) + 8);
+    
+    if (index_root != NULL)
+    {
+        sprintf(index_root, "%s/index", cache_root);
+    }
+    
+    if (index_root == NULL || (directory = opendir(index_root)) == NULL)
+    {
+        free(index_root);
+        return;
+    }
+    
+    while ((child = readdir(directory)) != NULL)
+    {
+        char key[IPA_CACHE_KEY_LENGTH];
+        char *index_path = malloc(strlen(index_root) + strlen(child->d_name) + 2);
+        char *target = malloc(strlen(cache_root) + IPA_CACHE_KEY_LENGTH + 1);
+        
+        if (index_path != NULL && target != NULL && child->d_name[0] != '.')
+        {
+            sprintf(index_path, "%s/%s", index_root, child->d_name);
+            
+            if (read_ipa_index(index_path, key))
+            {
+                sprintf(target, "%s/%s", cache_root, key);
+                
+                if (stat(target, &info) != 0)
+                {
+                    unlink(index_path);
+                }
+            }
+        }
+        
+        free(index_path);
+        free(target);
+    }
+    
+    closedir(directory);
+    free(index_root);
+}
+
+static int is_unpacking_ipa(const char *key)
+{
+    int i;
+    
+    for (i = 0; i < ipa_cache.unpacking_count; i++)
+    {
+        if (strcmp(ipa_cache.unpacking[i], key) == 0)
+        {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// Puts the unpacked bundle of archive at bundle_path unless it is there already,
+// returns 0, with a message on stderr, when it cannot be unpacked
+static int place_unpacked_ipa(struct ipa_archive *archive, const char *key, const char *bundle_path)
+{
+    struct stat info;
+    int i, registered = 0;
+    
+    pthread_mutex_lock(&ipa_cache.lock);
+    
+    while (is_unpacking_ipa(key))
+    {
+        pthread_cond_wait(&ipa_cache.unpacked, &ipa_cache.lock);
+    }
+    
+    if (stat(bundle_path, &info) == 0)
+    {
+        pthread_mutex_unlock(&ipa_cache.lock);
+        return 1;
+    }
+    
+    // with every slot taken the archive is unpacked again, the rename still settles it
+    if (ipa_cache.unpacking_count < MAX_FANOUT_DEVICES)
+    {
+        strcpy(ipa_cache.unpacking[ipa_cache.unpacking_count++], key);
+        registered = 1;
+    }
+    
+    pthread_mutex_unlock(&ipa_cache.lock);
+    
+    char *temporary = malloc(strlen(bundle_path) + 8);
+    int unpacked = 0, placed;
+    
+    if (temporary != NULL)
+    {
+        sprintf(temporary, "%s.XXXXXX", bundle_path);
+        unpacked = mkdtemp(temporary) != NULL && chmod(temporary, 0755) == 0 && unpack_ipa_tree(archive, temporary);
+    }
+    
+    pthread_mutex_lock(&ipa_cache.lock);
+    
+    // another appdeploy may have put the same tree in place in the meantime
+    placed = unpacked && (rename(temporary, bundle_path) == 0 || stat(bundle_path, &info) == 0);
+    
+    for (i = 0; registered && i < ipa_cache.unpacking_count; i++)
+    {
+        if (strcmp(ipa_cache.unpacking[i], key) == 0)
+        {
+            memcpy(ipa_cache.unpacking[i], ipa_cache.unpacking[--ipa_cache.unpacking_count], IPA_CACHE_KEY_LENGTH);
+            break;
+        }
+    }
+    
+    pthread_cond_broadcast(&ipa_cache.unpacked);
+    pthread_mutex_unlock(&ipa_cache.lock);
+    
+    if (temporary != NULL && stat(temporary, &info) == 0)
+    {
+        remove_local_tree(temporary);
+    }
+    
+    free(temporary);
+    return placed;
+}
+
+// Path of the unpacked bundle of the .ipa at ipa_path, from the cache or unpacked
+// into it first. Returns NULL, with a message on stderr, when it cannot be unpacked.
+char *unpack_ipa(const char *ipa_path)
+{
+    struct ipa_archive archive;
+    struct content_hash hash;
+    struct stat info;
+    char lookup[IPA_CACHE_KEY_LENGTH], key[IPA_CACHE_KEY_LENGTH];
+    char *bundle_path = NULL;
+    int cached = 0;
+    
+    if (!open_ipa(ipa_path, &archive))
+    {
+        fprintf(command_stderr(), "Error attempting to unpack app: %s is not an .ipa with an app in Payload\n", ipa_path);
+        return NULL;
+    }
+    
+    format_ipa_lookup_key(&archive, ipa_path, lookup);
+    
+    char *index_path = state_file_path("unpacked", "index", lookup, ".key");
+    
+    if (index_path != NULL && read_ipa_index(index_path, key))
+    {
+        bundle_path = state_file_path("unpacked", key, archive.app_name, "");
+        cached = (bundle_path != NULL && stat(bundle_path, &info) == 0);
+    }
+    
+    if (!cached)
+    {
+        free(bundle_path);
+        content_hash_init(&hash, FastContentHash);
+        content_hash_update(&hash, archive.data, archive.length);
+        format_cache_key(&hash, key);
+        
+        bundle_path = state_file_path("unpacked", key, archive.app_name, "");
+        
+        if (bundle_path != NULL && !place_unpacked_ipa(&archive, key, bundle_path))
+        {
+            free(bundle_path);
+            bundle_path = NULL;
+        }
+        
+        if (bundle_path != NULL && index_path != NULL)
+        {
+            write_ipa_index(index_path, key);
+        }
+    }
+    
+    close_ipa(&archive);
+    free(index_path);
+    
+    if (bundle_path == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to unpack app: unable to unpack %s\n", ipa_path);
+        return NULL;
+    }
+    
+    // unpacked/<hash> records when the archive was last used, for evict_unpacked_ipas()
+    char *entry_directory = strdup(bundle_path);
+    char *slash = (entry_directory != NULL) ? strrchr(entry_directory, '/') : NULL;
+    
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        utimes(entry_directory, NULL);
+    }
+    
+    // a new archive may push the cache over its limit
+    char *cache_root = (!cached && slash != NULL) ? strdup(entry_directory) : NULL;
+    
+    if (cache_root != NULL && (slash = strrchr(cache_root, '/')) != NULL)
+    {
+        *slash = '\0';
+        evict_unpacked_ipas(cache_root, entry_directory);
+    }
+    
+    free(cache_root);
+    free(entry_directory);
+    return bundle_path;
+}
+
+// Install App
+//
+// install -delta stages the bundle itself over the com.apple.afc service into
+// /PublicStaging/<App>.app, where AMDeviceSecureTransferPath would copy it, and only
+// sends the files whose content hash changed since the last install on that device.
+// The staged files are recorded in a manifest per device and app name. When staging
+// is gone or no longer matches the manifest the full AMDeviceSecureTransferPath copy
+// runs instead and the manifest is rebuilt from what it left behind.
+
+#define STAGING_DIRECTORY "/PublicStaging"
+
+void close_staging_connections(struct afc_connection **connections, int count)
+{
+    int i;
+    
+    for (i = 0; i < count; i++)
+    {
+        backend->connection_close(connections[i]);
+    }
+}
+
+// Opens count connections to the media directory through com.apple.afc. Returns 0,
+// or -1 with none left open.
+int open_staging_connections(struct am_device *device, struct afc_connection **connections, int count)
+{
+    int i;
+    
+    for (i = 0; i < count; i++)
+    {
+        int socket_fd;
+        
+        if (connect_to_device(device) != 0)
+        {
+            close_staging_connections(connections, i);
+            return -1;
+        }
+        
+        const char *failure = NULL;
+        
+        if (backend->start_service(device, AMSVC_AFC, &socket_fd) != 0)
+        {
+            failure = "AMDeviceStartService";
+        }
+        
+        close_device_session(device);
+        
+        if (failure == NULL && backend->connection_open(socket_fd, 0, &connections[i]) != 0)
+        {
+            failure = "AFCConnectionOpen";
+            close(socket_fd);
+        }
+        
+        if (failure != NULL)
+        {
+            fprintf(command_stderr(), "Error attempting to stage app: %s failed\n", failure);
+            close_staging_connections(connections, i);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// Sends the changed files of the bundle at app_path to staging. With require_manifest
+// nothing is sent unless staging still matches the manifest. Returns 1 once the bundle
+// is staged.
+int stage_app_delta(struct am_device *device, char *app_path, int require_manifest)
+{
+    struct afc_connection *connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int connection_count = parallel_job_count();
+    
+    app_path = trim_root(app_path);
+    const char *app_name = strrchr(app_path, '/');
+    
+    app_name = (app_name != NULL) ? app_name + 1 : app_path;
+    
+    char *udid = copy_device_udid(device);
+    char *manifest_file = (udid != NULL) ? manifest_path(udid, app_name) : NULL;
+    free(udid);
+    
+    if (manifest_file == NULL)
+    {
+        return 0;
+    }
+    
+    char *staging_root = malloc(strlen(STAGING_DIRECTORY) + strlen(app_name) + 2);
+    sprintf(staging_root, "%s/%s", STAGING_DIRECTORY, app_name);
+    
+    int flags = SyncCompareHashes | SyncDeleteExtras | (require_manifest ? SyncRequireManifest : 0);
+    struct sync_result result;
+    
+    int staged = 0;
+    
+    if (open_staging_connections(device, connections, connection_count) == 0)
+    {
+        staged = (sync_tree(connections, connection_count, app_path, staging_root, manifest_file, flags, &result) == 1 && result.failed == 0);
+        close_staging_connections(connections, connection_count);
+    }
+    
+    if (staged && require_manifest)
+    {
+        fprintf(command_stdout(), "Staged %lu changed files, %lu unchanged.\n", (unsigned long)result.uploaded, (unsigned long)result.unchanged);
+    }
+    
+    free(staging_root);
+    free(manifest_file);
+    
+    return staged;
+}
+
+// Install Progress
+//
+// AMDeviceSecureTransferPath and AMDeviceSecureInstallApplication call back with a
+// dictionary holding a Status such as CopyingFile or VerifyingApplication and a
+// PercentComplete. With -progress each change is printed as the phase (copy, verify
+// or install), the percent, and for the copy the bytes sent so far and bytes/s,
+// estimated from the bundle size. -json prints the same as one JSON object per line.
+// The callbacks run on the thread that made the call, so fan-out workers each keep
+// their own state.
+
+enum InstallProgressStage
+{
+    ProgressTransfer,
+    ProgressInstall
+};
+
+struct install_progress
+{
+    const char *app_name;
+    const char *phase;
+    char status[64];
+    int percent;
+    uint64_t total_bytes;
+    double start;
+};
+
+static __thread struct install_progress *current_progress;
+
+// Statuses reported by AMDeviceSecureInstallApplication while it checks the package
+static const char *install_verify_statuses[] = { "ExtractingPackage", "InspectingPackage", "TakingInstallLock", "PreflightingApplication", "InstallingEmbeddedProfile", "VerifyingApplication" };
+
+const char *install_phase(int stage, const char *status)
+{
+    size_t i;
+    
+    if (stage == ProgressTransfer)
+    {
+        return "copy";
+    }
+    
+    for (i = 0; i < sizeof(install_verify_statuses) / sizeof(install_verify_statuses[0]); i++)
+    {
+        if (strcmp(status, install_verify_statuses[i]) == 0)
+        {
+            return "verify";
+        }
+    }
+    
+    return "install";
+}
+
+void print_install_progress(struct install_progress *progress)
+{
+    const char *udid = (current_worker != NULL) ? current_worker->udid : NULL;
+    double elapsed = current_time() - progress->start;
+    int copying = (strcmp(progress->phase, "copy") == 0);
+    uint64_t bytes = progress->total_bytes * progress->percent / 100;
+    double rate = (elapsed > 0) ? bytes / elapsed : 0;
+    
+    FILE *output = command_stdout();
+    
+    // fan-out workers report at the same time, keep each line in one piece
+    flockfile(output);
+    
+    if (command.json)
+    {
+        fprintf(output, "{");
+        
+        if (udid != NULL)
+        {
+            fprintf(output, "\"device\": \"%s\", ", udid);
+        }
+        
+        if (command.app_count > 1)
+        {
+            fprintf(output, "\"app\": \"%s\", ", progress->app_name);
+        }
+        
+        fprintf(output, "\"phase\": \"%s\", \"status\": \"%s\", \"percent\": %d, \"elapsed\": %.3f", progress->phase, progress->status, progress->percent, elapsed);
+        
+        if (copying)
+        {
+            fprintf(output, ", \"bytes\": %llu, \"total_bytes\": %llu, \"bytes_per_second\": %.0f", (unsigned long long)bytes, (unsigned long long)progress->total_bytes, rate);
+        }
+        
+        fprintf(output, "}\n");
+    }
+    else
+    {
+        if (udid != NULL)
+        {
+            fprintf(output, "%-42s ", udid);
+        }
+        
+        if (command.app_count > 1)
+        {
+            fprintf(output, "%-24s ", progress->app_name);
+        }
+        
+        fprintf(output, "%-8s %3d%%  ", progress->phase, progress->percent);
+        
+        if (copying)
+        {
+            fprintf(output, "%9.2f MB/s  ", rate / (1024 * 1024));
+        }
+        else
+        {
+            fprintf(output, "%16s", "");
+        }
+        
+        fprintf(output, "%s\n", progress->status);
+    }
+    
+    fflush(output);
+    funlockfile(output);
+}
+
+// Called by MobileDevice; cookie is the InstallProgressStage passed with the callback
+void on_install_progress(CFDictionaryRef info, int cookie)
+{
+    struct install_progress *progress = current_progress;
+    
+    if (progress == NULL || info == NULL)
+    {
+        return;
+    }
+    
+    CFStringRef status = CFDictionaryGetValue(info, CFSTR("Status"));
+    CFNumberRef percent = CFDictionaryGetValue(info, CFSTR("PercentComplete"));
+    char *status_cstr = (status != NULL) ? create_cstr_from_cfstring(status) : NULL;
+    int value = progress->percent;
+    
+    if (percent != NULL)
+    {
+        CFNumberGetValue(percent, kCFNumberIntType, &value);
+    }
+    
+    const char *phase = install_phase(cookie, (status_cstr != NULL) ? status_cstr : "");
+    
+    // CopyingFile arrives once per file, only print when something visible changed
+    if (phase != progress->phase || value != progress->percent || strncmp(progress->status, (status_cstr != NULL) ? status_cstr : "", sizeof(progress->status) - 1) != 0)
+    {
+        progress->phase = phase;
+        progress->percent = value;
+        snprintf(progress->status, sizeof(progress->status), "%s", (status_cstr != NULL) ? status_cstr : "");
+        print_install_progress(progress);
+    }
+    
+    free(status_cstr);
+}
+
+// Sets up progress reporting for app_path on this thread when -progress is set
+void begin_install_progress(struct install_progress *progress, char *app_path)
+{
+    memset(progress, 0, sizeof(*progress));
+    
+    if (!command.progress)
+    {
+        return;
+    }
+    
+    struct sandbox_walk walk;
+    struct ipa_archive archive;
+    size_t i;
+    
+    if (is_ipa_path(app_path))
+    {
+        if (open_ipa(app_path, &archive))
+        {
+            progress->total_bytes = ipa_bundle_size(&archive);
+            close_ipa(&archive);
+        }
+    }
+    else
+    {
+        memset(&walk, 0, sizeof(walk));
+        walk_local_tree(app_path, &walk);
+        
+        for (i = 0; i < walk.count; i++)
+        {
+            progress->total_bytes += walk.entries[i].size;
+        }
+        
+        free_sandbox_walk(&walk);
+    }
+    
+    char *name = strrchr(trim_root(app_path), '/');
+    
+    progress->app_name = (name != NULL) ? name + 1 : app_path;
+    progress->percent = -1;
+    progress->start = current_time();
+    current_progress = progress;
+}
+
+void end_install_progress()
+{
+    current_progress = NULL;
+}
+
+// Install From IPA
+//
+// install -p <App>.ipa skips AMDeviceSecureTransferPath, which only copies local
+// directories. Every file under Payload/<App>.app is inflated on the way to
+// /PublicStaging/<App>.app over the com.apple.afc service, which is where
+// AMDeviceSecureTransferPath would have put the unpacked bundle, and
+// AMDeviceSecureInstallApplication then installs it from there. The files are shared
+// out over -j connections. A file larger than one chunk goes through
+// run_chunk_pipeline(), so the next chunk is inflated while this one is written.
+
+struct ipa_stage
+{
+    struct ipa_archive *archive;
+    char *staging_root;
+    struct install_progress *progress;
+    struct device_worker *worker;
+    pthread_mutex_t lock;
+    size_t next;
+    uint64_t bytes;
+    const char *failure;
+    char *failed_path;
+};
+
+struct ipa_stage_worker
+{
+    struct ipa_stage *stage;
+    struct afc_connection *connection;
+    pthread_t thread;
+};
+
+// Removes a remote directory and everything in it, children before their parents
+void remove_remote_tree(struct afc_connection *connection, const char *root)
+{
+    struct sandbox_walk walk;
+    size_t i;
+    
+    walk_sandbox(&connection, 1, root, 0, NULL, &walk);
+    
+    for (i = walk.count; i > 0; i--)
+    {
+        backend->remove_path(connection, walk.entries[i - 1].path);
+    }
+    
+    free_sandbox_walk(&walk);
+}
+
+void fail_ipa_stage(struct ipa_stage *stage, const char *failure, const char *path)
+{
+    pthread_mutex_lock(&stage->lock);
+    
+    if (stage->failure == NULL)
+    {
+        stage->failure = failure;
+        stage->failed_path = strdup(path);
+    }
+    
+    pthread_mutex_unlock(&stage->lock);
+}
+
+// Adds to the bytes staged and prints a copy line whenever the percent moves
+void add_ipa_stage_bytes(struct ipa_stage *stage, uint64_t bytes)
+{
+    struct install_progress *progress = stage->progress;
+    
+    pthread_mutex_lock(&stage->lock);
+    stage->bytes += bytes;
+    
+    if (progress != NULL && progress->total_bytes > 0)
+    {
+        int percent = (int)(stage->bytes * 100 / progress->total_bytes);
+        
+        if (percent != progress->percent)
+        {
+            progress->phase = "copy";
+            progress->percent = percent;
+            snprintf(progress->status, sizeof(progress->status), "CopyingFile");
+            print_install_progress(progress);
+        }
+    }
+    
+    pthread_mutex_unlock(&stage->lock);
+}
+
+// Inflates one file of the archive into remote_path
+int stage_ipa_file(struct ipa_stage *stage, struct afc_connection *connection, const struct ipa_entry *entry, char *remote_path)
+{
+    struct afc_file_stream stream = { connection, 0 };
+    struct ipa_reader reader;
+    double start = trace_begin();
+    uint64_t transferred = 0;
+    int err;
+    
+    if (!open_ipa_reader(stage->archive, entry, &reader))
+    {
+        fail_ipa_stage(stage, "reading the file from the archive", remote_path);
+        return 0;
+    }
+    
+    if (backend->file_ref_open(connection, remote_path, 3, &stream.file_ref) != 0)
+    {
+        close_ipa_reader(&reader);
+        fail_ipa_stage(stage, "AFCFileRefOpen", remote_path);
+        return 0;
+    }
+    
+    if (entry->size > TRANSFER_CHUNK_SIZE)
+    {
+        err = run_chunk_pipeline(fill_from_ipa_entry, &reader, drain_to_afc_file, &stream, TRANSFER_CHUNK_SIZE, &transferred);
+    }
+    else
+    {
+        // small files are inflated and written in one piece, without a producer thread
+        char *buffer = malloc(entry->size + 1);
+        size_t length = 0;
+        
+        err = (buffer == NULL) ? ENOMEM : fill_from_ipa_entry(&reader, buffer, entry->size, &length);
+        
+        if (err == 0 && length > 0)
+        {
+            err = backend->file_ref_write(connection, stream.file_ref, buffer, (unsigned int)length);
+        }
+        
+        transferred = length;
+        free(buffer);
+    }
+    
+    backend->file_ref_close(connection, stream.file_ref);
+    close_ipa_reader(&reader);
+    
+    if (err != 0 || transferred != entry->size)
+    {
+        fail_ipa_stage(stage, "inflating or writing the file", remote_path);
+        return 0;
+    }
+    
+    add_ipa_stage_bytes(stage, entry->size);
+    trace_span("Upload", "transfer", remote_path, start);
+    
+    return 1;
+}
+
+static void *run_ipa_stage_worker(void *context)
+{
+    struct ipa_stage_worker *worker = context;
+    struct ipa_stage *stage = worker->stage;
+    
+    // progress lines and trace spans are labelled with the fan-out device
+    current_worker = stage->worker;
+    
+    while (true)
+    {
+        pthread_mutex_lock(&stage->lock);
+        
+        while (stage->next < stage->archive->count && stage->archive->entries[stage->next].is_directory)
+        {
+            stage->next++;
+        }
+        
+        size_t index = stage->next++;
+        int done = (index >= stage->archive->count || stage->failure != NULL);
+        pthread_mutex_unlock(&stage->lock);
+        
+        if (done)
+        {
+            break;
+        }
+        
+        struct ipa_entry *entry = &stage->archive->entries[index];
+        char *path = copy_ipa_bundle_path(stage->archive, entry);
+        
+        if (path != NULL)
+        {
+            char *remote_path = malloc(strlen(stage->staging_root) + strlen(path) + 2);
+            
+            sprintf(remote_path, "%s/%s", stage->staging_root, path);
+            stage_ipa_file(stage, worker->connection, entry, remote_path);
+            free(remote_path);
+        }
+        
+        free(path);
+    }
+    
+    return NULL;
+}
+
+// Creates staging_root and every directory the bundle's files live in. AFCDirectoryCreate
+// makes missing parents too, so each directory only costs a call when the entries move
+// on to another one.
+int create_ipa_directories(struct ipa_stage *stage, struct afc_connection *connection)
+{
+    char *previous = NULL;
+    size_t i;
+    int ok = (backend->directory_create(connection, stage->staging_root) == 0);
+    
+    for (i = 0; i < stage->archive->count && ok; i++)
+    {
+        struct ipa_entry *entry = &stage->archive->entries[i];
+        char *path = copy_ipa_bundle_path(stage->archive, entry);
+        char *slash = (path != NULL) ? strrchr(path, '/') : NULL;
+        
+        if (path != NULL && entry->is_link)
+        {
+            fail_ipa_stage(stage, "staging a symbolic link", path);
+            ok = 0;
+        }
+        else if (slash != NULL && slash != path)
+        {
+            *slash = '\0';
+            
+            if (previous == NULL || strcmp(previous, path) != 0)
+            {
+                char *remote_path = malloc(strlen(stage->staging_root) + strlen(path) + 2);
+                
+                sprintf(remote_path, "%s/%s", stage->staging_root, path);
+                ok = (backend->directory_create(connection, remote_path) == 0);
+                
+                if (!ok)
+                {
+                    fail_ipa_stage(stage, "AFCDirectoryCreate", remote_path);
+                }
+                
+                free(remote_path);
+                free(previous);
+                previous = path;
+                path = NULL;
+            }
+        }
+        
+        free(path);
+    }
+    
+    if (!ok && stage->failure == NULL)
+    {
+        fail_ipa_stage(stage, "AFCDirectoryCreate", stage->staging_root);
+    }
+    
+    free(previous);
+    return ok;
+}
+
+// Stages the app inside the archive at ipa_path over connections, which must be open
+// to the media directory. Returns NULL once it is staged, or what failed with the
+// device path it failed on in failed_path.
+const char *stage_ipa(struct afc_connection **connections, int connection_count, const char *ipa_path, struct install_progress *progress, char **failed_path)
+{
+    struct ipa_stage_worker workers[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    struct ipa_archive archive;
+    struct ipa_stage stage;
+    int i;
+    
+    *failed_path = NULL;
+    
+    if (!open_ipa(ipa_path, &archive))
+    {
+        return "reading the archive";
+    }
+    
+    memset(&stage, 0, sizeof(stage));
+    stage.archive = &archive;
+    stage.progress = (progress != NULL && progress->start > 0) ? progress : NULL;
+    stage.worker = current_worker;
+    stage.staging_root = malloc(strlen(STAGING_DIRECTORY) + strlen(archive.app_name) + 2);
+    sprintf(stage.staging_root, "%s/%s", STAGING_DIRECTORY, archive.app_name);
+    pthread_mutex_init(&stage.lock, NULL);
+    
+    // anything left from an earlier copy would be installed along with the new files
+    remove_remote_tree(connections[0], stage.staging_root);
+    
+    if (create_ipa_directories(&stage, connections[0]))
+    {
+        for (i = 0; i < connection_count; i++)
+        {
+            workers[i].stage = &stage;
+            workers[i].connection = connections[i];
+        }
+        
+        // the first connection stages on the calling thread
+        int started = 1;
+        
+        while (started < connection_count && pthread_create(&workers[started].thread, NULL, run_ipa_stage_worker, &workers[started]) == 0)
+        {
+            started++;
+        }
+        
+        run_ipa_stage_worker(&workers[0]);
+        
+        while (started > 1)
+        {
+            pthread_join(workers[--started].thread, NULL);
+        }
+    }
+    
+    pthread_mutex_destroy(&stage.lock);
+    free(stage.staging_root);
+    close_ipa(&archive);
+    
+    *failed_path = stage.failed_path;
+    return stage.failure;
+}
+
+// URL AMDeviceSecureInstallApplication is given for app_path. For an .ipa that is the
+// app inside it, since only the name is used to find the copy in PublicStaging.
+CFURLRef copy_app_url(const char *app_path)
+{
+    struct ipa_archive archive;
+    
+    if (!is_ipa_path(app_path))
+    {
+        return get_absolute_file_url(app_path);
+    }
+    
+    if (!open_ipa(app_path, &archive))
+    {
+        return NULL;
+    }
+    
+    CFURLRef url = get_absolute_file_url(archive.app_name);
+    close_ipa(&archive);
+    
+    return url;
+}
+
+// Stages the .ipa given with -p for install_app(), returns 0 or prints why it could not
+int stage_ipa_app(struct am_device *device, struct install_progress *progress)
+{
+    struct afc_connection *connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int connection_count = parallel_job_count();
+    char *failed_path;
+    
+    if (open_staging_connections(device, connections, connection_count) != 0)
+    {
+        return 1;
+    }
+    
+    const char *failure = stage_ipa(connections, connection_count, command.app_path, progress, &failed_path);
+    close_staging_connections(connections, connection_count);
+    
+    if (failure != NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to install app: %s failed%s%s\n", failure, (failed_path != NULL) ? " for " : "", (failed_path != NULL) ? failed_path : "");
+    }
+    
+    free(failed_path);
+    return (failure != NULL);
+}
+
+// Install If Changed
+//
+// install -if_changed looks up the installed copy of each app with
+// AMDeviceLookupApplications and skips the app when its CFBundleVersion and
+// CFBundleShortVersionString match the app's Info.plist. Builds made during
+// development often keep the same version, so -hash also requires the bundle
+// fingerprint, the root hash_app_bundle() computes, to match the one recorded the
+// last time appdeploy installed the app on that device. The records live in
+// ~/.appdeploy/installs/<udid>/<bundle_id>, and any install made without them
+// removes the record so it can never vouch for a build it did not install.
+
+// Installed apps keyed by bundle id, each with the keys of its Info.plist. NULL when
+// they could not be looked up.
+CFDictionaryRef copy_installed_apps(struct am_device *device)
+{
+    if (connect_to_device(device) != 0)
+    {
+        return NULL;
+    }
+    
+    CFStringRef attributes[] = { CFSTR("CFBundleIdentifier"), CFSTR("CFBundleVersion"), CFSTR("CFBundleShortVersionString") };
+    CFDictionaryRef options = create_lookup_options(CFSTR("Any"), attributes, 3);
+    CFDictionaryRef apps = NULL;
+    
+    if (backend->lookup_applications(device, options, &apps))
+    {
+        fprintf(command_stderr(), "Error attempting to check installed apps: AMDeviceLookupApplications failed\n");
+        apps = NULL;
+    }
+    
+    close_device_session(device);
+    CFRelease(options);
+    
+    return apps;
+}
+
+int same_plist_value(CFDictionaryRef info, CFDictionaryRef installed, CFStringRef key)
+{
+    CFTypeRef value = CFDictionaryGetValue(info, key);
+    CFTypeRef installed_value = CFDictionaryGetValue(installed, key);
+    
+    return value != NULL && installed_value != NULL && CFEqual(value, installed_value);
+}
+
+// Hex root hash of the bundle, NULL when it cannot be read. Like hash_app, an .ipa is
+// fingerprinted as the bundle it unpacks to, so the .app and .ipa of a build match.
+char *app_fingerprint(char *app_path)
+{
+    struct app_hash result;
+    size_t i;
+    
+    char *bundle_path = is_ipa_path(app_path) ? unpack_ipa(app_path) : trim_root(app_path);
+    int hashed = (bundle_path != NULL && hash_app_bundle(bundle_path, FastContentHash, &result));
+    
+    if (bundle_path != app_path)
+    {
+        free(bundle_path);
+    }
+    
+    if (!hashed)
+    {
+        return NULL;
+    }
+    
+    char *fingerprint = malloc(result.digest_length * 2 + 1);
+    
+    for (i = 0; fingerprint != NULL && i < result.digest_length; i++)
+    {
+        sprintf(fingerprint + i * 2, "%02x", result.root[i]);
+    }
+    
+    free_app_hash(&result);
+    
+    return fingerprint;
+}
+
+// Path of the install record for the app at app_path, NULL if it has no bundle id
+char *install_record_path(struct am_device *device, const char *app_path)
+{
+    CFStringRef bundle_id = read_plist_for_app_path(app_path);
+    char *bundle_id_cstr = (bundle_id != NULL) ? create_cstr_from_cfstring(bundle_id) : NULL;
+    char *udid = copy_device_udid(device);
+    char *path = NULL;
+    
+    if (bundle_id_cstr != NULL && udid != NULL)
+    {
+        path = state_file_path("installs", udid, bundle_id_cstr, "");
+    }
+    
+    if (bundle_id != NULL)
+    {
+        CFRelease(bundle_id);
+    }
+    
+    free(bundle_id_cstr);
+    free(udid);
+    
+    return path;
+}
+
+int install_record_matches(struct am_device *device, const char *app_path, const char *fingerprint)
+{
+    char *path = install_record_path(device, app_path);
+    FILE *file = (path != NULL) ? fopen(path, "r") : NULL;
+    char line[256];
+    int matches = 0;
+    
+    if (file != NULL)
+    {
+        matches = fgets(line, sizeof(line), file) != NULL && strncmp(line, fingerprint, strlen(fingerprint)) == 0 && line[strlen(fingerprint)] == '\n';
+        fclose(file);
+    }
+    
+    free(path);
+    
+    return matches;
+}
+
+// Called after the app at app_path was installed. Records fingerprint, or forgets
+// the previous record when there is none.
+void record_install(struct am_device *device, const char *app_path, const char *fingerprint)
+{
+    char *path = install_record_path(device, app_path);
+    
+    if (path == NULL)
+    {
+        return;
+    }
+    
+    FILE *file = (fingerprint != NULL) ? fopen(path, "w") : NULL;
+    
+    if (file != NULL)
+    {
+        fprintf(file, "%s\n", fingerprint);
+        fclose(file);
+    }
+    else
+    {
+        unlink(path);
+    }
+    
+    free(path);
+}
+
+// Returns 1 when the build at app_path is already on the device. With -hash the
+// fingerprint is returned for record_install() whichever way it goes.
+int app_is_current(struct am_device *device, CFDictionaryRef installed_apps, char *app_path, char **fingerprint)
+{
+    CFDictionaryRef info = copy_app_info(app_path);
+    int current = 0;
+    
+    *fingerprint = command.compare_hashes ? app_fingerprint(app_path) : NULL;
+    
+    if (info == NULL)
+    {
+        return 0;
+    }
+    
+    CFTypeRef bundle_id = CFDictionaryGetValue(info, CFSTR("CFBundleIdentifier"));
+    CFDictionaryRef installed = (bundle_id != NULL) ? CFDictionaryGetValue(installed_apps, bundle_id) : NULL;
+    
+    if (installed != NULL && same_plist_value(info, installed, CFSTR("CFBundleVersion")) && same_plist_value(info, installed, CFSTR("CFBundleShortVersionString")))
+    {
+        current = !command.compare_hashes || (*fingerprint != NULL && install_record_matches(device, app_path, *fingerprint));
+    }
+    
+    CFRelease(info);
+    
+    return current;
+}
+
+// Install Several Apps
+//
+// install -p a.app -p b.app ... copies and installs the apps in order within one
+// device session. A second thread copies the apps with AMDeviceSecureTransferPath
+// while install_apps() installs them with AMDeviceSecureInstallApplication, so app
+// N+1 is being copied while app N installs. The copy runs at most one app ahead, so
+// staging never holds more than two apps that are waiting to be installed.
+
+struct app_install
+{
+    char *app_path;
+    CFURLRef url;
+    char *fingerprint;
+};
+
+struct install_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct am_device *device;
+    struct device_worker *worker;
+    CFDictionaryRef options;
+    struct app_install apps[MAX_INSTALL_APPS];
+    struct afc_connection *staging_connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int staging_count;
+    int count;
+    int transferred;
+    int installing;
+    int stop;
+    const char *failure;
+    const char *failed_app;
+};
+
+void fail_install_pipeline(struct install_pipeline *pipeline, int app, const char *failure)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    
+    if (pipeline->failure == NULL)
+    {
+        pipeline->failure = failure;
+        pipeline->failed_app = pipeline->apps[app].app_path;
+    }
+    
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void *run_app_transfers(void *context)
+{
+    struct install_pipeline *pipeline = context;
+    struct install_progress progress;
+    void *callback = command.progress ? (void *)on_install_progress : NULL;
+    int i;
+    
+    // progress lines and trace spans are labelled with the fan-out device
+    current_worker = pipeline->worker;
+    
+    for (i = 0; i < pipeline->count; i++)
+    {
+        pthread_mutex_lock(&pipeline->lock);
+        
+        while (!pipeline->stop && i > pipeline->installing + 1)
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        
+        int stop = pipeline->stop;
+        pthread_mutex_unlock(&pipeline->lock);
+        
+        if (stop)
+        {
+            break;
+        }
+        
+        const char *failure = NULL;
+        char *failed_path = NULL;
+        
+        begin_install_progress(&progress, pipeline->apps[i].app_path);
+        
+        if (is_ipa_path(pipeline->apps[i].app_path))
+        {
+            failure = stage_ipa(pipeline->staging_connections, pipeline->staging_count, pipeline->apps[i].app_path, &progress, &failed_path);
+        }
+        else if (backend->secure_transfer_path(0, pipeline->device, pipeline->apps[i].url, pipeline->options, callback, ProgressTransfer))
+        {
+            failure = "AMDeviceSecureTransferPath";
+        }
+        
+        end_install_progress();
+        free(failed_path);
+        
+        if (failure != NULL)
+        {
+            fail_install_pipeline(pipeline, i, failure);
+            break;
+        }
+        
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->transferred = i + 1;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+    
+    return NULL;
+}
+
+int install_apps(struct am_device *device)
+{
+    struct install_pipeline pipeline;
+    struct install_progress progress;
+    void *callback = command.progress ? (void *)on_install_progress : NULL;
+    CFStringRef keys[] = { CFSTR("PackageType") }, values[] = { CFSTR("Developer") };
+    pthread_t thread;
+    int i, staging_count = 0, failed = 0;
+    
+    ASSERT_OR_RETURN(!command.delta_install, "Error attempting to install apps: -delta installs one app at a time\n");
+    
+    CFDictionaryRef installed_apps = command.if_changed ? copy_installed_apps(device) : NULL;
+    
+    if (command.if_changed && installed_apps == NULL)
+    {
+        return 1;
+    }
+    
+    memset(&pipeline, 0, sizeof(pipeline));
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    pipeline.device = device;
+    pipeline.worker = current_worker;
+    pipeline.options = CFDictionaryCreate(NULL, (const void **)&keys, (const void **)&values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    pipeline.installing = -1;
+    
+    for (i = 0; i < command.app_count; i++)
+    {
+        struct app_install *app = &pipeline.apps[pipeline.count];
+        
+        if (installed_apps != NULL && app_is_current(device, installed_apps, command.app_paths[i], &app->fingerprint))
+        {
+            fprintf(command_stdout(), "%s is already installed, skipping.\n", command.app_paths[i]);
+            free(app->fingerprint);
+            continue;
+        }
+        
+        app->app_path = command.app_paths[i];
+        app->url = copy_app_url(command.app_paths[i]);
+        
+        if (app->url == NULL)
+        {
+            fprintf(command_stderr(), "Error attempting to install apps: %s is not an .ipa with an app in Payload\n", app->app_path);
+            free(app->fingerprint);
+            failed = 1;
+            break;
+        }
+        
+        pipeline.count++;
+        
+        // .ipa files are staged over AFC, which needs connections opened before the session
+        if (is_ipa_path(app->app_path))
+        {
+            staging_count = parallel_job_count();
+        }
+    }
+    
+    if (installed_apps != NULL)
+    {
+        CFRelease(installed_apps);
+    }
+    
+    if (!failed && pipeline.count > 0)
+    {
+        invalidate_app_inventory(device);
+    }
+    
+    if (!failed && staging_count > 0)
+    {
+        failed = (open_staging_connections(device, pipeline.staging_connections, staging_count) != 0);
+        pipeline.staging_count = failed ? 0 : staging_count;
+    }
+    
+    int connected = !failed && connect_to_device(device) == 0;
+    int started = connected && pthread_create(&thread, NULL, run_app_transfers, &pipeline) == 0;
+    
+    if (connected && !started)
+    {
+        fprintf(command_stderr(), "Error attempting to install apps: unable to start the copy thread\n");
+    }
+    
+    for (i = 0; started && i < pipeline.count; i++)
+    {
+        pthread_mutex_lock(&pipeline.lock);
+        
+        while (pipeline.transferred <= i && !pipeline.stop)
+        {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        
+        int ready = (pipeline.transferred > i);
+        
+        if (ready)
+        {
+            pipeline.installing = i;
+            pthread_cond_broadcast(&pipeline.changed);
+        }
+        
+        pthread_mutex_unlock(&pipeline.lock);
+        
+        if (!ready)
+        {
+            break;
+        }
+        
+        begin_install_progress(&progress, pipeline.apps[i].app_path);
+        int err = backend->secure_install_application(0, device, pipeline.apps[i].url, pipeline.options, callback, ProgressInstall);
+        end_install_progress();
+        
+        if (err)
+        {
+            fail_install_pipeline(&pipeline, i, "AMDeviceSecureInstallApplication");
+            break;
+        }
+        
+        record_install(device, pipeline.apps[i].app_path, pipeline.apps[i].fingerprint);
+        fprintf(command_stdout(), "%s successfully installed.\n", pipeline.apps[i].app_path);
+    }
+    
+    // the copy thread uses this stack frame, so it has to finish before returning
+    if (started)
+    {
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.stop = 1;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+        pthread_join(thread, NULL);
+    }
+    
+    if (connected)
+    {
+        close_device_session(device);
+    }
+    
+    if (pipeline.staging_count > 0)
+    {
+        close_staging_connections(pipeline.staging_connections, pipeline.staging_count);
+    }
+    
+    for (i = 0; i < pipeline.count; i++)
+    {
+        CFRelease(pipeline.apps[i].url);
+        free(pipeline.apps[i].fingerprint);
+    }
+    
+    CFRelease(pipeline.options);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+    
+    ASSERT_OR_RETURN(pipeline.failure == NULL, "Error attempting to install %s: %s failed\n", pipeline.failed_app, pipeline.failure);
+    return !started;
+}
+
+// Installs the app given with -p, or hands several over to install_apps()
+int install_app(struct am_device *device)
+{
+    struct install_progress progress;
+    void *callback = command.progress ? (void *)on_install_progress : NULL;
+    
+    char *fingerprint = NULL;
+    
+    if (command.app_count > 1)
+    {
+        return install_apps(device);
+    }
+    
+    if (command.if_changed)
+    {
+        CFDictionaryRef installed_apps = copy_installed_apps(device);
+        
+        if (installed_apps == NULL)
+        {
+            return 1;
+        }
+        
+        int current = app_is_current(device, installed_apps, command.app_path, &fingerprint);
+        
+        CFRelease(installed_apps);
+        
+        if (current)
+        {
+            fprintf(command_stdout(), "%s is already installed, skipping.\n", command.app_path);
+            free(fingerprint);
+            return 0;
+        }
+    }
+    
+    char *bundle_path = command.app_path;
+    
+    // -delta compares files, so an .ipa is installed from its unpacked bundle
+    if (command.delta_install && is_ipa_path(command.app_path))
+    {
+        bundle_path = unpack_ipa(command.app_path);
+        
+        if (bundle_path == NULL)
+        {
+            fprintf(command_stderr(), "Error attempting to install app: unable to unpack %s\n", command.app_path);
+            free(fingerprint);
+            return 1;
+        }
+    }
+    
+    CFURLRef local_app_url = copy_app_url(bundle_path);
+    
+    if (local_app_url == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to install app: %s is not an .ipa with an app in Payload\n", command.app_path);
+        free(fingerprint);
+        
+        if (bundle_path != command.app_path)
+        {
+            free(bundle_path);
+        }
+        
+        return 1;
+    }
+    
+    invalidate_app_inventory(device);
+    
+    int staged = command.delta_install && stage_app_delta(device, bundle_path, 1);
+    int failed = 0;
+    
+    begin_install_progress(&progress, bundle_path);
+    
+    if (is_ipa_path(bundle_path))
+    {
+        failed = stage_ipa_app(device, &progress);
+        staged = 1;
+    }
+    
+    CFStringRef keys[] = { CFSTR("PackageType") }, values[] = { CFSTR("Developer") };
+    CFDictionaryRef options = CFDictionaryCreate(NULL, (const void **)&keys, (const void **)&values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    int connected = !failed && connect_to_device(device) == 0;
+    
+    if (connected && !staged)
+    {
+        // copy .app to device
+        if (backend->secure_transfer_path(0, device, local_app_url, options, callback, ProgressTransfer))
+        {
+            fprintf(command_stderr(), "Error attempting to install app: AMDeviceSecureTransferPath failed\n");
+            failed = 1;
+        }
+        else if (command.delta_install)
+        {
+            // record the full copy so the next install can send only what changed
+            close_device_session(device);
+            stage_app_delta(device, bundle_path, 0);
+            connected = (connect_to_device(device) == 0);
+        }
+    }
+    
+    // install package on device
+    if (connected && !failed && backend->secure_install_application(0, device, local_app_url, options, callback, ProgressInstall))
+    {
+        fprintf(command_stderr(), "Error attempting to install app: AMDeviceSecureInstallApplication failed\n");
+        failed = 1;
+    }
+    
+    end_install_progress();
+    
+    if (connected)
+    {
+        close_device_session(device);
+    }
+    
+    int installed = (connected && !failed);
+    
+    if (installed)
+    {
+        record_install(device, command.app_path, fingerprint);
+        fprintf(command_stdout(), "%s successfully installed.\n", command.app_path);
+    }
+    
+    CFRelease(options);
+    CFRelease(local_app_url);
+    free(fingerprint);
+    
+    if (bundle_path != command.app_path)
+    {
+        free(bundle_path);
+    }
+    
+    return !installed;
+}
+
+// Batch
+//
+// appdeploy batch runs a script of sandbox operations over pooled house arrest
+// connections in one process. Each line is either
+//
+//     upload <local_path> <device_path>
+//     download <device_path> <local_path>
+//     remove <device_path>
+//     list [<device_path>]
+//     mkdir <device_path>
+//     rename <device_path> <new_device_path>
+//
+// with double quotes around paths that contain spaces, or a JSON object such as
+// {"op": "upload", "src": "a.db", "dst": "/Documents/a.db"} ("path" may be used
+// for single path operations). Up to -j operations run at once on separate
+// connections; an operation waits while an earlier unfinished one touches the
+// same device path, a parent of it, or the same local file.
+
+enum BatchOperationType
+{
+    BatchUpload,
+    BatchDownload,
+    BatchRemove,
+    BatchList,
+    BatchMakeDirectory,
+    BatchRename
+};
+
+enum BatchOperationState
+{
+    BatchPending,
+    BatchRunning,
+    BatchDone
+};
+
+struct batch_operation
+{
+    enum BatchOperationType type;
+    char *source;
+    char *destination;
+    int line;
+    enum BatchOperationState state;
+    int status;
+    double seconds;
+    const char *failure;
+    struct transfer_stats stats;
+};
+
+// Operations before next_pending are running or done, those before first_unfinished
+// are done, so scheduling only looks at the operations still in flight
+struct batch_run
+{
+    struct batch_operation *operations;
+    int count;
+    int next_pending;
+    int first_unfinished;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_mutex_t output_lock;
+};
+
+struct batch_worker
+{
+    struct batch_run *run;
+    struct afc_connection *connection;
+    pthread_t thread;
+};
+
+static const char *batch_operation_names[] = { "upload", "download", "remove", "list", "mkdir", "rename" };
+
+// Reads the next whitespace separated token, honouring double quotes and backslash escapes
+char *next_batch_token(char **position)
+{
+    char *read = *position, *write, *token;
+    
+    while (*read == ' ' || *read == '\t')
+    {
+        read++;
+    }
+    
+    if (*read == '\0' || *read == '#')
+    {
+        return NULL;
+    }
+    
+    token = write = read;
+    int quoted = 0;
+    
+    while (*read != '\0' && (quoted || (*read != ' ' && *read != '\t')))
+    {
+        if (*read == '"')
+        {
+            quoted = !quoted;
+            read++;
+        }
+        else if (*read == '\\' && read[1] != '\0')
+        {
+            *write++ = read[1];
+            read += 2;
+        }
+        else
+        {
+            *write++ = *read++;
+        }
+    }
+    
+    if (*read != '\0')
+    {
+        read++;
+    }
+    
+    *write = '\0';
+    *position = read;
+    return token;
+}
+
+// Decodes a JSON string in place, position points at the opening quote
+char *next_json_string(char **position)
+{
+    char *read = *position, *write, *value;
+    
+    if (*read != '"')
+    {
+        return NULL;
+    }
+    
+    value = write = ++read;
+    
+    while (*read != '"')
+    {
+        if (*read == '\0')
+        {
+            return NULL;
+        }
+        
+        if (*read != '\\')
+        {
+            *write++ = *read++;
+            continue;
+        }
+        
+        switch (read[1])
+        {
+            case 'n': *write++ = '\n'; break;
+            case 't': *write++ = '\t'; break;
+            case 'r': *write++ = '\r'; break;
+            case 'b': *write++ = '\b'; break;
+            case 'f': *write++ = '\f'; break;
+            case 'u':
+            {
+                unsigned int code = 0;
+                
+                if (sscanf(read + 2, "%4x", &code) != 1 || code > 0x7f)
+                {
+                    return NULL;
+                }
+                
+                *write++ = (char)code;
+                read += 4;
+                break;
+            }
+            case '\0': return NULL;
+            default: *write++ = read[1]; break;
+        }
+        
+        read += 2;
+    }
+    
+    *write = '\0';
+    *position = read + 1;
+    return value;
+}
+
+// Parses a flat JSON object of string values into op, src/path and dst
+int parse_batch_json(char *line, char **op, char **source, char **destination)
+{
+    char *position = line + 1;
+    
+    while (true)
+    {
+        while (*position == ' ' || *position == '\t' || *position == ',')
+        {
+            position++;
+        }
+        
+        if (*position == '}')
+        {
+            return *op != NULL;
+        }
+        
+        char *key = next_json_string(&position);
+        
+        while (*position == ' ' || *position == '\t')
+        {
+            position++;
+        }
+        
+        if (key == NULL || *position++ != ':')
+        {
+            return 0;
+        }
+        
+        while (*position == ' ' || *position == '\t')
+        {
+            position++;
+        }
+        
+        char *value = next_json_string(&position);
+        
+        if (value == NULL)
+        {
+            return 0;
+        }
+        
+        if (strcmp(key, "op") == 0)
+        {
+            *op = value;
+        }
+        else if (strcmp(key, "src") == 0 || strcmp(key, "path") == 0)
+        {
+            *source = value;
+        }
+        else if (strcmp(key, "dst") == 0)
+        {
+            *destination = value;
+        }
+    }
+}
+
+int parse_batch_line(char *line, int line_number, struct batch_operation *operation)
+{
+    char *op = NULL, *source = NULL, *destination = NULL;
+    
+    while (*line == ' ' || *line == '\t')
+    {
+        line++;
+    }
+    
+    if (*line == '{')
+    {
+        if (!parse_batch_json(line, &op, &source, &destination))
+        {
+            fprintf(command_stderr(), "Error in batch line %d: invalid JSON operation\n", line_number);
+            return -1;
+        }
+    }
+    else
+    {
+        op = next_batch_token(&line);
+        
+        if (op == NULL)
+        {
+            return 0;
+        }
+        
+        source = next_batch_token(&line);
+        destination = next_batch_token(&line);
+    }
+    
+    int type;
+    
+    for (type = 0; type <= BatchRename; type++)
+    {
+        if (strcmp(op, batch_operation_names[type]) == 0)
+        {
+            break;
+        }
+    }
+    
+    int needs_destination = (type == BatchUpload || type == BatchDownload || type == BatchRename);
+    
+    if (type > BatchRename || (source == NULL && type != BatchList) || (needs_destination && destination == NULL))
+    {
+        fprintf(command_stderr(), "Error in batch line %d: expected upload, download, remove, list, mkdir or rename with its paths\n", line_number);
+        return -1;
+    }
+    
+    memset(operation, 0, sizeof(*operation));
+    operation->type = type;
+    operation->source = strdup((source != NULL) ? source : "/Documents");
+    operation->destination = needs_destination ? strdup(destination) : NULL;
+    operation->line = line_number;
+    operation->status = 1;
+    
+    return 1;
+}
+
+// Returns 1 when one path is the other or one of its parent directories
+int paths_overlap(const char *a, const char *b)
+{
+    size_t a_length = strlen(a), b_length = strlen(b);
+    
+    while (a_length > 1 && a[a_length - 1] == '/')
+    {
+        a_length--;
+    }
+    
+    while (b_length > 1 && b[b_length - 1] == '/')
+    {
+        b_length--;
+    }
+    
+    size_t shorter = (a_length < b_length) ? a_length : b_length;
+    
+    if (strncmp(a, b, shorter) != 0)
+    {
+        return 0;
+    }
+    
+    if (a_length == b_length)
+    {
+        return 1;
+    }
+    
+    const char *longer = (a_length > b_length) ? a : b;
+    return longer[shorter] == '/' || (shorter == 1 && longer[0] == '/');
+}
+
+void batch_operation_paths(struct batch_operation *operation, const char **remote, const char **local)
+{
+    remote[0] = remote[1] = NULL;
+    *local = NULL;
+    
+    switch (operation->type)
+    {
+        case BatchUpload:
+            *local = operation->source;
+            remote[0] = operation->destination;
+            break;
+            
+        case BatchDownload:
+            remote[0] = operation->source;
+            *local = operation->destination;
+            break;
+            
+        case BatchRename:
+            remote[0] = operation->source;
+            remote[1] = operation->destination;
+            break;
+            
+        default:
+            remote[0] = operation->source;
+            break;
+    }
+}
+
+int batch_operations_conflict(struct batch_operation *a, struct batch_operation *b)
+{
+    const char *a_remote[2], *b_remote[2], *a_local, *b_local;
+    int i, j;
+    
+    batch_operation_paths(a, a_remote, &a_local);
+    batch_operation_paths(b, b_remote, &b_local);
+    
+    if (a_local != NULL && b_local != NULL && strcmp(a_local, b_local) == 0)
+    {
+        return 1;
+    }
+    
+    for (i = 0; i < 2; i++)
+    {
+        for (j = 0; j < 2; j++)
+        {
+            if (a_remote[i] != NULL && b_remote[j] != NULL && paths_overlap(a_remote[i], b_remote[j]))
+            {
+                return 1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+void run_batch_operation(struct batch_run *run, struct afc_connection *connection, struct batch_operation *operation)
+{
+    double start = current_time();
+    int err = 0;
+    
+    switch (operation->type)
+    {
+        case BatchUpload:
+            err = upload_path(connection, operation->source, operation->destination, NULL, TRANSFER_CHUNK_SIZE, &operation->stats);
+            operation->failure = operation->stats.failure;
+            break;
+            
+        case BatchDownload:
+            err = download_path(connection, operation->source, operation->destination, NULL, TRANSFER_CHUNK_SIZE, &operation->stats);
+            operation->failure = operation->stats.failure;
+            break;
+            
+        case BatchRemove:
+            err = backend->remove_path(connection, operation->source);
+            operation->failure = "AFCRemovePath";
+            break;
+            
+        case BatchList:
+        {
+            struct sandbox_walk walk;
+            struct remote_file_info info;
+            
+            // the walk takes a path it cannot open for a file, so check that it exists first
+            err = read_remote_file_info(connection, operation->source, &info);
+            operation->failure = "AFCFileInfoOpen";
+            
+            if (err != 0)
+            {
+                break;
+            }
+            
+            walk_sandbox(&connection, 1, operation->source, 0, NULL, &walk);
+            
+            if (walk.failed)
+            {
+                err = -1;
+                operation->failure = "malloc";
+                free_sandbox_walk(&walk);
+                break;
+            }
+            
+            // listings are printed whole rather than interleaved with other output
+            pthread_mutex_lock(&run->output_lock);
+            print_sandbox_walk(&walk);
+            pthread_mutex_unlock(&run->output_lock);
+            
+            free_sandbox_walk(&walk);
+            break;
+        }
+            
+        case BatchMakeDirectory:
+            err = backend->directory_create(connection, operation->source);
+            operation->failure = "AFCDirectoryCreate";
+            break;
+            
+        case BatchRename:
+            err = backend->rename_path(connection, operation->source, operation->destination);
+            operation->failure = "AFCRenamePath";
+            break;
+    }
+    
+    operation->status = (err != 0);
+    operation->seconds = current_time() - start;
+}
+
+// Takes the first pending operation that does not conflict with an earlier unfinished one
+static void *run_batch_worker(void *context)
+{
+    struct batch_worker *worker = context;
+    struct batch_run *run = worker->run;
+    
+    pthread_mutex_lock(&run->lock);
+    
+    while (true)
+    {
+        struct batch_operation *next = NULL;
+        int i, j;
+        
+        if (run->next_pending == run->count)
+        {
+            break;
+        }
+        
+        for (i = run->next_pending; i < run->count && next == NULL; i++)
+        {
+            if (run->operations[i].state != BatchPending)
+            {
+                continue;
+            }
+            
+            next = &run->operations[i];
+            
+            for (j = run->first_unfinished; j < i; j++)
+            {
+                if (run->operations[j].state != BatchDone && batch_operations_conflict(&run->operations[i], &run->operations[j]))
+                {
+                    next = NULL;
+                    break;
+                }
+            }
+        }
+        
+        if (next == NULL)
+        {
+            pthread_cond_wait(&run->changed, &run->lock);
+            continue;
+        }
+        
+        next->state = BatchRunning;
+        
+        while (run->next_pending < run->count && run->operations[run->next_pending].state != BatchPending)
+        {
+            run->next_pending++;
+        }
+        
+        pthread_mutex_unlock(&run->lock);
+        
+        run_batch_operation(run, worker->connection, next);
+        
+        pthread_mutex_lock(&run->lock);
+        next->state = BatchDone;
+        
+        while (run->first_unfinished < run->count && run->operations[run->first_unfinished].state == BatchDone)
+        {
+            run->first_unfinished++;
+        }
+        
+        pthread_cond_broadcast(&run->changed);
+    }
+    
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+void free_batch_operations(struct batch_run *run)
+{
+    int i;
+    
+    for (i = 0; i < run->count; i++)
+    {
+        free(run->operations[i].source);
+        free(run->operations[i].destination);
+    }
+    
+    free(run->operations);
+    run->operations = NULL;
+    run->count = 0;
+}
+
+int read_batch_file(const char *path, struct batch_run *run)
+{
+    FILE *file = (strcmp(path, "-") == 0) ? command_stdin() : fopen(path, "r");
+    
+    if (file == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to run batch: unable to open %s\n", path);
+        return 0;
+    }
+    
+    char *line = NULL;
+    size_t line_capacity = 0, capacity = 0;
+    ssize_t length;
+    int line_number = 0, ok = 1;
+    
+    while (ok && (length = getline(&line, &line_capacity, file)) >= 0)
+    {
+        line_number++;
+        
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        {
+            line[--length] = '\0';
+        }
+        
+        if (run->count == capacity)
+        {
+            size_t grown = (capacity == 0) ? 64 : capacity * 2;
+            struct batch_operation *operations = realloc(run->operations, grown * sizeof(struct batch_operation));
+            
+            if (operations == NULL)
+            {
+                fprintf(command_stderr(), "Error attempting to run batch: out of memory at line %d\n", line_number);
+                ok = 0;
+                break;
+            }
+            
+            run->operations = operations;
+            capacity = grown;
+        }
+        
+        int parsed = parse_batch_line(line, line_number, &run->operations[run->count]);
+        
+        if (parsed < 0)
+        {
+            ok = 0;
+        }
+        else if (parsed > 0)
+        {
+            run->count++;
+        }
+    }
+    
+    free(line);
+    
+    if (file != command_stdin())
+    {
+        fclose(file);
+    }
+    
+    // a partly read batch never runs, so drop the lines parsed before the failure
+    if (!ok)
+    {
+        free_batch_operations(run);
+    }
+    
+    return ok;
+}
+
+int run_batch(struct am_device *device)
+{
+    struct batch_run run;
+    memset(&run, 0, sizeof(run));
+    
+    ASSERT_OR_RETURN(read_batch_file(command.batch_path, &run), "Error attempting to run batch: invalid batch file\n");
+    
+    double start = current_time();
+    int jobs = parallel_job_count();
+    int i, failed = 0;
+    
+    if (jobs > run.count)
+    {
+        jobs = (run.count > 0) ? run.count : 1;
+    }
+    
+    // connections are opened here so a failed handshake is reported like any other command
+    struct batch_worker workers[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    struct afc_connection *connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    
+    if (acquire_file_connections(device, connections, jobs) != 0)
+    {
+        free_batch_operations(&run);
+        return 1;
+    }
+    
+    for (i = 0; i < jobs; i++)
+    {
+        workers[i].run = &run;
+        workers[i].connection = connections[i];
+    }
+    
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.changed, NULL);
+    pthread_mutex_init(&run.output_lock, NULL);
+    
+    // the first worker runs on the calling thread, so the batch finishes even when no
+    // other thread can be started
+    int started = 1;
+    
+    while (started < jobs && pthread_create(&workers[started].thread, NULL, run_batch_worker, &workers[started]) == 0)
+    {
+        started++;
+    }
+    
+    run_batch_worker(&workers[0]);
+    
+    for (i = 0; i < jobs; i++)
+    {
+        if (i > 0 && i < started)
+        {
+            pthread_join(workers[i].thread, NULL);
+        }
+        
+        release_file_connection(workers[i].connection, 1);
+    }
+    
+    for (i = 0; i < run.count; i++)
+    {
+        struct batch_operation *operation = &run.operations[i];
+        
+        fprintf(command_stdout(), "%-6s %8.3f s  %s %s%s%s", (operation->status == 0) ? "ok" : "failed", operation->seconds, batch_operation_names[operation->type], operation->source, (operation->destination != NULL) ? " -> " : "", (operation->destination != NULL) ? operation->destination : "");
+        
+        if (operation->status != 0)
+        {
+            failed++;
+            fprintf(command_stdout(), " (line %d: %s failed)", operation->line, operation->failure);
+        }
+        
+        fprintf(command_stdout(), "\n");
+        free(operation->source);
+        free(operation->destination);
+    }
+    
+    fprintf(command_stdout(), "%d operations, %d succeeded, %d failed in %.3f s\n", run.count, run.count - failed, failed, current_time() - start);
+    
+    pthread_mutex_destroy(&run.output_lock);
+    pthread_cond_destroy(&run.changed);
+    pthread_mutex_destroy(&run.lock);
+    free(run.operations);
+    
+    return (failed > 0);
+}
+
+// Syslog
+//
+// syslog starts com.apple.syslog_relay on the device and streams its log to stdout,
+// or appends it to -dest. The relay sends lines of text with a NUL between messages.
+// They are read into one fixed SYSLOG_BUFFER_SIZE buffer, where memchr, which libc
+// vectorizes, finds the line ends. Complete lines are filtered and written straight
+// from the buffer, and only the partial line at the end is moved to the front before
+// the next read, so memory use is fixed and a line is never copied on its way through.
+// A line longer than the buffer is passed on in pieces. -process and -level pick
+// messages by the process name and the <Level> in their header, and lines that do not
+// start with a header continue the message before them. -match is a regular expression
+// every line shown must contain. Output is flushed after every read, so lines show up
+// as soon as the device sends them.
+
+#define SYSLOG_BUFFER_SIZE (1024 * 1024)
+
+enum SyslogLevel
+{
+    SyslogDebug,
+    SyslogInfo,
+    SyslogNotice,
+    SyslogWarning,
+    SyslogError,
+    SyslogFault
+};
+
+static const char *syslog_level_names[] = { "debug", "info", "notice", "warning", "error", "fault" };
+
+struct syslog_filter
+{
+    regex_t match;
+    int has_match;
+    int keep;
+    uint64_t lines;
+    uint64_t shown;
+};
+
+// SyslogLevel for a name such as Notice or error, -1 when it is not one
+int parse_syslog_level(const char *name, size_t length)
+{
+    int i;
+    
+    for (i = 0; i <= SyslogFault; i++)
+    {
+        if (strlen(syslog_level_names[i]) == length && strncasecmp(name, syslog_level_names[i], length) == 0)
+        {
+            return i;
+        }
+    }
+    
+    if ((length == 7 && strncasecmp(name, "Default", 7) == 0))
+    {
+        return SyslogNotice;
+    }
+    
+    if ((length == 8 && strncasecmp(name, "Critical", 8) == 0) || (length == 5 && strncasecmp(name, "Alert", 5) == 0) ||
+        (length == 9 && strncasecmp(name, "Emergency", 9) == 0))
+    {
+        return SyslogFault;
+    }
+    
+    return -1;
+}
+
+// Finds the process name and level of a header such as
+// "Oct 18 09:41:07 iPhone SpringBoard(FrontBoard)[58] <Notice>: ...", returns 0 for a
+// line that does not start like one
+static int parse_syslog_header(const char *line, size_t length, const char **process, size_t *process_length, int *level)
+{
+    const char *position = line, *end = line + length, *fields[4];
+    int i;
+    
+    // month, day, time and device name, a single digit day is padded with a second space
+    for (i = 0; i < 4; i++)
+    {
+        const char *space = memchr(position, ' ', end - position);
+        
+        if (space == NULL || space == position)
+        {
+            return 0;
+        }
+        
+        fields[i] = position;
+        position = space + 1;
+        
+        while (position < end && *position == ' ')
+        {
+            position++;
+        }
+    }
+    
+    if (end - fields[2] < 8 || fields[2][2] != ':' || fields[2][5] != ':')
+    {
+        return 0;
+    }
+    
+    const char *space = memchr(position, ' ', end - position);
+    const char *bracket = memchr(position, '[', end - position);
+    
+    if (space == NULL || bracket == NULL || bracket > space)
+    {
+        return 0;
+    }
+    
+    const char *paren = memchr(position, '(', bracket - position);
+    const char *close = (space + 1 < end && space[1] == '<') ? memchr(space + 2, '>', end - space - 2) : NULL;
+    
+    *process = position;
+    *process_length = ((paren != NULL) ? paren : bracket) - position;
+    *level = (close != NULL) ? parse_syslog_level(space + 2, close - space - 2) : -1;
+    *level = (*level < 0) ? SyslogNotice : *level;
+    
+    return 1;
+}
+
+// Decides whether line, NUL terminated at length, is shown
+static int keep_syslog_line(struct syslog_filter *filter, const char *line, size_t length)
+{
+    const char *process;
+    size_t process_length;
+    int level, i;
+    
+    if (parse_syslog_header(line, length, &process, &process_length, &level))
+    {
+        filter->keep = (level >= command.syslog_level);
+        
+        for (i = 0; filter->keep && i < command.syslog_process_count; i++)
+        {
+            const char *name = command.syslog_processes[i];
+            
+            if (strlen(name) == process_length && strncmp(name, process, process_length) == 0)
+            {
+                break;
+            }
+        }
+        
+        filter->keep = filter->keep && (command.syslog_process_count == 0 || i < command.syslog_process_count);
+    }
+    
+    return filter->keep && (!filter->has_match || regexec(&filter->match, line, 0, NULL, 0) == 0);
+}
+
+// Writes the lines in buffer that pass the filters and returns the bytes used up. A
+// partial line at the end is left for the next read unless flush_partial is set. The
+// byte after buffer + length must be writable.
+static size_t write_syslog_lines(struct syslog_filter *filter, char *buffer, size_t length, int flush_partial, FILE *output)
+{
+    size_t start = 0;
+    
+    flockfile(output);
+    
+    while (start < length)
+    {
+        // the relay puts a NUL between messages
+        if (buffer[start] == '\0')
+        {
+            start++;
+            continue;
+        }
+        
+        char *newline = memchr(buffer + start, '\n', length - start);
+        
+        if (newline == NULL && !flush_partial)
+        {
+            break;
+        }
+        
+        size_t line_length = ((newline != NULL) ? (size_t)(newline - buffer) : length) - start;
+        char *line = buffer + start;
+        char saved = line[line_length];
+        
+        line[line_length] = '\0';
+        filter->lines++;
+        
+        if (keep_syslog_line(filter, line, line_length))
+        {
+            if (output == command_stdout() && current_worker != NULL && fanout.enabled)
+            {
+                fprintf(output, "%s ", current_worker->udid);
+            }
+            
+            fwrite(line, 1, line_length, output);
+            fputc('\n', output);
+            filter->shown++;
+        }
+        
+        line[line_length] = saved;
+        start += line_length + (newline != NULL);
+    }
+    
+    funlockfile(output);
+    return start;
+}
+
+// Streams the device log until the device closes the relay or the output goes away
+// Starts the syslog relay, returns its socket or -1 after saying why it could not
+static int open_syslog_relay(struct am_device *device)
+{
+    int socket_fd;
+    
+    if (connect_to_device(device) != 0)
+    {
+        return -1;
+    }
+    
+    int err = backend->start_service(device, AMSVC_SYSLOG_RELAY, &socket_fd);
+    close_device_session(device);
+    
+    if (err != 0)
+    {
+        fprintf(command_stderr(), "Error attempting to read syslog: AMDeviceStartService failed\n");
+        return -1;
+    }
+    
+    return socket_fd;
+}
+
+int stream_syslog(struct am_device *device)
+{
+    struct syslog_filter filter;
+    
+    memset(&filter, 0, sizeof(filter));
+    filter.keep = 1;
+    
+    if (command.syslog_match != NULL)
+    {
+        ASSERT_OR_RETURN(regcomp(&filter.match, command.syslog_match, REG_EXTENDED | REG_NOSUB) == 0, "Error: %s is not a valid regular expression\n", command.syslog_match);
+        filter.has_match = 1;
+    }
+    
+    char destination_buffer[PATH_MAX];
+    char *destination_path = (command.destination_path != NULL) ? local_destination_path(destination_buffer, sizeof(destination_buffer)) : NULL;
+    FILE *output = (destination_path != NULL) ? fopen(destination_path, "ab") : command_stdout();
+    char *buffer = malloc(SYSLOG_BUFFER_SIZE + 1);
+    int socket_fd = (output != NULL && buffer != NULL) ? open_syslog_relay(device) : -1;
+    size_t used = 0;
+    
+    if (output == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to read syslog: unable to write %s\n", destination_path);
+    }
+    else if (buffer == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to read syslog: out of memory\n");
+    }
+    
+    while (socket_fd >= 0)
+    {
+        ssize_t read_length = read(socket_fd, buffer + used, SYSLOG_BUFFER_SIZE - used);
+        
+        if (read_length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        
+        if (read_length <= 0)
+        {
+            break;
+        }
+        
+        used += (size_t)read_length;
+        
+        size_t consumed = write_syslog_lines(&filter, buffer, used, 0, output);
+        
+        // a line that fills the whole buffer is passed on as it is
+        if (consumed == 0 && used == SYSLOG_BUFFER_SIZE)
+        {
+            consumed = write_syslog_lines(&filter, buffer, used, 1, output);
+        }
+        
+        memmove(buffer, buffer + consumed, used - consumed);
+        used -= consumed;
+        
+        if (fflush(output) != 0)
+        {
+            break;
+        }
+    }
+    
+    if (socket_fd >= 0)
+    {
+        write_syslog_lines(&filter, buffer, used, 1, output);
+        fflush(output);
+        close(socket_fd);
+    }
+    
+    free(buffer);
+    
+    if (filter.has_match)
+    {
+        regfree(&filter.match);
+    }
+    
+    if (destination_path != NULL && output != NULL)
+    {
+        fclose(output);
+    }
+    
+    if (socket_fd >= 0 && command.print_paths)
+    {
+        fprintf(command_stderr(), "%llu lines, %llu shown\n", (unsigned long long)filter.lines, (unsigned long long)filter.shown);
+    }
+    
+    return (socket_fd < 0);
+}
+
+// Bench
+//
+// bench measures a device, or a -sim stand-in, through the same code the commands
+// use: the connect_to_device() and open_file_service() handshakes, uploads and
+// downloads across a sweep of chunk and file sizes, small file uploads and downloads,
+// and the list_files walk over those small files. Each measurement is repeated
+// -iterations times, 5 by default, and reported as the p50/p95/p99 time of one
+// operation with a rate derived from the median. The connections are opened before
+// anything is timed. The test data is written to /tmp/appdeploy-bench in the app's
+// sandbox and to a /tmp/appdeploy-bench-XXXXXX directory locally, and both are
+// removed afterwards, also when a step fails. Each step returns 0, after saying why,
+// when it fails.
+
+#define BENCH_REMOTE_DIRECTORY "/tmp/appdeploy-bench"
+#define BENCH_DEFAULT_ITERATIONS 5
+#define BENCH_SMALL_FILE_COUNT 100
+#define BENCH_SMALL_FILE_SIZE (4 * 1024)
+#define MAX_BENCH_RESULTS 64
+
+static const size_t bench_chunk_sizes[] = { 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+static const uint64_t bench_file_sizes[] = { 1024 * 1024, 8 * 1024 * 1024, 32 * 1024 * 1024 };
+
+struct bench_result
+{
+    const char *name;
+    uint64_t file_size;
+    size_t chunk_size;
+    double p50;
+    double p95;
+    double p99;
+    double rate;
+    const char *unit;
+};
+
+struct bench_run
+{
+    struct bench_result results[MAX_BENCH_RESULTS];
+    int count;
+    int iterations;
+    double *samples;
+    char local_root[64];
+};
+
+static int compare_samples(const void *a, const void *b)
+{
+    double left = *(const double *)a, right = *(const double *)b;
+    
+    return (left > right) - (left < right);
+}
+
+// Nearest-rank percentile of sorted samples
+double sample_percentile(const double *samples, int count, int percent)
+{
+    int rank = (percent * count + 99) / 100;
+    
+    return samples[(rank > 0) ? rank - 1 : 0];
+}
+
+// Records a measurement from the time each operation took. amount is what one
+// operation moves, in unit, and the rate is amount over the median.
+void add_bench_result(struct bench_run *run, const char *name, uint64_t file_size, size_t chunk_size, int count, double amount, const char *unit)
+{
+    if (run->count == MAX_BENCH_RESULTS || count == 0)
+    {
+        return;
+    }
+    
+    struct bench_result *result = &run->results[run->count++];
+    
+    qsort(run->samples, count, sizeof(double), compare_samples);
+    result->name = name;
+    result->file_size = file_size;
+    result->chunk_size = chunk_size;
+    result->p50 = sample_percentile(run->samples, count, 50);
+    result->p95 = sample_percentile(run->samples, count, 95);
+    result->p99 = sample_percentile(run->samples, count, 99);
+    result->rate = (result->p50 > 0) ? amount / result->p50 : 0;
+    result->unit = unit;
+}
+
+// Writes size bytes of incompressible data
+int write_bench_file(const char *path, uint64_t size)
+{
+    FILE *file = fopen(path, "wb");
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+    uint64_t block[8192];
+    int ok = (file != NULL);
+    
+    while (ok && size > 0)
+    {
+        size_t i, length = (size < sizeof(block)) ? (size_t)size : sizeof(block);
+        
+        for (i = 0; i < sizeof(block) / sizeof(block[0]); i++)
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            block[i] = state;
+        }
+        
+        ok = (fwrite(block, 1, length, file) == length);
+        size -= length;
+    }
+    
+    if (file != NULL && fclose(file) != 0)
+    {
+        ok = 0;
+    }
+    
+    return ok;
+}
+
+int bench_handshakes(struct am_device *device, struct bench_run *run)
+{
+    int i;
+    
+    for (i = 0; i < run->iterations; i++)
+    {
+        double start = current_time();
+        
+        if (connect_to_device(device) != 0)
+        {
+            return 0;
+        }
+        
+        run->samples[i] = current_time() - start;
+        
+        backend->stop_session(device);
+        backend->disconnect(device);
+    }
+    
+    add_bench_result(run, "connect_to_device", 0, 0, run->iterations, 1, "calls/s");
+    
+    for (i = 0; i < run->iterations; i++)
+    {
+        struct afc_connection *connection;
+        service_conn_t service_connection;
+        double start = current_time();
+        
+        if (open_file_service(device, &service_connection) != 0)
+        {
+            return 0;
+        }
+        
+        if (backend->connection_open(service_connection, 0, &connection) != 0)
+        {
+            fprintf(command_stderr(), "Error attempting to bench: AFCConnectionOpen failed\n");
+            return 0;
+        }
+        
+        run->samples[i] = current_time() - start;
+        backend->connection_close(connection);
+    }
+    
+    add_bench_result(run, "start_file_service", 0, 0, run->iterations, 1, "calls/s");
+    return 1;
+}
+
+int bench_transfers(struct afc_connection *connection, struct bench_run *run)
+{
+    char local_path[128], download_path_buffer[128];
+    char remote_path[] = BENCH_REMOTE_DIRECTORY "/data";
+    size_t chunk, size;
+    int i;
+    
+    snprintf(download_path_buffer, sizeof(download_path_buffer), "%s/download", run->local_root);
+    
+    for (size = 0; size < sizeof(bench_file_sizes) / sizeof(bench_file_sizes[0]); size++)
+    {
+        uint64_t file_size = bench_file_sizes[size];
+        
+        snprintf(local_path, sizeof(local_path), "%s/data-%llu", run->local_root, (unsigned long long)file_size);
+        
+        if (!write_bench_file(local_path, file_size))
+        {
+            fprintf(command_stderr(), "Error attempting to bench: unable to write %s\n", local_path);
+            return 0;
+        }
+        
+        for (chunk = 0; chunk < sizeof(bench_chunk_sizes) / sizeof(bench_chunk_sizes[0]); chunk++)
+        {
+            struct transfer_stats stats;
+            double megabytes = file_size / (1024.0 * 1024.0);
+            size_t chunk_size = bench_chunk_sizes[chunk];
+            
+            for (i = 0; i < run->iterations; i++)
+            {
+                if (upload_path(connection, local_path, remote_path, NULL, chunk_size, &stats) != 0)
+                {
+                    fprintf(command_stderr(), "Error attempting to bench upload: %s failed\n", stats.failure);
+                    return 0;
+                }
+                
+                run->samples[i] = stats.seconds;
+            }
+            
+            add_bench_result(run, "upload", file_size, chunk_size, run->iterations, megabytes, "MB/s");
+            
+            for (i = 0; i < run->iterations; i++)
+            {
+                if (download_path(connection, remote_path, download_path_buffer, NULL, chunk_size, &stats) != 0)
+                {
+                    fprintf(command_stderr(), "Error attempting to bench download: %s failed\n", stats.failure);
+                    return 0;
+                }
+                
+                run->samples[i] = stats.seconds;
+            }
+            
+            add_bench_result(run, "download", file_size, chunk_size, run->iterations, megabytes, "MB/s");
+        }
+        
+        unlink(local_path);
+    }
+    
+    unlink(download_path_buffer);
+    backend->remove_path(connection, remote_path);
+    return 1;
+}
+
+int bench_small_files(struct afc_connection *connection, struct bench_run *run)
+{
+    char local_path[128], download_path_buffer[128], remote_path[128];
+    int i, file, count = 0;
+    
+    snprintf(local_path, sizeof(local_path), "%s/small", run->local_root);
+    snprintf(download_path_buffer, sizeof(download_path_buffer), "%s/download", run->local_root);
+    
+    if (!write_bench_file(local_path, BENCH_SMALL_FILE_SIZE))
+    {
+        fprintf(command_stderr(), "Error attempting to bench: unable to write %s\n", local_path);
+        return 0;
+    }
+    
+    backend->directory_create(connection, BENCH_REMOTE_DIRECTORY "/small");
+    
+    for (i = 0; i < run->iterations; i++)
+    {
+        for (file = 0; file < BENCH_SMALL_FILE_COUNT; file++)
+        {
+            struct transfer_stats stats;
+            
+            snprintf(remote_path, sizeof(remote_path), BENCH_REMOTE_DIRECTORY "/small/%d", file);
+            
+            if (upload_path(connection, local_path, remote_path, NULL, TRANSFER_CHUNK_SIZE, &stats) != 0)
+            {
+                fprintf(command_stderr(), "Error attempting to bench upload: %s failed\n", stats.failure);
+                return 0;
+            }
+            
+            run->samples[count++] = stats.seconds;
+        }
+    }
+    
+    add_bench_result(run, "small file upload", BENCH_SMALL_FILE_SIZE, 0, count, 1, "files/s");
+    
+    for (i = 0, count = 0; i < run->iterations; i++)
+    {
+        for (file = 0; file < BENCH_SMALL_FILE_COUNT; file++)
+        {
+            struct transfer_stats stats;
+            
+            snprintf(remote_path, sizeof(remote_path), BENCH_REMOTE_DIRECTORY "/small/%d", file);
+            
+            if (download_path(connection, remote_path, download_path_buffer, NULL, TRANSFER_CHUNK_SIZE, &stats) != 0)
+            {
+                fprintf(command_stderr(), "Error attempting to bench download: %s failed\n", stats.failure);
+                return 0;
+            }
+            
+            run->samples[count++] = stats.seconds;
+        }
+    }
+    
+    add_bench_result(run, "small file download", BENCH_SMALL_FILE_SIZE, 0, count, 1, "files/s");
+    
+    unlink(local_path);
+    unlink(download_path_buffer);
+    return 1;
+}
+
+// Walks the small files the same way list_files does
+int bench_walk(struct afc_connection **connections, int connection_count, struct bench_run *run)
+{
+    struct sandbox_walk walk;
+    size_t entries = 0;
+    int i, failed;
+    
+    for (i = 0; i < run->iterations; i++)
+    {
+        double start = current_time();
+        walk_sandbox(connections, connection_count, BENCH_REMOTE_DIRECTORY, 0, NULL, &walk);
+        run->samples[i] = current_time() - start;
+        entries = walk.count;
+        failed = walk.failed;
+        free_sandbox_walk(&walk);
+        
+        if (failed)
+        {
+            fprintf(command_stderr(), "Error attempting to bench: out of memory walking %s\n", BENCH_REMOTE_DIRECTORY);
+            return 0;
+        }
+    }
+    
+    add_bench_result(run, "list_files walk", 0, 0, run->iterations, (double)entries, "entries/s");
+    return 1;
+}
+
+void format_bench_size(char *buffer, size_t length, uint64_t size)
+{
+    if (size == 0)
+    {
+        snprintf(buffer, length, "-");
+    }
+    else if (size >= 1024 * 1024)
+    {
+        snprintf(buffer, length, "%llu MB", (unsigned long long)(size / (1024 * 1024)));
+    }
+    else
+    {
+        snprintf(buffer, length, "%llu KB", (unsigned long long)(size / 1024));
+    }
+}
+
+void print_bench_table(struct bench_run *run)
+{
+    int i;
+    
+    fprintf(command_stdout(), "%-22s %9s %9s %10s %10s %10s  %s\n", "Benchmark", "File", "Chunk", "p50 ms", "p95 ms", "p99 ms", "Rate");
+    
+    for (i = 0; i < run->count; i++)
+    {
+        struct bench_result *result = &run->results[i];
+        char file_size[16], chunk_size[16];
+        
+        format_bench_size(file_size, sizeof(file_size), result->file_size);
+        format_bench_size(chunk_size, sizeof(chunk_size), result->chunk_size);
+        fprintf(command_stdout(), "%-22s %9s %9s %10.2f %10.2f %10.2f  %.2f %s\n", result->name, file_size, chunk_size, result->p50 * 1000, result->p95 * 1000, result->p99 * 1000, result->rate, result->unit);
+    }
+}
+
+void print_bench_json(struct bench_run *run, const char *udid)
+{
+    int i;
+    
+    fprintf(command_stdout(), "{\"device\": \"%s\", \"iterations\": %d, \"results\": [", (udid != NULL) ? udid : "", run->iterations);
+    
+    for (i = 0; i < run->count; i++)
+    {
+        struct bench_result *result = &run->results[i];
+        
+        fprintf(command_stdout(), "%s\n  {\"name\": \"%s\", \"file_size\": %llu, \"chunk_size\": %lu, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, \"rate\": %.3f, \"unit\": \"%s\"}", (i > 0) ? "," : "", result->name, (unsigned long long)result->file_size, (unsigned long)result->chunk_size, result->p50 * 1000, result->p95 * 1000, result->p99 * 1000, result->rate, result->unit);
+    }
+    
+    fprintf(command_stdout(), "\n]}\n");
+}
+
+int run_bench(struct am_device *device)
+{
+    struct afc_connection *connections[MAX_POOLED_CONNECTIONS_PER_DEVICE];
+    int connection_count = parallel_job_count();
+    struct bench_run *run = calloc(1, sizeof(struct bench_run));
+    
+    ASSERT_OR_RETURN(run != NULL, "Error attempting to bench: out of memory\n");
+    
+    run->iterations = (command.iterations > 0) ? command.iterations : BENCH_DEFAULT_ITERATIONS;
+    run->samples = malloc(sizeof(double) * run->iterations * BENCH_SMALL_FILE_COUNT);
+    strcpy(run->local_root, "/tmp/appdeploy-bench-XXXXXX");
+    
+    if (run->samples == NULL)
+    {
+        free(run);
+        ASSERT_OR_RETURN(0, "Error attempting to bench: out of memory\n");
+    }
+    
+    if (mkdtemp(run->local_root) == NULL)
+    {
+        fprintf(command_stderr(), "Error attempting to bench: unable to create %s\n", run->local_root);
+        free(run->samples);
+        free(run);
+        return 1;
+    }
+    
+    // pooled handshakes happen here rather than inside a timed step
+    if (acquire_file_connections(device, connections, connection_count) != 0)
+    {
+        remove_local_tree(run->local_root);
+        free(run->samples);
+        free(run);
+        return 1;
+    }
+    
+    backend->directory_create(connections[0], BENCH_REMOTE_DIRECTORY);
+    
+    int ok = bench_handshakes(device, run) && bench_transfers(connections[0], run) &&
+             bench_small_files(connections[0], run) && bench_walk(connections, connection_count, run);
+    
+    remove_remote_tree(connections[0], BENCH_REMOTE_DIRECTORY);
+    release_file_connections(connections, connection_count);
+    remove_local_tree(run->local_root);
+    
+    if (ok && command.json)
+    {
+        char *udid = copy_device_udid(device);
+        print_bench_json(run, udid);
+        free(udid);
+    }
+    else if (ok)
+    {
+        print_bench_table(run);
+    }
+    
+    free(run->samples);
+    free(run);
+    
+    return !ok;
+}
+
+// Device Connected
+
+// Runs the command on device and returns its exit status
+int run_command(struct am_device *device)
+{
+    // appdeploy serve already has its devices, there discovery is finding the request's one
+    double discovery_start = (server.serving && current_worker != NULL) ? current_worker->start : trace.discovery_start;
+    
+    if (discovery_start > 0)
+    {
+        trace_span("Device discovery", "discovery", NULL, discovery_start);
+    }
+    
+    command_trace_start = trace_begin();
+    
+    int status = 0;
+    
+    switch (command.type)
+    {
+        case GetUDID:
+            status = get_udid(device);
+            break;
+            
+        case InstallApp:
+            status = install_app(device);
+            break;
+            
+        case UninstallApp:
+            status = uninstall_app(device);
+            break;
+            
+        case ListApps:
+            status = list_apps(device);
+            break;
+            
+        case ListFiles:
+            status = list_files(device);
+            break;
+            
+        case RemoveFile:
+            status = delete_file(device);
+            break;
+            
+        case DownloadFile:
+            status = download_file(device);
+            break;
+            
+        case UploadFile:
+            status = upload_file(device);
+            break;
+            
+        case ReadRange:
+            status = read_range(device);
+            break;
+            
+        case Syslog:
+            status = stream_syslog(device);
+            break;
+            
+        case Batch:
+            status = run_batch(device);
+            break;
+            
+        case PullDirectory:
+            status = pull_directory(device);
+            break;
+            
+        case PushDirectory:
+            status = push_directory(device);
+            break;
+            
+        case SyncDirectory:
+            status = sync_directory(device);
+            break;
+            
+        case Snapshot:
+            status = take_snapshot(device);
+            break;
+            
+        case DiffSnapshot:
+            status = diff_snapshot(device);
+            break;
+            
+        case Bench:
+            status = run_bench(device);
+            break;
+            
+        default:
+            break;
+    }
+    
+    if (command_trace_start > 0)
+    {
+        trace_span(command.name, "command", NULL, command_trace_start);
+        command_trace_start = 0;
+    }
+    
+    return status;
+}
+
+void on_device_connected(struct am_device *device)
+{
+    unregister_device_notification(run_command(device));
+}
+
+void confirm_udid(struct am_device *device)
+{
+    if (command.target)
+    {
+        char *udid = create_cstr_from_cfstring(backend->copy_device_identifier(device));
+        
+        if (strcmp(command.target, udid) == 0)
+        {
+            on_device_connected(device);
+        }
+    }
+    else
+    {
+        on_device_connected(device);
+    }
+}
+
+// Fan-out
+
+int is_fanout_target(const char *udid)
+{
+    int i;
+    
+    if (fanout.all_devices)
+    {
+        return 1;
+    }
+    
+    for (i = 0; i < fanout.target_count; i++)
+    {
+        if (strcmp(fanout.targets[i], udid) == 0)
+        {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+void collect_fanout_device(struct am_device *device)
+{
+    char *udid = copy_device_udid(device);
+    int i;
+    
+    if (udid == NULL || !is_fanout_target(udid) || fanout.worker_count == MAX_FANOUT_DEVICES)
+    {
+        free(udid);
+        return;
+    }
+    
+    for (i = 0; i < fanout.worker_count; i++)
+    {
+        if (strcmp(fanout.workers[i].udid, udid) == 0)
+        {
+            free(udid);
+            return;
+        }
+    }
+    
+    backend->retain(device);
+    
+    struct device_worker *worker = &fanout.workers[fanout.worker_count++];
+    memset(worker, 0, sizeof(*worker));
+    worker->device = device;
+    worker->udid = udid;
+}
+
+static void *run_device_worker(void *context)
+{
+    struct device_worker *worker = context;
+    current_worker = worker;
+    
+    worker->status = run_command(worker->device);
+    worker->seconds = current_time() - worker->start;
+    
+    // a command returns having closed what it opened, this only catches what is left
+    release_worker_connections(worker);
+    return NULL;
+}
+
+// Parses -t all or -t udid1,udid2,... Returns 0 when only a single device was named.
+int parse_fanout_targets(char *target)
+{
+    if (target == NULL)
+    {
+        return 0;
+    }
+    
+    if (strcmp(target, "all") == 0)
+    {
+        fanout.all_devices = 1;
+        return 1;
+    }
+    
+    if (strchr(target, ',') == NULL)
+    {
+        return 0;
+    }
+    
+    char *udid;
+    
+    while ((udid = strsep(&target, ",")) != NULL)
+    {
+        if (*udid != '\0' && fanout.target_count < MAX_FANOUT_DEVICES)
+        {
+            fanout.targets[fanout.target_count++] = udid;
+        }
+    }
+    
+    return 1;
+}
+
+// Collects devices for the settle window, then runs the command on each of them in
+// its own thread and prints one summary line per device.
+void run_fanout()
+{
+    double deadline = current_time() + fanout.settle_seconds;
+    
+    while (current_time() < deadline)
+    {
+        if (!fanout.all_devices && fanout.worker_count == fanout.target_count)
+        {
+            break;
+        }
+        
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, false);
+    }
+    
+    ASSERT_OR_EXIT(fanout.worker_count > 0, "Error: no matching devices found\n");
+    
+    int i, succeeded = 0, failed = 0;
+    
+    for (i = 0; i < fanout.worker_count; i++)
+    {
+        struct device_worker *worker = &fanout.workers[i];
+        worker->status = 1;
+        worker->start = current_time();
+        
+        if (pthread_create(&worker->thread, NULL, run_device_worker, worker) != 0)
+        {
+            worker->thread = 0;
+        }
+    }
+    
+    for (i = 0; i < fanout.worker_count; i++)
+    {
+        if (fanout.workers[i].thread != 0)
+        {
+            pthread_join(fanout.workers[i].thread, NULL);
+        }
+    }
+    
+    fprintf(command_stdout(), "\n%-42s %-8s %s\n", "Device", "Status", "Time");
+    
+    for (i = 0; i < fanout.worker_count; i++)
+    {
+        struct device_worker *worker = &fanout.workers[i];
+        
+        if (worker->status == 0)
+        {
+            succeeded++;
+        }
+        else
+        {
+            failed++;
+        }
+        
+        fprintf(command_stdout(), "%-42s %-8s %.2f s\n", worker->udid, (worker->status == 0) ? "ok" : "failed", worker->seconds);
+    }
+    
+    for (i = 0; i < fanout.target_count; i++)
+    {
+        int j, found = 0;
+        
+        for (j = 0; j < fanout.worker_count; j++)
+        {
+            found |= (strcmp(fanout.targets[i], fanout.workers[j].udid) == 0);
+        }
+        
+        if (!found)
+        {
+            failed++;
+            fprintf(command_stdout(), "%-42s %-8s -\n", fanout.targets[i], "missing");
+        }
+    }
+    
+    for (i = 0; i < fanout.worker_count; i++)
+    {
+        backend->release(fanout.workers[i].device);
+        free(fanout.workers[i].udid);
+    }
+    
+    fprintf(command_stdout(), "%d succeeded, %d failed\n", succeeded, failed);
+    unregister_device_notification(failed ? 1 : 0);
+}
+
+// Known Devices
+
+void add_known_device(struct am_device *device)
+{
+    char *udid = copy_device_udid(device);
+    
+    if (udid == NULL)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&server.lock);
+    
+    if (find_known_device(device) == NULL && server.device_count < MAX_KNOWN_DEVICES)
+    {
+        backend->retain(device);
+        
+        struct known_device *known = &server.devices[server.device_count++];
+        known->device = device;
+        known->udid = udid;
+        known->paired = 0;
+        udid = NULL;
+    }
+    
+    pthread_mutex_unlock(&server.lock);
+    free(udid);
+}
+
+// A request already running on the device keeps its own reference until it finishes
+void remove_known_device(struct am_device *device)
+{
+    pthread_mutex_lock(&server.lock);
+    
+    struct known_device *known = find_known_device(device);
+    struct known_device removed;
+    
+    if (known != NULL)
+    {
+        removed = *known;
+        *known = server.devices[--server.device_count];
+    }
+    
+    pthread_mutex_unlock(&server.lock);
+    
+    if (known == NULL)
+    {
+        return;
+    }
+    
+    close_connection_pool(removed.udid);
+    backend->release(removed.device);
+    free(removed.udid);
+}
+
+// Returns the attached device with the given UDID, or the first one when udid is NULL.
+// Called with server.lock held.
+struct known_device *lookup_known_device(const char *udid)
+{
+    int i;
+    
+    for (i = 0; i < server.device_count; i++)
+    {
+        if (udid == NULL || strcmp(server.devices[i].udid, udid) == 0)
+        {
+            return &server.devices[i];
+        }
+    }
+    
+    return NULL;
+}
+
+void on_device_notification(struct am_device_notification_callback_info *info, int cookie)
+{
+    switch (info->msg)
+    {
+        case ADNCI_MSG_CONNECTED:
+            if (server.serving)
+            {
+                add_known_device(info->dev);
+            }
+            else if (fanout.enabled)
+            {
+                collect_fanout_device(info->dev);
+            }
+            else
+            {
+                confirm_udid(info->dev);
+            }
+            break;
+            
+        case ADNCI_MSG_DISCONNECTED:
+            if (server.serving)
+            {
+                remove_known_device(info->dev);
+            }
+            break;
+            
+        default:
+            break;
+    }
+}
+
+// Off the Mac there are no devices unless -sim provides them
+void require_backend()
+{
+    if (backend == NULL)
+    {
+        fprintf(stderr, "Error: MobileDevice is not available on this platform, use -sim <directory> for simulated devices\n");
+        exit(1);
+    }
+}
+
+void register_device_notification()
+{
+    require_backend();
+    trace.discovery_start = trace_begin();
+    backend->notification_subscribe(&on_device_notification, 0, 0, 0, &command.notification);
+    
+    if (fanout.enabled)
+    {
+        run_fanout();
+    }
+    
+    CFRunLoopRun();
+}
+
+// Reads a byte count such as 512, 64K, 10M or 2G
+uint64_t parse_byte_count(const char *text)
+{
+    char *suffix;
+    double count = strtod(text, &suffix);
+    
+    switch (*suffix)
+    {
+        case 'k': case 'K': return (uint64_t)(count * 1024.0);
+        case 'm': case 'M': return (uint64_t)(count * 1024.0 * 1024.0);
+        case 'g': case 'G': return (uint64_t)(count * 1024.0 * 1024.0 * 1024.0);
+        default: return (uint64_t)count;
+    }
+}
+
+// Reads an age in seconds such as 90, 30m, 12h or 7d
+double parse_age(const char *text)
+{
+    char *suffix;
+    double age = strtod(text, &suffix);
+    
+    switch (*suffix)
+    {
+        case 'm': return age * 60.0;
+        case 'h': return age * 3600.0;
+        case 'd': return age * 86400.0;
+        default: return age;
+    }
+}
+
+// Adds a -include or -exclude pattern, returns 0 when there is no room left
+int add_filter_pattern(char **patterns, int *count, char *pattern)
+{
+    if (*count == MAX_FILTER_PATTERNS)
+    {
+        fprintf(command_stderr(), "Error: at most %d -include and %d -exclude patterns can be given\n", MAX_FILTER_PATTERNS, MAX_FILTER_PATTERNS);
+        return 0;
+    }
+    
+    patterns[(*count)++] = pattern;
+    return 1;
+}
+
+// Fills in command from the arguments, returns 0 on invalid input rather than exiting
+// so that appdeploy serve can report the error to its client and keep running
+int process_args(int argc, char * params[])
+{
+    int i;
+    
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(params[i], "-p") == 0)
+        {
+            // install takes -p more than once, the other commands use the first
+            if (command.app_count == 0)
+            {
+                command.app_path = params[i+1];
+            }
+            
+            if (command.app_count == MAX_INSTALL_APPS)
+            {
+                fprintf(command_stderr(), "Error: at most %d apps can be installed at once\n", MAX_INSTALL_APPS);
+                return 0;
+            }
+            
+            command.app_paths[command.app_count++] = params[i+1];
+        }
+        else if (strcmp(params[i], "-b") == 0)
+        {
+            command.bundle_id = params[i+1];
+        }
+        else if (strcmp(params[i], "-f") == 0)
+        {
+            command.file_path = params[i+1];
+        }
+        else if (strcmp(params[i], "-dest") == 0)
+        {
+            command.destination_path = params[i+1];
+        }
+        else if (strcmp(params[i], "-t") == 0)
+        {
+            command.target = params[i+1];
+        }
+        else if (strcmp(params[i], "-v") == 0)
+        {
+            command.print_paths = 1;
+        }
+        else if (strcmp(params[i], "-settle") == 0 && i + 1 < argc)
+        {
+            fanout.settle_seconds = atof(params[i+1]);
+        }
+        else if (strcmp(params[i], "-socket") == 0)
+        {
+            command.socket_path = params[i+1];
+        }
+        else if (strcmp(params[i], "-j") == 0 && i + 1 < argc)
+        {
+            command.jobs = atoi(params[i+1]);
+        }
+        else if (strcmp(params[i], "-hash") == 0)
+        {
+            command.compare_hashes = 1;
+        }
+        else if (strcmp(params[i], "-delete") == 0)
+        {
+            command.delete_extras = 1;
+        }
+        else if (strcmp(params[i], "-delta") == 0)
+        {
+            command.delta_install = 1;
+        }
+        else if (strcmp(params[i], "-resume") == 0)
+        {
+            command.resume = 1;
+        }
+        else if (strcmp(params[i], "-offset") == 0 && i + 1 < argc)
+        {
+            command.range_offset = parse_byte_count(params[i+1]);
+        }
+        else if (strcmp(params[i], "-length") == 0 && i + 1 < argc)
+        {
+            command.range_length = parse_byte_count(params[i+1]);
+        }
+        else if (strcmp(params[i], "-last") == 0 && i + 1 < argc)
+        {
+            command.range_last = parse_byte_count(params[i+1]);
+        }
+        else if (strcmp(params[i], "-follow") == 0)
+        {
+            command.follow = 1;
+        }
+        else if (strcmp(params[i], "-process") == 0 && i + 1 < argc)
+        {
+            if (command.syslog_process_count == MAX_FILTER_PATTERNS)
+            {
+                fprintf(command_stderr(), "Error: at most %d -process names can be given\n", MAX_FILTER_PATTERNS);
+                return 0;
+            }
+            
+            command.syslog_processes[command.syslog_process_count++] = params[i+1];
+        }
+        else if (strcmp(params[i], "-match") == 0 && i + 1 < argc)
+        {
+            command.syslog_match = params[i+1];
+        }
+        else if (strcmp(params[i], "-level") == 0 && i + 1 < argc)
+        {
+            command.syslog_level = parse_syslog_level(params[i+1], strlen(params[i+1]));
+            
+            if (command.syslog_level < 0)
+            {
+                fprintf(command_stderr(), "Error: -level must be one of debug, info, notice, warning, error or fault\n");
+                return 0;
+            }
+        }
+        else if (strcmp(params[i], "-sha256") == 0)
+        {
+            command.sha256 = 1;
+        }
+        else if (strcmp(params[i], "-json") == 0)
+        {
+            command.json = 1;
+        }
+        else if (strcmp(params[i], "-iterations") == 0 && i + 1 < argc)
+        {
+            command.iterations = atoi(params[i+1]);
+        }
+        else if (strcmp(params[i], "-type") == 0 && i + 1 < argc)
+        {
+            command.app_type = params[i+1];
+        }
+        else if (strcmp(params[i], "-cache") == 0)
+        {
+            command.cache = 1;
+        }
+        else if (strcmp(params[i], "-include") == 0 && i + 1 < argc)
+        {
+            if (!add_filter_pattern(command.filter.include, &command.filter.include_count, params[i+1]))
+            {
+                return 0;
+            }
+        }
+        else if (strcmp(params[i], "-exclude") == 0 && i + 1 < argc)
+        {
+            if (!add_filter_pattern(command.filter.exclude, &command.filter.exclude_count, params[i+1]))
+            {
+                return 0;
+            }
+        }
+        else if (strcmp(params[i], "-regex") == 0)
+        {
+            command.filter.regex = 1;
+        }
+        else if (strcmp(params[i], "-max_depth") == 0 && i + 1 < argc)
+        {
+            command.filter.max_depth = atoi(params[i+1]);
+        }
+        else if (strcmp(params[i], "-min_size") == 0 && i + 1 < argc)
+        {
+            command.filter.min_size = parse_byte_count(params[i+1]);
+        }
+        else if (strcmp(params[i], "-max_size") == 0 && i + 1 < argc)
+        {
+            command.filter.max_size = parse_byte_count(params[i+1]);
+        }
+        else if (strcmp(params[i], "-newer") == 0 && i + 1 < argc)
+        {
+            command.filter.newer_than = parse_age(params[i+1]);
+        }
+        else if (strcmp(params[i], "-older") == 0 && i + 1 < argc)
+        {
+            command.filter.older_than = parse_age(params[i+1]);
+        }
+        else if (strcmp(params[i], "-if_changed") == 0)
+        {
+            command.if_changed = 1;
+        }
+        else if (strcmp(params[i], "-progress") == 0)
+        {
+            command.progress = 1;
+        }
+        else if (strcmp(params[i], "-trace") == 0 && i + 1 < argc)
+        {
+            trace.path = params[i+1];
+        }
+        else if (strcmp(params[i], "-sim") == 0 && i + 1 < argc)
+        {
+            simulator.root = params[i+1];
+        }
+        else if (strcmp(params[i], "-latency") == 0 && i + 1 < argc)
+        {
+            simulator.latency = atof(params[i+1]) / 1000.0;
+        }
+        else if (strcmp(params[i], "-bandwidth") == 0 && i + 1 < argc)
+        {
+            simulator.bandwidth = atof(params[i+1]) * 1024.0 * 1024.0;
+        }
+        else if (strcmp(params[i], "-failure_rate") == 0 && i + 1 < argc)
+        {
+            simulator.failure_rate = atof(params[i+1]);
+        }
+    }
+    
+    return 1;
+}
+
+// Maps argv[1] onto command.type, returns 0 for anything that needs no device
+int parse_command(int argc, char * argv[])
+{
+    command.name = (argc >= 2) ? argv[1] : NULL;
+    
+    if (argc >= 2 && strcmp(argv[1], "get_udid") == 0)
+    {
+        command.type = GetUDID;
+    }
+    else if (argc >= 2 && strcmp(argv[1], "install") == 0)
+    {
+        command.type = InstallApp;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "uninstall") == 0)
+    {
+        command.type = UninstallApp;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "list_apps") == 0)
+    {
+        command.type = ListApps;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "list_files") == 0)
+    {
+        command.type = ListFiles;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "remove_file") == 0)
+    {
+        command.type = RemoveFile;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "download_file") == 0)
+    {
+        command.type = DownloadFile;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "upload_file") == 0)
+    {
+        command.type = UploadFile;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "read_range") == 0)
+    {
+        command.type = ReadRange;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "syslog") == 0)
+    {
+        command.type = Syslog;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "pull_dir") == 0)
+    {
+        command.type = PullDirectory;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "push_dir") == 0)
+    {
+        command.type = PushDirectory;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "sync") == 0)
+    {
+        command.type = SyncDirectory;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "snapshot") == 0)
+    {
+        command.type = Snapshot;
+    }
+    else if(argc >= 3 && strcmp(argv[1], "diff") == 0)
+    {
+        command.type = DiffSnapshot;
+        command.snapshot_path = argv[2];
+        command.after_snapshot_path = (argc >= 4 && argv[3][0] != '-') ? argv[3] : NULL;
+    }
+    else if(argc >= 2 && strcmp(argv[1], "bench") == 0)
+    {
+        command.type = Bench;
+    }
+    else if(argc >= 3 && strcmp(argv[1], "batch") == 0)
+    {
+        command.type = Batch;
+        command.batch_path = argv[2];
+    }
+    else
+    {
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Daemon
+//
+// appdeploy serve keeps the notification subscription and the attached devices
+// alive and runs commands sent over a Unix domain socket. A request is a 4 byte
+// length followed by the client's working directory and its argv as NUL terminated
+// strings; the client's stdin, stdout and stderr travel with it as SCM_RIGHTS so
+// batch scripts can be piped in and output goes straight to the client. The reply is
+// the command's exit status as a 4 byte int. Each request is handled on its own
+// thread, so the run loop keeps accepting clients and following devices while a
+// command runs, and a client that sends nothing for REQUEST_READ_SECONDS is dropped.
+// Commands print through command_stdout() and command_stderr(), which point at the
+// client's descriptors, so the daemon's own streams are never redirected.
+
+char *default_socket_path()
+{
+    static char path[64];
+    snprintf(path, sizeof(path), "/tmp/appdeploy-%d.sock", (int)getuid());
+    
+    return path;
+}
+
+int fill_socket_address(struct sockaddr_un *address, const char *path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        return 0;
+    }
+    
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+int read_fully(int fd, void *buffer, size_t length)
+{
+    char *position = buffer;
+    
+    while (length > 0)
+    {
+        ssize_t count = read(fd, position, length);
+        
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        
+        if (count <= 0)
+        {
+            return 0;
+        }
+        
+        position += count;
+        length -= count;
+    }
+    
+    return 1;
+}
+
+int write_fully(int fd, const void *buffer, size_t length)
+{
+    const char *position = buffer;
+    
+    while (length > 0)
+    {
+        ssize_t count = write(fd, position, length);
+        
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        
+        if (count <= 0)
+        {
+            return 0;
+        }
+        
+        position += count;
+        length -= count;
+    }
+    
+    return 1;
+}
+
+void close_client_fds(int client_fds[3])
+{
+    int i;
+    
+    for (i = 0; i < 3; i++)
+    {
+        close(client_fds[i]);
+    }
+}
+
+// Runs one request on the calling thread, with server.request_lock held
+int run_daemon_command(int argc, char * argv[])
+{
+    struct am_device_notification *notification = command.notification;
+    memset(&command, 0, sizeof(command));
+    command.notification = notification;
+    
+    if (!process_args(argc, argv))
+    {
+        return 1;
+    }
+    
+    if (!parse_command(argc, argv))
+    {
+        fprintf(command_stderr(), "Error: %s is not supported by appdeploy serve\n", (argc >= 2) ? argv[1] : "(none)");
+        return 1;
+    }
+    
+    if (command.target != NULL && (strcmp(command.target, "all") == 0 || strchr(command.target, ',') != NULL))
+    {
+        fprintf(command_stderr(), "Error: appdeploy serve runs each request on a single device\n");
+        return 1;
+    }
+    
+    struct device_worker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.status = 1;
+    worker.start = current_time();
+    
+    // the device can detach while the command runs, so it is retained and its udid copied
+    pthread_mutex_lock(&server.lock);
+    
+    struct known_device *known = lookup_known_device(command.target);
+    
+    if (known != NULL && (worker.udid = strdup(known->udid)) != NULL)
+    {
+        worker.device = known->device;
+        backend->retain(worker.device);
+    }
+    
+    pthread_mutex_unlock(&server.lock);
+    
+    if (worker.device == NULL)
+    {
+        fprintf(command_stderr(), "Error: device %s is not attached\n", (command.target != NULL) ? command.target : "");
+        return 1;
+    }
+    
+    run_device_worker(&worker);
+    current_worker = NULL;
+    
+    backend->release(worker.device);
+    free(worker.udid);
+    return worker.status;
+}
+
+// Reads the request header along with the client's standard descriptors
+int receive_daemon_request(int client, char **payload, uint32_t *length, int client_fds[3])
+{
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec vector = { length, sizeof(*length) };
+    struct msghdr message;
+    
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    if (recvmsg(client, &message, MSG_WAITALL) != sizeof(*length))
+    {
+        return 0;
+    }
+    
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    
+    if (header == NULL || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    {
+        return 0;
+    }
+    
+    memcpy(client_fds, CMSG_DATA(header), 3 * sizeof(int));
+    
+    if (*length == 0 || *length > MAX_REQUEST_SIZE || (*payload = malloc(*length + 1)) == NULL)
+    {
+        close_client_fds(client_fds);
+        return 0;
+    }
+    
+    if (!read_fully(client, *payload, *length))
+    {
+        free(*payload);
+        close_client_fds(client_fds);
+        return 0;
+    }
+    
+    (*payload)[*length] = '\0';
+    return 1;
+}
+
+void handle_daemon_request(int client)
+{
+    char *payload;
+    uint32_t length;
+    int client_fds[3];
+    struct timeval timeout = { REQUEST_READ_SECONDS, 0 };
+    
+    // a client that stops sending is dropped instead of keeping its thread forever
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    if (!receive_daemon_request(client, &payload, &length, client_fds))
+    {
+        close(client);
+        return;
+    }
+    
+    // the payload is the working directory followed by argv
+    char *argv[256];
+    int argc = 0;
+    char *position = payload + strlen(payload) + 1;
+    
+    while (position < payload + length && argc < 255)
+    {
+        argv[argc++] = position;
+        position += strlen(position) + 1;
+    }
+    
+    argv[argc] = NULL;
+    
+    const char *modes[3] = { "r", "w", "w" };
+    FILE *streams[3];
+    int i, opened = 1, status = 1;
+    
+    for (i = 0; i < 3; i++)
+    {
+        streams[i] = fdopen(client_fds[i], modes[i]);
+        opened = opened && (streams[i] != NULL);
+    }
+    
+    if (opened)
+    {
+        setvbuf(streams[2], NULL, _IONBF, 0);
+        
+        pthread_mutex_lock(&server.request_lock);
+        server.input = streams[0];
+        server.output = streams[1];
+        server.errors = streams[2];
+        
+        if (chdir(payload) == 0)
+        {
+            status = run_daemon_command(argc, argv);
+        }
+        else
+        {
+            fprintf(command_stderr(), "Error: unable to change to directory %s\n", payload);
+        }
+        
+        server.input = NULL;
+        server.output = NULL;
+        server.errors = NULL;
+        pthread_mutex_unlock(&server.request_lock);
+    }
+    
+    // everything the command printed reaches the client before the status does
+    for (i = 0; i < 3; i++)
+    {
+        if (streams[i] != NULL)
+        {
+            fclose(streams[i]);
+        }
+        else
+        {
+            close(client_fds[i]);
+        }
+    }
+    
+    int32_t reply = status;
+    write_fully(client, &reply, sizeof(reply));
+    
+    close(client);
+    free(payload);
+}
+
+static void *run_daemon_request(void *context)
+{
+    handle_daemon_request((int)(intptr_t)context);
+    return NULL;
+}
+
+// Each client gets a detached thread, or the run loop's own when none can be started
+static void on_daemon_accept(CFSocketRef socket, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
+{
+    if (type != kCFSocketAcceptCallBack)
+    {
+        return;
+    }
+    
+    int client = *(const CFSocketNativeHandle *)data;
+    pthread_t thread;
+    
+    if (pthread_create(&thread, NULL, run_daemon_request, (void *)(intptr_t)client) == 0)
+    {
+        pthread_detach(thread);
+    }
+    else
+    {
+        handle_daemon_request(client);
+    }
+}
+
+static void on_daemon_signal(int signal_number)
+{
+    unlink(server.path);
+    _exit(0);
+}
+
+void serve_commands()
+{
+    struct sockaddr_un address;
+    
+    require_backend();
+    server.path = (command.socket_path != NULL) ? command.socket_path : default_socket_path();
+    
+    if (!fill_socket_address(&address, server.path))
+    {
+        fprintf(stderr, "Error: socket path %s is too long\n", server.path);
+        exit(1);
+    }
+    
+    // refuse to replace a daemon that is still answering, otherwise clear the stale socket
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        fprintf(stderr, "Error: appdeploy serve is already running on %s\n", server.path);
+        exit(1);
+    }
+    
+    close(probe);
+    unlink(server.path);
+    
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    // the socket is created owner only, so other users never get a moment to connect
+    mode_t previous_mask = umask(S_IRWXG | S_IRWXO);
+    int bound = (server.listen_fd >= 0 && bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0);
+    umask(previous_mask);
+    
+    if (!bound || listen(server.listen_fd, 16) != 0)
+    {
+        fprintf(stderr, "Error: unable to listen on %s\n", server.path);
+        exit(1);
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_daemon_signal);
+    signal(SIGTERM, on_daemon_signal);
+    
+    CFSocketRef listener = CFSocketCreateWithNative(NULL, server.listen_fd, kCFSocketAcceptCallBack, on_daemon_accept, NULL);
+    CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(NULL, listener, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+    
+    // idle house arrest connections are closed even when no requests arrive
+    CFRunLoopTimerRef pool_timer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent() + POOL_IDLE_SECONDS, POOL_IDLE_SECONDS / 2, 0, 0, on_connection_pool_timer, NULL);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), pool_timer, kCFRunLoopDefaultMode);
+    
+    server.serving = 1;
+    printf("Listening on %s\n", server.path);
+    fflush(stdout);
+    
+    backend->notification_subscribe(&on_device_notification, 0, 0, 0, &command.notification);
+    CFRunLoopRun();
+    
+    CFRelease(pool_timer);
+    CFRelease(source);
+    CFRelease(listener);
+    unlink(server.path);
+    exit(0);
+}
+
+// Thin client: forwards argv to appdeploy serve and returns the command's exit status
+int send_command_to_daemon(int argc, char * argv[])
+{
+    struct sockaddr_un address;
+    char cwd[4096];
+    
+    if (!fill_socket_address(&address, command.socket_path) || getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        fprintf(stderr, "Error: invalid socket path or working directory\n");
+        return 1;
+    }
+    
+    size_t length = strlen(cwd) + 1;
+    int i;
+    
+    for (i = 0; i < argc; i++)
+    {
+        length += strlen(argv[i]) + 1;
+    }
+    
+    if (length > MAX_REQUEST_SIZE)
+    {
+        fprintf(stderr, "Error: request is too large\n");
+        return 1;
+    }
+    
+    char *payload = malloc(length);
+    char *position = payload;
+    
+    strcpy(position, cwd);
+    position += strlen(cwd) + 1;
+    
+    for (i = 0; i < argc; i++)
+    {
+        strcpy(position, argv[i]);
+        position += strlen(argv[i]) + 1;
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, "Error: unable to connect to appdeploy serve on %s\n", command.socket_path);
+        free(payload);
+        return 1;
+    }
+    
+    uint32_t header_length = (uint32_t)length;
+    int client_fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(client_fds))];
+    struct iovec vector = { &header_length, sizeof(header_length) };
+    struct msghdr message;
+    
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(client_fds));
+    memcpy(CMSG_DATA(header), client_fds, sizeof(client_fds));
+    
+    fflush(stdout);
+    fflush(stderr);
+    
+    int32_t status = 1;
+    
+    if (sendmsg(fd, &message, 0) != sizeof(header_length) || !write_fully(fd, payload, length) || !read_fully(fd, &status, sizeof(status)))
+    {
+        fprintf(stderr, "Error: lost connection to appdeploy serve\n");
+        status = 1;
+    }
+    
+    close(fd);
+    free(payload);
+    return status;
+}
+
+// Simulated Device
+//
+// -sim <directory> runs commands against simulated devices instead of MobileDevice,
+// so transfers and listings can be measured without a phone. Every subdirectory of
+// <directory> is one device, named by its UDID:
+//
+//     <udid>/media/                    what com.apple.afc serves, PublicStaging included
+//     <udid>/apps/<bundle_id>/         the installed .app bundle of each app
+//     <udid>/containers/<bundle_id>/   the sandbox house arrest serves for that app
+//
+// An app is installed while apps/<bundle_id> exists, so devices can be prepared by
+// hand. -latency delays every call by that many milliseconds, -bandwidth caps the
+// file data of all connections together at that many MB/s, and -failure_rate fails
+// that fraction of calls. Each device draws from its own generator, seeded from its
+// UDID, so a run fails the same calls on a device however many others run with it.
+
+#define SIMULATED_FAILURE 1
+
+struct simulated_device *find_simulated_device(struct am_device *device)
+{
+    int i;
+    
+    for (i = 0; i < simulator.device_count; i++)
+    {
+        if (&simulator.devices[i]->device == device)
+        {
+            return simulator.devices[i];
+        }
+    }
+    
+    return NULL;
+}
+
+// AFC handles are packed structs, the simulator's own are reached through void *
+struct simulated_connection *as_simulated_connection(void *handle)
+{
+    return handle;
+}
+
+const char *simulated_root(struct afc_connection *connection)
+{
+    return as_simulated_connection(connection)->root;
+}
+
+struct simulated_device *simulated_connection_device(struct afc_connection *connection)
+{
+    return as_simulated_connection(connection)->device;
+}
+
+// Waits out the configured latency, returns 1 when this call should fail
+static int simulate_call(struct simulated_device *device)
+{
+    if (simulator.latency > 0)
+    {
+        usleep((useconds_t)(simulator.latency * 1000000));
+    }
+    
+    if (simulator.failure_rate <= 0)
+    {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&device->lock);
+    int draw = rand_r(&device->seed);
+    pthread_mutex_unlock(&device->lock);
+    
+    return draw < simulator.failure_rate * ((double)RAND_MAX + 1);
+}
+
+// Holds the caller until length bytes fit through the shared link
+static void simulate_transfer(size_t length)
+{
+    if (simulator.bandwidth <= 0 || length == 0)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&simulator.lock);
+    double now = current_time();
+    double start = (simulator.link_busy_until > now) ? simulator.link_busy_until : now;
+    simulator.link_busy_until = start + length / simulator.bandwidth;
+    double done = simulator.link_busy_until;
+    pthread_mutex_unlock(&simulator.lock);
+    
+    if (done > now)
+    {
+        usleep((useconds_t)((done - now) * 1000000));
+    }
+}
+
+// Call right after the system call that decided ok, before anything else can touch errno
+static afc_error_t simulated_status(int ok)
+{
+    return ok ? 0 : ((errno != 0) ? errno : EIO);
+}
+
+// Maps a device path into root, refusing any path that climbs out of it
+static char *simulated_path(const char *root, const char *path)
+{
+    const char *component = path;
+    
+    while (*component != '\0')
+    {
+        size_t length = strcspn(component, "/");
+        
+        if (length == 2 && strncmp(component, "..", 2) == 0)
+        {
+            errno = EACCES;
+            return NULL;
+        }
+        
+        component += length + (component[length] == '/');
+    }
+    
+    while (*path == '/')
+    {
+        path++;
+    }
+    
+    char *local = malloc(strlen(root) + strlen(path) + 2);
+    sprintf(local, "%s/%s", root, path);
+    
+    return local;
+}
+
+static char *simulated_cstr(CFStringRef string)
+{
+    return (string != NULL) ? create_cstr_from_cfstring(string) : NULL;
+}
+
+// Calls a MobileDevice style progress callback with Status and PercentComplete
+static void simulate_progress(void *callback, int callback_arg, const char *status, int percent)
+{
+    if (callback == NULL)
+    {
+        return;
+    }
+    
+    CFStringRef keys[] = { CFSTR("Status"), CFSTR("PercentComplete") };
+    CFTypeRef values[] = { CFStringCreateWithCString(NULL, status, kCFStringEncodingUTF8), CFNumberCreate(NULL, kCFNumberIntType, &percent) };
+    CFDictionaryRef info = CFDictionaryCreate(NULL, (const void **)keys, (const void **)values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    
+    ((void (*)(CFDictionaryRef, int))callback)(info, callback_arg);
+    
+    CFRelease(info);
+    CFRelease(values[0]);
+    CFRelease(values[1]);
+}
+
+// Copies the tree at source to destination, at the simulated bandwidth. A CopyingFile
+// progress report is made before each file when callback is set.
+static int copy_simulated_tree(const char *source, const char *destination, void *callback, int callback_arg)
+{
+    struct sandbox_walk walk;
+    uint64_t total = 0, copied = 0;
+    size_t i;
+    int ok = 1;
+    
+    memset(&walk, 0, sizeof(walk));
+    walk_local_tree(source, &walk);
+    
+    for (i = 0; i < walk.count; i++)
+    {
+        total += walk.entries[i].size;
+    }
+    
+    ok = !walk.failed;
+    
+    for (i = 0; ok && i < walk.count; i++)
+    {
+        struct sandbox_entry *entry = &walk.entries[i];
+        char *target = rebase_path(&walk.arena, entry->path, source, destination);
+        
+        if (entry->is_directory)
+        {
+            ok = make_directories(target, 0755);
+            continue;
+        }
+        
+        simulate_progress(callback, callback_arg, "CopyingFile", (total > 0) ? (int)(copied * 100 / total) : 0);
+        copied += entry->size;
+        
+        int input = open(entry->path, O_RDONLY);
+        int output = (input >= 0) ? open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        char buffer[64 * 1024];
+        ssize_t length = 0;
+        
+        while (output >= 0 && (length = read(input, buffer, sizeof(buffer))) > 0 && write_fully(output, buffer, length))
+        {
+            simulate_transfer(length);
+        }
+        
+        ok = (input >= 0 && output >= 0 && length == 0);
+        
+        if (input >= 0)
+        {
+            close(input);
+        }
+        
+        if (output >= 0)
+        {
+            close(output);
+        }
+    }
+    
+    ok = ok && walk.count > 0;
+    free_sandbox_walk(&walk);
+    
+    return ok;
+}
+
+// Parks a new connection to device rooted at root until connection_open picks it up
+static int register_simulated_service(struct simulated_device *device, const char *root)
+{
+    struct simulated_connection *connection = malloc(sizeof(struct simulated_connection));
+    size_t i;
+    
+    connection->device = device;
+    connection->root = strdup(root);
+    pthread_mutex_lock(&simulator.lock);
+    
+    for (i = 0; i < simulator.service_capacity && simulator.services[i] != NULL; i++);
+    
+    if (i == simulator.service_capacity)
+    {
+        size_t old_capacity = simulator.service_capacity;
+        
+        if (!grow_array((void **)&simulator.services, &simulator.service_capacity, i + 1, sizeof(struct simulated_connection *)))
+        {
+            pthread_mutex_unlock(&simulator.lock);
+            free(connection->root);
+            free(connection);
+            return -1;
+        }
+        
+        memset(simulator.services + old_capacity, 0, (simulator.service_capacity - old_capacity) * sizeof(struct simulated_connection *));
+    }
+    
+    simulator.services[i] = connection;
+    pthread_mutex_unlock(&simulator.lock);
+    
+    return (int)i + 1;
+}
+
+static mach_error_t simulated_notification_subscribe(am_device_notification_callback callback, unsigned int unused0, unsigned int unused1, unsigned int cookie, struct am_device_notification **subscription)
+{
+    DIR *directory = opendir(simulator.root);
+    struct dirent *child;
+    
+    if (directory == NULL)
+    {
+        fprintf(stderr, "Error attempting to start the simulator: unable to open %s\n", simulator.root);
+        return SIMULATED_FAILURE;
+    }
+    
+    *subscription = (struct am_device_notification *)&simulator;
+    
+    // devices attach right away instead of from the run loop
+    while ((child = readdir(directory)) != NULL && simulator.device_count < MAX_KNOWN_DEVICES)
+    {
+        struct simulated_device *device = calloc(1, sizeof(struct simulated_device));
+        struct stat info;
+        
+        device->udid = strdup(child->d_name);
+        device->root = malloc(strlen(simulator.root) + strlen(child->d_name) + 2);
+        sprintf(device->root, "%s/%s", simulator.root, child->d_name);
+        
+        if (child->d_name[0] == '.' || stat(device->root, &info) != 0 || !S_ISDIR(info.st_mode))
+        {
+            free(device->udid);
+            free(device->root);
+            free(device);
+            continue;
+        }
+        
+        pthread_mutex_init(&device->lock, NULL);
+        device->seed = (unsigned int)crc32(0, (const Bytef *)device->udid, (uInt)strlen(device->udid));
+        simulator.devices[simulator.device_count++] = device;
+        
+        struct am_device_notification_callback_info notification = { &device->device, ADNCI_MSG_CONNECTED, *subscription };
+        callback(&notification, cookie);
+    }
+    
+    closedir(directory);
+    return 0;
+}
+
+static mach_error_t simulated_notification_unsubscribe(struct am_device_notification *subscription)
+{
+    return 0;
+}
+
+static CFStringRef simulated_copy_device_identifier(struct am_device *device)
+{
+    return CFStringCreateWithCString(NULL, (find_simulated_device(device))->udid, kCFStringEncodingUTF8);
+}
+
+static void simulated_retain(struct am_device *device)
+{
+}
+
+static void simulated_release(struct am_device *device)
+{
+}
+
+// Connect, pairing and session calls only cost a round trip
+static mach_error_t simulated_handshake(struct am_device *device)
+{
+    return simulate_call(find_simulated_device(device)) ? SIMULATED_FAILURE : 0;
+}
+
+static mach_error_t simulated_is_paired(struct am_device *device)
+{
+    return !simulate_call(find_simulated_device(device));
+}
+
+static mach_error_t simulated_start_service(struct am_device *device, CFStringRef service_name, int *socket_fd)
+{
+    struct simulated_device *simulated = find_simulated_device(device);
+    
+    if (simulate_call(simulated))
+    {
+        return SIMULATED_FAILURE;
+    }
+    
+    // the relay streams <udid>/syslog, a file or a named pipe something else writes to
+    if (CFStringCompare(service_name, AMSVC_SYSLOG_RELAY, 0) == kCFCompareEqualTo)
+    {
+        char *syslog = simulated_path(simulated->root, "syslog");
+        
+        *socket_fd = open(syslog, O_RDONLY);
+        free(syslog);
+        
+        return (*socket_fd >= 0) ? 0 : SIMULATED_FAILURE;
+    }
+    
+    if (CFStringCompare(service_name, AMSVC_AFC, 0) != kCFCompareEqualTo)
+    {
+        return SIMULATED_FAILURE;
+    }
+    
+    char *media = simulated_path(simulated->root, "media");
+    int ok = make_directories(media, 0755);
+    
+    *socket_fd = ok ? register_simulated_service(simulated, media) : -1;
+    free(media);
+    
+    return (*socket_fd > 0) ? 0 : SIMULATED_FAILURE;
+}
+
+static mach_error_t simulated_start_house_arrest_service(struct am_device *device, CFStringRef identifier, void *unknown, service_conn_t *handle, unsigned int *what)
+{
+    struct simulated_device *simulated = find_simulated_device(device);
+    char *bundle_id = simulated_cstr(identifier);
+    char *apps = simulated_path(simulated->root, "apps");
+    char *containers = simulated_path(simulated->root, "containers");
+    char *installed = (bundle_id != NULL) ? simulated_path(apps, bundle_id) : NULL;
+    char *container = (bundle_id != NULL) ? simulated_path(containers, bundle_id) : NULL;
+    struct stat info;
+    int socket_fd = -1;
+    
+    if (!simulate_call(simulated) && installed != NULL && container != NULL && stat(installed, &info) == 0 && make_directories(container, 0755))
+    {
+        socket_fd = register_simulated_service(simulated, container);
+    }
+    
+    free(bundle_id);
+    free(apps);
+    free(containers);
+    free(installed);
+    free(container);
+    
+    if (socket_fd <= 0)
+    {
+        return SIMULATED_FAILURE;
+    }
+    
+    *handle = (service_conn_t)socket_fd;
+    return 0;
+}
+
+// PublicStaging path for the bundle at url, or NULL
+static char *simulated_staging_path(struct simulated_device *device, CFURLRef url, char *local_path)
+{
+    if (!CFURLGetFileSystemRepresentation(url, true, (UInt8 *)local_path, PATH_MAX))
+    {
+        return NULL;
+    }
+    
+    const char *name = strrchr(trim_root(local_path), '/');
+    char *staging = malloc(strlen(device->root) + strlen(local_path) + 24);
+    
+    sprintf(staging, "%s/media/PublicStaging/%s", device->root, (name != NULL) ? name + 1 : local_path);
+    return staging;
+}
+
+static int simulated_secure_transfer_path(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int callback_arg)
+{
+    struct simulated_device *simulated = find_simulated_device(device);
+    char local_path[PATH_MAX];
+    char *staging = simulated_staging_path(simulated, url, local_path);
+    int ok = (staging != NULL && !simulate_call(simulated));
+    
+    if (ok)
+    {
+        remove_local_tree(staging);
+        ok = copy_simulated_tree(local_path, staging, callback, callback_arg);
+        simulate_progress(callback, callback_arg, "Complete", 100);
+    }
     
-    printf("%s successfully installed.\n", command.app_path);
+    free(staging);
+    return ok ? 0 : SIMULATED_FAILURE;
 }
 
-// Uninstall App
-void uninstall_app(struct am_device *device)
+// Installs the staged copy of the bundle at url into apps/<bundle_id>
+static int simulated_secure_install_application(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int callback_arg)
 {
-    connect_to_device(device);
-    CFStringRef bundle_id = CFStringCreateWithCString(NULL, command.bundle_id, kCFStringEncodingUTF8);
+    struct simulated_device *simulated = find_simulated_device(device);
+    char local_path[PATH_MAX];
+    char *staging = simulated_staging_path(simulated, url, local_path);
+    CFStringRef identifier = (staging != NULL && !simulate_call(simulated)) ? read_plist_for_app_path(staging) : NULL;
+    char *bundle_id = simulated_cstr(identifier);
+    int ok = (bundle_id != NULL);
     
-    // uninstall package from device
-    ASSERT_OR_EXIT(!AMDeviceSecureUninstallApplication(0, device, bundle_id, 0, NULL, 0), "Error attempting to uninstall app: AMDeviceSecureUninstallApplication failed\n");
+    if (identifier != NULL)
+    {
+        CFRelease(identifier);
+    }
     
-    CFRelease(bundle_id);
+    if (ok)
+    {
+        const char *name = strrchr(staging, '/') + 1;
+        char *installed = malloc(strlen(simulated->root) + strlen(bundle_id) + 8);
+        char *bundle = malloc(strlen(simulated->root) + strlen(bundle_id) + strlen(name) + 8);
+        char *container = malloc(strlen(simulated->root) + strlen(bundle_id) + 32);
+        
+        sprintf(installed, "%s/apps/%s", simulated->root, bundle_id);
+        sprintf(bundle, "%s/%s", installed, name);
+        remove_local_tree(installed);
+        simulate_progress(callback, callback_arg, "VerifyingApplication", 40);
+        simulate_progress(callback, callback_arg, "InstallingApplication", 60);
+        ok = copy_simulated_tree(staging, bundle, NULL, 0);
+        
+        // an upgrade keeps the existing sandbox
+        sprintf(container, "%s/containers/%s/Documents", simulated->root, bundle_id);
+        ok = ok && make_directories(container, 0755);
+        sprintf(container, "%s/containers/%s/Library", simulated->root, bundle_id);
+        ok = ok && make_directories(container, 0755);
+        sprintf(container, "%s/containers/%s/tmp", simulated->root, bundle_id);
+        ok = ok && make_directories(container, 0755);
+        
+        free(installed);
+        free(bundle);
+        free(container);
+    }
+    
+    if (ok)
+    {
+        simulate_progress(callback, callback_arg, "Complete", 100);
+    }
     
-    printf("%s successfully uninstalled.\n", command.bundle_id);
+    free(bundle_id);
+    free(staging);
+    return ok ? 0 : SIMULATED_FAILURE;
 }
 
-// List Apps
-void list_apps(struct am_device *device)
+static int simulated_secure_uninstall_application(int unknown0, struct am_device *device, CFStringRef bundle_id, int unknown1, void *callback, int callback_arg)
 {
-    connect_to_device(device);
+    struct simulated_device *simulated = find_simulated_device(device);
+    char *name = simulated_cstr(bundle_id);
+    struct stat info;
+    int ok = (name != NULL && !simulate_call(simulated));
     
-    CFDictionaryRef apps;
-    ASSERT_OR_EXIT(!AMDeviceLookupApplications(device, 0, &apps), "Error attempting to list installed apps: AMDeviceLookupApplications failed\n");
+    if (ok)
+    {
+        char *path = malloc(strlen(simulated->root) + strlen(name) + 16);
+        
+        sprintf(path, "%s/apps/%s", simulated->root, name);
+        ok = (stat(path, &info) == 0);
+        remove_local_tree(path);
+        sprintf(path, "%s/containers/%s", simulated->root, name);
+        remove_local_tree(path);
+        free(path);
+    }
     
-    CFDictionaryApplyFunction(apps, print_installed_app, NULL);
-    CFRelease(apps);
+    free(name);
+    return ok ? 0 : SIMULATED_FAILURE;
 }
 
-// List Files
-void read_files(struct afc_connection* fileConnection, char* dir)
+// ReturnAttributes limits the keys reported for each app
+static int simulated_attribute_wanted(CFDictionaryRef options, CFStringRef key)
 {
-    char *dir_ent;
+    CFArrayRef wanted = (options != NULL) ? CFDictionaryGetValue(options, CFSTR("ReturnAttributes")) : NULL;
+    CFIndex i;
     
-    struct afc_dictionary* fileDictionary;
-    AFCFileInfoOpen(fileConnection, dir, &fileDictionary);
-    
-    struct afc_directory* fileDirectory;
-    afc_error_t err = AFCDirectoryOpen(fileConnection, dir, &fileDirectory);
+    if (wanted == NULL)
+    {
+        return 1;
+    }
     
-    if (err != 0)
+    for (i = 0; i < CFArrayGetCount(wanted); i++)
     {
-        printf("%s\n", dir);
-        return;
+        if (CFEqual(CFArrayGetValueAtIndex(wanted, i), key))
+        {
+            return 1;
+        }
     }
-    else if (command.print_paths)
+    
+    return 0;
+}
+
+// Every simulated app is a User app
+static int simulated_lookup_applications(struct am_device *device, CFDictionaryRef options, CFDictionaryRef *apps)
+{
+    struct simulated_device *simulated = find_simulated_device(device);
+    
+    if (simulate_call(simulated))
     {
-        printf("%s\n", dir);
+        return SIMULATED_FAILURE;
     }
     
-    while(true)
+    CFTypeRef type = (options != NULL) ? CFDictionaryGetValue(options, CFSTR("ApplicationType")) : NULL;
+    int user_apps = (type == NULL || CFEqual(type, CFSTR("User")) || CFEqual(type, CFSTR("Any")));
+    CFMutableDictionaryRef result = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    char *apps_path = simulated_path(simulated->root, "apps");
+    DIR *directory = user_apps ? opendir(apps_path) : NULL;
+    struct dirent *child;
+    
+    while (directory != NULL && (child = readdir(directory)) != NULL)
     {
-        err = AFCDirectoryRead(fileConnection, fileDirectory, &dir_ent);
+        if (child->d_name[0] == '.')
+        {
+            continue;
+        }
         
-        if (!dir_ent)
+        char *installed = simulated_path(apps_path, child->d_name);
+        DIR *bundles = opendir(installed);
+        struct dirent *bundle;
+        char *bundle_path = NULL;
+        
+        while (bundles != NULL && bundle_path == NULL && (bundle = readdir(bundles)) != NULL)
         {
-            break;
+            size_t length = strlen(bundle->d_name);
+            
+            if (length > 4 && strcmp(bundle->d_name + length - 4, ".app") == 0)
+            {
+                bundle_path = simulated_path(installed, bundle->d_name);
+            }
         }
         
-        if (strcmp(dir_ent, ".") == 0 || strcmp(dir_ent, "..") == 0)
+        if (bundles != NULL)
         {
-            continue;
+            closedir(bundles);
+        }
+        
+        CFStringRef key = CFStringCreateWithCString(NULL, child->d_name, kCFStringEncodingUTF8);
+        CFStringRef path = CFStringCreateWithCString(NULL, (bundle_path != NULL) ? bundle_path : installed, kCFStringEncodingUTF8);
+        CFDictionaryRef info = (bundle_path != NULL) ? copy_app_info(bundle_path) : NULL;
+        CFStringRef keys[] = { CFSTR("CFBundleIdentifier"), CFSTR("Path"), CFSTR("ApplicationType"), CFSTR("CFBundleVersion"), CFSTR("CFBundleShortVersionString") };
+        CFTypeRef values[] = { key, path, CFSTR("User"), NULL, NULL };
+        CFIndex count = 0;
+        int k;
+        
+        // like a device, report the versions from the installed bundle's Info.plist
+        if (info != NULL)
+        {
+            values[3] = CFDictionaryGetValue(info, keys[3]);
+            values[4] = CFDictionaryGetValue(info, keys[4]);
         }
         
-        char* dir_joined = malloc(strlen(dir) + strlen(dir_ent) + 2);
-        strcpy(dir_joined, dir);
+        for (k = 0; k < 5; k++)
+        {
+            if (values[k] != NULL && simulated_attribute_wanted(options, keys[k]))
+            {
+                keys[count] = keys[k];
+                values[count++] = values[k];
+            }
+        }
+        
+        CFDictionaryRef attributes = CFDictionaryCreate(NULL, (const void **)keys, (const void **)values, count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        
+        CFDictionarySetValue(result, key, attributes);
+        CFRelease(attributes);
         
-        if (dir_joined[strlen(dir)-1] != '/')
+        if (info != NULL)
         {
-            strcat(dir_joined, "/");
+            CFRelease(info);
         }
         
-        strcat(dir_joined, dir_ent);
-        read_files(fileConnection, dir_joined);
-        free(dir_joined);
+        CFRelease(path);
+        CFRelease(key);
+        free(bundle_path);
+        free(installed);
     }
     
-    AFCDirectoryClose(fileConnection, fileDirectory);
+    if (directory != NULL)
+    {
+        closedir(directory);
+    }
+    
+    free(apps_path);
+    *apps = result;
+    return 0;
 }
 
-service_conn_t start_file_service(struct am_device * device)
+static afc_error_t simulated_connection_open(int socket_fd, unsigned int io_timeout, struct afc_connection **connection)
 {
-    connect_to_device(device);
+    struct simulated_connection *simulated = NULL;
     
-    service_conn_t serviceConnection;
+    pthread_mutex_lock(&simulator.lock);
     
-    CFStringRef cf_bundle_id = CFStringCreateWithCString(NULL, command.bundle_id, kCFStringEncodingASCII);
-    if (AMDeviceStartHouseArrestService(device, cf_bundle_id, 0, &serviceConnection, 0) != 0)
+    if (socket_fd > 0 && (size_t)socket_fd <= simulator.service_capacity)
     {
-        printf("Unable to find bundle with id: %s\n", command.bundle_id);
-        exit(1);
+        simulated = simulator.services[socket_fd - 1];
+        simulator.services[socket_fd - 1] = NULL;
     }
     
-    ASSERT_OR_EXIT(AMDeviceStopSession(device) == 0, "Error attempting to list files: AMDeviceStopSession failed\n");
-    ASSERT_OR_EXIT(AMDeviceDisconnect(device) == 0, "Error attempting to list files: AMDeviceDisconnect failed\n");
-    CFRelease(cf_bundle_id);
+    pthread_mutex_unlock(&simulator.lock);
+    
+    if (simulated == NULL)
+    {
+        return EBADF;
+    }
     
-    return serviceConnection;
+    *connection = (struct afc_connection *)simulated;
+    return 0;
 }
 
-
-void list_files(struct am_device *device)
+static afc_error_t simulated_connection_close(struct afc_connection *connection)
 {
-    service_conn_t serviceConnection = start_file_service(device);
+    struct simulated_connection *simulated = as_simulated_connection(connection);
     
-    struct afc_connection* fileConnection;
-    AFCConnectionOpen(serviceConnection, 0, &fileConnection);
-    
-    read_files(fileConnection, "/Documents");
+    free(simulated->root);
+    free(simulated);
+    return 0;
 }
 
-//Remove File
+static struct simulated_dictionary *new_simulated_dictionary()
+{
+    return calloc(1, sizeof(struct simulated_dictionary));
+}
+
+static void add_simulated_value(struct simulated_dictionary *dictionary, const char *key, const char *value)
+{
+    if (dictionary->count < SIMULATED_KEY_COUNT)
+    {
+        snprintf(dictionary->keys[dictionary->count], sizeof(dictionary->keys[0]), "%s", key);
+        snprintf(dictionary->values[dictionary->count], sizeof(dictionary->values[0]), "%s", value);
+        dictionary->count++;
+    }
+}
 
-void delete_file(struct am_device *device)
+static void add_simulated_number(struct simulated_dictionary *dictionary, const char *key, unsigned long long value)
 {
-    service_conn_t serviceConnection = start_file_service(device);
-    struct afc_connection* fileConnection;
-    AFCConnectionOpen(serviceConnection, 0, &fileConnection);
+    char text[32];
     
-    char *fileDir = command.file_path;
+    snprintf(text, sizeof(text), "%llu", value);
+    add_simulated_value(dictionary, key, text);
+}
+
+static afc_error_t simulated_device_info_open(struct afc_connection *connection, struct afc_dictionary **info)
+{
+    if (simulate_call(simulated_connection_device(connection)))
+    {
+        return EIO;
+    }
+    
+    struct simulated_dictionary *dictionary = new_simulated_dictionary();
     
-    ASSERT_OR_EXIT(AFCRemovePath(fileConnection, fileDir) == 0, "Error attempting to remove file: AFCRemovePath failed\n");
-    ASSERT_OR_EXIT(AFCConnectionClose(fileConnection) == 0, "Error attempting to remove file: AFCConnectionClose failed\n");
+    add_simulated_value(dictionary, "Model", "Simulated");
+    add_simulated_number(dictionary, "FSBlockSize", 4096);
+    *info = (struct afc_dictionary *)dictionary;
     
-    printf("%s successfully removed.\n", command.file_path);
+    return 0;
 }
 
-//Downlaod File
-
-void download_file(struct am_device *device)
+static afc_error_t simulated_file_info_open(struct afc_connection *connection, char *path, struct afc_dictionary **info)
 {
-    service_conn_t serviceConnection = start_file_service(device);
-    struct afc_connection* fileConnection;
-    AFCConnectionOpen(serviceConnection, 0, &fileConnection);
+    if (simulate_call(simulated_connection_device(connection)))
+    {
+        return EIO;
+    }
     
-    char *fileDir = command.file_path;
-    afc_file_ref file_ref;
+    char *local = simulated_path(simulated_root(connection), path);
+    struct stat file_info;
+    afc_error_t status = simulated_status(local != NULL && lstat(local, &file_info) == 0);
+    
+    free(local);
+    
+    if (status != 0)
+    {
+        return status;
+    }
     
-    ASSERT_OR_EXIT(AFCFileRefOpen(fileConnection, fileDir, 2, &file_ref) == 0, "Error attempting to download file: AFCFileRefOpen failed\n");
+    struct simulated_dictionary *dictionary = new_simulated_dictionary();
+    const char *type = S_ISDIR(file_info.st_mode) ? "S_IFDIR" : (S_ISLNK(file_info.st_mode) ? "S_IFLNK" : "S_IFREG");
     
-    struct afc_dictionary* fileDictionary;
-    ASSERT_OR_EXIT(AFCFileInfoOpen(fileConnection, fileDir, &fileDictionary) == 0, "Error attempting to download file: AFCFileInfoOpen failed\n");
+    add_simulated_number(dictionary, "st_size", (unsigned long long)file_info.st_size);
+    add_simulated_number(dictionary, "st_blocks", (unsigned long long)file_info.st_blocks);
+    add_simulated_number(dictionary, "st_nlink", (unsigned long long)file_info.st_nlink);
+    add_simulated_value(dictionary, "st_ifmt", type);
+    add_simulated_number(dictionary, "st_mtime", (unsigned long long)file_info.st_mtime * 1000000000ULL);
+    *info = (struct afc_dictionary *)dictionary;
     
-    char *pValue, *pKey;
-    unsigned int fsize = 0;
+    return 0;
+}
+
+static afc_error_t simulated_key_value_read(struct afc_dictionary *dictionary, char **key, char **value)
+{
+    void *handle = dictionary;
+    struct simulated_dictionary *simulated = handle;
     
-    AFCKeyValueRead(fileDictionary, &pKey, &pValue);
+    *key = (simulated->next < simulated->count) ? simulated->keys[simulated->next] : NULL;
+    *value = (simulated->next < simulated->count) ? simulated->values[simulated->next] : NULL;
+    simulated->next++;
     
-	while(pKey || pValue)
+    return 0;
+}
+
+static afc_error_t simulated_key_value_close(struct afc_dictionary *dictionary)
+{
+    free(dictionary);
+    return 0;
+}
+
+static afc_error_t simulated_directory_open(struct afc_connection *connection, char *path, struct afc_directory **directory)
+{
+    if (simulate_call(simulated_connection_device(connection)))
     {
-		if (pKey == NULL || pValue == NULL)
-        {
-			break;
-        }
-		if (!strcmp(pKey, "st_size"))
-        {
-			fsize = (unsigned int)atoi(pValue);
-			break;
-		}
-		AFCKeyValueRead(fileDictionary, &pKey, &pValue);
-	}
-	AFCKeyValueClose(fileDictionary);
+        return EIO;
+    }
     
-    char* buf = malloc(fsize);
+    char *local = simulated_path(simulated_root(connection), path);
+    DIR *opened = (local != NULL) ? opendir(local) : NULL;
+    afc_error_t status = simulated_status(opened != NULL);
     
-    ASSERT_OR_EXIT(AFCFileRefRead(fileConnection, file_ref, buf, &fsize) == 0, "Error attempting to download file: AFCFileRefRead failed\n");
-    FILE* pFile = fopen(command.destination_path, "wb");
+    free(local);
     
-    if (pFile)
+    if (status != 0)
     {
-        fwrite(buf, fsize, 1, pFile);
+        return status;
     }
-    fclose(pFile);
     
-    ASSERT_OR_EXIT(AFCFileRefClose(fileConnection, file_ref) == 0, "Error attempting to download file: AFCFileRefClose failed\n");
-    ASSERT_OR_EXIT(AFCConnectionClose(fileConnection) == 0, "Error attempting to download file: AFCConnectionClose failed\n");
+    *directory = (struct afc_directory *)opened;
+    return 0;
+}
+
+// The listing arrives with the open, reading it costs nothing extra
+static afc_error_t simulated_directory_read(struct afc_connection *connection, struct afc_directory *directory, char **entry)
+{
+    struct dirent *child = readdir((DIR *)directory);
     
-    printf("%s successfully downloaded to %s.\n", command.file_path, command.destination_path);
+    *entry = (child != NULL) ? child->d_name : NULL;
+    return 0;
 }
 
-//Upload File
+static afc_error_t simulated_directory_close(struct afc_connection *connection, struct afc_directory *directory)
+{
+    closedir((DIR *)directory);
+    return 0;
+}
 
-void upload_file(struct am_device *device)
+static afc_error_t simulated_directory_create(struct afc_connection *connection, char *path)
 {
-    service_conn_t serviceConnection = start_file_service(device);
-    struct afc_connection* fileConnection;
-    AFCConnectionOpen(serviceConnection, 0, &fileConnection);
+    if (simulate_call(simulated_connection_device(connection)))
+    {
+        return EIO;
+    }
     
-    char *fileDir = command.file_path;
-    char *target_dir = command.destination_path;
-    afc_file_ref file_ref;
+    char *local = simulated_path(simulated_root(connection), path);
+    afc_error_t status = simulated_status(local != NULL && make_directories(local, 0755));
     
-    struct stat buf;
-    stat(fileDir, &buf);
+    free(local);
+    return status;
+}
+
+static afc_error_t simulated_remove_path(struct afc_connection *connection, char *path)
+{
+    if (simulate_call(simulated_connection_device(connection)))
+    {
+        return EIO;
+    }
     
-    printf("%lld", buf.st_size);
-    unsigned int file_size = buf.st_size;
-    printf("%u", file_size);
-    FILE* pFile = fopen(fileDir, "rb");
-    char* content = malloc(file_size);
+    char *local = simulated_path(simulated_root(connection), path);
+    afc_error_t status = simulated_status(local != NULL && remove(local) == 0);
     
-    if (pFile)
+    free(local);
+    return status;
+}
+
+static afc_error_t simulated_rename_path(struct afc_connection *connection, char *old_path, char *new_path)
+{
+    if (simulate_call(simulated_connection_device(connection)))
     {
-        fread(content, file_size, 1, pFile);
+        return EIO;
     }
     
-    ASSERT_OR_EXIT(AFCFileRefOpen(fileConnection, target_dir, 3, &file_ref) == 0, "Error attempting to upload file: AFCFileRefOpen failed\n");
-    ASSERT_OR_EXIT(AFCFileRefWrite(fileConnection, file_ref, content, file_size) == 0, "Error attempting to upload file: AFCFileRefWrite failed\n");
-    fclose(pFile);
-    
-    ASSERT_OR_EXIT(AFCFileRefClose(fileConnection, file_ref) == 0, "Error attempting to upload file: AFCFileRefClose failed\n");
-    ASSERT_OR_EXIT(AFCConnectionClose(fileConnection) == 0, "Error attempting to upload file: AFCConnectionClose failed\n");
+    char *old_local = simulated_path(simulated_root(connection), old_path);
+    char *new_local = (old_local != NULL) ? simulated_path(simulated_root(connection), new_path) : NULL;
+    afc_error_t status = simulated_status(new_local != NULL && rename(old_local, new_local) == 0);
     
-    printf("%s successfully upload to %s.\n", command.file_path, command.destination_path);
+    free(old_local);
+    free(new_local);
+    return status;
 }
 
-// Device Connected
-
-void on_device_connected(struct am_device *device)
+// AFC open modes 1 to 6 are r, r+, w, w+, a and a+
+static afc_error_t simulated_file_ref_open(struct afc_connection *connection, char *path, unsigned long long mode, afc_file_ref *file_ref)
 {
-    switch (command.type)
+    static const int flags[] = { O_RDONLY, O_RDWR, O_WRONLY | O_CREAT | O_TRUNC, O_RDWR | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND, O_RDWR | O_CREAT | O_APPEND };
+    if (simulate_call(simulated_connection_device(connection)))
     {
-        case GetUDID:
-            get_udid(device);
-            break;
-            
-        case InstallApp:
-            install_app(device);
-            break;
-            
-        case UninstallApp:
-            uninstall_app(device);
-            break;
-            
-        case ListApps:
-            list_apps(device);
-            break;
-            
-        case ListFiles:
-            list_files(device);
-            break;
-            
-        case RemoveFile:
-            delete_file(device);
-            break;
-            
-        case DownloadFile:
-            download_file(device);
-            break;
-            
-        case UploadFile:
-            upload_file(device);
-            break;
-            
-        default:
-            break;
+        return EIO;
+    }
+    
+    if (mode < 1 || mode > 6)
+    {
+        return EINVAL;
+    }
+    
+    char *local = simulated_path(simulated_root(connection), path);
+    int fd = (local != NULL) ? open(local, flags[mode - 1], 0644) : -1;
+    afc_error_t status = simulated_status(fd >= 0);
+    
+    free(local);
+    
+    if (status != 0)
+    {
+        return status;
     }
     
-    unregister_device_notification(0);
+    *file_ref = (afc_file_ref)fd;
+    return 0;
 }
 
-void confirm_udid(struct am_device *device)
+static afc_error_t simulated_file_ref_read(struct afc_connection *connection, afc_file_ref file_ref, void *buffer, unsigned int *length)
 {
-    if (command.target)
+    if (simulate_call(simulated_connection_device(connection)))
     {
-        char *udid = create_cstr_from_cfstring(AMDeviceCopyDeviceIdentifier(device));
-        
-        if (strcmp(command.target, udid) == 0)
-        {
-            on_device_connected(device);
-        }
+        return EIO;
     }
-    else
+    
+    ssize_t read_length = read((int)file_ref, buffer, *length);
+    
+    if (read_length < 0)
     {
-        on_device_connected(device);
+        return simulated_status(0);
     }
+    
+    simulate_transfer(read_length);
+    *length = (unsigned int)read_length;
+    
+    return 0;
 }
 
-void on_device_notification(struct am_device_notification_callback_info *info, int cookie)
+static afc_error_t simulated_file_ref_write(struct afc_connection *connection, afc_file_ref file_ref, void *buffer, unsigned int length)
 {
-    switch (info->msg)
+    if (simulate_call(simulated_connection_device(connection)))
     {
-        case ADNCI_MSG_CONNECTED:
-            confirm_udid(info->dev);
-            break;
-            
-        default:
-            break;
+        return EIO;
     }
+    
+    simulate_transfer(length);
+    return simulated_status(write_fully((int)file_ref, buffer, length));
 }
 
-void register_device_notification()
+static afc_error_t simulated_file_ref_seek(struct afc_connection *connection, afc_file_ref file_ref, unsigned long long offset, int origin, int unused)
 {
-    AMDeviceNotificationSubscribe(&on_device_notification, 0, 0, 0, &command.notification);
-    CFRunLoopRun();
+    if (simulate_call(simulated_connection_device(connection)))
+    {
+        return EIO;
+    }
+    
+    return simulated_status(lseek((int)file_ref, (off_t)offset, origin) >= 0);
 }
 
-void process_args(int argc, char * params[])
+static afc_error_t simulated_file_ref_tell(struct afc_connection *connection, afc_file_ref file_ref, unsigned long long *offset)
 {
-    int i;
+    if (simulate_call(simulated_connection_device(connection)))
+    {
+        return EIO;
+    }
     
-    for (i = 0; i < argc; i++)
+    off_t position = lseek((int)file_ref, 0, SEEK_CUR);
+    
+    if (position < 0)
     {
-        if (strcmp(params[i], "-p") == 0)
-        {
-            command.app_path = params[i+1];
-        }
-        else if (strcmp(params[i], "-b") == 0)
-        {
-            command.bundle_id = params[i+1];
-        }
-        else if (strcmp(params[i], "-f") == 0)
-        {
-            command.file_path = params[i+1];
-        }
-        else if (strcmp(params[i], "-dest") == 0)
-        {
-            command.destination_path = params[i+1];
-        }
-        else if (strcmp(params[i], "-t") == 0)
-        {
-            command.target = params[i+1];
-        }
-        else if (strcmp(params[i], "-v") == 0)
-        {
-            command.print_paths = 1;
-        }
+        return simulated_status(0);
+    }
+    
+    *offset = (unsigned long long)position;
+    return 0;
+}
+
+static afc_error_t simulated_file_ref_set_file_size(struct afc_connection *connection, afc_file_ref file_ref, unsigned long long size)
+{
+    if (simulate_call(simulated_connection_device(connection)))
+    {
+        return EIO;
     }
+    
+    return simulated_status(ftruncate((int)file_ref, (off_t)size) == 0);
+}
+
+static afc_error_t simulated_file_ref_close(struct afc_connection *connection, afc_file_ref file_ref)
+{
+    return simulated_status(close((int)file_ref) == 0);
 }
 
+struct device_backend simulated_backend =
+{
+    simulated_notification_subscribe,
+    simulated_notification_unsubscribe,
+    simulated_copy_device_identifier,
+    simulated_retain,
+    simulated_release,
+    simulated_handshake,
+    simulated_is_paired,
+    simulated_handshake,
+    simulated_handshake,
+    simulated_handshake,
+    simulated_handshake,
+    simulated_start_service,
+    simulated_start_house_arrest_service,
+    simulated_secure_transfer_path,
+    simulated_secure_install_application,
+    simulated_secure_uninstall_application,
+    simulated_lookup_applications,
+    simulated_connection_open,
+    simulated_connection_close,
+    simulated_device_info_open,
+    simulated_directory_open,
+    simulated_directory_read,
+    simulated_directory_close,
+    simulated_directory_create,
+    simulated_remove_path,
+    simulated_rename_path,
+    simulated_file_info_open,
+    simulated_key_value_read,
+    simulated_key_value_close,
+    simulated_file_ref_open,
+    simulated_file_ref_read,
+    simulated_file_ref_write,
+    simulated_file_ref_seek,
+    simulated_file_ref_tell,
+    simulated_file_ref_set_file_size,
+    simulated_file_ref_close
+};
+
 // Main Run Loop
 int main(int argc, char * argv[])
 {
     command.print_paths = 0;
+    fanout.settle_seconds = DEFAULT_SETTLE_SECONDS;
     
-    process_args(argc, argv);
-    
-    if (argc >= 2 && strcmp(argv[1], "get_udid") == 0)
-    {
-        command.type = GetUDID;
-    }
-    else if (argc >= 2 && strcmp(argv[1], "get_bundle_id") == 0)
+    if (!process_args(argc, argv))
     {
-        get_bundle_id(command.app_path);
         exit(1);
     }
-    else if (argc >= 2 && strcmp(argv[1], "install") == 0)
+    
+    if (simulator.root != NULL)
     {
-        command.type = InstallApp;
+        backend = &simulated_backend;
     }
-    else if(argc >= 2 && strcmp(argv[1], "uninstall") == 0)
+    
+    if (trace.path != NULL)
     {
-        command.type = UninstallApp;
+        start_trace();
     }
-    else if(argc >= 2 && strcmp(argv[1], "list_apps") == 0)
+    
+    if (argc >= 2 && strcmp(argv[1], "get_bundle_id") == 0)
     {
-        command.type = ListApps;
+        get_bundle_id((command.app_path == NULL && argc >= 3) ? argv[2] : command.app_path);
+        exit(1);
     }
-    else if(argc >= 2 && strcmp(argv[1], "list_files") == 0)
+    else if (argc >= 2 && strcmp(argv[1], "hash_app") == 0)
     {
-        command.type = ListFiles;
+        hash_app(command.app_path);
     }
-    else if(argc >= 2 && strcmp(argv[1], "remove_file") == 0)
+    else if (argc >= 2 && strcmp(argv[1], "serve") == 0)
     {
-        command.type = RemoveFile;
+        serve_commands();
     }
-    else if(argc >= 2 && strcmp(argv[1], "download_file") == 0)
+    else if (!parse_command(argc, argv))
     {
-        command.type = DownloadFile;
+        print_usage();
+        exit(1);
     }
-    else if(argc >= 2 && strcmp(argv[1], "upload_file") == 0)
+    
+    if (command.type == DiffSnapshot && command.after_snapshot_path != NULL)
     {
-        command.type = UploadFile;
+        exit(diff_snapshot_files(command.snapshot_path, command.after_snapshot_path));
     }
-    else
+    
+    if (command.socket_path != NULL)
     {
-        print_usage();
-        exit(1);
+        exit(send_command_to_daemon(argc, argv));
     }
     
+    fanout.enabled = parse_fanout_targets(command.target);
+    
     register_device_notification();
     return 1;
 }
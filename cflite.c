@@ -0,0 +1,1836 @@
+//
+//  cflite.c
+//  appdeploy
+//
+//  See cflite.h. Built instead of linking CoreFoundation where it does not exist.
+//
+
+#include "cflite.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+// Objects
+//
+// Every object starts with its type and retain count. A retain count of 0 marks a
+// constant, which CFRetain() and CFRelease() leave alone. Counts change under one
+// lock, since objects are shared between the threads fan-out and serve start.
+
+enum CFLiteType
+{
+    CFLiteString = 1,
+    CFLiteNumber,
+    CFLiteBoolean,
+    CFLiteData,
+    CFLiteArray,
+    CFLiteDictionary,
+    CFLiteURL,
+    CFLiteReadStream,
+    CFLiteSocket,
+    CFLiteRunLoopSource,
+    CFLiteRunLoopTimer
+};
+
+struct cflite_object
+{
+    CFTypeID type;
+    long retain_count;
+};
+
+struct __CFString
+{
+    struct cflite_object object;
+    char *bytes;
+};
+
+struct __CFNumber
+{
+    struct cflite_object object;
+    int is_real;
+    int64_t integer;
+    double real;
+};
+
+struct __CFBoolean
+{
+    struct cflite_object object;
+    Boolean value;
+};
+
+struct __CFData
+{
+    struct cflite_object object;
+    UInt8 *bytes;
+    CFIndex length;
+};
+
+struct __CFArray
+{
+    struct cflite_object object;
+    const void **values;
+    CFIndex count;
+};
+
+struct __CFDictionary
+{
+    struct cflite_object object;
+    const void **keys;
+    const void **values;
+    CFIndex count;
+    CFIndex capacity;
+};
+
+struct __CFURL
+{
+    struct cflite_object object;
+    char *path;
+};
+
+struct __CFReadStream
+{
+    struct cflite_object object;
+    char *path;
+    UInt8 *bytes;
+    size_t length;
+};
+
+struct __CFSocket
+{
+    struct cflite_object object;
+    int fd;
+    CFOptionFlags callback_types;
+    CFSocketCallBack callback;
+    void *info;
+};
+
+struct __CFRunLoopSource
+{
+    struct cflite_object object;
+    struct __CFSocket *socket;
+};
+
+struct __CFRunLoopTimer
+{
+    struct cflite_object object;
+    CFAbsoluteTime fire_date;
+    CFTimeInterval interval;
+    CFRunLoopTimerCallBack callback;
+    void *info;
+};
+
+static pthread_mutex_t retain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct __CFBoolean true_value = { { CFLiteBoolean, 0 }, 1 };
+static struct __CFBoolean false_value = { { CFLiteBoolean, 0 }, 0 };
+static struct __CFString default_mode = { { CFLiteString, 0 }, "kCFRunLoopDefaultMode" };
+
+const CFAllocatorRef kCFAllocatorDefault = NULL;
+const CFDictionaryKeyCallBacks kCFTypeDictionaryKeyCallBacks = { 0 };
+const CFDictionaryValueCallBacks kCFTypeDictionaryValueCallBacks = { 0 };
+const CFArrayCallBacks kCFTypeArrayCallBacks = { 0 };
+const CFBooleanRef kCFBooleanTrue = &true_value;
+const CFBooleanRef kCFBooleanFalse = &false_value;
+const CFStringRef kCFRunLoopDefaultMode = &default_mode;
+
+static void *create_object(CFTypeID type, size_t size)
+{
+    struct cflite_object *object = calloc(1, size);
+    
+    if (object != NULL)
+    {
+        object->type = type;
+        object->retain_count = 1;
+    }
+    
+    return object;
+}
+
+CFTypeRef CFRetain(CFTypeRef object)
+{
+    struct cflite_object *header = (struct cflite_object *)object;
+    
+    if (header != NULL && header->retain_count > 0)
+    {
+        pthread_mutex_lock(&retain_lock);
+        header->retain_count++;
+        pthread_mutex_unlock(&retain_lock);
+    }
+    
+    return object;
+}
+
+static void free_object(struct cflite_object *object)
+{
+    CFIndex i;
+    
+    switch (object->type)
+    {
+        case CFLiteString:
+            free(((struct __CFString *)object)->bytes);
+            break;
+        
+        case CFLiteData:
+            free(((struct __CFData *)object)->bytes);
+            break;
+        
+        case CFLiteArray:
+        {
+            struct __CFArray *array = (struct __CFArray *)object;
+            
+            for (i = 0; i < array->count; i++)
+            {
+                CFRelease(array->values[i]);
+            }
+            
+            free(array->values);
+            break;
+        }
+        
+        case CFLiteDictionary:
+        {
+            struct __CFDictionary *dictionary = (struct __CFDictionary *)object;
+            
+            for (i = 0; i < dictionary->count; i++)
+            {
+                CFRelease(dictionary->keys[i]);
+                CFRelease(dictionary->values[i]);
+            }
+            
+            free(dictionary->keys);
+            free(dictionary->values);
+            break;
+        }
+        
+        case CFLiteURL:
+            free(((struct __CFURL *)object)->path);
+            break;
+        
+        case CFLiteReadStream:
+            free(((struct __CFReadStream *)object)->path);
+            free(((struct __CFReadStream *)object)->bytes);
+            break;
+        
+        case CFLiteRunLoopSource:
+            CFRelease(((struct __CFRunLoopSource *)object)->socket);
+            break;
+        
+        default:
+            break;
+    }
+    
+    free(object);
+}
+
+void CFRelease(CFTypeRef object)
+{
+    struct cflite_object *header = (struct cflite_object *)object;
+    
+    if (header == NULL || header->retain_count == 0)
+    {
+        return;
+    }
+    
+    pthread_mutex_lock(&retain_lock);
+    long retain_count = --header->retain_count;
+    pthread_mutex_unlock(&retain_lock);
+    
+    if (retain_count == 0)
+    {
+        free_object(header);
+    }
+}
+
+CFTypeID CFGetTypeID(CFTypeRef object)
+{
+    return ((const struct cflite_object *)object)->type;
+}
+
+Boolean CFEqual(CFTypeRef first, CFTypeRef second)
+{
+    if (first == second)
+    {
+        return TRUE;
+    }
+    
+    if (first == NULL || second == NULL || CFGetTypeID(first) != CFGetTypeID(second))
+    {
+        return FALSE;
+    }
+    
+    switch (CFGetTypeID(first))
+    {
+        case CFLiteString:
+            return strcmp(((CFStringRef)first)->bytes, ((CFStringRef)second)->bytes) == 0;
+        
+        case CFLiteNumber:
+        {
+            CFNumberRef a = first, b = second;
+            
+            if (!a->is_real && !b->is_real)
+            {
+                return a->integer == b->integer;
+            }
+            
+            return (a->is_real ? a->real : (double)a->integer) == (b->is_real ? b->real : (double)b->integer);
+        }
+        
+        case CFLiteData:
+        {
+            CFDataRef a = first, b = second;
+            
+            return a->length == b->length && memcmp(a->bytes, b->bytes, a->length) == 0;
+        }
+        
+        default:
+            return FALSE;
+    }
+}
+
+// Strings
+//
+// Strings keep their UTF-8 bytes. Lengths are counted in UTF-16 units, like
+// CoreFoundation, so buffers sized with CFStringGetMaximumSizeForEncoding() fit.
+
+static CFStringRef create_string(const char *bytes, size_t length)
+{
+    struct __CFString *string = create_object(CFLiteString, sizeof(struct __CFString));
+    
+    if (string == NULL || (string->bytes = malloc(length + 1)) == NULL)
+    {
+        free(string);
+        return NULL;
+    }
+    
+    memcpy(string->bytes, bytes, length);
+    string->bytes[length] = '\0';
+    
+    return string;
+}
+
+// Each literal is made once and kept for the life of the process
+CFStringRef __CFStringMakeConstantString(const char *text)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static struct constant_string { const char *text; struct __CFString *string; struct constant_string *next; } *constants = NULL;
+    struct constant_string *constant;
+    
+    pthread_mutex_lock(&lock);
+    
+    for (constant = constants; constant != NULL && constant->text != text; constant = constant->next);
+    
+    if (constant == NULL && (constant = malloc(sizeof(*constant))) != NULL)
+    {
+        constant->text = text;
+        constant->string = (struct __CFString *)create_string(text, strlen(text));
+        constant->next = constants;
+        constants = constant;
+        
+        if (constant->string != NULL)
+        {
+            constant->string->object.retain_count = 0;
+        }
+    }
+    
+    pthread_mutex_unlock(&lock);
+    return (constant != NULL) ? constant->string : NULL;
+}
+
+CFTypeID CFStringGetTypeID(void)
+{
+    return CFLiteString;
+}
+
+CFStringRef CFStringCreateWithCString(CFAllocatorRef allocator, const char *text, CFStringEncoding encoding)
+{
+    return (text != NULL) ? create_string(text, strlen(text)) : NULL;
+}
+
+CFIndex CFStringGetLength(CFStringRef string)
+{
+    const unsigned char *byte;
+    CFIndex length = 0;
+    
+    for (byte = (const unsigned char *)string->bytes; *byte != '\0'; byte++)
+    {
+        // continuation bytes add nothing, a four byte sequence is a surrogate pair
+        length += ((*byte & 0xC0) != 0x80) + ((*byte & 0xF8) == 0xF0);
+    }
+    
+    return length;
+}
+
+CFIndex CFStringGetMaximumSizeForEncoding(CFIndex length, CFStringEncoding encoding)
+{
+    return (encoding == kCFStringEncodingUTF8) ? length * 3 : length;
+}
+
+Boolean CFStringGetCString(CFStringRef string, char *buffer, CFIndex size, CFStringEncoding encoding)
+{
+    size_t length = strlen(string->bytes);
+    size_t i;
+    
+    if (size <= 0 || length >= (size_t)size)
+    {
+        return FALSE;
+    }
+    
+    for (i = 0; encoding == kCFStringEncodingASCII && i < length; i++)
+    {
+        if ((unsigned char)string->bytes[i] > 0x7F)
+        {
+            return FALSE;
+        }
+    }
+    
+    memcpy(buffer, string->bytes, length + 1);
+    return TRUE;
+}
+
+CFComparisonResult CFStringCompare(CFStringRef first, CFStringRef second, CFStringCompareFlags options)
+{
+    int order = strcmp(first->bytes, second->bytes);
+    
+    return (order < 0) ? kCFCompareLessThan : ((order > 0) ? kCFCompareGreaterThan : kCFCompareEqualTo);
+}
+
+// Numbers, booleans and data
+
+static CFNumberRef create_integer(int64_t value)
+{
+    struct __CFNumber *number = create_object(CFLiteNumber, sizeof(struct __CFNumber));
+    
+    if (number != NULL)
+    {
+        number->integer = value;
+    }
+    
+    return number;
+}
+
+static CFNumberRef create_real(double value)
+{
+    struct __CFNumber *number = create_object(CFLiteNumber, sizeof(struct __CFNumber));
+    
+    if (number != NULL)
+    {
+        number->is_real = 1;
+        number->real = value;
+    }
+    
+    return number;
+}
+
+CFTypeID CFNumberGetTypeID(void)
+{
+    return CFLiteNumber;
+}
+
+CFNumberRef CFNumberCreate(CFAllocatorRef allocator, CFNumberType type, const void *value)
+{
+    switch (type)
+    {
+        case kCFNumberSInt32Type:
+            return create_integer(*(const int32_t *)value);
+        
+        case kCFNumberIntType:
+            return create_integer(*(const int *)value);
+        
+        case kCFNumberSInt64Type:
+            return create_integer(*(const int64_t *)value);
+        
+        case kCFNumberLongLongType:
+            return create_integer(*(const long long *)value);
+        
+        case kCFNumberCFIndexType:
+            return create_integer(*(const CFIndex *)value);
+        
+        case kCFNumberDoubleType:
+            return create_real(*(const double *)value);
+        
+        default:
+            return NULL;
+    }
+}
+
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType type, void *value)
+{
+    int64_t integer = number->is_real ? (int64_t)number->real : number->integer;
+    
+    switch (type)
+    {
+        case kCFNumberSInt32Type:
+            *(int32_t *)value = (int32_t)integer;
+            return integer >= INT32_MIN && integer <= INT32_MAX;
+        
+        case kCFNumberIntType:
+            *(int *)value = (int)integer;
+            return integer >= INT_MIN && integer <= INT_MAX;
+        
+        case kCFNumberSInt64Type:
+            *(int64_t *)value = integer;
+            return TRUE;
+        
+        case kCFNumberLongLongType:
+            *(long long *)value = integer;
+            return TRUE;
+        
+        case kCFNumberCFIndexType:
+            *(CFIndex *)value = (CFIndex)integer;
+            return TRUE;
+        
+        case kCFNumberDoubleType:
+            *(double *)value = number->is_real ? number->real : (double)number->integer;
+            return TRUE;
+        
+        default:
+            return FALSE;
+    }
+}
+
+CFTypeID CFBooleanGetTypeID(void)
+{
+    return CFLiteBoolean;
+}
+
+Boolean CFBooleanGetValue(CFBooleanRef boolean)
+{
+    return boolean->value;
+}
+
+CFTypeID CFDataGetTypeID(void)
+{
+    return CFLiteData;
+}
+
+CFDataRef CFDataCreate(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length)
+{
+    struct __CFData *data = create_object(CFLiteData, sizeof(struct __CFData));
+    
+    if (data == NULL || (data->bytes = malloc((length > 0) ? length : 1)) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    
+    if (length > 0)
+    {
+        memcpy(data->bytes, bytes, length);
+    }
+    
+    data->length = length;
+    return data;
+}
+
+const UInt8 *CFDataGetBytePtr(CFDataRef data)
+{
+    return data->bytes;
+}
+
+CFIndex CFDataGetLength(CFDataRef data)
+{
+    return data->length;
+}
+
+// Arrays and dictionaries
+//
+// Both retain what they hold. Dictionaries are searched in order, they only ever
+// hold an Info.plist or one entry per installed app.
+
+CFTypeID CFArrayGetTypeID(void)
+{
+    return CFLiteArray;
+}
+
+CFArrayRef CFArrayCreate(CFAllocatorRef allocator, const void **values, CFIndex count, const CFArrayCallBacks *callbacks)
+{
+    struct __CFArray *array = create_object(CFLiteArray, sizeof(struct __CFArray));
+    CFIndex i;
+    
+    if (array == NULL || (array->values = malloc(((count > 0) ? count : 1) * sizeof(void *))) == NULL)
+    {
+        free(array);
+        return NULL;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        array->values[i] = CFRetain(values[i]);
+    }
+    
+    array->count = count;
+    return array;
+}
+
+CFIndex CFArrayGetCount(CFArrayRef array)
+{
+    return array->count;
+}
+
+const void *CFArrayGetValueAtIndex(CFArrayRef array, CFIndex index)
+{
+    return (index >= 0 && index < array->count) ? array->values[index] : NULL;
+}
+
+CFTypeID CFDictionaryGetTypeID(void)
+{
+    return CFLiteDictionary;
+}
+
+CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFDictionaryKeyCallBacks *key_callbacks, const CFDictionaryValueCallBacks *value_callbacks)
+{
+    struct __CFDictionary *dictionary = create_object(CFLiteDictionary, sizeof(struct __CFDictionary));
+    
+    if (dictionary == NULL)
+    {
+        return NULL;
+    }
+    
+    dictionary->capacity = (capacity > 0) ? capacity : 8;
+    dictionary->keys = malloc(dictionary->capacity * sizeof(void *));
+    dictionary->values = malloc(dictionary->capacity * sizeof(void *));
+    
+    if (dictionary->keys == NULL || dictionary->values == NULL)
+    {
+        free(dictionary->keys);
+        free(dictionary->values);
+        free(dictionary);
+        return NULL;
+    }
+    
+    return dictionary;
+}
+
+static CFIndex find_key(CFDictionaryRef dictionary, const void *key)
+{
+    CFIndex i;
+    
+    for (i = 0; i < dictionary->count; i++)
+    {
+        if (CFEqual(dictionary->keys[i], key))
+        {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+void CFDictionarySetValue(CFMutableDictionaryRef dictionary, const void *key, const void *value)
+{
+    CFIndex index = find_key(dictionary, key);
+    
+    if (index >= 0)
+    {
+        CFRetain(value);
+        CFRelease(dictionary->values[index]);
+        dictionary->values[index] = value;
+        return;
+    }
+    
+    if (dictionary->count == dictionary->capacity)
+    {
+        CFIndex capacity = dictionary->capacity * 2;
+        const void **keys = realloc(dictionary->keys, capacity * sizeof(void *));
+        
+        if (keys == NULL)
+        {
+            return;
+        }
+        
+        dictionary->keys = keys;
+        
+        const void **values = realloc(dictionary->values, capacity * sizeof(void *));
+        
+        if (values == NULL)
+        {
+            return;
+        }
+        
+        dictionary->values = values;
+        dictionary->capacity = capacity;
+    }
+    
+    dictionary->keys[dictionary->count] = CFRetain(key);
+    dictionary->values[dictionary->count] = CFRetain(value);
+    dictionary->count++;
+}
+
+CFDictionaryRef CFDictionaryCreate(CFAllocatorRef allocator, const void **keys, const void **values, CFIndex count, const CFDictionaryKeyCallBacks *key_callbacks, const CFDictionaryValueCallBacks *value_callbacks)
+{
+    CFMutableDictionaryRef dictionary = CFDictionaryCreateMutable(allocator, count, key_callbacks, value_callbacks);
+    CFIndex i;
+    
+    for (i = 0; dictionary != NULL && i < count; i++)
+    {
+        CFDictionarySetValue(dictionary, keys[i], values[i]);
+    }
+    
+    return dictionary;
+}
+
+CFIndex CFDictionaryGetCount(CFDictionaryRef dictionary)
+{
+    return dictionary->count;
+}
+
+const void *CFDictionaryGetValue(CFDictionaryRef dictionary, const void *key)
+{
+    CFIndex index = find_key(dictionary, key);
+    
+    return (index >= 0) ? dictionary->values[index] : NULL;
+}
+
+void CFDictionaryApplyFunction(CFDictionaryRef dictionary, CFDictionaryApplierFunction applier, void *context)
+{
+    CFIndex i;
+    
+    for (i = 0; i < dictionary->count; i++)
+    {
+        applier(dictionary->keys[i], dictionary->values[i], context);
+    }
+}
+
+// URLs and read streams
+//
+// A URL is only ever a local path here. A read stream loads the whole file when it
+// is opened, property lists are parsed from memory.
+
+static CFURLRef create_url(const char *path, size_t length)
+{
+    struct __CFURL *url = create_object(CFLiteURL, sizeof(struct __CFURL));
+    
+    if (url == NULL || (url->path = malloc(length + 1)) == NULL)
+    {
+        free(url);
+        return NULL;
+    }
+    
+    memcpy(url->path, path, length);
+    url->path[length] = '\0';
+    
+    return url;
+}
+
+CFURLRef CFURLCreateWithFileSystemPath(CFAllocatorRef allocator, CFStringRef path, CFURLPathStyle style, Boolean is_directory)
+{
+    return (path != NULL) ? create_url(path->bytes, strlen(path->bytes)) : NULL;
+}
+
+CFURLRef CFURLCopyAbsoluteURL(CFURLRef url)
+{
+    char directory[PATH_MAX];
+    
+    if (url->path[0] == '/')
+    {
+        return CFRetain(url);
+    }
+    
+    if (getcwd(directory, sizeof(directory)) == NULL)
+    {
+        return NULL;
+    }
+    
+    size_t directory_length = strlen(directory);
+    char *path = malloc(directory_length + strlen(url->path) + 2);
+    
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    
+    sprintf(path, "%s/%s", directory, url->path);
+    
+    CFURLRef absolute = create_url(path, strlen(path));
+    free(path);
+    
+    return absolute;
+}
+
+CFURLRef CFURLCreateCopyAppendingPathComponent(CFAllocatorRef allocator, CFURLRef url, CFStringRef component, Boolean is_directory)
+{
+    size_t length = strlen(url->path);
+    char *path = malloc(length + strlen(component->bytes) + 2);
+    
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    
+    sprintf(path, "%s%s%s", url->path, (length > 0 && url->path[length - 1] == '/') ? "" : "/", component->bytes);
+    
+    CFURLRef appended = create_url(path, strlen(path));
+    free(path);
+    
+    return appended;
+}
+
+Boolean CFURLGetFileSystemRepresentation(CFURLRef url, Boolean resolve_against_base, UInt8 *buffer, CFIndex size)
+{
+    size_t length = strlen(url->path);
+    
+    if (size <= 0 || length >= (size_t)size)
+    {
+        return FALSE;
+    }
+    
+    memcpy(buffer, url->path, length + 1);
+    return TRUE;
+}
+
+CFReadStreamRef CFReadStreamCreateWithFile(CFAllocatorRef allocator, CFURLRef url)
+{
+    struct __CFReadStream *stream = create_object(CFLiteReadStream, sizeof(struct __CFReadStream));
+    
+    if (stream == NULL || (stream->path = strdup(url->path)) == NULL)
+    {
+        free(stream);
+        return NULL;
+    }
+    
+    return stream;
+}
+
+Boolean CFReadStreamOpen(CFReadStreamRef stream)
+{
+    FILE *file = fopen(stream->path, "rb");
+    size_t capacity = 64 * 1024;
+    size_t length;
+    
+    if (file == NULL || (stream->bytes = malloc(capacity)) == NULL)
+    {
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        
+        return FALSE;
+    }
+    
+    while ((length = fread(stream->bytes + stream->length, 1, capacity - stream->length, file)) > 0)
+    {
+        stream->length += length;
+        
+        if (stream->length == capacity)
+        {
+            UInt8 *grown = realloc(stream->bytes, capacity * 2);
+            
+            if (grown == NULL)
+            {
+                break;
+            }
+            
+            stream->bytes = grown;
+            capacity *= 2;
+        }
+    }
+    
+    int failed = ferror(file) || stream->length == capacity;
+    fclose(file);
+    
+    if (failed)
+    {
+        free(stream->bytes);
+        stream->bytes = NULL;
+        stream->length = 0;
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+void CFReadStreamClose(CFReadStreamRef stream)
+{
+    free(stream->bytes);
+    stream->bytes = NULL;
+    stream->length = 0;
+}
+
+// Binary Property Lists
+//
+// bplist00: objects, then a table of their offsets, then a 32 byte trailer giving
+// the size of offsets and object references, the object count, the top object and
+// where the offset table starts. Every number is big endian.
+
+#define PLIST_MAX_DEPTH 64
+
+struct binary_plist
+{
+    const UInt8 *bytes;
+    size_t length;
+    int offset_size;
+    int reference_size;
+    uint64_t object_count;
+    uint64_t offset_table;
+};
+
+static uint64_t read_big_endian(const UInt8 *bytes, int size)
+{
+    uint64_t value = 0;
+    int i;
+    
+    for (i = 0; i < size; i++)
+    {
+        value = (value << 8) | bytes[i];
+    }
+    
+    return value;
+}
+
+// The count in a marker's low nibble, or the integer object after it when that is 0xF
+static int read_binary_count(struct binary_plist *plist, size_t *position, int info, uint64_t *count)
+{
+    if (info != 0xF)
+    {
+        *count = info;
+        return 1;
+    }
+    
+    if (*position >= plist->length || (plist->bytes[*position] & 0xF0) != 0x10)
+    {
+        return 0;
+    }
+    
+    int size = 1 << (plist->bytes[*position] & 0x0F);
+    
+    if (size > 8 || *position + 1 + size > plist->length)
+    {
+        return 0;
+    }
+    
+    *count = read_big_endian(plist->bytes + *position + 1, size);
+    *position += 1 + size;
+    
+    return 1;
+}
+
+static CFStringRef create_string_from_utf16(const UInt8 *bytes, uint64_t count)
+{
+    char *text = malloc(count * 3 + 1);
+    size_t length = 0;
+    uint64_t i;
+    
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        uint32_t unit = (uint32_t)read_big_endian(bytes + 2 * i, 2);
+        
+        if (unit >= 0xD800 && unit < 0xDC00 && i + 1 < count)
+        {
+            uint32_t low = (uint32_t)read_big_endian(bytes + 2 * (i + 1), 2);
+            
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+        
+        if (unit < 0x80)
+        {
+            text[length++] = (char)unit;
+        }
+        else if (unit < 0x800)
+        {
+            text[length++] = (char)(0xC0 | (unit >> 6));
+            text[length++] = (char)(0x80 | (unit & 0x3F));
+        }
+        else if (unit < 0x10000)
+        {
+            text[length++] = (char)(0xE0 | (unit >> 12));
+            text[length++] = (char)(0x80 | ((unit >> 6) & 0x3F));
+            text[length++] = (char)(0x80 | (unit & 0x3F));
+        }
+        else
+        {
+            text[length++] = (char)(0xF0 | (unit >> 18));
+            text[length++] = (char)(0x80 | ((unit >> 12) & 0x3F));
+            text[length++] = (char)(0x80 | ((unit >> 6) & 0x3F));
+            text[length++] = (char)(0x80 | (unit & 0x3F));
+        }
+    }
+    
+    CFStringRef string = create_string(text, length);
+    free(text);
+    
+    return string;
+}
+
+static CFTypeRef read_binary_object(struct binary_plist *plist, uint64_t index, int depth);
+
+// Reads count object references starting at position into a new array of objects
+static const void **read_binary_references(struct binary_plist *plist, size_t position, uint64_t count, int depth)
+{
+    const void **objects;
+    uint64_t i;
+    
+    if (count > plist->object_count || position + count * plist->reference_size > plist->length || (objects = calloc((count > 0) ? count : 1, sizeof(void *))) == NULL)
+    {
+        return NULL;
+    }
+    
+    for (i = 0; i < count; i++)
+    {
+        objects[i] = read_binary_object(plist, read_big_endian(plist->bytes + position + i * plist->reference_size, plist->reference_size), depth + 1);
+        
+        if (objects[i] == NULL)
+        {
+            while (i > 0)
+            {
+                CFRelease(objects[--i]);
+            }
+            
+            free(objects);
+            return NULL;
+        }
+    }
+    
+    return objects;
+}
+
+static void release_objects(const void **objects, uint64_t count)
+{
+    uint64_t i;
+    
+    for (i = 0; i < count; i++)
+    {
+        CFRelease(objects[i]);
+    }
+    
+    free(objects);
+}
+
+static CFTypeRef read_binary_object(struct binary_plist *plist, uint64_t index, int depth)
+{
+    if (index >= plist->object_count || depth > PLIST_MAX_DEPTH)
+    {
+        return NULL;
+    }
+    
+    size_t position = read_big_endian(plist->bytes + plist->offset_table + index * plist->offset_size, plist->offset_size);
+    
+    if (position >= plist->offset_table)
+    {
+        return NULL;
+    }
+    
+    int marker = plist->bytes[position++];
+    int info = marker & 0x0F;
+    uint64_t count;
+    
+    switch (marker >> 4)
+    {
+        case 0x0:
+            return (info == 0x9) ? (CFTypeRef)kCFBooleanTrue : ((info == 0x8) ? (CFTypeRef)kCFBooleanFalse : NULL);
+        
+        case 0x1:
+        case 0x8:
+        {
+            // 16 byte integers keep their low 8 bytes, UIDs are read as integers
+            int size = ((marker >> 4) == 0x1) ? (1 << info) : info + 1;
+            
+            if (size > 16 || position + size > plist->offset_table)
+            {
+                return NULL;
+            }
+            
+            return create_integer((int64_t)read_big_endian(plist->bytes + position + ((size > 8) ? size - 8 : 0), (size > 8) ? 8 : size));
+        }
+        
+        case 0x2:
+        case 0x3:
+        {
+            int size = ((marker >> 4) == 0x3) ? 8 : (1 << info);
+            
+            if ((size != 4 && size != 8) || position + size > plist->offset_table)
+            {
+                return NULL;
+            }
+            
+            uint64_t bits = read_big_endian(plist->bytes + position, size);
+            
+            if (size == 4)
+            {
+                uint32_t narrow = (uint32_t)bits;
+                float value;
+                
+                memcpy(&value, &narrow, sizeof(value));
+                return create_real(value);
+            }
+            
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            
+            if ((marker >> 4) == 0x3)
+            {
+                char text[32];
+                snprintf(text, sizeof(text), "%.0f", value);
+                return create_string(text, strlen(text));
+            }
+            
+            return create_real(value);
+        }
+        
+        case 0x4:
+        case 0x5:
+        case 0x6:
+        {
+            if (!read_binary_count(plist, &position, info, &count))
+            {
+                return NULL;
+            }
+            
+            uint64_t size = ((marker >> 4) == 0x6) ? count * 2 : count;
+            
+            if (size > plist->offset_table - position)
+            {
+                return NULL;
+            }
+            
+            if ((marker >> 4) == 0x4)
+            {
+                return CFDataCreate(NULL, plist->bytes + position, (CFIndex)size);
+            }
+            
+            if ((marker >> 4) == 0x5)
+            {
+                return create_string((const char *)plist->bytes + position, size);
+            }
+            
+            return create_string_from_utf16(plist->bytes + position, count);
+        }
+        
+        case 0xA:
+        case 0xC:
+        {
+            if (!read_binary_count(plist, &position, info, &count))
+            {
+                return NULL;
+            }
+            
+            const void **values = read_binary_references(plist, position, count, depth);
+            
+            if (values == NULL)
+            {
+                return NULL;
+            }
+            
+            CFArrayRef array = CFArrayCreate(NULL, values, (CFIndex)count, &kCFTypeArrayCallBacks);
+            release_objects(values, count);
+            
+            return array;
+        }
+        
+        case 0xD:
+        {
+            if (!read_binary_count(plist, &position, info, &count))
+            {
+                return NULL;
+            }
+            
+            const void **keys = read_binary_references(plist, position, count, depth);
+            const void **values = (keys != NULL) ? read_binary_references(plist, position + count * plist->reference_size, count, depth) : NULL;
+            CFDictionaryRef dictionary = NULL;
+            
+            if (values != NULL)
+            {
+                dictionary = CFDictionaryCreate(NULL, keys, values, (CFIndex)count, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+                release_objects(values, count);
+            }
+            
+            if (keys != NULL)
+            {
+                release_objects(keys, count);
+            }
+            
+            return dictionary;
+        }
+        
+        default:
+            return NULL;
+    }
+}
+
+static CFPropertyListRef read_binary_plist(const UInt8 *bytes, size_t length)
+{
+    struct binary_plist plist;
+    
+    if (length < 8 + 32)
+    {
+        return NULL;
+    }
+    
+    const UInt8 *trailer = bytes + length - 32;
+    
+    plist.bytes = bytes;
+    plist.length = length;
+    plist.offset_size = trailer[6];
+    plist.reference_size = trailer[7];
+    plist.object_count = read_big_endian(trailer + 8, 8);
+    plist.offset_table = read_big_endian(trailer + 24, 8);
+    
+    if (plist.offset_size < 1 || plist.offset_size > 8 || plist.reference_size < 1 || plist.reference_size > 8)
+    {
+        return NULL;
+    }
+    
+    if (plist.offset_table < 8 || plist.offset_table > length - 32 || plist.object_count > (length - 32 - plist.offset_table) / plist.offset_size)
+    {
+        return NULL;
+    }
+    
+    return read_binary_object(&plist, read_big_endian(trailer + 16, 8), 0);
+}
+
+// XML Property Lists
+//
+// Enough of XML for what Xcode and plutil write: the declaration, doctype and
+// comments are skipped, entities and character references are decoded, and <data>
+// is base64.
+
+struct xml_reader
+{
+    const char *position;
+    const char *end;
+};
+
+static int xml_starts_with(struct xml_reader *reader, const char *text)
+{
+    size_t length = strlen(text);
+    
+    return (size_t)(reader->end - reader->position) >= length && memcmp(reader->position, text, length) == 0;
+}
+
+// Moves past text, returns 0 when it is not found
+static int xml_skip_past(struct xml_reader *reader, const char *text)
+{
+    size_t length = strlen(text);
+    
+    while ((size_t)(reader->end - reader->position) >= length)
+    {
+        if (memcmp(reader->position, text, length) == 0)
+        {
+            reader->position += length;
+            return 1;
+        }
+        
+        reader->position++;
+    }
+    
+    return 0;
+}
+
+// Skips white space, comments, the declaration and the doctype
+static void xml_skip_markup(struct xml_reader *reader)
+{
+    while (reader->position < reader->end)
+    {
+        if (*reader->position == ' ' || *reader->position == '\t' || *reader->position == '\r' || *reader->position == '\n')
+        {
+            reader->position++;
+        }
+        else if (xml_starts_with(reader, "<!--"))
+        {
+            xml_skip_past(reader, "-->");
+        }
+        else if (xml_starts_with(reader, "<?") || xml_starts_with(reader, "<!"))
+        {
+            xml_skip_past(reader, ">");
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+// Reads <name ...> or <name/>, returns 0 when the next markup is not an opening tag
+static int xml_read_tag(struct xml_reader *reader, char *name, size_t size, int *empty)
+{
+    size_t length = 0;
+    
+    xml_skip_markup(reader);
+    
+    if (reader->position >= reader->end || *reader->position != '<' || reader->position + 1 >= reader->end || reader->position[1] == '/')
+    {
+        return 0;
+    }
+    
+    reader->position++;
+    
+    while (reader->position < reader->end && strchr(" \t\r\n/>", *reader->position) == NULL)
+    {
+        if (length + 1 < size)
+        {
+            name[length++] = *reader->position;
+        }
+        
+        reader->position++;
+    }
+    
+    name[length] = '\0';
+    
+    const char *close = memchr(reader->position, '>', reader->end - reader->position);
+    
+    if (close == NULL)
+    {
+        return 0;
+    }
+    
+    *empty = (close > reader->position && close[-1] == '/');
+    reader->position = close + 1;
+    
+    return 1;
+}
+
+// Moves past </name>, returns 0 when something else comes first
+static int xml_read_end_tag(struct xml_reader *reader, const char *name)
+{
+    xml_skip_markup(reader);
+    
+    if (!xml_starts_with(reader, "</"))
+    {
+        return 0;
+    }
+    
+    reader->position += 2;
+    
+    if (!xml_starts_with(reader, name))
+    {
+        return 0;
+    }
+    
+    reader->position += strlen(name);
+    return xml_skip_past(reader, ">");
+}
+
+static size_t encode_utf8(uint32_t code, char *text)
+{
+    if (code < 0x80)
+    {
+        text[0] = (char)code;
+        return 1;
+    }
+    
+    if (code < 0x800)
+    {
+        text[0] = (char)(0xC0 | (code >> 6));
+        text[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    
+    if (code < 0x10000)
+    {
+        text[0] = (char)(0xE0 | (code >> 12));
+        text[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        text[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    
+    text[0] = (char)(0xF0 | (code >> 18));
+    text[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    text[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    text[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+// The decoded text up to the next tag, as a NUL terminated string the caller frees
+static char *xml_read_text(struct xml_reader *reader)
+{
+    const char *start = reader->position;
+    const char *end = memchr(start, '<', reader->end - start);
+    
+    if (end == NULL)
+    {
+        return NULL;
+    }
+    
+    char *text = malloc(end - start + 1);
+    size_t length = 0;
+    
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    
+    while (start < end)
+    {
+        if (*start != '&')
+        {
+            text[length++] = *start++;
+            continue;
+        }
+        
+        const char *semicolon = memchr(start, ';', end - start);
+        size_t name_length = (semicolon != NULL) ? (size_t)(semicolon - start - 1) : 0;
+        static const char *entities[][2] = { { "lt", "<" }, { "gt", ">" }, { "amp", "&" }, { "quot", "\"" }, { "apos", "'" } };
+        size_t i;
+        
+        if (semicolon == NULL)
+        {
+            text[length++] = *start++;
+            continue;
+        }
+        
+        if (start[1] == '#')
+        {
+            uint32_t code = (start[2] == 'x') ? (uint32_t)strtoul(start + 3, NULL, 16) : (uint32_t)strtoul(start + 2, NULL, 10);
+            
+            // a character reference is never longer than the UTF-8 it stands for
+            length += encode_utf8((code <= 0x10FFFF) ? code : 0xFFFD, text + length);
+        }
+        else
+        {
+            for (i = 0; i < sizeof(entities) / sizeof(entities[0]); i++)
+            {
+                if (strlen(entities[i][0]) == name_length && strncmp(start + 1, entities[i][0], name_length) == 0)
+                {
+                    text[length++] = entities[i][1][0];
+                    break;
+                }
+            }
+        }
+        
+        start = semicolon + 1;
+    }
+    
+    text[length] = '\0';
+    reader->position = end;
+    
+    return text;
+}
+
+static CFDataRef create_data_from_base64(const char *text)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    UInt8 *bytes = malloc(strlen(text) / 4 * 3 + 3);
+    uint32_t bits = 0;
+    int bit_count = 0;
+    size_t length = 0;
+    
+    if (bytes == NULL)
+    {
+        return NULL;
+    }
+    
+    for (; *text != '\0' && *text != '='; text++)
+    {
+        const char *digit = strchr(alphabet, *text);
+        
+        if (digit == NULL)
+        {
+            continue;
+        }
+        
+        bits = (bits << 6) | (uint32_t)(digit - alphabet);
+        bit_count += 6;
+        
+        if (bit_count >= 8)
+        {
+            bit_count -= 8;
+            bytes[length++] = (UInt8)(bits >> bit_count);
+        }
+    }
+    
+    CFDataRef data = CFDataCreate(NULL, bytes, (CFIndex)length);
+    free(bytes);
+    
+    return data;
+}
+
+static CFTypeRef read_xml_value(struct xml_reader *reader, int depth);
+
+// Reads values up to </array>
+static CFArrayRef read_xml_array(struct xml_reader *reader, int depth)
+{
+    const void **values = NULL;
+    CFIndex count = 0, capacity = 0;
+    CFArrayRef array = NULL;
+    int closed;
+    
+    while (!(closed = xml_read_end_tag(reader, "array")))
+    {
+        if (count == capacity)
+        {
+            const void **grown = realloc(values, ((capacity > 0) ? capacity * 2 : 8) * sizeof(void *));
+            
+            if (grown == NULL)
+            {
+                break;
+            }
+            
+            values = grown;
+            capacity = (capacity > 0) ? capacity * 2 : 8;
+        }
+        
+        if ((values[count] = read_xml_value(reader, depth + 1)) == NULL)
+        {
+            break;
+        }
+        
+        count++;
+    }
+    
+    if (closed)
+    {
+        array = CFArrayCreate(NULL, values, count, &kCFTypeArrayCallBacks);
+    }
+    
+    release_objects(values, count);
+    return array;
+}
+
+// Reads <key> and value pairs up to </dict>
+static CFDictionaryRef read_xml_dictionary(struct xml_reader *reader, int depth)
+{
+    CFMutableDictionaryRef dictionary = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    char name[16];
+    int empty;
+    
+    while (dictionary != NULL && !xml_read_end_tag(reader, "dict"))
+    {
+        char *text = NULL;
+        
+        if (!xml_read_tag(reader, name, sizeof(name), &empty) || strcmp(name, "key") != 0 || (!empty && ((text = xml_read_text(reader)) == NULL || !xml_read_end_tag(reader, "key"))))
+        {
+            free(text);
+            CFRelease(dictionary);
+            return NULL;
+        }
+        
+        CFStringRef key = create_string((text != NULL) ? text : "", (text != NULL) ? strlen(text) : 0);
+        CFTypeRef value = read_xml_value(reader, depth + 1);
+        
+        free(text);
+        
+        if (key == NULL || value == NULL)
+        {
+            CFRelease(key);
+            CFRelease(value);
+            CFRelease(dictionary);
+            return NULL;
+        }
+        
+        CFDictionarySetValue(dictionary, key, value);
+        CFRelease(key);
+        CFRelease(value);
+    }
+    
+    return dictionary;
+}
+
+static CFTypeRef read_xml_value(struct xml_reader *reader, int depth)
+{
+    char name[16];
+    int empty;
+    
+    if (depth > PLIST_MAX_DEPTH || !xml_read_tag(reader, name, sizeof(name), &empty))
+    {
+        return NULL;
+    }
+    
+    if (strcmp(name, "true") == 0 || strcmp(name, "false") == 0)
+    {
+        return (empty || xml_read_end_tag(reader, name)) ? ((name[0] == 't') ? (CFTypeRef)kCFBooleanTrue : (CFTypeRef)kCFBooleanFalse) : NULL;
+    }
+    
+    if (strcmp(name, "dict") == 0)
+    {
+        return empty ? CFDictionaryCreate(NULL, NULL, NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks) : read_xml_dictionary(reader, depth);
+    }
+    
+    if (strcmp(name, "array") == 0)
+    {
+        return empty ? CFArrayCreate(NULL, NULL, 0, &kCFTypeArrayCallBacks) : read_xml_array(reader, depth);
+    }
+    
+    char *text = empty ? strdup("") : xml_read_text(reader);
+    CFTypeRef value = NULL;
+    
+    if (text == NULL || (!empty && !xml_read_end_tag(reader, name)))
+    {
+        free(text);
+        return NULL;
+    }
+    
+    if (strcmp(name, "string") == 0 || strcmp(name, "date") == 0)
+    {
+        value = create_string(text, strlen(text));
+    }
+    else if (strcmp(name, "integer") == 0)
+    {
+        value = create_integer(strtoll(text, NULL, 10));
+    }
+    else if (strcmp(name, "real") == 0)
+    {
+        value = create_real(strtod(text, NULL));
+    }
+    else if (strcmp(name, "data") == 0)
+    {
+        value = create_data_from_base64(text);
+    }
+    
+    free(text);
+    return value;
+}
+
+static CFPropertyListRef read_xml_plist(const UInt8 *bytes, size_t length)
+{
+    struct xml_reader reader = { (const char *)bytes, (const char *)bytes + length };
+    struct xml_reader start = reader;
+    char name[16];
+    int empty;
+    
+    // the <plist> wrapper is optional
+    if (!xml_read_tag(&reader, name, sizeof(name), &empty) || strcmp(name, "plist") != 0)
+    {
+        reader = start;
+    }
+    
+    return read_xml_value(&reader, 0);
+}
+
+static CFPropertyListRef read_plist(const UInt8 *bytes, size_t length)
+{
+    if (length >= 8 && memcmp(bytes, "bplist00", 8) == 0)
+    {
+        return read_binary_plist(bytes, length);
+    }
+    
+    return read_xml_plist(bytes, length);
+}
+
+CFPropertyListRef CFPropertyListCreateWithStream(CFAllocatorRef allocator, CFReadStreamRef stream, CFIndex length, CFOptionFlags options, void *format, CFErrorRef *error)
+{
+    return (stream->bytes != NULL) ? read_plist(stream->bytes, stream->length) : NULL;
+}
+
+CFPropertyListRef CFPropertyListCreateWithData(CFAllocatorRef allocator, CFDataRef data, CFOptionFlags options, void *format, CFErrorRef *error)
+{
+    return read_plist(data->bytes, data->length);
+}
+
+// Run Loop
+//
+// The process has one run loop, run from the main thread. It waits in poll() for
+// its sockets and the next timer, then calls back every socket that is ready and
+// every timer that is due. Modes are accepted and ignored.
+
+#define ABSOLUTE_TIME_OFFSET 978307200.0
+
+static struct
+{
+    struct __CFRunLoopSource **sources;
+    int source_count;
+    struct __CFRunLoopTimer **timers;
+    int timer_count;
+    int stopped;
+} run_loop;
+
+CFAbsoluteTime CFAbsoluteTimeGetCurrent(void)
+{
+    struct timeval now;
+    
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1000000.0 - ABSOLUTE_TIME_OFFSET;
+}
+
+CFRunLoopRef CFRunLoopGetCurrent(void)
+{
+    return (CFRunLoopRef)&run_loop;
+}
+
+void CFRunLoopStop(CFRunLoopRef loop)
+{
+    run_loop.stopped = 1;
+}
+
+void CFRunLoopAddSource(CFRunLoopRef loop, CFRunLoopSourceRef source, CFStringRef mode)
+{
+    struct __CFRunLoopSource **sources = realloc(run_loop.sources, (run_loop.source_count + 1) * sizeof(*sources));
+    
+    if (sources != NULL)
+    {
+        run_loop.sources = sources;
+        run_loop.sources[run_loop.source_count++] = (struct __CFRunLoopSource *)CFRetain(source);
+    }
+}
+
+void CFRunLoopAddTimer(CFRunLoopRef loop, CFRunLoopTimerRef timer, CFStringRef mode)
+{
+    struct __CFRunLoopTimer **timers = realloc(run_loop.timers, (run_loop.timer_count + 1) * sizeof(*timers));
+    
+    if (timers != NULL)
+    {
+        run_loop.timers = timers;
+        run_loop.timers[run_loop.timer_count++] = (struct __CFRunLoopTimer *)CFRetain(timer);
+    }
+}
+
+CFRunLoopTimerRef CFRunLoopTimerCreate(CFAllocatorRef allocator, CFAbsoluteTime fire_date, CFTimeInterval interval, CFOptionFlags flags, CFIndex order, CFRunLoopTimerCallBack callback, CFRunLoopTimerContext *context)
+{
+    struct __CFRunLoopTimer *timer = create_object(CFLiteRunLoopTimer, sizeof(struct __CFRunLoopTimer));
+    
+    if (timer != NULL)
+    {
+        timer->fire_date = fire_date;
+        timer->interval = interval;
+        timer->callback = callback;
+        timer->info = (context != NULL) ? context->info : NULL;
+    }
+    
+    return timer;
+}
+
+CFSocketRef CFSocketCreateWithNative(CFAllocatorRef allocator, CFSocketNativeHandle fd, CFOptionFlags callback_types, CFSocketCallBack callback, const CFSocketContext *context)
+{
+    struct __CFSocket *socket = create_object(CFLiteSocket, sizeof(struct __CFSocket));
+    
+    if (socket != NULL)
+    {
+        socket->fd = fd;
+        socket->callback_types = callback_types;
+        socket->callback = callback;
+        socket->info = (context != NULL) ? context->info : NULL;
+    }
+    
+    return socket;
+}
+
+CFRunLoopSourceRef CFSocketCreateRunLoopSource(CFAllocatorRef allocator, CFSocketRef socket, CFIndex order)
+{
+    struct __CFRunLoopSource *source = create_object(CFLiteRunLoopSource, sizeof(struct __CFRunLoopSource));
+    
+    if (source != NULL)
+    {
+        source->socket = (struct __CFSocket *)CFRetain(socket);
+    }
+    
+    return source;
+}
+
+// Calls back a socket that poll() found readable
+static void handle_socket(struct __CFSocket *socket)
+{
+    if (socket->callback_types & kCFSocketAcceptCallBack)
+    {
+        CFSocketNativeHandle client = accept(socket->fd, NULL, NULL);
+        
+        if (client >= 0)
+        {
+            socket->callback(socket, kCFSocketAcceptCallBack, NULL, &client, socket->info);
+        }
+    }
+    else if (socket->callback_types & kCFSocketReadCallBack)
+    {
+        socket->callback(socket, kCFSocketReadCallBack, NULL, NULL, socket->info);
+    }
+}
+
+// Runs until deadline, forever when it is negative
+static int run_until(CFAbsoluteTime deadline, Boolean return_after_source_handled)
+{
+    while (!run_loop.stopped)
+    {
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        CFAbsoluteTime wake = deadline;
+        int i, handled = 0;
+        
+        if (deadline >= 0 && now >= deadline)
+        {
+            return kCFRunLoopRunTimedOut;
+        }
+        
+        if (run_loop.source_count == 0 && run_loop.timer_count == 0 && deadline < 0)
+        {
+            return kCFRunLoopRunFinished;
+        }
+        
+        for (i = 0; i < run_loop.timer_count; i++)
+        {
+            if (wake < 0 || run_loop.timers[i]->fire_date < wake)
+            {
+                wake = run_loop.timers[i]->fire_date;
+            }
+        }
+        
+        struct pollfd fds[run_loop.source_count + 1];
+        int timeout = (wake < 0) ? -1 : ((wake > now) ? (int)((wake - now) * 1000) + 1 : 0);
+        
+        for (i = 0; i < run_loop.source_count; i++)
+        {
+            fds[i].fd = run_loop.sources[i]->socket->fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        
+        if (poll(fds, run_loop.source_count, timeout) < 0 && errno != EINTR)
+        {
+            return kCFRunLoopRunFinished;
+        }
+        
+        for (i = 0; i < run_loop.source_count; i++)
+        {
+            if (fds[i].revents != 0)
+            {
+                handle_socket(run_loop.sources[i]->socket);
+                handled = 1;
+            }
+        }
+        
+        now = CFAbsoluteTimeGetCurrent();
+        
+        for (i = 0; i < run_loop.timer_count; i++)
+        {
+            struct __CFRunLoopTimer *timer = run_loop.timers[i];
+            
+            if (timer->fire_date > now)
+            {
+                continue;
+            }
+            
+            timer->callback(timer, timer->info);
+            
+            if (timer->interval > 0)
+            {
+                while (timer->fire_date <= now)
+                {
+                    timer->fire_date += timer->interval;
+                }
+            }
+            else
+            {
+                run_loop.timers[i--] = run_loop.timers[--run_loop.timer_count];
+                CFRelease(timer);
+            }
+        }
+        
+        if (handled && return_after_source_handled)
+        {
+            return kCFRunLoopRunHandledSource;
+        }
+    }
+    
+    run_loop.stopped = 0;
+    return kCFRunLoopRunStopped;
+}
+
+void CFRunLoopRun(void)
+{
+    run_until(-1, FALSE);
+}
+
+int CFRunLoopRunInMode(CFStringRef mode, CFTimeInterval seconds, Boolean return_after_source_handled)
+{
+    return run_until(CFAbsoluteTimeGetCurrent() + seconds, return_after_source_handled);
+}
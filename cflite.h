@@ -0,0 +1,187 @@
+//
+//  cflite.h
+//  appdeploy
+//
+//  The part of CoreFoundation that appdeploy uses, for platforms without it. Only
+//  the simulated devices (-sim), hash_app and the client side of appdeploy serve can
+//  run there, so this is enough to read Info.plist files, build the dictionaries
+//  the device backend passes around and run a run loop with sockets and timers.
+//  Everything is retained and released like CoreFoundation objects, and constant
+//  strings made with CFSTR() are never freed.
+//
+
+#ifndef CFLITE_H
+#define CFLITE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef long CFIndex;
+typedef unsigned char Boolean;
+typedef uint8_t UInt8;
+typedef unsigned long CFOptionFlags;
+typedef unsigned long CFTypeID;
+typedef uint32_t CFStringEncoding;
+typedef double CFTimeInterval;
+typedef double CFAbsoluteTime;
+typedef CFIndex CFNumberType;
+typedef CFIndex CFURLPathStyle;
+typedef CFOptionFlags CFStringCompareFlags;
+typedef int CFSocketNativeHandle;
+typedef CFOptionFlags CFSocketCallBackType;
+
+typedef const void *CFTypeRef;
+typedef const void *CFPropertyListRef;
+typedef const struct __CFAllocator *CFAllocatorRef;
+typedef const struct __CFString *CFStringRef;
+typedef const struct __CFNumber *CFNumberRef;
+typedef const struct __CFBoolean *CFBooleanRef;
+typedef const struct __CFData *CFDataRef;
+typedef const struct __CFArray *CFArrayRef;
+typedef const struct __CFDictionary *CFDictionaryRef;
+typedef struct __CFDictionary *CFMutableDictionaryRef;
+typedef const struct __CFURL *CFURLRef;
+typedef struct __CFReadStream *CFReadStreamRef;
+typedef struct __CFError *CFErrorRef;
+typedef struct __CFRunLoop *CFRunLoopRef;
+typedef struct __CFRunLoopSource *CFRunLoopSourceRef;
+typedef struct __CFRunLoopTimer *CFRunLoopTimerRef;
+typedef struct __CFSocket *CFSocketRef;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+typedef enum
+{
+    kCFCompareLessThan = -1,
+    kCFCompareEqualTo = 0,
+    kCFCompareGreaterThan = 1
+} CFComparisonResult;
+
+#define kCFStringEncodingASCII 0x0600
+#define kCFStringEncodingUTF8 0x08000100
+
+#define kCFNumberSInt32Type 3
+#define kCFNumberSInt64Type 4
+#define kCFNumberDoubleType 13
+#define kCFNumberIntType 9
+#define kCFNumberLongLongType 11
+#define kCFNumberCFIndexType 14
+
+#define kCFURLPOSIXPathStyle 0
+#define kCFPropertyListImmutable 0
+
+#define kCFSocketReadCallBack 1
+#define kCFSocketAcceptCallBack 2
+
+#define kCFRunLoopRunFinished 1
+#define kCFRunLoopRunStopped 2
+#define kCFRunLoopRunTimedOut 3
+#define kCFRunLoopRunHandledSource 4
+
+// Collections always retain what they hold, the callbacks only keep the signatures
+typedef struct { CFIndex version; } CFDictionaryKeyCallBacks;
+typedef struct { CFIndex version; } CFDictionaryValueCallBacks;
+typedef struct { CFIndex version; } CFArrayCallBacks;
+
+typedef struct
+{
+    CFIndex version;
+    void *info;
+    const void *(*retain)(const void *info);
+    void (*release)(const void *info);
+    CFStringRef (*copyDescription)(const void *info);
+} CFSocketContext;
+
+typedef CFSocketContext CFRunLoopTimerContext;
+
+typedef void (*CFDictionaryApplierFunction)(const void *key, const void *value, void *context);
+typedef void (*CFSocketCallBack)(CFSocketRef socket, CFSocketCallBackType type, CFDataRef address, const void *data, void *info);
+typedef void (*CFRunLoopTimerCallBack)(CFRunLoopTimerRef timer, void *info);
+
+extern const CFAllocatorRef kCFAllocatorDefault;
+extern const CFDictionaryKeyCallBacks kCFTypeDictionaryKeyCallBacks;
+extern const CFDictionaryValueCallBacks kCFTypeDictionaryValueCallBacks;
+extern const CFArrayCallBacks kCFTypeArrayCallBacks;
+extern const CFBooleanRef kCFBooleanTrue;
+extern const CFBooleanRef kCFBooleanFalse;
+extern const CFStringRef kCFRunLoopDefaultMode;
+
+#define CFSTR(text) __CFStringMakeConstantString("" text "")
+
+CFStringRef __CFStringMakeConstantString(const char *text);
+
+CFTypeRef CFRetain(CFTypeRef object);
+void CFRelease(CFTypeRef object);
+CFTypeID CFGetTypeID(CFTypeRef object);
+Boolean CFEqual(CFTypeRef first, CFTypeRef second);
+
+CFTypeID CFStringGetTypeID(void);
+CFStringRef CFStringCreateWithCString(CFAllocatorRef allocator, const char *text, CFStringEncoding encoding);
+CFIndex CFStringGetLength(CFStringRef string);
+CFIndex CFStringGetMaximumSizeForEncoding(CFIndex length, CFStringEncoding encoding);
+Boolean CFStringGetCString(CFStringRef string, char *buffer, CFIndex size, CFStringEncoding encoding);
+CFComparisonResult CFStringCompare(CFStringRef first, CFStringRef second, CFStringCompareFlags options);
+
+CFTypeID CFNumberGetTypeID(void);
+CFNumberRef CFNumberCreate(CFAllocatorRef allocator, CFNumberType type, const void *value);
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType type, void *value);
+
+CFTypeID CFBooleanGetTypeID(void);
+Boolean CFBooleanGetValue(CFBooleanRef boolean);
+
+CFTypeID CFDataGetTypeID(void);
+CFDataRef CFDataCreate(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length);
+const UInt8 *CFDataGetBytePtr(CFDataRef data);
+CFIndex CFDataGetLength(CFDataRef data);
+
+CFTypeID CFArrayGetTypeID(void);
+CFArrayRef CFArrayCreate(CFAllocatorRef allocator, const void **values, CFIndex count, const CFArrayCallBacks *callbacks);
+CFIndex CFArrayGetCount(CFArrayRef array);
+const void *CFArrayGetValueAtIndex(CFArrayRef array, CFIndex index);
+
+CFTypeID CFDictionaryGetTypeID(void);
+CFDictionaryRef CFDictionaryCreate(CFAllocatorRef allocator, const void **keys, const void **values, CFIndex count, const CFDictionaryKeyCallBacks *key_callbacks, const CFDictionaryValueCallBacks *value_callbacks);
+CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef allocator, CFIndex capacity, const CFDictionaryKeyCallBacks *key_callbacks, const CFDictionaryValueCallBacks *value_callbacks);
+CFIndex CFDictionaryGetCount(CFDictionaryRef dictionary);
+const void *CFDictionaryGetValue(CFDictionaryRef dictionary, const void *key);
+void CFDictionarySetValue(CFMutableDictionaryRef dictionary, const void *key, const void *value);
+void CFDictionaryApplyFunction(CFDictionaryRef dictionary, CFDictionaryApplierFunction applier, void *context);
+
+CFURLRef CFURLCreateWithFileSystemPath(CFAllocatorRef allocator, CFStringRef path, CFURLPathStyle style, Boolean is_directory);
+CFURLRef CFURLCopyAbsoluteURL(CFURLRef url);
+CFURLRef CFURLCreateCopyAppendingPathComponent(CFAllocatorRef allocator, CFURLRef url, CFStringRef component, Boolean is_directory);
+Boolean CFURLGetFileSystemRepresentation(CFURLRef url, Boolean resolve_against_base, UInt8 *buffer, CFIndex size);
+
+CFReadStreamRef CFReadStreamCreateWithFile(CFAllocatorRef allocator, CFURLRef url);
+Boolean CFReadStreamOpen(CFReadStreamRef stream);
+void CFReadStreamClose(CFReadStreamRef stream);
+
+// XML and binary (bplist00) property lists. Dates come back as strings.
+CFPropertyListRef CFPropertyListCreateWithStream(CFAllocatorRef allocator, CFReadStreamRef stream, CFIndex length, CFOptionFlags options, void *format, CFErrorRef *error);
+CFPropertyListRef CFPropertyListCreateWithData(CFAllocatorRef allocator, CFDataRef data, CFOptionFlags options, void *format, CFErrorRef *error);
+
+// One run loop per process, serving the sockets and timers added to it
+CFAbsoluteTime CFAbsoluteTimeGetCurrent(void);
+CFRunLoopRef CFRunLoopGetCurrent(void);
+void CFRunLoopRun(void);
+int CFRunLoopRunInMode(CFStringRef mode, CFTimeInterval seconds, Boolean return_after_source_handled);
+void CFRunLoopStop(CFRunLoopRef run_loop);
+void CFRunLoopAddSource(CFRunLoopRef run_loop, CFRunLoopSourceRef source, CFStringRef mode);
+void CFRunLoopAddTimer(CFRunLoopRef run_loop, CFRunLoopTimerRef timer, CFStringRef mode);
+CFRunLoopTimerRef CFRunLoopTimerCreate(CFAllocatorRef allocator, CFAbsoluteTime fire_date, CFTimeInterval interval, CFOptionFlags flags, CFIndex order, CFRunLoopTimerCallBack callback, CFRunLoopTimerContext *context);
+CFSocketRef CFSocketCreateWithNative(CFAllocatorRef allocator, CFSocketNativeHandle socket, CFOptionFlags callback_types, CFSocketCallBack callback, const CFSocketContext *context);
+CFRunLoopSourceRef CFSocketCreateRunLoopSource(CFAllocatorRef allocator, CFSocketRef socket, CFIndex order);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -26,6 +26,11 @@ extern "C" {
 #define __DLLIMPORT
 #include <CoreFoundation/CoreFoundation.h>
 #include <mach/error.h>
+#else
+	/* No MobileDevice here, only the types the simulated backend shares with it */
+#define __DLLIMPORT
+#include "cflite.h"
+	typedef unsigned int mach_error_t;
 #endif	
 	
 	/* Error codes */
@@ -603,7 +608,7 @@ extern "C" {
                                        CFDictionaryRef options, void *callback, int callback_arg);
   int AMDeviceSecureUninstallApplication(int unknown0, struct am_device *device, CFStringRef bundle_id,
                                          int unknown1, void *callback, int callback_arg);
-  int AMDeviceLookupApplications(struct am_device *device, int unknown0, CFDictionaryRef* apps);
+  int AMDeviceLookupApplications(struct am_device *device, CFDictionaryRef options, CFDictionaryRef* apps);
 
   /* obtained from http://theiphonewiki.com/wiki/index.php?title=USBMuxConnectByPort */
   int USBMuxConnectByPort(int connectionID, int iPhone_port_network_byte_order, int* outHandle);